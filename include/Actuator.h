@@ -1,13 +1,19 @@
 #ifndef ACTUATOR_H
 #define ACTUATOR_H
 
-#include <Arduino.h>
-#include <SPI.h>
-#include <ArduinoLog.h>
+#include <Hal.h>
+#include <Calibration.h>
 #include <Constant.h>
-#include <Encoder.h>
-#include <queue>
-#include <ODrive.h>
+#include <DiagnosticFormat.h>
+#include <Estop.h>
+#include <Filters.h>
+#include <MotionSequencer.h>
+#include <ODriveBackend.h>
+#include <ParameterStore.h>
+#include <PidController.h>
+#include <Sensors.h>
+#include <SoftLimits.h>
+#include <StateEstimator.h>
 
 class Actuator
 {
@@ -38,15 +44,74 @@ public:
   unsigned int ROLLING_FRAME = 16;
   unsigned int EXP_DECAY = 17;
   unsigned int REF_RPM = 18;
-
-
-  Actuator(HardwareSerial& serial, Constant constant, 
-          volatile unsigned long* eg_tooth_count,  volatile unsigned long* gb_tooth_count,
+  unsigned int ODRV_AGE = 19;   // us since the encoder position was received
+  // 20 is the estop, logged by main
+  unsigned int PID_P = 21;      // controller terms, turns/s x1000
+  unsigned int PID_I = 22;
+  unsigned int PID_D = 23;
+  unsigned int PID_FF = 24;
+  unsigned int GB_MEDIAN = 25;
+  unsigned int EST_EG_RPM = 26;  // state estimator
+  unsigned int EST_GB_RPM = 27;
+  unsigned int EST_RATIO = 28;   // x1000
+  unsigned int GB_RPM = 29;      // gear tooth, unfiltered
+
+
+  Actuator(ODriveBackend::Port& odrive_port, const Constant& constant, 
+          Sensors* sensors, const ParameterStore* parameters,
           bool print_to_serial);
 
-  int init(int odrive_timeout);
+  // Brings the ODrive link up: bus voltage, encoder index search, then where the index is on the
+  // Teensy encoder. init() blocks until it's done, setup can instead begin_link() and keep calling
+  // poll_link() between its other steps. poll_link returns k_link_busy until it's done, then 0 or
+  // the code init() would have returned. begin_link opens the port, after it the e-stop
+  // interrupt can write to it.
+  const static int k_link_busy = -1;
+  int init(int odrive_timeout);  // ms
+  void begin_link(int odrive_timeout);
+  int poll_link(uint32_t now_us);
+  bool link_ready() const { return m_link_phase == LINK_READY; }
   int* control_function(int* out);
   int control_function_two(int* out);
+
+  // Homing and full shifts run inside control_function, one step per cycle, and take over from
+  // the PID until they end. One that fails or is aborted leaves the actuator stopped and idle
+  // until the next one starts. start_* return false while another motion is running.
+  bool start_homing();
+  bool start_shift(bool inbound, int timeout);  // ms
+  void abort_motion() { m_motion.abort(); }
+  bool motion_active() const { return m_motion.active(); }
+  int motion_status() const { return m_motion.status(); }
+  int32_t encoder_inbound() const { return m_encoder_inbound; }
+  int32_t encoder_outbound() const { return m_encoder_outbound; }
+
+  // Ends of travel kept across power cycles (Calibration), counted from the ODrive's index so
+  // both need the link up. calibration() is false until homed, restore_calibration() sets the
+  // ends of travel like homing does and must run before the control step does. It compares where
+  // the actuator rested before the index search, the search itself turns it up to a turn.
+  bool calibrated() const { return m_calibrated; }
+  bool calibration(Calibration::Record& record);
+  Calibration::Config calibration_config() const;
+  int restore_calibration(const Calibration::Record& record);
+
+  // From the hall interrupt with what Sensors::on_hall_change returned: a sensor the actuator
+  // is moving into stops it right there instead of on the next cycle
+  void on_limit(int hits);
+  // Caps ahead of the latched sensor edges, from Constant unless changed
+  void configure_soft_limits(const SoftLimits::Config& config) { m_soft_limits.configure(config); }
+  const SoftLimits& soft_limits() const { return m_soft_limits; }
+
+  // Cooling motor speed from the background (ThermalMonitor), control_function sends it along with
+  // the actuator setpoint and runs the axis closed loop while it isn't 0. Untouched until first set.
+  void set_cooling_velocity(float velocity);
+
+  // While the e-stop is tripped control_function holds both axes idle and the motion aborted.
+  // on_estop is the pin interrupt: trips it and idles the axes right there, ahead of anything
+  // queued. Without an Estop attached it does nothing.
+  void attach_estop(Estop* estop) { m_estop = estop; }
+  void on_estop();
+
+  // Blocking versions for setup, they step control_function themselves
   int* homing_sequence(int* out);
 
   int get_status_code();
@@ -54,9 +119,15 @@ public:
   float get_p_value();
   float communication_speed();
   // float get_odrive_current();
-  String odrive_errors();
-
-  String diagnostic(bool is_mainpower_on, int dt, bool serial_out);
+  void odrive_errors(Print& out);
+  const ODriveLink& odrive_link() const { return odrive; }
+  void configure_setpoints(const SetpointGate::Config& config) { odrive.configure_setpoints(config); }
+  const StateEstimate& estimate() const { return m_estimator.estimate(); }
+
+  // Diagnostic stream, sample_diagnostic is safe from the background while the control step
+  // runs. request_diagnostic_reads keeps the ODrive values coming when it doesn't.
+  void sample_diagnostic(diagnostic::Sample& sample);
+  void request_diagnostic_reads();
   int fully_shift(bool direction, int timeout);
 
 private:
@@ -65,27 +136,76 @@ private:
   int status;
   Constant constant;
   Encoder encoder;
-  ODrive odrive;
+  ODriveBackend odrive;
 
   // Functions that get information from Odrive
   int get_encoder_count();
 
   // Functions that help calculate rpm
-  unsigned long m_last_control_execution;
-  float calc_engine_rpm(float dt);
-
-  // Members to handle rolling frame gearbox rpm
-  float calc_gearbox_rpm(float dt);
-  float calc_gearbox_rpm_rolling(float dt);
-  std::queue<float> m_gearbox_rpm_frames;
-  float m_gearbox_frames_average = 0;
-
-  // Handling exponential decay
-  float m_old_rpm = 0;
-  float calc_gearbox_rpm_exponential(float dt);
+  unsigned long m_last_control_execution;  // us
+  float calc_engine_rpm();
+
+  // Gearbox rpm and its rolling average, median and exponential decay
+  float calc_gearbox_rpm();
+  typedef FilterBank<float, Constant::gearbox_rolling_frames, Constant::gearbox_median_frames> GearboxFilters;
+  GearboxFilters m_gearbox_filters;
+
+  // Shaft speeds, accelerations and ratio from every speed and position sensor
+  StateEstimator m_estimator;
+  EstimatorInput estimator_input(float eg_rpm, float gb_rpm, const SensorSnapshot& sensors, uint32_t dt_us);
+  uint32_t m_last_eg_count = 0;
+  uint32_t m_last_gb_count = 0;
+  float m_last_eg_rpm = 0;
+  float m_last_gb_rpm = 0;
 
   // For reference scheduling
-  float calc_reference_rpm(float gearbox_rpm);
+  float calc_reference_rpm(float gearbox_rpm, const Parameters& params);
+  float calc_reference_slope(float gearbox_rpm, const Parameters& params);
+  PidController::Config pid_config(const Parameters& params);
+
+  // Shift control
+  PidController m_pid;
+
+  // Where the hall sensors latched, the PID slows down ahead of them
+  SoftLimits m_soft_limits;
+  uint32_t m_inbound_hits = 0;
+  uint32_t m_outbound_hits = 0;
+  void update_soft_limits(const HallState& hall);
+  volatile float m_commanded_velocity = 0;  // last setpoint, for on_limit
+
+  // Cooling motor, set from the background
+  volatile float m_cooling_velocity = 0;
+  volatile bool m_cooling_enabled = false;
+
+  Estop* m_estop = nullptr;
+
+  // Link bring-up, see poll_link
+  enum LinkPhase
+  {
+    LINK_DOWN,
+    LINK_VOLTAGE,
+    LINK_INDEX,   // index search running
+    LINK_LOCATE,  // reading where it left the ODrive count
+    LINK_READY,
+    LINK_FAILED
+  };
+  const static uint32_t k_index_timeout_us = 5000000;
+  const static uint32_t k_index_settle_us = 100000;  // before current_state reflects the search
+  LinkPhase m_link_phase = LINK_DOWN;
+  uint32_t m_link_timeout_us = 0;
+  uint32_t m_link_phase_us = 0;  // when the phase started
+  void link_phase(LinkPhase phase, uint32_t now_us);
+  bool link_fresh(int property, uint32_t since_us);
+  // Teensy encoder count where the ODrive count is 0, both count from power up until the index search
+  int32_t m_odrive_origin = 0;
+  // Where it rested at power up, before the index search turned it onto the index
+  Calibration::Observed m_rest = {};
+
+  // Homing and full shifts
+  MotionSequencer m_motion;
+  MotionSequencer::Config motion_config(int timeout);
+  const MotionSequencer::Command& step_motion(const SensorSnapshot& sensors, uint32_t now_us);
+  void run_motion();
 
   //Functions that help calculate motor speed
   int calc_motor_rps(int dt);
@@ -97,18 +217,20 @@ private:
   int32_t m_encoder_outbound;  // out of the car
   int32_t m_encoder_inbound;   // towards the engine
   int32_t m_encoder_engage;    // when belt enganged
+  // Set by homing or a restored calibration
+  volatile bool m_calibrated = false;
+  void set_travel(int32_t inbound, int32_t outbound);
+  Calibration::Observed observe();
 
   // Debugging vars
   long m_control_function_count = 0;
   bool m_has_run;
-  unsigned long m_last_serial_execution = 0;
-  float m_serial_dt;
-
-  // running gear tooth sensor counts
-  volatile unsigned long* m_gb_tooth_count;
-  volatile unsigned long* m_eg_tooth_count;
-  unsigned long m_last_eg_tooth_count;
-  unsigned long m_last_gb_tooth_count;
+
+  // gear tooth and hall state, fed by the pin interrupts
+  Sensors* m_sensors;
+
+  // gains and reference curve, can change between cycles
+  const ParameterStore* m_parameters;
   // float m_eg_rpm = 0;
   // float m_currentrpm_eg_accum = 0;
   // float m_gb_rpm = 0;
@@ -117,8 +239,6 @@ private:
 
   // running control terms
   int m_error = 0;
-  float m_gb_rolling;
-  float m_gb_exp_decay;
   float m_ref_rpm;
   bool m_outbound_signal;
   bool m_inbound_signal;
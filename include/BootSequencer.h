@@ -0,0 +1,63 @@
+#ifndef boot_sequencer_h
+#define boot_sequencer_h
+
+#include <Hal.h>
+
+// Startup as steps that don't depend on each other, taken in turns so the slow ones overlap:
+// while the ODrive boots and runs its index search the SD card and the interrupts come up.
+// A step is called again every poll() until it's done or failed, one that has to wait returns
+// k_busy instead of waiting. Each stage keeps when it started and finished and how long its
+// calls took, so the boot time can be reported per stage.
+// run() polls until the steps finish. On host builds time only moves when the simulation steps
+// it, so poll() between hal::sim::advance_us calls instead.
+class BootSequencer
+{
+public:
+  const static int k_max_steps = 8;
+
+  // Step results
+  const static int k_busy = 0;
+  const static int k_done = 1;
+  const static int k_failed = 2;
+  const static int k_timed_out = 3;  // still busy when run() gave up
+
+  typedef int (*Step)(uint32_t now_us);
+
+  // All times in us
+  struct Stage
+  {
+    const char* name;
+    Step step;
+    bool required;        // the others don't hold up ready_us() or make ok() false
+    int result;
+    uint32_t started_us;
+    uint32_t finished_us;
+    uint32_t active_us;   // inside the step
+    uint32_t calls;
+  };
+
+  // false once k_max_steps are in, or after start()
+  bool add(const char* name, Step step, bool required = true);
+  void start();
+  // Calls every step that is still busy once, true while any is
+  bool poll();
+  // poll() until every step finished or timeout_us passed, true if ok()
+  bool run(uint32_t timeout_us);
+
+  bool busy() const;
+  bool ok() const;                  // every required step done
+  uint32_t started_us() const { return m_started_us; }
+  uint32_t ready_us() const;        // the last required step finished, 0 while one is busy
+  int count() const { return m_count; }
+  const Stage& stage(int i) const { return m_stages[i]; }
+  void report(Print& out) const;
+  static const char* result_name(int result);
+
+private:
+  Stage m_stages[k_max_steps];
+  int m_count = 0;
+  bool m_started = false;
+  uint32_t m_started_us = 0;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef calibration_h
+#define calibration_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Homing results kept across power cycles, so a boot can skip homing when the actuator hasn't
+// moved. Neither encoder keeps its count without power, but the ODrive encoder's index pulse is
+// at the same place on every turn: a Record holds the ends of travel and where the actuator came
+// to rest, all counted from the index the saving boot found. The next boot's index search finds
+// an index again and the resting position says which turn it is on. The limits are reused only
+// when the actuator sits within tolerance of where it was saved, inside the travel, and the hall
+// sensors read the same. A move of whole turns only shows up at the hall sensors.
+// Stored as a calibration::Header followed by the Record, the crc covers the Record.
+namespace calibration
+{
+const uint32_t k_magic = 0x424C4143;  // "CALB"
+const uint16_t k_version = 1;
+
+struct Header
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;       // of the Record
+  uint16_t crc;        // crc16 of the Record
+  uint16_t reserved;
+};
+}  // namespace calibration
+
+class Calibration
+{
+public:
+  // decode() / restore() status
+  const static int k_ok = 0;
+  const static int k_too_short = 1;
+  const static int k_bad_magic = 2;
+  const static int k_bad_version = 3;
+  const static int k_bad_crc = 4;
+  const static int k_other_model = 5;
+  const static int k_moved = 6;          // not where the index says it was saved
+  const static int k_hall_changed = 7;
+  const static int k_out_of_range = 8;   // outside the travel it was saved with
+  const static int k_no_index = 9;       // the index search hasn't run this boot
+
+  struct Record
+  {
+    int32_t model;
+    int32_t inbound;       // encoder counts from the index
+    int32_t outbound;
+    int32_t position;      // where it rested when saved
+    uint32_t saves;
+    uint8_t hall_inbound;
+    uint8_t hall_outbound;
+    uint8_t reserved[2];
+  };
+
+  // This boot, Teensy encoder counts since power up
+  struct Observed
+  {
+    int32_t index;         // where the index search found the index
+    int32_t position;
+    bool hall_inbound;
+    bool hall_outbound;
+  };
+
+  struct Config
+  {
+    int model = 0;
+    int32_t counts_per_turn = 8192;
+    int32_t tolerance = 100;  // counts from where it was saved
+    int32_t margin = 0;       // counts it may rest past either end
+  };
+
+  // Ends of travel in this boot's counts
+  struct Restored
+  {
+    int32_t inbound;
+    int32_t outbound;
+    int32_t error;         // counts between where it was saved and where the index puts it
+  };
+
+  const static size_t k_size = sizeof(calibration::Header) + sizeof(Record);
+
+  static Record capture(int model, const Observed& observed, int32_t inbound, int32_t outbound);
+  static int restore(const Config& config, const Record& record, const Observed& observed, Restored& restored);
+  // A save is only worth the flash wear when the limits changed or it came to rest somewhere else.
+  // Records from boots that found the index whole turns apart are the same when all of them are.
+  static bool changed(const Config& config, const Record& saved, const Record& current);
+
+  static size_t encode(const Record& record, uint8_t* data, size_t capacity);
+  static int decode(const uint8_t* data, size_t length, Record& record);
+  static const char* status_name(int status);
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef can_bus_h
+#define can_bus_h
+
+#include <RingBuffer.h>
+#include <stdint.h>
+
+// A classic CAN frame, 11 bit id
+struct CanFrame
+{
+  uint32_t id;
+  uint8_t length;
+  bool rtr;  // remote request, asks the node for the message with this id
+  uint8_t data[8];
+};
+
+// Where ODriveCan sends and receives frames. Neither call may block.
+class CanBus
+{
+public:
+  virtual bool write(const CanFrame& frame) = 0;  // false if the transmit queue is full
+  virtual bool read(CanFrame& frame) = 0;         // false if nothing has arrived
+
+protected:
+  ~CanBus() {}
+};
+
+// Two ends of a bus in memory, what one end writes the other reads.
+// Stands in for the wire on the host, the firmware side and the simulated ODrive each get one.
+class CanLoopback
+{
+public:
+  const static int k_queue_frames = 256;
+
+  class End : public CanBus
+  {
+  public:
+    bool write(const CanFrame& frame) override
+    {
+      if (m_out->push(frame)) return true;
+      m_dropped++;
+      return false;
+    }
+    bool read(CanFrame& frame) override { return m_in->pop(frame); }
+    uint32_t dropped() const { return m_dropped; }
+
+  private:
+    friend class CanLoopback;
+    RingBuffer<CanFrame, k_queue_frames>* m_in = nullptr;
+    RingBuffer<CanFrame, k_queue_frames>* m_out = nullptr;
+    uint32_t m_dropped = 0;
+  };
+
+  CanLoopback()
+  {
+    m_ends[0].m_in = &m_queues[0];
+    m_ends[0].m_out = &m_queues[1];
+    m_ends[1].m_in = &m_queues[1];
+    m_ends[1].m_out = &m_queues[0];
+  }
+  CanLoopback(const CanLoopback&) = delete;
+  CanLoopback& operator=(const CanLoopback&) = delete;
+
+  End& end(int n) { return m_ends[n & 1]; }
+
+private:
+  RingBuffer<CanFrame, k_queue_frames> m_queues[2];  // into end 0, into end 1
+  End m_ends[2];
+};
+
+#if defined(ARDUINO) && defined(MOAT_ODRIVE_CAN)
+#include <FlexCAN_T4.h>
+
+// The Teensy's CAN3 controller (pins 30 / 31, k_odrive_rx_pin / k_odrive_tx_pin) through FlexCAN_T4
+class TeensyCanBus : public CanBus
+{
+public:
+  void begin(uint32_t bitrate);
+  bool write(const CanFrame& frame) override;
+  bool read(CanFrame& frame) override;
+
+private:
+  FlexCAN_T4<CAN3, RX_SIZE_256, TX_SIZE_16> m_can;
+};
+#endif
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef can_simple_h
+#define can_simple_h
+
+#include <CanBus.h>
+#include <stdint.h>
+#include <string.h>
+
+// The ODrive's CAN-simple protocol (firmware 0.5.x).
+// A frame id is node_id << 5 | command, payloads are little endian. Every axis is its own node.
+// The ODrive pushes some messages on its own at the rates set in axisN.config.can
+// (heartbeat, encoder estimates, encoder count, bus voltage / current), the rest are answered
+// when asked for with a remote request of the same id.
+namespace can_simple
+{
+const uint32_t k_heartbeat = 0x001;               // axis_error u32, axis_state u8, flags u8, controller_flags u8
+const uint32_t k_estop = 0x002;
+const uint32_t k_get_motor_error = 0x003;         // u64
+const uint32_t k_get_encoder_error = 0x004;       // u32
+const uint32_t k_get_sensorless_error = 0x005;    // u32
+const uint32_t k_set_axis_state = 0x007;          // u32
+const uint32_t k_get_encoder_estimates = 0x009;   // pos_estimate f32 turns, vel_estimate f32 turns/s
+const uint32_t k_get_encoder_count = 0x00A;       // shadow_count i32, count_in_cpr i32
+const uint32_t k_set_input_vel = 0x00D;           // input_vel f32 turns/s, input_torque_ff f32 Nm
+const uint32_t k_get_bus_voltage_current = 0x017; // vbus f32 V, ibus f32 A
+const uint32_t k_clear_errors = 0x018;
+const uint32_t k_get_controller_error = 0x01D;    // u32
+
+const int k_node_bits = 5;
+const uint32_t k_command_mask = (1 << k_node_bits) - 1;
+
+inline uint32_t frame_id(uint8_t node, uint32_t command)
+{
+  return (uint32_t)node << k_node_bits | command;
+}
+inline uint8_t node_of(uint32_t id)
+{
+  return id >> k_node_bits;
+}
+inline uint32_t command_of(uint32_t id)
+{
+  return id & k_command_mask;
+}
+
+inline void put_u32(uint8_t* data, uint32_t value)
+{
+  for (int i = 0; i < 4; i++) data[i] = value >> (8 * i);
+}
+inline uint32_t get_u32(const uint8_t* data)
+{
+  return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+inline void put_float(uint8_t* data, float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  put_u32(data, bits);
+}
+inline float get_float(const uint8_t* data)
+{
+  uint32_t bits = get_u32(data);
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+//-----------------Teensy -> ODrive--------------//
+inline CanFrame set_input_vel(uint8_t node, float velocity, float torque_ff)
+{
+  CanFrame frame = {frame_id(node, k_set_input_vel), 8, false, {}};
+  put_float(frame.data, velocity);
+  put_float(frame.data + 4, torque_ff);
+  return frame;
+}
+
+inline CanFrame set_axis_state(uint8_t node, uint32_t state)
+{
+  CanFrame frame = {frame_id(node, k_set_axis_state), 4, false, {}};
+  put_u32(frame.data, state);
+  return frame;
+}
+
+// Asks for one of the get_ messages, answered with a frame of the same id
+inline CanFrame request(uint8_t node, uint32_t command)
+{
+  CanFrame frame = {frame_id(node, command), 0, true, {}};
+  return frame;
+}
+
+//-----------------ODrive -> Teensy--------------//
+// What the ODrive sends, built by the simulator and the loopback test
+inline CanFrame heartbeat(uint8_t node, uint32_t axis_error, uint8_t axis_state)
+{
+  CanFrame frame = {frame_id(node, k_heartbeat), 8, false, {}};
+  put_u32(frame.data, axis_error);
+  frame.data[4] = axis_state;
+  return frame;
+}
+
+inline CanFrame pair(uint8_t node, uint32_t command, float first, float second)
+{
+  CanFrame frame = {frame_id(node, command), 8, false, {}};
+  put_float(frame.data, first);
+  put_float(frame.data + 4, second);
+  return frame;
+}
+
+inline CanFrame encoder_count(uint8_t node, int32_t shadow_count, int32_t count_in_cpr)
+{
+  CanFrame frame = {frame_id(node, k_get_encoder_count), 8, false, {}};
+  put_u32(frame.data, (uint32_t)shadow_count);
+  put_u32(frame.data + 4, (uint32_t)count_in_cpr);
+  return frame;
+}
+
+inline CanFrame error(uint8_t node, uint32_t command, uint32_t error)
+{
+  CanFrame frame = {frame_id(node, command), (uint8_t)(command == k_get_motor_error ? 8 : 4), false, {}};
+  put_u32(frame.data, error);
+  return frame;
+}
+
+// Each returns false, leaving the outputs alone, if the payload is too short for the message
+struct Heartbeat
+{
+  uint32_t axis_error;
+  uint8_t axis_state;
+};
+inline bool decode_heartbeat(const CanFrame& frame, Heartbeat& heartbeat)
+{
+  if (frame.length < 5) return false;
+  heartbeat.axis_error = get_u32(frame.data);
+  heartbeat.axis_state = frame.data[4];
+  return true;
+}
+
+inline bool decode_pair(const CanFrame& frame, float& first, float& second)
+{
+  if (frame.length < 8) return false;
+  first = get_float(frame.data);
+  second = get_float(frame.data + 4);
+  return true;
+}
+
+inline bool decode_encoder_count(const CanFrame& frame, int32_t& shadow_count, int32_t& count_in_cpr)
+{
+  if (frame.length < 8) return false;
+  shadow_count = (int32_t)get_u32(frame.data);
+  count_in_cpr = (int32_t)get_u32(frame.data + 4);
+  return true;
+}
+
+// Error messages are a u32, except the motor's u64 of which the low word is kept
+inline bool decode_error(const CanFrame& frame, uint32_t& error)
+{
+  if (frame.length < 4) return false;
+  error = get_u32(frame.data);
+  return true;
+}
+}  // namespace can_simple
+
+#endif
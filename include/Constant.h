@@ -1,121 +1,235 @@
 #ifndef constant_h
 #define constant_h
 
-#include <SD.h>
-#include <map>
+#include <stdint.h>
 
 #define dancing 13
-// IF YOU WANT TO CHANGE MODEL NUMBER DO SO IN BEGINNING OF PRIVATE MEMBERS
 
+// Model selection, build with -DMOAT_MODEL=20 for the Model 20 car
+#ifndef MOAT_MODEL
+#define MOAT_MODEL 21
+#endif
+
+// Everything that changes between cars. One constexpr table per model, the one in use is picked
+// at compile time and the checks in constant.cpp run against all of them.
+struct ModelPins
+{
+  int estop;
+  int enc_a;
+  int enc_b;
+  int hall_inbound;
+  int hall_outbound;
+  int engine_geartooth;
+  int gearbox_geartooth;
+  int thermistor_1;  // analog pins, -1 when not fitted
+  int thermistor_2;
+  int thermistor_3;
+};
+
+// The ODrive link's pins, the same on every model: CAN3 with MOAT_ODRIVE_CAN (CAN1 would be
+// the hall pins 22 / 23), otherwise Serial1
+#ifdef MOAT_ODRIVE_CAN
+constexpr int k_odrive_rx_pin = 30;
+constexpr int k_odrive_tx_pin = 31;
+#else
+constexpr int k_odrive_rx_pin = 0;
+constexpr int k_odrive_tx_pin = 1;
+#endif
+
+struct ModelConfig
+{
+  int model;
+  ModelPins pins;
+
+  float proportional_gain;
+  float integral_gain;
+  float derivative_gain;
+  float feed_forward_gain;            // actuator turns/s per ratio/s
+  float derivative_filter_time;       // s
+  float integral_limit;               // turns/s
+  float actuator_velocity_limit;      // turns/s
+  float actuator_acceleration_limit;  // turns/s^2, 0 for none
+  float exponential_filter_alpha;
+  float overdrive_ratio;
+  float ecvt_max_ratio;
+
+  int actuator_motor_number;   // odrive axis
+  int cooling_motor_number;    // odrive axis
+  int homing_timeout;          // ms
+  int cycle_period;            // ms
+  int gearbox_rolling_frames;  // number of frames
+  int gearbox_median_frames;   // number of frames, odd
+};
+
+constexpr ModelConfig k_model_21 = {
+  21,
+  // estop, enc_a, enc_b, hall_inbound, hall_outbound, engine_geartooth, gearbox_geartooth, thermistors
+  {35, 3, 4, 22, 23, 37, 36, 40, 39, 38},
+  0.015,  // proportional_gain
+  0,      // integral_gain
+  0,      // derivative_gain
+  0,      // feed_forward_gain, the screw geometry gives ~7 (24 turns over 3.4 of ratio)
+  0.02,   // derivative_filter_time
+  10,     // integral_limit
+  40,     // actuator_velocity_limit
+  0,      // actuator_acceleration_limit
+  0.5,    // exponential_filter_alpha
+  0.85,   // overdrive_ratio
+  4.25,   // ecvt_max_ratio
+  1,      // actuator_motor_number
+  0,      // cooling_motor_number
+  20000,  // homing_timeout, the whole 24 turns at homing speed take 12 s
+  10,     // cycle_period
+  60,     // gearbox_rolling_frames
+  5       // gearbox_median_frames
+};
+
+// The car wiring that used to sit in main.cpp as "PINS CAR", everything else as on Model 21
+constexpr ModelConfig k_model_20 = {
+  20,
+  {36, 2, 3, 23, 22, 41, 40, -1, 39, 38},
+  k_model_21.proportional_gain,
+  k_model_21.integral_gain,
+  k_model_21.derivative_gain,
+  k_model_21.feed_forward_gain,
+  k_model_21.derivative_filter_time,
+  k_model_21.integral_limit,
+  k_model_21.actuator_velocity_limit,
+  k_model_21.actuator_acceleration_limit,
+  k_model_21.exponential_filter_alpha,
+  k_model_21.overdrive_ratio,
+  k_model_21.ecvt_max_ratio,
+  k_model_21.actuator_motor_number,
+  k_model_21.cooling_motor_number,
+  k_model_21.homing_timeout,
+  k_model_21.cycle_period,
+  k_model_21.gearbox_rolling_frames,
+  k_model_21.gearbox_median_frames
+};
+
+#if MOAT_MODEL == 20
+constexpr ModelConfig k_model = k_model_20;
+#elif MOAT_MODEL == 21
+constexpr ModelConfig k_model = k_model_21;
+#else
+#error "MOAT_MODEL has to be 20 or 21"
+#endif
+
+// All compile time, an instance holds no data so passing it around costs nothing
 struct Constant
 {
-  private:
-  
-  // This sets which model number is currently selected
-  // std::map<String, int> pins = m_20_pins;
-  // std::map<String, float> float_constants = m_20_float_constants;
-  // std::map<String, int> int_constants = m_20_int_constants;
-
-  std::map<String, int> pins = {
-    {"estop", 36},
-    {"enc_a", 3},
-    {"enc_b", 4},
-    {"hall_inbound", 22},
-    {"hall_outbound", 23},
-    {"engine_geartooth", 37},
-    {"gearbox_geartooth", 36},
-    {"thermistor_1", 40},
-    {"thermistor_2", 39},
-    {"thermistor_3", 38}
-  };
-
-  std::map<String, float> float_constants = {
-    {"proportional_gain", 0.015},
-    {"integral_gain", 0},
-    {"derivative_gain", 0},
-    {"exponential_filter_alpha", 0.5},
-    {"overdrive_ratio", 0.85},
-    {"ecvt_max_ratio", 4.25}
-  };
-
-  std::map<String, int> int_constants = {
-    {"actuator_motor_number", 1},
-    {"cooling_motor_number", 0},
-    {"homing_timeout", 50e6}, // ms
-    {"cycle_period", 10},     // ms
-    // This also has to be changed in actuator header
-    {"gearbox_rolling_frames", 60}
-  };
-  
-  public:
   // These constants do not change between models
 
   // Engine Constants (ty Tyler)
-  const unsigned int engine_idle = 1750;      // rpm
-  const unsigned int engine_engage = 2100;    // rpm
-  const unsigned int engine_launch = 2600;    // rpm
-  const unsigned int engine_torque = 2700;    // rpm
-  const unsigned int engine_power = 3400;     // rpm
-  const unsigned int desired_rpm = 2250;      // rpm
-  const float rpm_target_multiplier = 1.5;
+  constexpr static unsigned int engine_idle = 1750;      // rpm
+  constexpr static unsigned int engine_engage = 2100;    // rpm
+  constexpr static unsigned int engine_launch = 2600;    // rpm
+  constexpr static unsigned int engine_torque = 2700;    // rpm
+  constexpr static unsigned int engine_power = 3400;     // rpm
+  constexpr static unsigned int desired_rpm = 2250;      // rpm
+  constexpr static float rpm_target_multiplier = 1.5;
 
-  const static int minimum_rpm = 1000;        // rpm
+  constexpr static int minimum_rpm = 1000;        // rpm
 
   // These constants change between models
+  constexpr static int model = k_model.model;
 
   // Pins
-  const int estop_pin = pins["estop"];
-  const int encoder_a_pin = pins["enc_a"];
-  const int encoder_b_pin = pins["enc_b"];
-  const int hall_inbound_pin = pins["hall_inbound"];
-  const int hall_outbound_pin = pins["hall_outbound"];
-  const int engine_geartooth_pin = pins["engine_geartooth"];
-  const int gearbox_geartooth_pin = pins["gearbox_geartooth"];
-  const int thermistor_1_pin = pins["thermistor_1"];
-  const int thermistor_2_pin = pins["thermistor_2"];
-  const int thermistor_3_pin = pins["thermistor_3"];
+  constexpr static int estop_pin = k_model.pins.estop;
+  constexpr static int encoder_a_pin = k_model.pins.enc_a;
+  constexpr static int encoder_b_pin = k_model.pins.enc_b;
+  constexpr static int hall_inbound_pin = k_model.pins.hall_inbound;
+  constexpr static int hall_outbound_pin = k_model.pins.hall_outbound;
+  constexpr static int engine_geartooth_pin = k_model.pins.engine_geartooth;
+  constexpr static int gearbox_geartooth_pin = k_model.pins.gearbox_geartooth;
+  constexpr static int thermistor_1_pin = k_model.pins.thermistor_1;
+  constexpr static int thermistor_2_pin = k_model.pins.thermistor_2;
+  constexpr static int thermistor_3_pin = k_model.pins.thermistor_3;
 
   // Actuator Constants
-  const int actuator_motor_number = int_constants["actuator_motor_number"];     // odrive axis
-  const int cooling_motor_number = int_constants["cooling_motor_number"];       // odrive axis
-  const int homing_timeout = int_constants["homing_timeout"];                   // ms
-  const int cycle_period = int_constants["cycle_period"];                       // ms
-
-  const int gearbox_rolling_frames = int_constants["gearbox_rolling_frames"];     // number of frames
-
-  const float proportional_gain = float_constants["proportional_gain"];
-  const float integral_gain = float_constants["integral_gain"];
-  const float derivative_gain = float_constants["derivative_gain"];
-  const float exponential_filter_alpha = float_constants["exponential_filter_alpha"];
-
-  const float position_p_gain = proportional_gain;
+  constexpr static int actuator_motor_number = k_model.actuator_motor_number;     // odrive axis
+  constexpr static int cooling_motor_number = k_model.cooling_motor_number;       // odrive axis
+  constexpr static int homing_timeout = k_model.homing_timeout;                   // ms
+  constexpr static float homing_speed = 2;                                        // turns/s
+  constexpr static float homing_back_off_speed = 0.5;                             // turns/s, off a hall sensor
+  constexpr static int closed_loop_timeout = 1000;                                // ms for the ODrive to get there
+  constexpr static int cycle_period = k_model.cycle_period;                       // ms
+
+  // Actuator setpoints to the ODrive (SetpointGate)
+  constexpr static float setpoint_deadband = 0.005;          // turns/s, smaller changes aren't sent
+  constexpr static uint32_t setpoint_min_interval = 0;       // us between changes
+  constexpr static uint32_t setpoint_keepalive = 100000;     // us, resend so the watchdog sees traffic
+  constexpr static int state_poll_cycles = 50;               // control cycles between current_state reads
+
+  constexpr static int gearbox_rolling_frames = k_model.gearbox_rolling_frames;   // number of frames
+  constexpr static int gearbox_median_frames = k_model.gearbox_median_frames;     // number of frames
+
+  constexpr static float proportional_gain = k_model.proportional_gain;
+  constexpr static float integral_gain = k_model.integral_gain;
+  constexpr static float derivative_gain = k_model.derivative_gain;
+  constexpr static float feed_forward_gain = k_model.feed_forward_gain;
+  constexpr static float derivative_filter_time = k_model.derivative_filter_time;
+  constexpr static float integral_limit = k_model.integral_limit;
+  constexpr static float actuator_velocity_limit = k_model.actuator_velocity_limit;
+  constexpr static float actuator_acceleration_limit = k_model.actuator_acceleration_limit;
+  constexpr static float exponential_filter_alpha = k_model.exponential_filter_alpha;
+
+  constexpr static float position_p_gain = proportional_gain;
 
   // Physical Constants
-  const float ecvt_max_ratio = float_constants["ecvt_max_ratio"];
-  const float overdrive_ratio = float_constants["overdrive_ratio"];
-  const int gearbox_engage_rpm = engine_engage / ecvt_max_ratio;
-  const int gearbox_power_rpm = engine_power / ecvt_max_ratio;
-  const int gearbox_overdrive_rpm = engine_power / overdrive_ratio;
-
-
-  
+  constexpr static float ecvt_max_ratio = k_model.ecvt_max_ratio;
+  constexpr static float overdrive_ratio = k_model.overdrive_ratio;
+  constexpr static int gearbox_engage_rpm = engine_engage / ecvt_max_ratio;
+  constexpr static int gearbox_power_rpm = engine_power / ecvt_max_ratio;
+  constexpr static int gearbox_overdrive_rpm = engine_power / overdrive_ratio;
 
   // Linear Actuator Math
   constexpr static float linear_distance_per_rotation = 0.125;            // inches/rotation
+  constexpr static int32_t encoder_counts_per_turn = 4 * 2048;            // encoder count
   constexpr static float linear_shift_length = 3;                         // inches
   constexpr static int32_t encoder_count_shift_length =
-      (linear_shift_length / linear_distance_per_rotation) * 4 * 2048;    //encoder count
+      (linear_shift_length / linear_distance_per_rotation) * encoder_counts_per_turn;    //encoder count
   constexpr static float linear_engage_length = 1;                        //inches
-  constexpr static int32_t encoder_engage_dist = 
+  constexpr static int32_t encoder_engage_dist =
       (linear_engage_length / linear_distance_per_rotation) * 4 * 2048;   //encoder count
   constexpr static float linear_engage_buffer = .2;                       // inches
-  constexpr static int32_t encoder_engage_buffer = 
+  constexpr static int32_t encoder_engage_buffer =
       (linear_engage_buffer) / linear_distance_per_rotation * 4 * 2048;   // encoder count
-  const float cycle_period_minutes = (cycle_period / 1e3) / 60;         // minutes
+  constexpr static float cycle_period_minutes = (cycle_period / 1e3) / 60;  // minutes
   constexpr static int eg_teeth_per_rotation = 88;
-  
-
-  
+  constexpr static float gb_teeth_per_rotation = 17.0 / 6.0;
+  constexpr static int eg_rpm_window_teeth = 22;       // quarter turn of the engine
+  constexpr static int gb_rpm_window_teeth = 3;
+  constexpr static uint32_t tooth_stall_timeout = 500000;  // us without an edge before rpm reads 0
+
+  // Soft limits ahead of the latched hall sensor edges (SoftLimits)
+  constexpr static float soft_limit_decel = 400;         // turns/s^2, the last 2 turns from full speed
+  constexpr static float soft_limit_min_speed = 0.5;     // turns/s, creeps onto the sensor
+  constexpr static float soft_limit_response = 0.05;     // s, a cycle plus the ODrive settling on a new setpoint
+  constexpr static float linear_overtravel = 0.02;       // inches past the sensor edge
+  constexpr static int32_t soft_limit_overtravel =
+      linear_overtravel / linear_distance_per_rotation * encoder_counts_per_turn;  // encoder count
+
+  // Ends of travel kept across power cycles (Calibration), reused when it rests where they were saved
+  constexpr static int32_t calibration_tolerance = 100;                     // encoder count
+  constexpr static int32_t calibration_margin = 2 * soft_limit_overtravel;  // encoder count it may rest past an end
+
+  // Thermistors (ThermalMonitor), 10k NTC from the pin to ground under a pull-up to the ADC reference
+  constexpr static float thermistor_beta = 3950;              // K
+  constexpr static float thermistor_nominal = 10000;          // ohm at 25 C
+  constexpr static float thermistor_series = 10000;           // ohm, the pull-up
+  constexpr static uint32_t thermistor_sample_rate = 100;     // Hz per thermistor
+
+  // Cooling motor, set from the hottest thermistor
+  constexpr static uint32_t cooling_update_period = 100000;   // us between setpoints
+  constexpr static float cooling_on_temp = 60;                // C, starts at the minimum speed
+  constexpr static float cooling_full_temp = 90;              // C, full speed from here up
+  constexpr static float cooling_hysteresis = 5;              // C under cooling_on_temp before it stops
+  constexpr static float cooling_min_speed = 5;               // turns/s
+  constexpr static float cooling_max_speed = 30;              // turns/s
+
+  // E-stop (Estop), active high under a pull-down
+  constexpr static uint32_t estop_release_hold = 500000;      // us released before it can be reset
 };
 
-#endif
\ No newline at end of file
+#endif
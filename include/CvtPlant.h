@@ -0,0 +1,96 @@
+#ifndef cvt_plant_h
+#define cvt_plant_h
+
+#include <Constant.h>
+#include <Hal.h>
+#include <ODriveSim.h>
+
+// Host-only model of the car around the Teensy: engine, centrifugal engagement, the eCVT whose
+// ratio follows the actuator (read from the simulated ODrive axis), and the vehicle.
+// Each step it toggles the gear tooth pins, the hall sensor pins and the actuator encoder through
+// the simulated HAL, so the firmware sees it the same way it sees the car.
+class CvtPlant
+{
+public:
+  struct Config
+  {
+    // Engine
+    float engine_peak_torque = 19;        // Nm
+    float engine_peak_rpm = 2700;
+    float engine_torque_span = 2600;      // rpm from peak to no torque
+    float engine_governed_rpm = 3800;
+    float engine_idle_rpm = 1750;
+    float engine_inertia = 0.05;          // kg m^2
+    float clutch_start_rpm = 1900;        // primary starts grabbing the belt
+    float clutch_full_rpm = 2300;
+    float clutch_max_torque = 60;         // Nm
+
+    // Vehicle, seen from the CVT secondary
+    float vehicle_mass = 250;             // kg with driver
+    float wheel_radius = 0.29;            // m
+    float final_drive = 7.8;              // secondary : wheel
+    float rolling_coefficient = 0.03;
+    float drag_area = 0.8;                // Cd * A, m^2
+    float grade = 0;                      // rad
+
+    // Actuator
+    int32_t inbound_count = 10000;        // ODrive counts at the inbound stop
+    float start_position = 1;             // 0 inbound .. 1 outbound
+    float hall_band = 0.005;              // fraction of travel the hall sensors see
+    int32_t encoder_origin = 0;           // ODrive position counts the Teensy encoder reads 0 at
+
+    // Sensors
+    float gb_teeth_per_rotation = Constant::gb_teeth_per_rotation;
+    int actuator_axis = 1;
+  };
+
+  CvtPlant(ODriveSim& odrive, const Constant& constant, const Config& config);
+  void step(uint64_t now_us);
+
+  void set_throttle(float throttle) { m_throttle = throttle; }
+  void set_grade(float grade) { m_config.grade = grade; }
+
+  float engine_rpm() const { return m_engine_rpm; }
+  float gearbox_rpm() const { return m_gearbox_rpm; }
+  float ratio() const { return m_ratio; }
+  float position() const { return m_position; }      // 0 inbound .. 1 outbound
+  float speed() const;                                // m/s
+  bool locked() const { return m_locked; }
+  uint32_t limit_hits() const { return m_limit_hits; }
+  uint32_t stop_hits() const { return m_stop_hits; }    // ran into a hard stop
+  int32_t inbound_count() const { return m_config.inbound_count; }
+  int32_t outbound_count() const { return m_config.inbound_count + m_shift_counts; }
+
+private:
+  float engine_torque(float rpm) const;
+  float clutch_capacity(float rpm) const;
+  float load_torque() const;
+  void emit_teeth(double& phase, double teeth, int pin);
+
+  ODriveSim& m_odrive;
+  Config m_config;
+  int m_eg_pin;
+  int m_gb_pin;
+  int m_hall_inbound_pin;
+  int m_hall_outbound_pin;
+  int m_encoder_pin;
+  int32_t m_shift_counts;
+  float m_min_ratio;
+  float m_max_ratio;
+
+  uint64_t m_last_us = 0;
+  float m_throttle = 0;
+  float m_engine_rpm;
+  float m_gearbox_rpm = 0;
+  float m_ratio;
+  float m_position;
+  bool m_locked = false;
+  bool m_at_limit = false;
+  uint32_t m_limit_hits = 0;
+  bool m_at_stop = false;
+  uint32_t m_stop_hits = 0;
+  double m_eg_phase = 0;
+  double m_gb_phase = 0;
+};
+
+#endif
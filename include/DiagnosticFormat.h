@@ -0,0 +1,79 @@
+#ifndef diagnostic_format_h
+#define diagnostic_format_h
+
+#include <TelemetryFormat.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Frames of the diagnostic stream on USB serial, shared by the firmware and tools/diag_viewer.
+//
+// Each frame is a FrameHeader, one Sample and the crc16 of everything after the sync word.
+// Everything is little endian. Text the firmware prints on the same port lands between frames,
+// the viewer skips it by hunting for the sync word and checking the length and crc.
+namespace diagnostic
+{
+const uint16_t k_sync = 0x5AD1;
+const uint8_t k_version = 1;
+
+struct FrameHeader
+{
+  uint16_t sync;
+  uint8_t version;
+  uint8_t length;        // bytes of sample
+  uint32_t sequence;     // counts every frame built, a gap is frames dropped for a full port
+};
+
+// One look at everything the controller reads. Nothing here is computed for the sample: rpm
+// and filter outputs are whatever the last control cycle left, 0 if the control step isn't
+// running (diagnostic mode), the viewer works rpm out of the tooth counts instead.
+struct Sample
+{
+  uint32_t time_us;
+  // Gear teeth, as the interrupts last published them
+  uint32_t engine_count;
+  uint32_t engine_edge_us;
+  uint32_t gearbox_count;
+  uint32_t gearbox_edge_us;
+  // Last control cycle
+  float engine_rpm;
+  float gearbox_rpm;
+  float gearbox_average;
+  float gearbox_median;
+  float gearbox_exponential;
+  float commanded_velocity;   // turns/s
+  // Last ODrive reads that came back, and the age of the oldest of them
+  float odrive_voltage;
+  float odrive_current;
+  float odrive_velocity;      // turns/s
+  int32_t odrive_position;    // encoder counts
+  uint32_t odrive_age_us;     // UINT32_MAX if any was never read
+  // Actuator encoder, ends of travel from homing and what the hall interrupts latched
+  int32_t encoder_count;
+  int32_t encoder_inbound;
+  int32_t encoder_outbound;
+  int32_t hall_inbound_count;
+  int32_t hall_outbound_count;
+  uint32_t hall_changes;
+  uint8_t hall_inbound;
+  uint8_t hall_outbound;
+  uint8_t estop_pin;
+  uint8_t estop_pressed;      // Estop tripped, latched until reset
+  uint8_t motion_state;       // MotionSequencer::State
+  uint8_t motion_status;
+  uint8_t reserved[2];
+};
+
+static_assert(sizeof(FrameHeader) == 8, "FrameHeader must stay packed");
+static_assert(sizeof(Sample) == 96, "Sample must stay packed");
+static_assert(sizeof(Sample) <= 255, "Sample length must fit the header");
+
+const size_t k_frame_size = sizeof(FrameHeader) + sizeof(Sample) + sizeof(uint16_t);
+
+// crc of a whole frame as laid out in memory, from the version to the end of the sample
+inline uint16_t frame_crc(const uint8_t* frame)
+{
+  return telemetry::crc16(frame + offsetof(FrameHeader, version), k_frame_size - sizeof(uint16_t) - sizeof(uint16_t));
+}
+}  // namespace diagnostic
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef diagnostic_stream_h
+#define diagnostic_stream_h
+
+#include <DiagnosticFormat.h>
+#include <Hal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Sends diagnostic::Sample frames at a fixed rate without ever waiting on the port.
+// due() says when the next sample should be taken, send() frames it into a buffer that lives
+// here and writes it only if the port has room for all of it, otherwise it's dropped and counted.
+class DiagnosticStream
+{
+public:
+  void begin(uint32_t rate_hz, uint32_t now_us);
+  void set_rate(uint32_t rate_hz);  // 0 stops the stream
+  uint32_t rate() const { return m_rate_hz; }
+
+  bool due(uint32_t now_us);
+  bool send(const diagnostic::Sample& sample, Print& out);
+
+  uint32_t frames() const { return m_sequence; }
+  uint32_t dropped() const { return m_dropped; }
+
+  // Frames the sample into buffer (k_frame_size bytes), for anything other than a port
+  size_t encode(const diagnostic::Sample& sample, uint8_t* buffer);
+
+private:
+  uint8_t m_frame[diagnostic::k_frame_size] __attribute__((aligned(4)));
+  uint32_t m_rate_hz = 0;
+  uint32_t m_period_us = 0;
+  uint32_t m_next_us = 0;
+  uint32_t m_sequence = 0;
+  uint32_t m_dropped = 0;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef estop_h
+#define estop_h
+
+#include <Constant.h>
+#include <Hal.h>
+
+// Latched e-stop. The pin interrupt trips it and (through Actuator::on_estop) idles the ODrive
+// axes from the interrupt itself, the control step then holds everything idle for as long as
+// it stays tripped. A trip only clears by hand: the button has to be released for
+// release_hold_us and then reset(), pressing it again in between trips it again.
+//   ARMED --press--> TRIPPED --released for release_hold_us--> RELEASED --reset()--> ARMED
+//                       ^------------------press-------------------'
+// When the interrupt's stop was handed to the port is reported by the interrupt itself, or with
+// the port busy by the control step or the background once it went out. The time from the
+// interrupt to that is the reaction latency.
+class Estop
+{
+public:
+  enum State
+  {
+    ARMED = 0,
+    TRIPPED,
+    RELEASED
+  };
+
+  // reset() results
+  const static int k_reset_ok = 0;
+  const static int k_reset_armed = 1;    // nothing to reset
+  const static int k_reset_pressed = 2;  // still pressed, or not released for long enough
+
+  struct Config
+  {
+    int pin = -1;
+    bool active_high = true;
+    uint32_t release_hold_us = 500000;
+  };
+
+  struct Stats
+  {
+    uint32_t presses = 0;        // interrupts, bounces included
+    uint32_t trips = 0;
+    uint32_t tripped_us = 0;     // micros() of the last trip
+    uint32_t latency_count = 0;  // trips with a measured latency
+    uint32_t last_latency_us = 0;
+    uint32_t max_latency_us = 0;
+  };
+
+  // Config from Constant, configure() before begin() to change it
+  explicit Estop(const Constant& constant);
+  void configure(const Config& config) { m_config = config; }
+  const Config& config() const { return m_config; }
+
+  // Trips right away if the button is already pressed
+  void begin(uint32_t now_us);
+
+  // Interrupt side
+  void press(uint32_t now_us);
+
+  // Control side: true while the outputs have to be held idle. stopped() with when the idle
+  // went out (ODriveLink::idle_written_us), records the latency once per trip. Safe from
+  // anywhere, a stop from before the trip is ignored.
+  bool tripped() const { return m_state != ARMED; }
+  void stopped(uint32_t written_us);
+
+  // Background
+  void update(uint32_t now_us);
+  int reset(uint32_t now_us);
+  bool pressed() const;
+  State state() const { return (State)m_state; }
+  Stats stats() const;
+  static const char* state_name(int state);
+
+private:
+  Config m_config;
+  volatile int m_state = ARMED;
+  volatile bool m_latency_pending = false;
+  Stats m_stats;
+  volatile bool m_released = false;
+  uint32_t m_released_since_us = 0;
+};
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef filters_h
+#define filters_h
+
+#include <stddef.h>
+
+// Statically sized sample filters for the control step, no heap and no std containers.
+// Every filter starts empty and only averages over what it has seen so far, so there's no ramp
+// up from zero after boot.
+
+// Mean of the last N samples.
+// Kept as a running sum, which is resummed exactly from the window every N samples so float
+// rounding can't build up over a long run.
+template <class T, int N>
+class MovingAverage
+{
+  static_assert(N > 0, "MovingAverage needs at least one sample");
+
+public:
+  T update(T sample)
+  {
+    // Slots that haven't been written yet hold 0
+    m_sum += sample - m_samples[m_index];
+    m_samples[m_index] = sample;
+    if (++m_index == N)
+    {
+      m_index = 0;
+      resum();
+    }
+    if (m_count < N) m_count++;
+    m_value = m_sum / m_count;
+    return m_value;
+  }
+
+  T value() const { return m_value; }
+  int count() const { return m_count; }
+  constexpr static int window() { return N; }
+
+  void reset() { *this = MovingAverage(); }
+
+private:
+  void resum()
+  {
+    T sum = 0;
+    for (int i = 0; i < N; i++) sum += m_samples[i];
+    m_sum = sum;
+  }
+
+  T m_samples[N] = {};
+  T m_sum = 0;
+  T m_value = 0;
+  int m_index = 0;
+  int m_count = 0;
+};
+
+// Median of the last N samples, a single spike shorter than half the window never gets through.
+// Keeps the window sorted alongside the ring, an update is one removal and one insertion.
+template <class T, int N>
+class MovingMedian
+{
+  static_assert(N > 0 && N % 2 == 1, "MovingMedian window has to be odd");
+
+public:
+  T update(T sample)
+  {
+    int size = m_count;
+    if (m_count == N)
+    {
+      // Drop the oldest sample from the sorted copy
+      T oldest = m_samples[m_index];
+      int i = 0;
+      while (i < size - 1 && m_sorted[i] != oldest) i++;
+      for (; i < size - 1; i++) m_sorted[i] = m_sorted[i + 1];
+      size--;
+    }
+    else
+    {
+      m_count++;
+    }
+    m_samples[m_index] = sample;
+    if (++m_index == N) m_index = 0;
+
+    int i = size;
+    while (i > 0 && m_sorted[i - 1] > sample)
+    {
+      m_sorted[i] = m_sorted[i - 1];
+      i--;
+    }
+    m_sorted[i] = sample;
+
+    m_value = m_sorted[m_count / 2];
+    return m_value;
+  }
+
+  T value() const { return m_value; }
+  int count() const { return m_count; }
+  constexpr static int window() { return N; }
+
+  void reset() { *this = MovingMedian(); }
+
+private:
+  T m_samples[N] = {};
+  T m_sorted[N] = {};
+  T m_value = 0;
+  int m_index = 0;
+  int m_count = 0;
+};
+
+// First order low pass, value += alpha * (sample - value). Alpha can change between samples.
+template <class T>
+class ExponentialFilter
+{
+public:
+  explicit ExponentialFilter(T alpha = 1) : m_alpha(alpha) {}
+
+  void set_alpha(T alpha) { m_alpha = alpha; }
+  T alpha() const { return m_alpha; }
+
+  T update(T sample)
+  {
+    // Seeded with the first sample
+    m_value = m_primed ? m_value + m_alpha * (sample - m_value) : sample;
+    m_primed = true;
+    return m_value;
+  }
+
+  T value() const { return m_value; }
+  void reset()
+  {
+    m_value = 0;
+    m_primed = false;
+  }
+
+private:
+  T m_alpha;
+  T m_value = 0;
+  bool m_primed = false;
+};
+
+// The filters the control step runs on one signal, all fed the same sample in one update
+template <class T, int AverageWindow, int MedianWindow>
+class FilterBank
+{
+public:
+  struct Outputs
+  {
+    T average;
+    T median;
+    T exponential;
+  };
+
+  void set_alpha(T alpha) { m_exponential.set_alpha(alpha); }
+
+  const Outputs& update(T sample)
+  {
+    m_outputs.average = m_average.update(sample);
+    m_outputs.median = m_median.update(sample);
+    m_outputs.exponential = m_exponential.update(sample);
+    return m_outputs;
+  }
+
+  // Last update's results, reading them doesn't advance the filters
+  const Outputs& outputs() const { return m_outputs; }
+
+  void reset()
+  {
+    m_average.reset();
+    m_median.reset();
+    m_exponential.reset();
+    m_outputs = Outputs();
+  }
+
+private:
+  MovingAverage<T, AverageWindow> m_average;
+  MovingMedian<T, MedianWindow> m_median;
+  ExponentialFilter<T> m_exponential;
+  Outputs m_outputs = {};
+};
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef hal_h
+#define hal_h
+
+// Hardware access for everything except main.cpp: clock, GPIO and interrupts, analog inputs,
+// serial ports and the quadrature encoder. On the Teensy this is just the Arduino core, host builds get
+// the simulated board from HalNative.h instead.
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <HardwareSerial.h>
+#include <Encoder.h>
+#else
+#include <HalNative.h>
+#endif
+
+#endif
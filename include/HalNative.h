@@ -0,0 +1,215 @@
+#ifndef hal_native_h
+#define hal_native_h
+
+// Host stand-in for the slice of the Teensy core the control code uses: clock, GPIO with
+// edge interrupts, analog inputs, serial ports and the quadrature Encoder. Time only moves when the
+// simulation says so (hal::sim), which makes every run deterministic. Every thread gets its own
+// board, clock and ports, so independent simulations can run on several threads (tools/sweep).
+// Only included through Hal.h on builds without ARDUINO.
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <RingBuffer.h>
+#include <string>
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define INPUT_PULLDOWN 3
+#define RISING 3
+#define FALLING 2
+#define CHANGE 4
+#define LED_BUILTIN 13
+
+//-----------------Clock--------------//
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+//-----------------GPIO--------------//
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+int digitalReadFast(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t level);
+void digitalWriteFast(uint8_t pin, uint8_t level);
+void attachInterrupt(uint8_t pin, void (*isr)(), int mode);
+void detachInterrupt(uint8_t pin);
+inline uint8_t digitalPinToInterrupt(uint8_t pin) { return pin; }
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+//-----------------Analog--------------//
+// Whatever code the simulation set for the pin, as the 12 bit ADC reads it
+int analogRead(uint8_t pin);
+
+//-----------------Strings--------------//
+// Just enough of Arduino's String for the diagnostic and error dump paths
+class String
+{
+public:
+  String() {}
+  String(const char* text) : m_text(text ? text : "") {}
+  String(const std::string& text) : m_text(text) {}
+  String(char c) : m_text(1, c) {}
+  String(int value) : m_text(std::to_string(value)) {}
+  String(unsigned int value) : m_text(std::to_string(value)) {}
+  String(long value) : m_text(std::to_string(value)) {}
+  String(unsigned long value) : m_text(std::to_string(value)) {}
+  String(float value, int decimals = 2) : String((double)value, decimals) {}
+  String(double value, int decimals = 2)
+  {
+    char buffer[48];
+    snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+    m_text = buffer;
+  }
+
+  String& operator+=(const String& other) { m_text += other.m_text; return *this; }
+  String& operator+=(const char* other) { m_text += other; return *this; }
+  String& operator+=(char c) { m_text += c; return *this; }
+  String& operator+=(int value) { m_text += std::to_string(value); return *this; }
+  friend String operator+(const String& a, const String& b) { return String(a.m_text + b.m_text); }
+  friend String operator+(const char* a, const String& b) { return String(a + b.m_text); }
+  friend String operator+(const String& a, const char* b) { return String(a.m_text + b); }
+  bool operator<(const String& other) const { return m_text < other.m_text; }
+  bool operator==(const String& other) const { return m_text == other.m_text; }
+
+  const char* c_str() const { return m_text.c_str(); }
+  unsigned int length() const { return m_text.size(); }
+  float toFloat() const { return atof(m_text.c_str()); }
+  long toInt() const { return atol(m_text.c_str()); }
+
+private:
+  std::string m_text;
+};
+
+//-----------------Serial--------------//
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* data, size_t length)
+  {
+    for (size_t i = 0; i < length; i++) write(data[i]);
+    return length;
+  }
+  virtual int availableForWrite() { return 0; }
+
+  size_t print(const char* text) { return write((const uint8_t*)text, strlen(text)); }
+  size_t print(const String& text) { return print(text.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int value) { return print(String(value)); }
+  size_t print(unsigned int value) { return print(String(value)); }
+  size_t print(long value) { return print(String(value)); }
+  size_t print(unsigned long value) { return print(String(value)); }
+  size_t print(double value, int decimals = 2) { return print(String(value, decimals)); }
+  template <class T>
+  size_t println(T value) { return print(value) + print("\n"); }
+  size_t println() { return print("\n"); }
+};
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+// Two byte queues. The firmware side writes into tx and reads from rx, the simulation does the
+// opposite through the sim_* calls. tx holds as much as a Teensy UART buffer, writing into a full
+// one lets simulated time pass until the other side drains it, like the real blocking write.
+// Both are fixed rings like the UART's own buffers, so the port never allocates and the bench
+// counts only what the firmware allocates. Bytes past k_queue_size are dropped like an overrun.
+class HardwareSerial : public Stream
+{
+public:
+  const static size_t k_tx_capacity = 64;
+  const static size_t k_queue_size = 4096;
+
+  void begin(uint32_t baud) { m_baud = baud; m_open = true; }
+  void end() { m_open = false; }
+  operator bool() const { return true; }
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t c) override;
+  using Print::write;
+  int availableForWrite() override { return k_tx_capacity - m_tx.size(); }
+  void flush() {}
+  void clear() { m_rx.clear(); }
+
+  // Simulation side
+  uint32_t baud() const { return m_baud; }
+  bool is_open() const { return m_open; }
+  void sim_attach() { m_attached = true; }  // something on the other end drains tx
+  size_t sim_pending() const { return m_tx.size(); }
+  int sim_take();                  // next byte the firmware wrote, -1 if none
+  void sim_give(uint8_t c);        // byte for the firmware to read
+  void sim_reset() { m_rx.clear(); m_tx.clear(); m_open = false; m_attached = false; echo = false; }
+  bool echo = false;               // print tx to stdout (for Serial)
+
+private:
+  RingBuffer<uint8_t, k_queue_size> m_rx;
+  RingBuffer<uint8_t, k_queue_size> m_tx;
+  uint32_t m_baud = 0;
+  bool m_open = false;
+  bool m_attached = false;
+};
+
+extern thread_local HardwareSerial Serial;
+extern thread_local HardwareSerial Serial1;
+extern thread_local HardwareSerial Serial2;
+
+//-----------------Encoder--------------//
+// Reads the count the simulation set for its A pin
+class Encoder
+{
+public:
+  Encoder(uint8_t pin_a, uint8_t pin_b) : m_pin_a(pin_a) { (void)pin_b; }
+  int32_t read();
+  void write(int32_t count);
+
+private:
+  uint8_t m_pin_a;
+};
+
+//-----------------Simulation control--------------//
+namespace hal
+{
+namespace sim
+{
+const int k_pin_count = 64;
+
+// Called whenever simulated time moves so the plant can keep up with blocking code
+typedef void (*WorldHook)(void* context, uint64_t now_us);
+
+void reset();
+void set_world(WorldHook hook, void* context);
+void advance_us(uint32_t us);       // moves the clock in steps of at most step_us()
+void set_step_us(uint32_t us);
+uint32_t step_us();
+uint64_t now_us();
+
+void set_pin(uint8_t pin, int level);  // runs attached interrupts on matching edges
+int pin(uint8_t pin);
+int pin_mode(uint8_t pin);
+uint32_t interrupt_count(uint8_t pin);
+
+void set_analog(uint8_t pin, uint16_t code);
+uint32_t analog_reads(uint8_t pin);
+
+void set_encoder(uint8_t pin_a, int32_t count);
+int32_t encoder(uint8_t pin_a);
+}  // namespace sim
+}  // namespace hal
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef log_replay_h
+#define log_replay_h
+
+#include <Parameters.h>
+#include <stdint.h>
+#include <vector>
+
+// Host-only. Re-runs a recorded log through the real control code: rebuilds what the interrupts
+// saw each cycle and calls Actuator::control_function at the recorded cycle times against the
+// simulated ODrive, as fast as the host allows. Runs on the calling thread's simulated board.
+//
+// Reads binary telemetry (tlm_N.bin), the text logs from before it (log_N.txt, the lines after
+// the "status, rpm, rpm_count, ..." header) and the CSV tools/log_decoder writes.
+// Engine teeth come from rpm_count spread over the cycle, gearbox teeth from gb_rpm (roll_frame
+// in logs without it, which lags by half the rolling window), the actuator encoder and the ODrive
+// position from enc_pos.
+class LogReplay
+{
+public:
+  // What the replay needs of one recorded cycle
+  struct Cycle
+  {
+    uint64_t time_us;
+    int32_t status;
+    int32_t rpm;
+    uint32_t rpm_count;
+    int32_t gb_rpm;
+    int32_t act_vel;
+    int32_t enc_pos;
+    int32_t hall_in;
+    int32_t hall_out;
+    int32_t ref_rpm;
+  };
+
+  struct Recording
+  {
+    std::vector<Cycle> cycles;
+    const char* format = "";
+    bool has_gb_rpm = false;       // roll_frame stands in otherwise
+    bool has_ref_rpm = false;
+    unsigned long skipped = 0;     // lines or records that didn't parse
+  };
+
+  struct Config
+  {
+    float skip = 1;                // s left out of the comparison while the filters warm up
+    uint32_t step_us = 200;        // simulation step between tooth edges
+  };
+
+  // What control_function filled in for one cycle
+  struct Replayed
+  {
+    int32_t status;
+    int32_t act_vel;
+    int32_t ref_rpm;
+  };
+  typedef void (*CycleHook)(void* context, const Cycle& recorded, const Replayed& replayed, double t);
+
+  // act_vel against the recorded one. Cycles the car spent homing or shifting fully (status 3
+  // and 4) or held by the e-stop (5) aren't the PID and aren't compared.
+  struct Result
+  {
+    uint32_t cycles = 0;
+    uint32_t compared = 0;
+    uint32_t identical = 0;        // act_vel exactly as recorded
+    double act_vel_squared = 0;
+    double act_vel_sum = 0;
+    int32_t act_vel_max = 0;
+    double act_vel_max_at = 0;     // s into the log
+    double first_difference = -1;  // s into the log, -1 if none
+    double ref_rpm_squared = 0;
+    double seconds = 0;            // recorded
+    double wall = 0;               // replaying it
+
+    float act_vel_rms() const;
+    float ref_rpm_rms() const;
+  };
+
+  // nullptr once loaded, otherwise what's wrong with the file
+  const char* load(const char* path);
+  const Recording& recording() const { return m_recording; }
+
+  Result run(const Parameters& params, const Config& config, CycleHook hook = nullptr, void* context = nullptr) const;
+
+private:
+  Recording m_recording;
+};
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef matrix_h
+#define matrix_h
+
+// Fixed size float matrix for the estimator, lives on the stack or in the owning object.
+// Only what a small Kalman filter needs, sizes are checked at compile time.
+template <int R, int C>
+struct Matrix
+{
+  float m[R][C];
+
+  float& operator()(int r, int c) { return m[r][c]; }
+  float operator()(int r, int c) const { return m[r][c]; }
+
+  static Matrix zero()
+  {
+    Matrix out = {};
+    return out;
+  }
+
+  static Matrix identity()
+  {
+    static_assert(R == C, "identity has to be square");
+    Matrix out = {};
+    for (int i = 0; i < R; i++) out.m[i][i] = 1;
+    return out;
+  }
+
+  Matrix<C, R> transpose() const
+  {
+    Matrix<C, R> out;
+    for (int r = 0; r < R; r++)
+    {
+      for (int c = 0; c < C; c++) out.m[c][r] = m[r][c];
+    }
+    return out;
+  }
+
+  Matrix operator+(const Matrix& other) const
+  {
+    Matrix out;
+    for (int r = 0; r < R; r++)
+    {
+      for (int c = 0; c < C; c++) out.m[r][c] = m[r][c] + other.m[r][c];
+    }
+    return out;
+  }
+
+  Matrix operator-(const Matrix& other) const
+  {
+    Matrix out;
+    for (int r = 0; r < R; r++)
+    {
+      for (int c = 0; c < C; c++) out.m[r][c] = m[r][c] - other.m[r][c];
+    }
+    return out;
+  }
+
+  Matrix operator*(float scale) const
+  {
+    Matrix out;
+    for (int r = 0; r < R; r++)
+    {
+      for (int c = 0; c < C; c++) out.m[r][c] = m[r][c] * scale;
+    }
+    return out;
+  }
+
+  template <int K>
+  Matrix<R, K> operator*(const Matrix<C, K>& other) const
+  {
+    Matrix<R, K> out;
+    for (int r = 0; r < R; r++)
+    {
+      for (int k = 0; k < K; k++)
+      {
+        float sum = 0;
+        for (int c = 0; c < C; c++) sum += m[r][c] * other.m[c][k];
+        out.m[r][k] = sum;
+      }
+    }
+    return out;
+  }
+};
+
+#endif
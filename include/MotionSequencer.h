@@ -0,0 +1,109 @@
+#ifndef motion_sequencer_h
+#define motion_sequencer_h
+
+#include <Sensors.h>
+#include <stdint.h>
+
+// Homing and full shifts as a state machine the control step advances once per cycle, so the
+// scheduler, logging and the estop keep running while the actuator travels.
+//  - enter closed loop: velocity 0 in closed loop until a current_state read after the start
+//    says the ODrive got there
+//  - back off: if the target hall sensor is already active, move away slowly until it lets go
+//  - approach: move toward the sensor until its interrupt latches a new edge, the count it
+//    latched is where the sensor is, however late the next cycle sees it
+// Pure logic, step() only looks at what it's handed and says what the ODrive should do.
+class MotionSequencer
+{
+public:
+  enum Kind
+  {
+    HOME = 0,   // outbound, and the latched count becomes the outbound limit
+    SHIFT_IN,
+    SHIFT_OUT
+  };
+
+  enum State
+  {
+    IDLE = 0,
+    ENTER_CLOSED_LOOP,
+    BACK_OFF,
+    APPROACH,
+    DONE,
+    FAILED
+  };
+
+  // Status of the last motion
+  const static int k_ok = 0;
+  const static int k_busy = 1;
+  const static int k_timeout = 2;
+  const static int k_aborted = 3;
+  const static int k_no_closed_loop = 4;
+
+  const static int k_state_idle = 1;         // ODrive axis states
+  const static int k_state_closed_loop = 8;
+
+  struct Config
+  {
+    float speed = 2;                      // turns/s toward the sensor
+    float back_off_speed = 0.5;           // turns/s off it
+    uint32_t closed_loop_timeout_us = 1000000;
+    uint32_t timeout_us = 20000000;       // whole motion
+  };
+
+  struct Input
+  {
+    uint32_t now_us;
+    HallState hall;
+    int odrive_state;                     // last current_state read
+    uint32_t odrive_state_age_us;         // UINT32_MAX if never read
+  };
+
+  // What the ODrive should be doing this cycle
+  struct Command
+  {
+    float velocity = 0;                   // turns/s
+    int state = k_state_idle;
+    bool stop = false;                    // send right away instead of through the setpoint gate
+  };
+
+  void configure(const Config& config) { m_config = config; }
+  const Config& config() const { return m_config; }
+
+  // false if a motion is already running
+  bool start(int kind, uint32_t now_us);
+  // Safe from any context, the next step() stops the actuator and ends the motion
+  void abort() { m_abort_requested = true; }
+  const Command& step(const Input& input);
+
+  bool active() const { return m_state != IDLE && m_state != DONE && m_state != FAILED; }
+  int kind() const { return m_kind; }
+  int state() const { return m_state; }
+  int status() const { return m_status; }
+  // Encoder count the target sensor latched, valid once the motion is DONE
+  int32_t latched_count() const { return m_latched_count; }
+  uint32_t elapsed_us() const { return m_elapsed_us; }
+
+  static const char* status_name(int status);
+
+private:
+  void enter(int state, uint32_t now_us);
+  void finish(int status, uint32_t now_us);
+  bool target_active(const HallState& hall) const;
+  uint32_t target_hits(const HallState& hall) const;
+  int32_t target_count(const HallState& hall) const;
+
+  Config m_config;
+  int m_kind = HOME;
+  int m_state = IDLE;
+  int m_status = k_ok;
+  float m_direction = 1;          // +1 outbound, -1 inbound
+  uint32_t m_started_us = 0;
+  uint32_t m_state_us = 0;
+  uint32_t m_elapsed_us = 0;
+  uint32_t m_baseline_hits = 0;
+  int32_t m_latched_count = 0;
+  volatile bool m_abort_requested = false;
+  Command m_command;
+};
+
+#endif
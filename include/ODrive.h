@@ -1,33 +1,101 @@
 #ifndef odrive_h
 #define odrive_h
 
-#include <Arduino.h>
-#include <HardwareSerial.h>
-#include <ODrive.h>
-#include <SoftwareSerial.h>
+#include <Hal.h>
+#include <ODriveLink.h>
+#include <ReplyParser.h>
+#include <RingBuffer.h>
 
-class ODrive
+// ODrive over its ASCII protocol on a UART. Reads are polled: request() queues a query and
+// update() sends them back-to-back in batches and matches the replies up in order.
+// Queued setpoints have no reply, update() writes them in the same burst as the queries.
+class ODrive final : public ODriveLink
 {
 public:
+  typedef HardwareSerial Port;
+
+  // Async transport tuning
+  const static int k_pipeline_depth = 4;                 // queries sent back-to-back as one batch
+  const static uint32_t k_reply_timeout_us = 10000;      // drop a batch after this long
+  const static uint32_t k_resync_guard_us = 2000;        // ignore late replies after a timeout
+  const static int k_query_size = 48;
+  const static int k_command_size = 32;
+
   ODrive(HardwareSerial& serial);
-  int init(int timeout);
-  bool run_state(int axis, int requested_state, bool wait_for_idle, float timeout);
-  void set_velocity(int motor_number, float velocity);
+  void begin() override;
+  int init(int timeout) override;
+  bool run_state(int axis, int requested_state, bool wait_for_idle, float timeout) override;
+  void set_velocity(int motor_number, float velocity) override;
+  void queue_velocity(int motor_number, float velocity, uint32_t stops_seen) override;
 
-  float get_encoder_pos(int motor_number);
-  float get_vel(int motor_number);
-  float get_voltage();
+  // Blocking getters, these wait for all asynchronous queries to finish first
+  float get_encoder_pos(int motor_number) override;
+  float get_vel(int motor_number) override;
+  float get_voltage() override;
+  float get_cur() override;
+  // 0 if the read timed out or the reply wasn't a number, read_status() tells which
   int32_t read_int();
-  String read_string();
-  String dump_errors();
   float read_float();
-  float get_cur();
+  // One reply at a time
+  void dump_errors(Print& out) override;
+
+  // Non-blocking, pipelined reads
+  bool request(int property, int axis) override;
+  void update() override;
+  bool is_idle() const override;
 
 private:
-  int m_current_state = -1;
   int status;
   HardwareSerial& OdriveSerial;
-  float get_voltage_private();
+
+  struct Query
+  {
+    uint8_t property;
+    uint8_t axis;
+  };
+
+  // All writes to the port, see ODriveLink::stop_now
+  void write(const char* buffer, int length);
+  void write_lines(const char* buffer, int length);  // the writer is already held
+  void write_query(int property, int axis);
+  bool write_stop(int axis, bool idle) override;
+  int format_query(char* buffer, int property, int axis);
+  static int format_velocity(char* buffer, int axis, float velocity);
+  int take_commands(char* buffer, int room);
+  bool read_line();
+  void handle_line(uint32_t now);
+  void receive(uint32_t now);
+  void expire(uint32_t now);
+  void wait_idle();
+
+  void finish_batch(uint32_t now);
+  void drop_batch();
+
+  // Setpoints waiting for the next update(), length 0 if none
+  char m_velocity_command[k_axis_count][k_command_size];
+  int m_velocity_length[k_axis_count] = {};
+  int m_velocity_sent_length[k_axis_count] = {};
+  // Zero velocity and idle per axis for stop_now
+  char m_stop_command[k_axis_count][k_command_size];
+  int m_stop_length[k_axis_count];
+  char m_idle_command[k_axis_count][k_command_size];
+  int m_idle_length[k_axis_count];
+
+  RingBuffer<Query, 16> m_pending;
+  uint32_t m_outstanding = 0;  // bit per slot that is pending or in flight
+
+  // Batch in flight. Replies carry no id, so values are only trusted once
+  // exactly one clean line came back for every query in the batch.
+  Query m_batch[k_pipeline_depth];
+  float m_batch_values[k_pipeline_depth];
+  int m_batch_size = 0;
+  int m_batch_received = 0;
+  bool m_batch_bad = false;
+  uint32_t m_batch_sent_us = 0;
+
+  ReplyParser m_parser;
+  uint32_t m_resync_until = 0;
+  bool m_resyncing = false;
 };
 
-#endif
\ No newline at end of file
+#endif
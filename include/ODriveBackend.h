@@ -0,0 +1,14 @@
+#ifndef odrive_backend_h
+#define odrive_backend_h
+
+// Which ODrive protocol the firmware speaks, picked at compile time so the control loop calls
+// the backend directly. MOAT_ODRIVE_CAN selects CAN-simple on CAN3, otherwise ASCII on Serial1.
+#ifdef MOAT_ODRIVE_CAN
+#include <ODriveCan.h>
+typedef ODriveCan ODriveBackend;
+#else
+#include <ODrive.h>
+typedef ODrive ODriveBackend;
+#endif
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef odrive_can_h
+#define odrive_can_h
+
+#include <CanBus.h>
+#include <CanSimple.h>
+#include <Hal.h>
+#include <ODriveLink.h>
+
+// ODrive over the CAN-simple protocol. Axis n is CAN node n.
+// With axisN.config.can set to push the encoder count, encoder estimates and bus voltage /
+// current cyclically, values just arrive and update() files them away: nothing is polled and
+// no reply has to be matched up with a query. request() only sends a remote request for a
+// value that hasn't arrived for k_poll_after_us, so a missing cyclic message still gets read.
+class ODriveCan final : public ODriveLink
+{
+public:
+  typedef CanBus Port;
+
+  const static uint32_t k_bitrate = 250000;
+  const static uint32_t k_poll_after_us = 25000;
+
+  ODriveCan(CanBus& bus);
+  void begin() override {}  // the bus belongs to its owner
+  int init(int timeout) override;
+  bool run_state(int axis, int requested_state, bool wait_for_idle, float timeout) override;
+  void set_velocity(int motor_number, float velocity) override;
+  void queue_velocity(int motor_number, float velocity, uint32_t stops_seen) override;
+
+  float get_encoder_pos(int motor_number) override;
+  float get_vel(int motor_number) override;
+  float get_voltage() override;
+  float get_cur() override;
+  void dump_errors(Print& out) override;
+
+  bool request(int property, int axis) override;
+  void update() override;
+  bool is_idle() const override { return true; }
+
+  uint32_t axis_error(int axis) const { return m_axis_error[axis & 1]; }
+  uint32_t tx_frames() const { return m_tx_frames; }
+  uint32_t tx_dropped() const { return m_tx_dropped; }
+  uint32_t remote_requests() const { return m_remote_requests; }
+
+private:
+  const static int k_velocity_bytes = 8;  // set_input_vel payload
+
+  static uint32_t command_for(int property);
+  bool send(const CanFrame& frame);
+  bool transmit(const CanFrame& frame);  // the writer is already held
+  bool write_stop(int axis, bool idle) override;
+  void receive(uint32_t now);
+  void handle(const CanFrame& frame, uint32_t now);
+  void store_value(int property, int axis, float value, uint32_t now);
+  bool wait_for(int slot, uint32_t updates_before);
+  float read(int property, int axis);
+  bool read_error(int axis, uint32_t command, uint32_t& error);
+
+  CanBus& m_bus;
+  float m_queued_velocity[k_axis_count] = {};
+  bool m_velocity_queued[k_axis_count] = {};
+  CanFrame m_stop_frames[k_axis_count];  // zero velocity for stop_now
+  CanFrame m_idle_frames[k_axis_count];
+  uint32_t m_updates[PROPERTY_COUNT * k_axis_count] = {};     // values received per slot
+  uint32_t m_requested_us[PROPERTY_COUNT * k_axis_count] = {}; // last remote request per slot
+  uint32_t m_requested = 0;                                     // bit per slot ever requested
+  uint32_t m_axis_error[k_axis_count] = {};
+
+  // Blocking error read in progress
+  uint32_t m_error_id = 0;
+  uint32_t m_error_value = 0;
+  bool m_error_received = false;
+
+  uint32_t m_tx_frames = 0;
+  uint32_t m_tx_dropped = 0;
+  uint32_t m_remote_requests = 0;
+};
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef odrive_link_h
+#define odrive_link_h
+
+#include <Hal.h>
+#include <SetpointGate.h>
+
+// What the actuator needs from the ODrive, whatever the wire.
+// ODrive speaks the ASCII protocol over a UART, ODriveCan the CAN-simple protocol. One of them
+// is picked at compile time (ODriveBackend.h) and used by its concrete type, so the calls in
+// the control step aren't virtual. The interface keeps the two backends honest.
+class ODriveLink
+{
+public:
+  // Properties that can be read asynchronously with request()/update()
+  enum Property
+  {
+    ENCODER_POS = 0,  // axisN.encoder.shadow_count
+    VELOCITY,         // axisN.encoder.vel_estimate
+    VBUS_VOLTAGE,     // vbus_voltage (not per axis)
+    IBUS_CURRENT,     // ibus (not per axis)
+    CURRENT_STATE,    // axisN.current_state
+    PROPERTY_COUNT
+  };
+  const static int k_axis_count = 2;
+  const static uint32_t k_blocking_timeout_ms = 1000;
+
+  // Outcome of the last blocking read
+  const static int k_read_ok = 0;
+  const static int k_read_timeout = 1;
+  const static int k_read_parse_error = 2;
+
+  // A state change the ODrive didn't keep (an error dropping it out of closed loop) is only
+  // noticed once CURRENT_STATE has been read, after that run_state sends the state again
+  const static uint32_t k_state_settle_us = 200000;
+
+  // Opens the port, init() does it too before waiting for the ODrive to answer
+  virtual void begin() = 0;
+  virtual int init(int timeout) = 0;
+  virtual bool run_state(int axis, int requested_state, bool wait_for_idle, float timeout) = 0;
+  // Sent right away, every time
+  virtual void set_velocity(int motor_number, float velocity) = 0;
+  // Non-blocking setpoint for the control loop. Goes through the axis' SetpointGate and the
+  // backend sends it with the next update(); one queued but not yet sent is replaced.
+  // stops_seen is stops(axis) from before the setpoint was worked out, one worked out before a
+  // newer stop_now is dropped instead of following the stop.
+  virtual void queue_velocity(int motor_number, float velocity, uint32_t stops_seen) = 0;
+  void configure_setpoints(const SetpointGate::Config& config);
+  // Safe from an interrupt: zero velocity on the axis right away, or with idle the axis dropped
+  // out of closed loop, with a command built ahead of time. One that comes in while a line or
+  // frame is going out follows it instead of splitting it.
+  void stop_now(int axis, bool idle = false);
+  // micros() when the last stop_now on the axis was handed to the port, 0 before the first
+  uint32_t stop_written_us(int axis) const { return m_stop_written_us[axis]; }
+  // The same for the last idle alone, a plain limit stop after it doesn't move this one
+  uint32_t idle_written_us(int axis) const { return m_idle_written_us[axis]; }
+  // stop_now calls on the axis so far
+  uint32_t stops(int axis) const { return m_stops[axis]; }
+
+  // Blocking getters, 0 if the read failed and read_status() tells why
+  virtual float get_encoder_pos(int motor_number) = 0;
+  virtual float get_vel(int motor_number) = 0;
+  virtual float get_voltage() = 0;
+  virtual float get_cur() = 0;
+  int read_status() const { return m_read_status; }
+  // Error codes of the system and both axes
+  virtual void dump_errors(Print& out) = 0;
+
+  // Non-blocking reads
+  // request() asks for a property, update() must be called often,
+  // cached() / age_us() give the last value received for that property
+  virtual bool request(int property, int axis) = 0;
+  virtual void update() = 0;
+  virtual bool is_idle() const = 0;
+  float cached(int property, int axis) const;
+  uint32_t age_us(int property, int axis) const;  // UINT32_MAX if never received
+
+  // Transport counters. A message is a reply line or a CAN frame; timeouts and parse errors
+  // count blocking and asynchronous reads.
+  uint32_t rx_bytes() const { return m_rx_bytes; }
+  uint32_t rx_messages() const { return m_rx_messages; }
+  uint32_t replies() const { return m_replies; }
+  uint32_t timeouts() const { return m_timeouts; }
+  uint32_t parse_errors() const { return m_parse_errors; }
+  uint32_t discarded_messages() const { return m_discarded_messages; }
+  // Outbound: commands written and the ones coalesced away, with the bytes they'd have taken
+  uint32_t commands_sent() const { return m_commands_sent; }
+  uint32_t keepalives_sent() const { return m_keepalives_sent; }
+  uint32_t commands_saved() const { return m_commands_saved; }
+  uint32_t command_bytes_saved() const { return m_command_bytes_saved; }
+  uint32_t state_resends() const { return m_state_resends; }
+  uint32_t immediate_stops() const { return m_immediate_stops; }
+  // Stop writes the port didn't take, each is tried again with the next end_write
+  uint32_t stop_retries() const { return m_stop_retries; }
+
+protected:
+  ~ODriveLink() {}
+
+  struct CachedValue
+  {
+    float value = 0;
+    uint32_t stamp_us = 0;
+    bool valid = false;
+  };
+
+  static bool valid_property(int property, int axis)
+  {
+    return property >= 0 && property < PROPERTY_COUNT && axis >= 0 && axis < k_axis_count;
+  }
+  static int slot(int property, int axis)
+  {
+    // vbus and ibus are not per axis, keep them in the axis 0 slot
+    if (property == VBUS_VOLTAGE || property == IBUS_CURRENT) axis = 0;
+    return property * k_axis_count + axis;
+  }
+  void store(int property, int axis, float value, uint32_t now_us);
+  void state_sent(int axis, int state);
+  // Gate decision for a queued setpoint, counts what's saved
+  int admit_velocity(int axis, float velocity, int bytes);
+  // Every write to the port goes between these so stop_now can't land inside it
+  void begin_write() { m_writing = true; }
+  void end_write();
+  // Holding the writer: sends whatever stop_now left pending, a longer write calls this between lines.
+  // False when the port didn't take one, it stays pending for the next end_write.
+  bool write_stops();
+  // Writes the prebuilt stop or idle, the writer is already held. False if the port didn't take it.
+  virtual bool write_stop(int axis, bool idle) = 0;
+  // For queue_velocity: false when a stop_now came in after stops_seen. Otherwise after_stop is
+  // true once after a stop_now on the axis, whatever was queued before it is stale.
+  bool take_stopped(int axis, uint32_t stops_seen, bool& after_stop);
+  bool stopped(int axis) const { return m_stopped & (1 << axis); }
+
+  CachedValue m_cache[PROPERTY_COUNT * k_axis_count];
+  // Per axis, the actuator and the cooling motor each hold their own state
+  int m_current_state[k_axis_count] = {-1, -1};
+  uint32_t m_state_sent_us[k_axis_count] = {};
+  int m_read_status = k_read_ok;
+  SetpointGate m_velocity_gates[k_axis_count];
+
+  uint32_t m_rx_bytes = 0;
+  uint32_t m_rx_messages = 0;
+  uint32_t m_replies = 0;
+  uint32_t m_timeouts = 0;
+  uint32_t m_parse_errors = 0;
+  uint32_t m_discarded_messages = 0;
+  uint32_t m_commands_sent = 0;
+  uint32_t m_keepalives_sent = 0;
+  uint32_t m_commands_saved = 0;
+  uint32_t m_command_bytes_saved = 0;
+  uint32_t m_state_resends = 0;
+
+  // Touched by stop_now from interrupts
+  volatile bool m_writing = false;
+  volatile uint8_t m_stop_pending = 0;  // bit per axis
+  volatile uint8_t m_idle_pending = 0;
+  volatile uint8_t m_stopped = 0;
+  volatile uint32_t m_stop_written_us[k_axis_count] = {};
+  volatile uint32_t m_idle_written_us[k_axis_count] = {};
+  volatile uint32_t m_stops[k_axis_count] = {};
+  volatile uint32_t m_immediate_stops = 0;
+  volatile uint32_t m_stop_retries = 0;
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef odrive_sim_h
+#define odrive_sim_h
+
+#include <CanBus.h>
+#include <Hal.h>
+#include <deque>
+#include <string>
+
+// Host-only ODrive on the far end of a simulated HardwareSerial or CAN bus.
+// On serial it speaks the ASCII protocol the ODrive class uses, moves bytes at the configured baud
+// rate, answers after a configurable latency and can lose whole replies or single bytes.
+// On CAN it speaks CAN-simple like ODriveCan expects: pushes the cyclic messages at their periods
+// and answers remote requests after the same latency, dropping replies at reply_drop_rate.
+class ODriveSim
+{
+public:
+  struct Config
+  {
+    uint32_t baud = 115200;
+    uint32_t reply_latency_us = 300;       // command received -> first reply byte
+    float reply_drop_rate = 0;             // chance a whole reply never comes back
+    float byte_drop_rate = 0;              // chance any single reply byte is lost
+    float velocity_time_constant = 0.02;   // s, closed loop velocity response
+    float counts_per_turn = 8192;
+    float vbus_voltage = 24;
+    uint32_t index_search_us = 400000;    // without an index
+    // Where the encoder's index pulse is, in position counts, repeating every turn. An index
+    // search turns the axis at index_search_velocity until it reaches one, stops there and
+    // counts from it. Below 0 the encoder has no index, the search takes index_search_us and
+    // the count stays where it was.
+    double index_position = -1;
+    float index_search_velocity = -2;     // turns/s, inbound so one parked outbound has room
+    uint32_t seed = 1;
+
+    // CAN cyclic messages per axis, 0 turns one off. Bus voltage / current comes from node 0.
+    uint32_t heartbeat_period_us = 100000;
+    uint32_t encoder_estimates_period_us = 5000;
+    uint32_t encoder_count_period_us = 5000;
+    uint32_t bus_vi_period_us = 10000;
+  };
+
+  struct Axis
+  {
+    int state = 1;              // 1 idle, 6 index search, 8 closed loop
+    float vel_setpoint = 0;     // turns/s
+    float velocity = 0;         // turns/s
+    double position = 0;        // encoder counts
+    double count_origin = 0;    // position the reported count is 0 at, where it powered up
+    uint64_t state_since_us = 0;
+    double count() const { return position - count_origin; }
+  };
+
+  ODriveSim(HardwareSerial& port, const Config& config);
+  ODriveSim(CanBus& bus, const Config& config);
+  void step(uint64_t now_us);
+
+  Axis& axis(int n) { return m_axes[n & 1]; }
+  float ibus() const;
+
+  uint32_t commands() const { return m_commands; }
+  uint32_t queries() const { return m_queries; }
+  uint32_t dropped_replies() const { return m_dropped_replies; }
+  uint32_t dropped_bytes() const { return m_dropped_bytes; }
+  uint32_t velocity_commands() const { return m_velocity_commands; }
+  uint32_t cyclic_frames() const { return m_cyclic_frames; }
+
+private:
+  struct Reply
+  {
+    uint64_t due_us;
+    std::string text;
+  };
+
+  struct PendingFrame
+  {
+    uint64_t due_us;
+    CanFrame frame;
+  };
+  enum Cyclic
+  {
+    HEARTBEAT,
+    ENCODER_ESTIMATES,
+    ENCODER_COUNT,
+    BUS_VI,
+    CYCLIC_COUNT
+  };
+
+  void step_serial(double dt, uint64_t now_us);
+  void step_can(uint64_t now_us);
+  void handle_frame(const CanFrame& frame, uint64_t now_us);
+  bool build_frame(uint8_t node, uint32_t command, CanFrame& frame);
+  void handle_line(uint64_t now_us);
+  void reply(const std::string& text, uint64_t now_us);
+  bool read_property(const char* name, std::string& value);
+  float random();
+
+  HardwareSerial* m_port = nullptr;
+  CanBus* m_bus = nullptr;
+  Config m_config;
+  Axis m_axes[2];
+  uint64_t m_last_us = 0;
+  double m_rx_credit = 0;
+  double m_tx_credit = 0;
+  std::string m_line;
+  std::deque<Reply> m_replies;
+  std::deque<uint8_t> m_wire;
+  std::deque<PendingFrame> m_frames;
+  uint64_t m_next_cyclic_us[2][CYCLIC_COUNT] = {};
+  uint32_t m_rng;
+
+  uint32_t m_commands = 0;
+  uint32_t m_queries = 0;
+  uint32_t m_dropped_replies = 0;
+  uint32_t m_dropped_bytes = 0;
+  uint32_t m_velocity_commands = 0;
+  uint32_t m_cyclic_frames = 0;
+};
+
+#endif
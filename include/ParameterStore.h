@@ -0,0 +1,68 @@
+#ifndef parameter_store_h
+#define parameter_store_h
+
+#include <Parameters.h>
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+class Print;
+
+// Runtime tunable parameters.
+// The control step reads active() once per cycle. Changes (from params.bin at boot or from
+// serial commands) are validated, written into the inactive copy and then published by
+// flipping the index, so a cycle always sees one complete, consistent set. Only the background
+// loop may change parameters, the control step interrupt can't land in the middle of a flip.
+class ParameterStore
+{
+public:
+  // Status codes of load() / stage()
+  const static int k_ok = 0;
+  const static int k_too_short = 1;
+  const static int k_bad_magic = 2;
+  const static int k_bad_version = 3;
+  const static int k_bad_count = 4;
+  const static int k_bad_crc = 5;
+  const static int k_out_of_range = 6;
+  const static int k_inconsistent = 7;
+
+  // What command() wants the caller to do, file access stays with the caller
+  const static int k_command_done = 0;
+  const static int k_command_error = 1;
+  const static int k_command_save = 2;
+  const static int k_command_reload = 3;
+
+  const static size_t k_file_size = sizeof(parameters::ParameterFileHeader) + k_parameter_count * sizeof(float);
+
+  ParameterStore();
+
+  const Parameters& active() const { return m_slots[m_active.load(std::memory_order_acquire)]; }
+  uint32_t changes() const { return m_changes; }
+
+  // Validates, derives and publishes, the active set is untouched on failure
+  int stage(const Parameters& params);
+  int load(const uint8_t* data, size_t length);
+  void restore_defaults();
+
+  // Text commands over USB serial, one line without the newline:
+  //   get [name] | set <name> <value> | defaults | save | reload
+  int command(char* line, Print& reply);
+
+  // Pure helpers, no state
+  static Parameters defaults();
+  static int validate(const Parameters& params);
+  static void derive(Parameters& params);
+  static int decode(const uint8_t* data, size_t length, Parameters& params);
+  static size_t encode(const Parameters& params, uint8_t* data, size_t capacity);
+  static int find(const char* name);
+  static const char* status_name(int status);
+
+private:
+  void print_parameter(Print& reply, int index) const;
+
+  Parameters m_slots[2];
+  std::atomic<int> m_active{0};
+  uint32_t m_changes = 0;
+};
+
+#endif
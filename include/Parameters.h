@@ -0,0 +1,99 @@
+#ifndef parameters_h
+#define parameters_h
+
+#include <Constant.h>
+#include <ReferenceCurve.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Tunable control parameters and the params.bin layout, shared by the firmware and host tools.
+//
+// params.bin is a ParameterFileHeader followed by value_count little endian floats in the
+// order of parameter_info(). A file with the wrong magic, version, count or crc is ignored and
+// the compiled defaults (from Constant) are used instead.
+namespace parameters
+{
+const uint32_t k_file_magic = 0x4D525250;  // "PRRM"
+const uint16_t k_version = 3;
+
+struct ParameterFileHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t value_count;
+  uint16_t crc;          // crc16 of the values
+  uint16_t reserved;
+};
+}  // namespace parameters
+
+struct Parameters
+{
+  // Tunable, in file order
+  float proportional_gain;
+  float integral_gain;
+  float derivative_gain;
+  float feed_forward_gain;
+  float derivative_filter_time;       // s
+  float integral_limit;               // turns/s
+  float actuator_velocity_limit;      // turns/s
+  float actuator_acceleration_limit;  // turns/s^2, 0 for none
+  float exponential_filter_alpha;
+  float engine_engage;       // rpm, reference curve breakpoints
+  float engine_launch;       // rpm, engage point of the launch and hill profiles
+  float engine_power;        // rpm
+  float ecvt_max_ratio;
+  float overdrive_ratio;
+  float reference_profile;   // k_profile_endurance / launch / hill
+
+  // Derived from the above whenever they change, see ParameterStore::derive
+  float gearbox_engage_rpm;
+  float gearbox_power_rpm;
+  float gearbox_overdrive_rpm;
+  int profile;
+  ReferenceCurve curves[k_profile_count];
+};
+
+struct ParameterInfo
+{
+  const char* name;
+  size_t offset;
+  float min;
+  float max;
+};
+
+const int k_parameter_count = 15;
+
+// Name, location and allowed range of every tunable, in file order
+inline const ParameterInfo* parameter_info()
+{
+  static const ParameterInfo info[k_parameter_count] = {
+    {"proportional_gain", offsetof(Parameters, proportional_gain), 0, 1},
+    {"integral_gain", offsetof(Parameters, integral_gain), 0, 1},
+    {"derivative_gain", offsetof(Parameters, derivative_gain), 0, 1},
+    {"feed_forward_gain", offsetof(Parameters, feed_forward_gain), 0, 50},
+    {"derivative_filter_time", offsetof(Parameters, derivative_filter_time), 0.001, 1},
+    {"integral_limit", offsetof(Parameters, integral_limit), 0, 60},
+    {"actuator_velocity_limit", offsetof(Parameters, actuator_velocity_limit), 0.1, 60},
+    {"actuator_acceleration_limit", offsetof(Parameters, actuator_acceleration_limit), 0, 10000},
+    {"exponential_filter_alpha", offsetof(Parameters, exponential_filter_alpha), 0.001, 1},
+    {"engine_engage", offsetof(Parameters, engine_engage), Constant::engine_idle, 4000},
+    {"engine_launch", offsetof(Parameters, engine_launch), Constant::engine_idle, 4000},
+    {"engine_power", offsetof(Parameters, engine_power), Constant::engine_idle, 4000},
+    {"ecvt_max_ratio", offsetof(Parameters, ecvt_max_ratio), 1, 6},
+    {"overdrive_ratio", offsetof(Parameters, overdrive_ratio), 0.5, 1.5},
+    {"reference_profile", offsetof(Parameters, reference_profile), 0, k_profile_count - 1},
+  };
+  return info;
+}
+
+inline float& parameter_value(Parameters& params, int index)
+{
+  return *(float*)((uint8_t*)&params + parameter_info()[index].offset);
+}
+
+inline float parameter_value(const Parameters& params, int index)
+{
+  return *(const float*)((const uint8_t*)&params + parameter_info()[index].offset);
+}
+
+#endif
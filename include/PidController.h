@@ -0,0 +1,63 @@
+#ifndef pid_controller_h
+#define pid_controller_h
+
+#include <float.h>
+#include <stdint.h>
+
+// PID with the pieces a shifting actuator needs:
+//  - integral clamped to +-integral_limit and frozen while the output is saturated or the
+//    actuator sits on a hall limit, so it doesn't wind up against a hard stop
+//  - derivative on the measurement through a first order low pass, no kick on reference steps
+//  - feed-forward, kff times whatever rate signal the caller hands in
+//  - output clamped to +-output_limit and slew limited to rate_limit per second
+// Fixed cost per update, no loops and no allocation.
+class PidController
+{
+public:
+  struct Config
+  {
+    float kp;
+    float ki;                        // per second
+    float kd;                        // seconds
+    float kff;
+    float derivative_time_constant;  // s
+    float integral_limit;            // output units
+    float output_limit;              // output units
+    float rate_limit;                // output units per second, 0 for none
+  };
+
+  // Directions the output may not go, e.g. when a hall sensor says the actuator is at a stop
+  const static int k_block_positive = 1;
+  const static int k_block_negative = 2;
+
+  void configure(const Config& config) { m_config = config; }
+  const Config& config() const { return m_config; }
+  void reset();
+
+  // dt in seconds, returns the new output. max_positive / max_negative cap the output each way
+  // on top of output_limit, e.g. to slow down ahead of a stop; like the stops they beat the slew limit.
+  float update(float reference, float measurement, float feed_forward_signal, float dt, int blocked,
+               float max_positive = FLT_MAX, float max_negative = FLT_MAX);
+
+  float proportional() const { return m_proportional; }
+  float integral() const { return m_integral; }
+  float derivative() const { return m_derivative; }
+  float feed_forward() const { return m_feed_forward; }
+  float output() const { return m_output; }
+
+private:
+  static float clamp(float value, float low, float high) { return value < low ? low : (value > high ? high : value); }
+
+  Config m_config = {};
+  bool m_started = false;
+  float m_last_measurement = 0;
+  float m_measurement_rate = 0;   // filtered d(measurement)/dt
+
+  float m_proportional = 0;
+  float m_integral = 0;
+  float m_derivative = 0;
+  float m_feed_forward = 0;
+  float m_output = 0;
+};
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef profiler_h
+#define profiler_h
+
+// Stage timing for the control step and the background loop.
+// Only built with -DMOAT_PROFILE (pio env teensy41_profile), without it every PROFILE_ macro
+// expands to nothing and none of the code below exists, so production builds pay nothing.
+//
+//   PROFILE_SCOPE(profile::k_cycle);          times until the end of the enclosing block
+//   PROFILE_LAPS(laps);                        starts a lap timer for a run of stages
+//   PROFILE_LAP(laps, profile::k_pid);         time since the last lap goes to that stage
+//
+// Time is ARM_DWT_CYCCNT cycles on the Teensy (600 MHz) and steady_clock ns on the host.
+// Each stage keeps count, min, max, total and a log2 histogram in fixed memory. Only one
+// context may record a given stage (the control step or the loop), stats() can be read from
+// anywhere.
+
+#include <stdint.h>
+
+namespace profile
+{
+// Control step
+const int k_cycle = 0;
+const int k_snapshot = 1;
+const int k_engine_rpm = 2;
+const int k_gearbox_rpm = 3;
+const int k_filters = 4;
+const int k_estimator = 5;
+const int k_reference = 6;
+const int k_pid = 7;
+const int k_odrive = 8;
+const int k_log_fill = 9;
+const int k_estop_read = 10;
+const int k_telemetry_push = 11;
+// Background loop
+const int k_telemetry_write = 12;
+const int k_serial_commands = 13;
+const int k_stage_count = 14;
+}  // namespace profile
+
+#ifdef MOAT_PROFILE
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <chrono>
+#endif
+
+class Print;
+
+namespace profile
+{
+const char* stage_name(int stage);
+}
+
+class Profiler
+{
+public:
+  // Bucket b counts stages that took [2^b, 2^(b+1)) ticks, ~1.7 ns to ~14 ms at 600 MHz
+  const static int k_buckets = 24;
+
+  struct StageStats
+  {
+    uint32_t count;
+    uint32_t min;    // ticks
+    uint32_t max;
+    uint64_t total;
+    uint32_t histogram[k_buckets];
+  };
+
+  static Profiler& instance();
+
+  static uint32_t now()
+  {
+#ifdef ARDUINO
+    return ARM_DWT_CYCCNT;
+#else
+    return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  static float ticks_per_us()
+  {
+#ifdef ARDUINO
+    return F_CPU_ACTUAL / 1e6f;
+#else
+    return 1000;
+#endif
+  }
+
+  void record(int stage, uint32_t ticks);
+  StageStats stats(int stage) const;
+  // Takes effect the next time each stage records, so it is safe from any context
+  void reset();
+
+  // One line per stage that ran: name, count, min / mean / max us and the histogram
+  void print(Print& out) const;
+
+private:
+  struct Slot
+  {
+    volatile uint32_t version;  // odd while the recording context is writing
+    volatile bool reset_requested;
+    StageStats stats;
+  };
+
+  Slot m_slots[profile::k_stage_count] = {};
+};
+
+class ProfileScope
+{
+public:
+  explicit ProfileScope(int stage) : m_stage(stage), m_start(Profiler::now()) {}
+  ~ProfileScope() { Profiler::instance().record(m_stage, Profiler::now() - m_start); }
+
+private:
+  int m_stage;
+  uint32_t m_start;
+};
+
+class ProfileLaps
+{
+public:
+  ProfileLaps() : m_last(Profiler::now()) {}
+  void lap(int stage)
+  {
+    uint32_t now = Profiler::now();
+    Profiler::instance().record(stage, now - m_last);
+    m_last = now;
+  }
+
+private:
+  uint32_t m_last;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(stage) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(stage)
+#define PROFILE_LAPS(name) ProfileLaps name
+#define PROFILE_LAP(name, stage) name.lap(stage)
+
+#else
+
+#define PROFILE_SCOPE(stage) do {} while (0)
+#define PROFILE_LAPS(name) do {} while (0)
+#define PROFILE_LAP(name, stage) do {} while (0)
+
+#endif
+
+#endif
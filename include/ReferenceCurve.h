@@ -0,0 +1,73 @@
+#ifndef reference_curve_h
+#define reference_curve_h
+
+#include <stdint.h>
+
+// Target engine rpm as a function of gearbox rpm.
+// A profile is a handful of breakpoints, linear between them and flat outside. build() samples
+// it onto a uniform grid once (when parameters change), evaluate() is then a clamp, a multiply
+// and one lerp with no branches, whatever the shape of the curve.
+struct CurvePoint
+{
+  float gearbox_rpm;
+  float engine_rpm;
+};
+
+class ReferenceCurve
+{
+public:
+  const static int k_cells = 512;     // ~12 rpm cells, kinks are rounded by at most slope * cell / 4
+  constexpr static float k_max_gearbox_rpm = 6000;
+  constexpr static float k_cell_rpm = k_max_gearbox_rpm / k_cells;
+  const static int k_max_points = 8;
+
+  // Points have to be sorted by gearbox rpm, returns false (and leaves the table alone) if not
+  bool build(const CurvePoint* points, int count);
+
+  float evaluate(float gearbox_rpm) const
+  {
+    int i;
+    float fraction = locate(gearbox_rpm, i);
+    return m_table[i] + (m_table[i + 1] - m_table[i]) * fraction;
+  }
+
+  // d(engine rpm)/d(gearbox rpm) of the cell gearbox_rpm falls in
+  float slope(float gearbox_rpm) const
+  {
+    int i;
+    locate(gearbox_rpm, i);
+    return (m_table[i + 1] - m_table[i]) * (1 / k_cell_rpm);
+  }
+
+private:
+  float locate(float gearbox_rpm, int& cell) const
+  {
+    float x = gearbox_rpm * (1 / k_cell_rpm);
+    x = x < 0 ? 0 : x;                 // conditional selects, no branch
+    x = x > k_cells ? k_cells : x;
+    cell = (int)x;
+    cell = cell < k_cells - 1 ? cell : k_cells - 1;
+    return x - cell;
+  }
+
+  float m_table[k_cells + 1] = {};
+};
+
+// Shift profiles, picked at runtime with the reference_profile parameter
+const int k_profile_endurance = 0;
+const int k_profile_launch = 1;
+const int k_profile_hill = 2;
+const int k_profile_count = 3;
+
+inline const char* profile_name(int profile)
+{
+  switch (profile)
+  {
+    case k_profile_endurance: return "endurance";
+    case k_profile_launch: return "launch";
+    case k_profile_hill: return "hill";
+    default: return "unknown";
+  }
+}
+
+#endif
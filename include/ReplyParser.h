@@ -0,0 +1,59 @@
+#ifndef reply_parser_h
+#define reply_parser_h
+
+#include <stdint.h>
+
+// Turns the ODrive's ASCII replies into numbers without touching the heap.
+// feed() assembles bytes into a fixed line buffer ('\r' is skipped, '\n' ends a line), a line
+// longer than the buffer is cut off and reported as too long rather than split in two.
+// parse_float() / parse_int() are strict: optional spaces and sign, digits, for floats an
+// optional fraction and exponent, and nothing else. "nan", "inf", hex and the ODrive's
+// "invalid property" all come back as k_invalid, the output is only written on k_ok.
+class ReplyParser
+{
+public:
+  const static int k_line_size = 32;
+
+  // feed() results
+  const static int k_incomplete = 0;
+  const static int k_complete = 1;
+
+  // Parse and line status codes
+  const static int k_ok = 0;
+  const static int k_empty = 1;
+  const static int k_invalid = 2;
+  const static int k_out_of_range = 3;
+  const static int k_too_long = 4;
+
+  int feed(char c);
+  // The line feed() just completed, nul terminated, until the next feed()
+  const char* line() const { return m_line; }
+  int line_length() const { return m_length; }
+  bool line_too_long() const { return m_too_long; }
+  // Drops a partly received line
+  void reset();
+
+  // Parses the completed line, k_too_long if it was cut off
+  int parse_float(float& value) const;
+  int parse_int(int32_t& value) const;
+
+  static int parse_float(const char* text, float& value);
+  static int parse_int(const char* text, int32_t& value);
+  static const char* status_name(int status);
+
+  uint32_t bytes() const { return m_bytes; }
+  uint32_t lines() const { return m_lines; }
+  uint32_t long_lines() const { return m_long_lines; }
+
+private:
+  char m_line[k_line_size] = {};
+  int m_length = 0;
+  bool m_too_long = false;
+  bool m_complete = false;
+
+  uint32_t m_bytes = 0;
+  uint32_t m_lines = 0;
+  uint32_t m_long_lines = 0;
+};
+
+#endif
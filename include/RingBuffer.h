@@ -0,0 +1,56 @@
+#ifndef ring_buffer_h
+#define ring_buffer_h
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed size single-producer / single-consumer ring buffer.
+// Safe to push from an ISR and pop from the main loop (or the other way around)
+// without masking interrupts. N has to be a power of two.
+template <class T, size_t N>
+class RingBuffer
+{
+  static_assert(N > 0 && (N & (N - 1)) == 0, "RingBuffer size must be a power of two");
+
+public:
+  bool push(const T& item)
+  {
+    uint32_t head = m_head.load(std::memory_order_relaxed);
+    if (head - m_tail.load(std::memory_order_acquire) >= N) return false;
+    m_items[head & (N - 1)] = item;
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& item)
+  {
+    uint32_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail == m_head.load(std::memory_order_acquire)) return false;
+    item = m_items[tail & (N - 1)];
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Oldest item, only valid when not empty
+  T& front() { return m_items[m_tail.load(std::memory_order_relaxed) & (N - 1)]; }
+  const T& front() const { return m_items[m_tail.load(std::memory_order_relaxed) & (N - 1)]; }
+
+  // Item i places after the oldest one, only valid when i < size()
+  const T& at(size_t i) const { return m_items[(m_tail.load(std::memory_order_relaxed) + i) & (N - 1)]; }
+
+  size_t size() const { return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire); }
+  bool empty() const { return size() == 0; }
+  bool full() const { return size() >= N; }
+  constexpr static size_t capacity() { return N; }
+
+  // Only call from the consumer side
+  void clear() { m_tail.store(m_head.load(std::memory_order_acquire), std::memory_order_release); }
+
+private:
+  T m_items[N];
+  std::atomic<uint32_t> m_head{0};
+  std::atomic<uint32_t> m_tail{0};
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef scheduler_h
+#define scheduler_h
+
+#include <Hal.h>
+
+// Runs one task at a fixed rate from a hardware timer (IntervalTimer on the Teensy).
+// Anything that isn't real time (logging, SD, diagnostics) belongs in loop(), fed by
+// whatever the task pushes into a RingBuffer.
+// Without a timer (host builds) call poll() as often as possible instead, it runs the
+// task whenever micros() passes the next deadline.
+class Scheduler
+{
+public:
+  typedef void (*Task)();
+
+  const static uint32_t k_min_period_us = 1000;  // 1 kHz at most
+
+  // All times in us
+  struct Stats
+  {
+    uint32_t cycles;
+    uint32_t overruns;      // task ran past the next deadline
+    uint32_t missed;        // deadlines skipped entirely
+    int32_t jitter_min;     // start - deadline
+    int32_t jitter_max;
+    int32_t jitter_mean;
+    uint32_t exec_min;
+    uint32_t exec_max;
+    uint32_t exec_mean;
+  };
+
+  Scheduler();
+  bool begin(uint32_t period_us, Task task);
+  void end();
+  bool poll();
+  void dispatch();
+
+  Stats stats() const;
+  void reset_stats();
+  uint32_t period_us() const { return m_period_us; }
+  bool running() const { return m_running; }
+
+private:
+  static void timer_isr();
+  void clear_stats();
+  static Scheduler* s_active;
+
+  Task m_task = nullptr;
+  uint32_t m_period_us = 0;
+  uint32_t m_next_deadline = 0;
+  volatile bool m_running = false;
+  volatile bool m_in_task = false;
+  volatile bool m_reset_requested = false;
+
+  // Written from the task context only, the version lets stats() take a consistent copy
+  volatile uint32_t m_version = 0;
+  uint32_t m_cycles = 0;
+  uint32_t m_overruns = 0;
+  uint32_t m_missed = 0;
+  int32_t m_jitter_min = 0;
+  int32_t m_jitter_max = 0;
+  int64_t m_jitter_sum = 0;
+  uint32_t m_exec_min = 0;
+  uint32_t m_exec_max = 0;
+  uint64_t m_exec_sum = 0;
+};
+
+#endif
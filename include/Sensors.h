@@ -0,0 +1,69 @@
+#ifndef sensors_h
+#define sensors_h
+
+#include <Constant.h>
+#include <Hal.h>
+#include <Seqlock.h>
+#include <ToothSensor.h>
+
+// Hall sensors, active low at the ends of travel
+struct HallState
+{
+  uint32_t inbound;
+  uint32_t outbound;
+  uint32_t changed_us;   // last edge on either sensor
+  uint32_t changes;
+  // Actuator encoder count latched by the interrupt when a sensor last became active
+  uint32_t inbound_hits;
+  uint32_t outbound_hits;
+  int32_t inbound_count;
+  int32_t outbound_count;
+};
+
+// Everything the interrupts know, each part internally consistent
+struct SensorSnapshot
+{
+  ToothState engine;
+  ToothState gearbox;
+  HallState hall;
+};
+
+// Collects what the pin interrupts publish so the control step can read it without
+// noInterrupts(). Every source has its own Seqlock because the interrupts can nest.
+class Sensors
+{
+public:
+  // Sensors on_hall_change saw become active
+  const static int k_inbound_hit = 1;
+  const static int k_outbound_hit = 2;
+
+  Sensors(const Constant& constant, ToothSensor& engine, ToothSensor& gearbox);
+
+  // Reads the hall pins once so the snapshot is valid before the first edge
+  void begin();
+  // Actuator encoder the hall interrupt latches, counts stay 0 without one
+  void attach_encoder(Encoder* encoder) { m_actuator_encoder = encoder; }
+
+  // Interrupt side
+  int on_hall_change();
+
+  // Control side
+  SensorSnapshot snapshot() const;
+  ToothSensor& engine() { return m_engine; }
+  ToothSensor& gearbox() { return m_gearbox; }
+
+private:
+  int m_hall_inbound_pin;
+  int m_hall_outbound_pin;
+  ToothSensor& m_engine;
+  ToothSensor& m_gearbox;
+  Seqlock<HallState> m_hall;
+
+  Encoder* m_actuator_encoder = nullptr;
+
+  // Only touched by their interrupt
+  HallState m_hall_last = {};
+  uint32_t m_hall_changes = 0;
+};
+
+#endif
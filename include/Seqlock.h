@@ -0,0 +1,74 @@
+#ifndef seqlock_h
+#define seqlock_h
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+// Single-writer sequence lock for small plain structs.
+// The writer (an ISR) bumps the sequence to odd, stores the words and bumps it back to even.
+// Readers copy the words and retry if the sequence was odd or moved, so neither side ever
+// masks interrupts. On the Teensy the writer can't be interrupted by the reader, so a read
+// retries at most once per write that lands on top of it.
+// Only one context may write a given Seqlock, give each interrupt its own.
+template <class T>
+class Seqlock
+{
+  static_assert(std::is_trivially_copyable<T>::value, "Seqlock holds plain data only");
+  static_assert(sizeof(T) % sizeof(uint32_t) == 0, "Seqlock data has to be whole 32 bit words");
+
+public:
+  Seqlock()
+  {
+    for (size_t i = 0; i < k_words; i++) m_words[i].store(0, std::memory_order_relaxed);
+  }
+
+  void write(const T& value)
+  {
+    uint32_t words[k_words];
+    memcpy(words, &value, sizeof(T));
+    uint32_t sequence = m_sequence.load(std::memory_order_relaxed);
+    m_sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < k_words; i++) m_words[i].store(words[i], std::memory_order_relaxed);
+    m_sequence.store(sequence + 2, std::memory_order_release);
+  }
+
+  // Returns the number of retries it took, mostly for the stress test
+  uint32_t read(T& value) const
+  {
+    uint32_t words[k_words];
+    uint32_t retries = 0;
+    while (true)
+    {
+      uint32_t before = m_sequence.load(std::memory_order_acquire);
+      if ((before & 1) == 0)
+      {
+        for (size_t i = 0; i < k_words; i++) words[i] = m_words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_sequence.load(std::memory_order_relaxed) == before) break;
+      }
+      retries++;
+    }
+    memcpy(&value, words, sizeof(T));
+    return retries;
+  }
+
+  T read() const
+  {
+    T value;
+    read(value);
+    return value;
+  }
+
+  // Number of writes so far
+  uint32_t version() const { return m_sequence.load(std::memory_order_acquire) / 2; }
+
+private:
+  static const size_t k_words = sizeof(T) / sizeof(uint32_t);
+  std::atomic<uint32_t> m_sequence{0};
+  std::atomic<uint32_t> m_words[k_words];
+};
+
+#endif
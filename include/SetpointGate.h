@@ -0,0 +1,50 @@
+#ifndef setpoint_gate_h
+#define setpoint_gate_h
+
+#include <stdint.h>
+
+// Decides which setpoints are worth sending:
+//  - a change beyond deadband goes out, at most once per min_interval_us; one held back by
+//    the interval goes out as soon as the interval is over
+//  - a stop (non-zero to zero) always goes out at once
+//  - otherwise the current value is resent every keepalive_us so the ODrive's watchdog is fed
+//  - everything else is coalesced into the last value sent
+// The first value after reset() always goes out.
+class SetpointGate
+{
+public:
+  struct Config
+  {
+    float deadband = 0;            // setpoint units
+    uint32_t min_interval_us = 0;  // between changes, 0 for none
+    uint32_t keepalive_us = 0;     // resend an unchanged value after this long, 0 for never
+  };
+
+  const static int k_skip = 0;       // coalesced, nothing to send
+  const static int k_change = 1;
+  const static int k_keepalive = 2;
+
+  void configure(const Config& config) { m_config = config; }
+  const Config& config() const { return m_config; }
+  void reset() { m_sent = false; }
+
+  // Records value as sent unless the answer is k_skip
+  int decide(float value, uint32_t now_us);
+  float sent_value() const { return m_value; }
+
+  uint32_t changes() const { return m_changes; }
+  uint32_t keepalives() const { return m_keepalives; }
+  uint32_t skipped() const { return m_skipped; }
+
+private:
+  Config m_config;
+  bool m_sent = false;
+  float m_value = 0;
+  uint32_t m_sent_us = 0;
+
+  uint32_t m_changes = 0;
+  uint32_t m_keepalives = 0;
+  uint32_t m_skipped = 0;
+};
+
+#endif
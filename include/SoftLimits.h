@@ -0,0 +1,49 @@
+#ifndef soft_limits_h
+#define soft_limits_h
+
+#include <stdint.h>
+
+// Speed caps that bring the actuator to the ends of travel slowly instead of at full speed.
+// The ends are the encoder counts the hall interrupts latched (or homing derived). Toward one
+// the speed is held to what can still stop there at decel after response seconds of carrying on
+// (the next cycle plus the ODrive catching up), v * response + v^2 / (2 * decel) = distance, but
+// never below min_speed so it still gets onto the sensor. More than overtravel past it nothing goes.
+// Away from an end, or toward one that isn't known yet, there's no cap.
+class SoftLimits
+{
+public:
+  struct Config
+  {
+    float decel = 0;               // turns/s^2, 0 turns the caps off
+    float min_speed = 0;           // turns/s
+    float response = 0;            // s before a lower cap takes effect
+    int32_t overtravel = 0;        // counts past the end
+    float counts_per_turn = 8192;
+  };
+
+  void configure(const Config& config) { m_config = config; }
+  const Config& config() const { return m_config; }
+
+  void set_inbound(int32_t count);
+  void set_outbound(int32_t count);
+  void clear() { m_has_inbound = m_has_outbound = false; }
+  bool has_inbound() const { return m_has_inbound; }
+  bool has_outbound() const { return m_has_outbound; }
+  int32_t inbound() const { return m_inbound; }
+  int32_t outbound() const { return m_outbound; }
+
+  // turns/s the actuator at position may move each way, FLT_MAX for no cap
+  float max_outbound_speed(int32_t position) const;
+  float max_inbound_speed(int32_t position) const;
+
+private:
+  float cap(int32_t distance) const;
+
+  Config m_config;
+  bool m_has_inbound = false;
+  bool m_has_outbound = false;
+  int32_t m_inbound = 0;
+  int32_t m_outbound = 0;
+};
+
+#endif
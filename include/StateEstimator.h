@@ -0,0 +1,105 @@
+#ifndef state_estimator_h
+#define state_estimator_h
+
+#include <Constant.h>
+#include <Matrix.h>
+#include <stdint.h>
+
+// Everything the estimator is fed once per control cycle
+struct EstimatorInput
+{
+  float engine_rpm;        // gear tooth rpm
+  float engine_age_s;      // how long ago the middle of its tooth window was
+  bool engine_fresh;       // teeth arrived since the last cycle
+  float gearbox_rpm;
+  float gearbox_age_s;
+  bool gearbox_fresh;
+  int32_t encoder_count;   // Teensy quadrature count of the actuator
+  bool odrive_fresh;       // new shadow_count / vel_estimate replies since the last cycle
+  float odrive_count;      // axis shadow_count
+  float odrive_velocity;   // axis vel_estimate, turns/s
+  float odrive_age_s;      // age of the shadow_count reply
+};
+
+struct StateEstimate
+{
+  float engine_rpm;
+  float engine_accel;      // rpm/s
+  float gearbox_rpm;
+  float gearbox_accel;     // rpm/s
+  float ratio;             // engine / gearbox through the belt
+  float sheave_position;   // actuator counts
+  float sheave_velocity;   // counts/s
+  bool belt_locked;        // the belt measurement passed the gate this cycle
+};
+
+// Kalman filter over engine rpm, gearbox rpm, their accelerations and the belt ratio.
+// Gear tooth rpm is an average over a window that ends at the last tooth, so each reading is
+// compared against the state that far back. When the belt grips, engine = ratio * gearbox ties
+// the two shafts together: the fast engine teeth then fill in between the slow gearbox teeth.
+// A reading that disagrees with that by more than the gate (clutch slipping) is left out.
+// The ratio moves with the sheave, a second small filter fuses the Teensy encoder and the ODrive
+// shadow_count and vel_estimate into sheave position and velocity. Once homing has found the
+// travel the sheave position also gives the ratio directly.
+// Measurements are applied one at a time, so there is never a matrix to invert.
+class StateEstimator
+{
+public:
+  struct Config
+  {
+    float engine_jerk = 40000;        // rpm/s^2 / sqrt(Hz), process noise on the accelerations
+    float gearbox_jerk = 6000;
+    float ratio_walk = 0.05;          // 1 / sqrt(s), ratio change the sheave doesn't explain
+    float engine_noise = 15;          // rpm, one sigma of a tooth reading
+    float gearbox_noise = 25;
+    float belt_noise = 30;            // rpm, engine - ratio * gearbox while gripping
+    float belt_gate = 3;              // sigma
+    float belt_min_gearbox_rpm = 150; // too few gearbox teeth below this to say anything
+    float sheave_jerk = 2e6;          // counts/s^2 / sqrt(Hz)
+    float encoder_noise = 2;          // counts
+    float odrive_count_noise = 20;    // counts
+    float odrive_velocity_noise = 0.2;  // turns/s
+    float position_ratio_noise = 0.1;   // sheave position to ratio map, one sigma
+    float counts_per_turn = 4 * 2048;
+    float min_ratio = Constant::overdrive_ratio;
+    float max_ratio = Constant::ecvt_max_ratio;
+    float ratio_per_count = (Constant::ecvt_max_ratio - Constant::overdrive_ratio) /
+                            Constant::encoder_count_shift_length;  // outbound is the higher ratio
+  };
+
+  StateEstimator();
+  explicit StateEstimator(const Config& config);
+
+  // Starts over from the car at rest, shifted all the way out
+  void reset();
+  // From homing, until then the ratio only comes from the belt
+  void set_travel(int32_t inbound_count, int32_t outbound_count);
+
+  const StateEstimate& update(const EstimatorInput& input, float dt_s);
+  const StateEstimate& estimate() const { return m_estimate; }
+
+private:
+  const static int k_states = 5;
+  const static int k_engine = 0;
+  const static int k_engine_accel = 1;
+  const static int k_gearbox = 2;
+  const static int k_gearbox_accel = 3;
+  const static int k_ratio = 4;
+
+  void predict(float dt_s);
+  void correct_sheave(const EstimatorInput& input);
+  void correct_shafts(const EstimatorInput& input);
+
+  Config m_config;
+  Matrix<k_states, 1> m_x;
+  Matrix<k_states, k_states> m_p;
+  Matrix<2, 1> m_sheave;       // position, velocity
+  Matrix<2, 2> m_sheave_p;
+  bool m_sheave_started = false;
+  bool m_has_travel = false;
+  float m_inbound_count = 0;
+  float m_outbound_count = 0;
+  StateEstimate m_estimate = {};
+};
+
+#endif
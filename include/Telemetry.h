@@ -0,0 +1,49 @@
+#ifndef telemetry_h
+#define telemetry_h
+
+#include <TelemetryFormat.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Double buffered binary telemetry.
+// push() runs in the control step: it packs one record into the active RAM buffer and never
+// touches the SD card. When a buffer fills up it is handed to the background, which writes it
+// out in whole 512 byte blocks (ready() / release()) while the other buffer keeps filling.
+// If the background falls a full buffer behind, records are dropped and counted instead of
+// stalling the control step.
+class Telemetry
+{
+public:
+  const static int k_buffer_blocks = 8;
+  const static size_t k_buffer_size = k_buffer_blocks * telemetry::k_block_size;
+
+  bool begin(const telemetry::FieldInfo* fields, int field_count, uint32_t period_us);
+  bool push(const int* out, uint32_t time_us);
+
+  // Background side
+  const uint8_t* ready(size_t& length);
+  void release();
+  const uint8_t* drain(size_t& length);  // partially filled buffer, only once pushing has stopped
+
+  uint32_t records() const { return m_sequence; }
+  uint32_t dropped() const { return m_dropped; }
+  size_t record_size() const { return m_record_size; }
+
+private:
+  void write(const uint8_t* data, size_t length);
+
+  uint8_t m_buffers[2][k_buffer_size] __attribute__((aligned(4)));
+  int m_active = 0;
+  size_t m_fill = 0;
+  volatile int m_ready = -1;  // buffer waiting for the background, -1 if none
+
+  telemetry::FileHeader m_header;
+  uint8_t m_field_index[telemetry::k_max_fields];
+  int m_field_count = 0;
+  size_t m_record_size = 0;
+
+  uint32_t m_sequence = 0;
+  volatile uint32_t m_dropped = 0;
+};
+
+#endif
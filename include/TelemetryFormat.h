@@ -0,0 +1,86 @@
+#ifndef telemetry_format_h
+#define telemetry_format_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// On-disk layout of the binary telemetry log, shared by the firmware and the host decoder.
+//
+// The file starts with one 512 byte block holding a FileHeader (zero padded), followed by
+// a stream of fixed size records: RecordHeader then field_count int32 values.
+// Everything is little endian. A record whose sync word is zero marks the end of the data.
+namespace telemetry
+{
+const uint32_t k_file_magic = 0x474F4C4D;  // "MLOG"
+const uint16_t k_version = 1;
+const uint16_t k_record_sync = 0xA55A;
+const int k_block_size = 512;
+const int k_max_fields = 28;  // the FileHeader has to fit in the first block
+const int k_name_size = 12;
+
+struct FieldInfo
+{
+  char name[k_name_size];
+  uint8_t out_index;  // index into the control_function out[] array
+  uint8_t reserved[3];
+};
+
+struct FileHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;  // offset of the first record
+  uint16_t record_size;
+  uint16_t field_count;
+  uint32_t period_us;    // control period the log was recorded at
+  uint16_t crc;          // crc16 of the header with this field zeroed
+  uint16_t reserved;
+  FieldInfo fields[k_max_fields];
+};
+
+struct RecordHeader
+{
+  uint16_t sync;
+  uint16_t crc;          // crc16 of everything after this field
+  uint32_t sequence;
+  uint32_t time_us;
+};
+
+static_assert(sizeof(FieldInfo) == 16, "FieldInfo must stay packed");
+static_assert(sizeof(FileHeader) <= k_block_size, "FileHeader must fit in one block");
+static_assert(sizeof(RecordHeader) == 12, "RecordHeader must stay packed");
+
+constexpr size_t record_size(int field_count)
+{
+  return sizeof(RecordHeader) + field_count * sizeof(int32_t);
+}
+
+// CRC-16/CCITT-FALSE, nibble table so it is cheap enough to run in the control interrupt
+inline uint16_t crc16(const uint8_t* data, size_t length, uint16_t crc = 0xFFFF)
+{
+  static const uint16_t table[16] = {0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+                                     0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF};
+  for (size_t i = 0; i < length; i++)
+  {
+    crc = (crc << 4) ^ table[(crc >> 12) ^ (data[i] >> 4)];
+    crc = (crc << 4) ^ table[(crc >> 12) ^ (data[i] & 0x0F)];
+  }
+  return crc;
+}
+
+inline uint16_t header_crc(const FileHeader& header)
+{
+  FileHeader copy = header;
+  copy.crc = 0;
+  return crc16((const uint8_t*)&copy, sizeof(copy));
+}
+
+// crc of a whole record as laid out in memory
+inline uint16_t record_crc(const uint8_t* record, size_t size)
+{
+  return crc16(record + offsetof(RecordHeader, sequence), size - offsetof(RecordHeader, sequence));
+}
+}  // namespace telemetry
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef thermal_monitor_h
+#define thermal_monitor_h
+
+#include <Constant.h>
+#include <Hal.h>
+#include <RingBuffer.h>
+#include <Thermistor.h>
+
+// Thermistor temperatures and the cooling motor setpoint, all outside the control step.
+// On the Teensy the ADC converts one thermistor per timer trigger and its interrupt only moves
+// the code into a RingBuffer and points the ADC at the next pin. update() runs in the background:
+// averages what came in, converts through the ThermistorTable and sets the cooling speed from the
+// hottest thermistor every update_period_us.
+// Without the ADC timer (host builds) call poll() as often as possible instead, it samples with
+// analogRead whenever micros() passes the next trigger.
+class ThermalMonitor
+{
+public:
+  const static int k_channels = 3;
+
+  // Reading status
+  const static int k_ok = 0;
+  const static int k_unused = 1;      // no pin
+  const static int k_no_samples = 2;  // nothing converted since the last update
+  const static int k_shorted = 3;
+  const static int k_open = 4;
+
+  struct Config
+  {
+    int pins[k_channels] = {-1, -1, -1};  // -1 leaves a channel out
+    uint32_t sample_rate = 100;           // Hz per channel
+    uint32_t update_period_us = 100000;
+    ThermistorTable::Config thermistor;
+
+    // Off below on_temp - hysteresis, min_speed at on_temp rising linearly to max_speed at full_temp.
+    // Any thermistor that can't be read runs it at max_speed.
+    float on_temp = 60;                   // C
+    float full_temp = 90;                 // C
+    float hysteresis = 5;                 // C
+    float min_speed = 5;                  // turns/s
+    float max_speed = 30;                 // turns/s
+  };
+
+  struct Reading
+  {
+    float temperature = 0;  // C, the last good one while status isn't k_ok
+    uint16_t code = 0;      // mean over the last update
+    int status = k_unused;
+  };
+
+  // Config from Constant, configure() before begin() to change it
+  explicit ThermalMonitor(const Constant& constant);
+  void configure(const Config& config);
+  const Config& config() const { return m_config; }
+
+  bool begin();
+  void end();
+  bool poll();
+
+  // Interrupt side: the code for the channel the last trigger converted, returns the pin to
+  // convert next
+  int on_conversion(uint16_t code);
+
+  // Background, true when a new cooling setpoint is out
+  bool update(uint32_t now_us);
+  const Reading& reading(int channel) const { return m_readings[channel]; }
+  float hottest() const { return m_hottest; }       // C over the readable thermistors
+  float cooling_velocity() const { return m_cooling_velocity; }
+  uint32_t samples() const { return m_samples; }
+  uint32_t dropped() const { return m_dropped; }    // ring buffer was full
+  const ThermistorTable& table() const { return m_table; }
+  static const char* status_name(int status);
+
+private:
+  struct Sample
+  {
+    uint8_t channel;
+    uint16_t code;
+  };
+
+  static void adc_isr();
+  static ThermalMonitor* s_active;
+  float cooling_speed(bool fault);
+
+  Config m_config;
+  ThermistorTable m_table;
+  RingBuffer<Sample, 64> m_samples_ready;
+  int m_scan[k_channels];    // channels with a pin, in conversion order
+  int m_scan_count = 0;
+  volatile int m_scan_index = 0;
+  volatile uint32_t m_dropped = 0;
+  bool m_running = false;
+  uint32_t m_trigger_period_us = 0;
+  uint32_t m_next_trigger_us = 0;
+
+  // Background only
+  uint32_t m_sums[k_channels] = {};
+  uint32_t m_counts[k_channels] = {};
+  uint32_t m_last_update_us = 0;
+  bool m_updated = false;
+  Reading m_readings[k_channels];
+  float m_hottest = 0;
+  bool m_cooling = false;
+  float m_cooling_velocity = 0;
+  uint32_t m_samples = 0;
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef tooth_sensor_h
+#define tooth_sensor_h
+
+#include <Hal.h>
+#include <RingBuffer.h>
+#include <Seqlock.h>
+#include <atomic>
+
+// What the interrupt last published, count and time always belong to the same edge
+struct ToothState
+{
+  uint32_t count;
+  uint32_t last_edge_us;
+};
+
+// Gear tooth sensor that timestamps every edge instead of only counting them.
+// on_edge() runs in the pin interrupt and pushes micros() into a lock-free ring, rpm() runs in
+// the control step, drains the ring and divides the last few teeth by the time they took.
+// A tooth counted per 10 ms cycle is ~68 rpm on the engine, a period over 22 teeth at 1 us is < 1 rpm.
+class ToothSensor
+{
+public:
+  // Edges stored between two rpm() calls, at 3800 rpm the engine sensor gives ~56 per 10 ms
+  const static size_t k_edge_buffer = 256;
+  // Edges kept for the estimate, window_teeth has to be smaller than this
+  const static size_t k_history = 64;
+
+  ToothSensor(float teeth_per_rotation, uint32_t window_teeth, uint32_t stall_us);
+
+  // Interrupt side
+  void on_edge();
+
+  // Control side, only call from one context (the control step or the diagnostic loop)
+  float rpm();
+  ToothState state() const { return m_state.read(); }
+  uint32_t count() const { return state().count; }
+  uint32_t overflows() const { return m_overflows.load(std::memory_order_relaxed); }
+  uint32_t last_edge_us() const { return m_last_edge_us; }
+  // How long before the last rpm() call the middle of the window it averaged over was
+  uint32_t age_us() const { return m_age_us; }
+
+private:
+  void drain();
+  uint32_t history(uint32_t age) const { return m_history[(m_history_count - 1 - age) & (k_history - 1)]; }
+
+  RingBuffer<uint32_t, k_edge_buffer> m_edges;
+  Seqlock<ToothState> m_state;
+  uint32_t m_count = 0;   // interrupt side copy of m_state.count
+  std::atomic<uint32_t> m_overflows{0};
+
+  float m_teeth_per_rotation;
+  uint32_t m_window_teeth;
+  uint32_t m_stall_us;
+
+  uint32_t m_history[k_history];
+  uint32_t m_history_count = 0;
+  uint32_t m_last_edge_us = 0;
+  uint32_t m_seen_overflows = 0;
+  float m_last_rpm = 0;
+  uint32_t m_age_us = 0;
+};
+
+#endif
@@ -0,0 +1,141 @@
+#include <BootSequencer.h>
+
+bool BootSequencer::add(const char* name, Step step, bool required)
+{
+  if (m_count >= k_max_steps || m_started) return false;
+  Stage& stage = m_stages[m_count++];
+  stage = Stage();
+  stage.name = name;
+  stage.step = step;
+  stage.required = required;
+  stage.result = k_busy;
+  return true;
+}
+
+void BootSequencer::start()
+{
+  uint32_t now_us = micros();
+  m_started = true;
+  m_started_us = now_us;
+  for (int i = 0; i < m_count; i++)
+  {
+    m_stages[i].result = k_busy;
+    m_stages[i].started_us = now_us;
+    m_stages[i].finished_us = 0;
+    m_stages[i].active_us = 0;
+    m_stages[i].calls = 0;
+  }
+}
+
+bool BootSequencer::poll()
+{
+  if (!m_started) start();
+  bool busy = false;
+  for (int i = 0; i < m_count; i++)
+  {
+    Stage& stage = m_stages[i];
+    if (stage.result != k_busy) continue;
+    // A step that blocks anyway (SD) still moves the clock for the ones after it
+    uint32_t before = micros();
+    int result = stage.step(before);
+    uint32_t after = micros();
+    stage.active_us += after - before;
+    stage.calls++;
+    if (result == k_busy)
+    {
+      busy = true;
+      continue;
+    }
+    stage.result = result == k_done ? k_done : k_failed;
+    stage.finished_us = after;
+  }
+  return busy;
+}
+
+bool BootSequencer::run(uint32_t timeout_us)
+{
+  if (!m_started) start();
+  uint32_t started = micros();
+  while (poll())
+  {
+    if (micros() - started <= timeout_us) continue;
+    for (int i = 0; i < m_count; i++)
+    {
+      if (m_stages[i].result != k_busy) continue;
+      m_stages[i].result = k_timed_out;
+      m_stages[i].finished_us = micros();
+    }
+    break;
+  }
+  return ok();
+}
+
+bool BootSequencer::busy() const
+{
+  for (int i = 0; i < m_count; i++)
+  {
+    if (m_stages[i].result == k_busy) return true;
+  }
+  return false;
+}
+
+bool BootSequencer::ok() const
+{
+  for (int i = 0; i < m_count; i++)
+  {
+    if (m_stages[i].required && m_stages[i].result != k_done) return false;
+  }
+  return true;
+}
+
+uint32_t BootSequencer::ready_us() const
+{
+  uint32_t ready = m_started_us;
+  for (int i = 0; i < m_count; i++)
+  {
+    const Stage& stage = m_stages[i];
+    if (!stage.required) continue;
+    if (stage.result == k_busy) return 0;
+    if ((int32_t)(stage.finished_us - ready) > 0) ready = stage.finished_us;
+  }
+  return ready;
+}
+
+void BootSequencer::report(Print& out) const
+{
+  // Times from power up, the Teensy's own startup is before started_us
+  for (int i = 0; i < m_count; i++)
+  {
+    const Stage& stage = m_stages[i];
+    out.print("boot ");
+    out.print(stage.name);
+    out.print(": ");
+    out.print(result_name(stage.result));
+    out.print(", finished at ");
+    out.print(stage.finished_us);
+    out.print(" us, took ");
+    out.print(stage.finished_us - stage.started_us);
+    out.print(" us, ");
+    out.print(stage.active_us);
+    out.print(" us in ");
+    out.print(stage.calls);
+    out.println(" calls");
+  }
+  out.print("boot started at ");
+  out.print(m_started_us);
+  out.print(" us, ready at ");
+  out.print(ready_us());
+  out.println(ok() ? " us" : " us with a required step failed");
+}
+
+const char* BootSequencer::result_name(int result)
+{
+  switch (result)
+  {
+    case k_busy: return "busy";
+    case k_done: return "done";
+    case k_failed: return "failed";
+    case k_timed_out: return "timed out";
+    default: return "unknown";
+  }
+}
@@ -0,0 +1,97 @@
+#include <Calibration.h>
+#include <TelemetryFormat.h>
+#include <math.h>
+#include <string.h>
+
+Calibration::Record Calibration::capture(int model, const Observed& observed, int32_t inbound, int32_t outbound)
+{
+  Record record = {};
+  record.model = model;
+  record.inbound = inbound - observed.index;
+  record.outbound = outbound - observed.index;
+  record.position = observed.position - observed.index;
+  record.hall_inbound = observed.hall_inbound;
+  record.hall_outbound = observed.hall_outbound;
+  return record;
+}
+
+int Calibration::restore(const Config& config, const Record& record, const Observed& observed, Restored& restored)
+{
+  if (record.model != config.model) return k_other_model;
+
+  // The index found this boot is a whole number of turns from the one the record counts from,
+  // the turn that puts the actuator closest to where it rested is the one
+  int32_t position = observed.position - observed.index;
+  int32_t turns = (int32_t)lroundf((float)(record.position - position) / config.counts_per_turn);
+  int32_t error = record.position - position - turns * config.counts_per_turn;
+  if (error > config.tolerance || error < -config.tolerance) return k_moved;
+  if (observed.hall_inbound != (bool)record.hall_inbound || observed.hall_outbound != (bool)record.hall_outbound)
+  {
+    return k_hall_changed;
+  }
+  if (record.inbound >= record.outbound || record.position < record.inbound - config.margin ||
+      record.position > record.outbound + config.margin)
+  {
+    return k_out_of_range;
+  }
+
+  int32_t base = observed.index - turns * config.counts_per_turn;
+  restored.inbound = base + record.inbound;
+  restored.outbound = base + record.outbound;
+  restored.error = error;
+  return k_ok;
+}
+
+bool Calibration::changed(const Config& config, const Record& saved, const Record& current)
+{
+  int32_t turns = (int32_t)lroundf((float)(current.position - saved.position) / config.counts_per_turn);
+  int32_t offset = turns * config.counts_per_turn;
+  int32_t moved = current.position - offset - saved.position;
+  return saved.model != current.model || saved.inbound != current.inbound - offset ||
+         saved.outbound != current.outbound - offset || moved > config.tolerance || moved < -config.tolerance ||
+         saved.hall_inbound != current.hall_inbound || saved.hall_outbound != current.hall_outbound;
+}
+
+size_t Calibration::encode(const Record& record, uint8_t* data, size_t capacity)
+{
+  if (capacity < k_size) return 0;
+  calibration::Header header = {};
+  header.magic = calibration::k_magic;
+  header.version = calibration::k_version;
+  header.size = sizeof(Record);
+  header.crc = telemetry::crc16((const uint8_t*)&record, sizeof(Record));
+  memcpy(data, &header, sizeof(header));
+  memcpy(data + sizeof(header), &record, sizeof(Record));
+  return k_size;
+}
+
+int Calibration::decode(const uint8_t* data, size_t length, Record& record)
+{
+  calibration::Header header;
+  if (length < sizeof(header)) return k_too_short;
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != calibration::k_magic) return k_bad_magic;
+  if (header.version != calibration::k_version || header.size != sizeof(Record)) return k_bad_version;
+  if (length < k_size) return k_too_short;
+  if (telemetry::crc16(data + sizeof(header), sizeof(Record)) != header.crc) return k_bad_crc;
+  memcpy(&record, data + sizeof(header), sizeof(Record));
+  return k_ok;
+}
+
+const char* Calibration::status_name(int status)
+{
+  switch (status)
+  {
+    case k_ok: return "ok";
+    case k_too_short: return "too short";
+    case k_bad_magic: return "nothing saved";
+    case k_bad_version: return "wrong version";
+    case k_bad_crc: return "bad crc";
+    case k_other_model: return "other model";
+    case k_moved: return "moved";
+    case k_hall_changed: return "hall sensors changed";
+    case k_out_of_range: return "out of range";
+    case k_no_index: return "no index";
+    default: return "unknown";
+  }
+}
@@ -0,0 +1,31 @@
+#if defined(ARDUINO) && defined(MOAT_ODRIVE_CAN)
+#include <CanBus.h>
+#include <string.h>
+
+void TeensyCanBus::begin(uint32_t bitrate)
+{
+  m_can.begin();
+  m_can.setBaudRate(bitrate);
+}
+
+bool TeensyCanBus::write(const CanFrame& frame)
+{
+  CAN_message_t message;
+  message.id = frame.id;
+  message.len = frame.length;
+  message.flags.remote = frame.rtr;
+  memcpy(message.buf, frame.data, sizeof(message.buf));
+  return m_can.write(message) > 0;
+}
+
+bool TeensyCanBus::read(CanFrame& frame)
+{
+  CAN_message_t message;
+  if (!m_can.read(message)) return false;
+  frame.id = message.id;
+  frame.length = message.len > 8 ? 8 : message.len;
+  frame.rtr = message.flags.remote;
+  memcpy(frame.data, message.buf, sizeof(frame.data));
+  return true;
+}
+#endif
@@ -1,2 +1,78 @@
 #include <Constant.h>
-#include <SD.h>
\ No newline at end of file
+#include <ToothSensor.h>
+
+// Compile time checks on every model table, a bad table fails the build instead of the car
+
+constexpr int k_last_pin = 54;  // Teensy 4.1
+
+constexpr bool pin_valid(int pin)
+{
+  return pin >= 0 && pin <= k_last_pin;
+}
+
+constexpr bool pins_valid(const ModelPins& pins)
+{
+  return pin_valid(pins.estop) && pin_valid(pins.enc_a) && pin_valid(pins.enc_b) &&
+         pin_valid(pins.hall_inbound) && pin_valid(pins.hall_outbound) && pin_valid(pins.engine_geartooth) &&
+         pin_valid(pins.gearbox_geartooth) && (pins.thermistor_1 == -1 || pin_valid(pins.thermistor_1)) &&
+         (pins.thermistor_2 == -1 || pin_valid(pins.thermistor_2)) &&
+         (pins.thermistor_3 == -1 || pin_valid(pins.thermistor_3));
+}
+
+// Every input needs its own pin: the e-stop, encoder, hall and gear tooth inputs for their
+// interrupts, the thermistors for the ADC pin mux, and none of them on the ODrive link. An e-stop
+// sharing a pin would fire on every gear tooth, or never be seen at all.
+constexpr bool pins_distinct(const ModelPins& pins)
+{
+  const int used_pins[] = {pins.estop, pins.enc_a, pins.enc_b, pins.hall_inbound, pins.hall_outbound,
+                           pins.engine_geartooth, pins.gearbox_geartooth, pins.thermistor_1,
+                           pins.thermistor_2, pins.thermistor_3, k_odrive_rx_pin, k_odrive_tx_pin};
+  const int count = sizeof(used_pins) / sizeof(used_pins[0]);
+  for (int i = 0; i < count; i++)
+  {
+    for (int j = i + 1; j < count; j++)
+    {
+      if (used_pins[i] != -1 && used_pins[i] == used_pins[j]) return false;
+    }
+  }
+  return true;
+}
+
+constexpr bool model_valid(const ModelConfig& config)
+{
+  return pins_valid(config.pins) && pins_distinct(config.pins) &&
+         (config.actuator_motor_number == 0 || config.actuator_motor_number == 1) &&
+         (config.cooling_motor_number == 0 || config.cooling_motor_number == 1) &&
+         config.actuator_motor_number != config.cooling_motor_number &&
+         config.cycle_period >= 1 &&                      // Scheduler runs at most at 1 kHz
+         config.gearbox_rolling_frames > 0 &&
+         config.gearbox_median_frames > 0 && config.gearbox_median_frames % 2 == 1 &&
+         config.homing_timeout > 0 && config.homing_timeout <= 4000000 &&  // us have to fit 32 bits
+         config.proportional_gain >= 0 && config.integral_gain >= 0 && config.derivative_gain >= 0 &&
+         config.feed_forward_gain >= 0 && config.derivative_filter_time > 0 && config.integral_limit >= 0 &&
+         config.actuator_velocity_limit > 0 && config.actuator_acceleration_limit >= 0 &&
+         config.exponential_filter_alpha > 0 && config.exponential_filter_alpha <= 1 &&
+         config.overdrive_ratio > 0 && config.overdrive_ratio < config.ecvt_max_ratio;
+}
+
+static_assert(model_valid(k_model_20), "Model 20 configuration is out of range");
+static_assert(model_valid(k_model_21), "Model 21 configuration is out of range");
+
+// Derived values for the model being built
+static_assert(Constant::gearbox_engage_rpm > 0, "engage rpm has to be above 0");
+static_assert(Constant::gearbox_engage_rpm < Constant::gearbox_power_rpm,
+              "reference curve regions are out of order (engage >= power)");
+static_assert(Constant::gearbox_power_rpm < Constant::gearbox_overdrive_rpm,
+              "reference curve regions are out of order (power >= overdrive)");
+static_assert(Constant::encoder_count_shift_length == 196608, "shift length no longer matches the 3 in screw travel");
+static_assert(Constant::encoder_engage_dist > 0 && Constant::encoder_engage_dist < Constant::encoder_count_shift_length,
+              "engage point has to be inside the shift travel");
+static_assert(Constant::encoder_engage_buffer < Constant::encoder_engage_dist, "engage buffer larger than the engage distance");
+static_assert(Constant::cooling_full_temp > Constant::cooling_on_temp && Constant::cooling_hysteresis >= 0,
+              "cooling has to reach full speed above where it starts");
+static_assert(Constant::cooling_max_speed >= Constant::cooling_min_speed && Constant::cooling_min_speed >= 0,
+              "cooling speeds are out of order");
+static_assert(Constant::eg_rpm_window_teeth > 0 && Constant::eg_rpm_window_teeth < ToothSensor::k_history,
+              "engine rpm window doesn't fit the tooth history");
+static_assert(Constant::gb_rpm_window_teeth > 0 && Constant::gb_rpm_window_teeth < ToothSensor::k_history,
+              "gearbox rpm window doesn't fit the tooth history");
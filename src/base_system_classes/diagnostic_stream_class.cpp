@@ -0,0 +1,53 @@
+#include <DiagnosticStream.h>
+#include <string.h>
+
+void DiagnosticStream::begin(uint32_t rate_hz, uint32_t now_us)
+{
+  set_rate(rate_hz);
+  m_next_us = now_us;
+  m_sequence = 0;
+  m_dropped = 0;
+}
+
+void DiagnosticStream::set_rate(uint32_t rate_hz)
+{
+  m_rate_hz = rate_hz;
+  m_period_us = rate_hz > 0 ? 1000000 / rate_hz : 0;
+}
+
+bool DiagnosticStream::due(uint32_t now_us)
+{
+  if (m_period_us == 0) return false;
+  if ((int32_t)(now_us - m_next_us) < 0) return false;
+  // A late caller gets one sample, not a burst to catch up
+  m_next_us += m_period_us;
+  if ((int32_t)(now_us - m_next_us) >= 0) m_next_us = now_us + m_period_us;
+  return true;
+}
+
+size_t DiagnosticStream::encode(const diagnostic::Sample& sample, uint8_t* buffer)
+{
+  diagnostic::FrameHeader header;
+  header.sync = diagnostic::k_sync;
+  header.version = diagnostic::k_version;
+  header.length = sizeof(diagnostic::Sample);
+  header.sequence = m_sequence++;
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(buffer + sizeof(header), &sample, sizeof(sample));
+  uint16_t crc = diagnostic::frame_crc(buffer);
+  memcpy(buffer + diagnostic::k_frame_size - sizeof(crc), &crc, sizeof(crc));
+  return diagnostic::k_frame_size;
+}
+
+bool DiagnosticStream::send(const diagnostic::Sample& sample, Print& out)
+{
+  // Half a frame on the wire would cost the viewer the next one too, so all of it or nothing
+  size_t length = encode(sample, m_frame);
+  if (out.availableForWrite() < (int)length)
+  {
+    m_dropped++;
+    return false;
+  }
+  out.write(m_frame, length);
+  return true;
+}
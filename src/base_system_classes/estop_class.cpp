@@ -0,0 +1,94 @@
+#include <Estop.h>
+
+Estop::Estop(const Constant& constant)
+{
+  m_config.pin = constant.estop_pin;
+  m_config.release_hold_us = constant.estop_release_hold;
+}
+
+void Estop::begin(uint32_t now_us)
+{
+  if (pressed()) press(now_us);
+}
+
+void Estop::press(uint32_t now_us)
+{
+  // Any press restarts the release hold, even one too short for update() to see
+  m_stats.presses++;
+  m_released = false;
+  if (m_state == TRIPPED) return;
+  m_state = TRIPPED;
+  m_stats.trips++;
+  m_stats.tripped_us = now_us;
+  m_latency_pending = true;
+}
+
+void Estop::stopped(uint32_t written_us)
+{
+  noInterrupts();
+  // A stop written before this trip is an older one, the interrupt's hasn't gone out yet
+  int32_t latency = written_us - m_stats.tripped_us;
+  if (m_latency_pending && latency >= 0)
+  {
+    m_latency_pending = false;
+    m_stats.latency_count++;
+    m_stats.last_latency_us = latency;
+    if ((uint32_t)latency > m_stats.max_latency_us) m_stats.max_latency_us = latency;
+  }
+  interrupts();
+}
+
+void Estop::update(uint32_t now_us)
+{
+  // The pin read goes first, a press landing after it wins
+  bool down = pressed();
+  noInterrupts();
+  if (m_state == TRIPPED)
+  {
+    if (down) m_released = false;
+    else if (!m_released)
+    {
+      m_released = true;
+      m_released_since_us = now_us;
+    }
+    else if (now_us - m_released_since_us >= m_config.release_hold_us) m_state = RELEASED;
+  }
+  interrupts();
+}
+
+int Estop::reset(uint32_t now_us)
+{
+  update(now_us);
+  noInterrupts();
+  int result = k_reset_ok;
+  if (m_state == ARMED) result = k_reset_armed;
+  else if (m_state == TRIPPED) result = k_reset_pressed;
+  else m_state = ARMED;
+  interrupts();
+  return result;
+}
+
+bool Estop::pressed() const
+{
+  if (m_config.pin < 0) return false;
+  return (digitalReadFast(m_config.pin) == HIGH) == m_config.active_high;
+}
+
+Estop::Stats Estop::stats() const
+{
+  noInterrupts();
+  Stats stats = m_stats;
+  interrupts();
+  return stats;
+}
+
+const char* Estop::state_name(int state)
+{
+  switch (state)
+  {
+    case ARMED: return "armed";
+    case TRIPPED: return "tripped";
+    case RELEASED: return "released";
+    default: return "unknown";
+  }
+}
@@ -0,0 +1,123 @@
+#include <MotionSequencer.h>
+
+bool MotionSequencer::start(int kind, uint32_t now_us)
+{
+  if (active()) return false;
+  m_kind = kind;
+  m_direction = kind == SHIFT_IN ? -1 : 1;
+  m_status = k_busy;
+  m_started_us = now_us;
+  m_elapsed_us = 0;
+  m_abort_requested = false;
+  enter(ENTER_CLOSED_LOOP, now_us);
+  return true;
+}
+
+const MotionSequencer::Command& MotionSequencer::step(const Input& input)
+{
+  if (!active()) return m_command;
+  uint32_t now_us = input.now_us;
+  m_elapsed_us = now_us - m_started_us;
+
+  if (m_abort_requested)
+  {
+    finish(k_aborted, now_us);
+    return m_command;
+  }
+  if (m_elapsed_us > m_config.timeout_us)
+  {
+    finish(k_timeout, now_us);
+    return m_command;
+  }
+
+  m_command.state = k_state_closed_loop;
+  m_command.stop = false;
+  switch (m_state)
+  {
+  case ENTER_CLOSED_LOOP:
+  {
+    // Only a read taken since this state began counts, an old one could be from before an error
+    m_command.velocity = 0;
+    uint32_t in_state_us = now_us - m_state_us;
+    bool fresh = input.odrive_state_age_us != UINT32_MAX && input.odrive_state_age_us <= in_state_us;
+    if (fresh && input.odrive_state == k_state_closed_loop)
+    {
+      if (target_active(input.hall)) enter(BACK_OFF, now_us);
+      else
+      {
+        m_baseline_hits = target_hits(input.hall);
+        enter(APPROACH, now_us);
+      }
+    }
+    else if (in_state_us > m_config.closed_loop_timeout_us)
+    {
+      finish(k_no_closed_loop, now_us);
+    }
+    break;
+  }
+
+  case BACK_OFF:
+    m_command.velocity = -m_direction * m_config.back_off_speed;
+    if (!target_active(input.hall))
+    {
+      m_baseline_hits = target_hits(input.hall);
+      enter(APPROACH, now_us);
+    }
+    break;
+
+  case APPROACH:
+    m_command.velocity = m_direction * m_config.speed;
+    if (target_hits(input.hall) != m_baseline_hits)
+    {
+      m_latched_count = target_count(input.hall);
+      finish(k_ok, now_us);
+    }
+    break;
+  }
+  return m_command;
+}
+
+void MotionSequencer::enter(int state, uint32_t now_us)
+{
+  m_state = state;
+  m_state_us = now_us;
+}
+
+void MotionSequencer::finish(int status, uint32_t now_us)
+{
+  // Stop at once either way, a motion that didn't make it also drops out of closed loop
+  m_status = status;
+  m_command.velocity = 0;
+  m_command.state = status == k_ok ? k_state_closed_loop : k_state_idle;
+  m_command.stop = true;
+  m_abort_requested = false;
+  enter(status == k_ok ? DONE : FAILED, now_us);
+}
+
+bool MotionSequencer::target_active(const HallState& hall) const
+{
+  return m_direction > 0 ? hall.outbound : hall.inbound;
+}
+
+uint32_t MotionSequencer::target_hits(const HallState& hall) const
+{
+  return m_direction > 0 ? hall.outbound_hits : hall.inbound_hits;
+}
+
+int32_t MotionSequencer::target_count(const HallState& hall) const
+{
+  return m_direction > 0 ? hall.outbound_count : hall.inbound_count;
+}
+
+const char* MotionSequencer::status_name(int status)
+{
+  switch (status)
+  {
+  case k_ok: return "ok";
+  case k_busy: return "busy";
+  case k_timeout: return "timeout";
+  case k_aborted: return "aborted";
+  case k_no_closed_loop: return "no closed loop";
+  }
+  return "unknown";
+}
@@ -0,0 +1,334 @@
+#include <ODriveCan.h>
+
+ODriveCan::ODriveCan(CanBus& bus) : m_bus(bus)
+{
+  // Built now so stop_now only has to hand a frame to the bus
+  for (int axis = 0; axis < k_axis_count; axis++)
+  {
+    m_stop_frames[axis] = can_simple::set_input_vel(axis, 0, 0);
+    m_idle_frames[axis] = can_simple::set_axis_state(axis, 1);
+  }
+}
+
+int ODriveCan::init(int timeout)
+{
+  // Waits for the ODrive to show up on the bus, the bus itself is started by its owner
+  long start = millis();
+  while (get_voltage() <= 1)
+  {
+    if (millis() - start > timeout) return 13;
+  }
+  return 0;
+}
+
+//-----------------ODrive Setters--------------//
+bool ODriveCan::run_state(int axis, int requested_state, bool wait_for_idle, float timeout)
+{
+  // Dont set odrive to same state again
+  if (axis < 0 || axis >= k_axis_count) return false;
+  if (requested_state == m_current_state[axis]) return false;
+
+  send(can_simple::set_axis_state(axis, requested_state));
+  m_commands_sent++;
+  if (wait_for_idle)
+  {
+    // Index search and calibration drop back to idle when they're done
+    uint32_t start = millis();
+    delay(100);
+    for (;;)
+    {
+      float state = read(CURRENT_STATE, axis);
+      if (m_read_status == k_read_ok && state == 1) break;
+      if (millis() - start > timeout * 1000) return false;
+      delay(100);
+    }
+  }
+  state_sent(axis, requested_state);
+  return true;
+}
+
+void ODriveCan::set_velocity(int motor_number, float velocity)
+{
+  send(can_simple::set_input_vel(motor_number, velocity, 0));
+  m_commands_sent++;
+  // Whatever the control loop queued is out of date now
+  if (motor_number >= 0 && motor_number < k_axis_count)
+  {
+    m_velocity_queued[motor_number] = false;
+    m_velocity_gates[motor_number].reset();
+  }
+}
+
+void ODriveCan::queue_velocity(int motor_number, float velocity, uint32_t stops_seen)
+{
+  if (motor_number < 0 || motor_number >= k_axis_count) return;
+  // Worked out before the last stop_now, the next cycle decides again. After a stop the ODrive
+  // holds 0, so the first fresh one has to go out.
+  bool after_stop;
+  if (!take_stopped(motor_number, stops_seen, after_stop)) return;
+  if (after_stop) m_velocity_gates[motor_number].reset();
+  if (admit_velocity(motor_number, velocity, k_velocity_bytes) == SetpointGate::k_skip) return;
+  if (m_velocity_queued[motor_number])
+  {
+    // Never sent, the new one replaces it
+    m_commands_saved++;
+    m_command_bytes_saved += k_velocity_bytes;
+  }
+  m_queued_velocity[motor_number] = velocity;
+  m_velocity_queued[motor_number] = true;
+}
+
+//-----------------ODrive Getters--------------//
+float ODriveCan::get_encoder_pos(int motor_number)
+{
+  return read(ENCODER_POS, motor_number);
+}
+
+float ODriveCan::get_vel(int motor_number)
+{
+  return read(VELOCITY, motor_number);
+}
+
+float ODriveCan::get_voltage()
+{
+  return read(VBUS_VOLTAGE, 0);
+}
+
+float ODriveCan::get_cur()
+{
+  return read(IBUS_CURRENT, 0);
+}
+
+void ODriveCan::dump_errors(Print& out)
+{
+  struct ErrorRead
+  {
+    const char* name;
+    uint32_t command;
+  };
+  static const ErrorRead k_errors[] = {{"motor", can_simple::k_get_motor_error},
+                                       {"sensorless_estimator", can_simple::k_get_sensorless_error},
+                                       {"encoder", can_simple::k_get_encoder_error},
+                                       {"controller", can_simple::k_get_controller_error}};
+  // There's no system error over CAN, every axis reports its own
+  out.print("system: n/a");
+  for (int axis = 0; axis < k_axis_count; ++axis)
+  {
+    out.print("\naxis");
+    out.print(axis);
+    out.print("\n  axis: ");
+    if (m_cache[slot(CURRENT_STATE, axis)].valid) out.print(m_axis_error[axis]);
+    else out.print("no heartbeat");
+    for (const ErrorRead& entry : k_errors)
+    {
+      uint32_t error;
+      out.print("\n  ");
+      out.print(entry.name);
+      out.print(": ");
+      if (read_error(axis, entry.command, error)) out.print(error);
+      else out.print("no reply");
+    }
+  }
+  out.print("\n");
+}
+
+//-----------------Cyclic Reads--------------//
+uint32_t ODriveCan::command_for(int property)
+{
+  switch (property)
+  {
+    case ENCODER_POS: return can_simple::k_get_encoder_count;
+    case VELOCITY: return can_simple::k_get_encoder_estimates;
+    case VBUS_VOLTAGE:
+    case IBUS_CURRENT: return can_simple::k_get_bus_voltage_current;
+    default: return can_simple::k_heartbeat;
+  }
+}
+
+bool ODriveCan::request(int property, int axis)
+{
+  // Only asks for what the cyclic messages haven't brought in a while
+  if (!valid_property(property, axis)) return false;
+  uint32_t now = micros();
+  int index = slot(property, axis);
+  if (m_cache[index].valid && now - m_cache[index].stamp_us < k_poll_after_us) return true;
+  // Bus voltage and current come in one message, so they share one request
+  int message = slot(property == IBUS_CURRENT ? VBUS_VOLTAGE : property, axis);
+  if ((m_requested & (1UL << message)) && now - m_requested_us[message] < k_poll_after_us) return true;
+  m_requested |= 1UL << message;
+  m_requested_us[message] = now;
+  m_remote_requests++;
+  return send(can_simple::request(axis, command_for(property)));
+}
+
+void ODriveCan::update()
+{
+  receive(micros());
+  // Held while the setpoints go out, so a stop_now is either seen here or follows them
+  begin_write();
+  for (int axis = 0; axis < k_axis_count; axis++)
+  {
+    // Queued before a stop_now, the next queue_velocity decides again
+    if (stopped(axis)) m_velocity_queued[axis] = false;
+    if (!m_velocity_queued[axis]) continue;
+    // A full transmit queue keeps it for the next update
+    bool sent = transmit(can_simple::set_input_vel(axis, m_queued_velocity[axis], 0));
+    write_stops();
+    if (!sent) continue;
+    m_velocity_queued[axis] = false;
+    m_commands_sent++;
+  }
+  end_write();
+}
+
+bool ODriveCan::send(const CanFrame& frame)
+{
+  begin_write();
+  bool written = transmit(frame);
+  end_write();
+  return written;
+}
+
+bool ODriveCan::transmit(const CanFrame& frame)
+{
+  if (!m_bus.write(frame))
+  {
+    m_tx_dropped++;
+    return false;
+  }
+  m_tx_frames++;
+  return true;
+}
+
+bool ODriveCan::write_stop(int axis, bool idle)
+{
+  // A full transmit queue or nobody acking, end_write tries again
+  return m_bus.write(idle ? m_idle_frames[axis] : m_stop_frames[axis]);
+}
+
+void ODriveCan::receive(uint32_t now)
+{
+  CanFrame frame;
+  while (m_bus.read(frame))
+  {
+    m_rx_bytes += frame.length;
+    m_rx_messages++;
+    handle(frame, now);
+  }
+}
+
+void ODriveCan::store_value(int property, int axis, float value, uint32_t now)
+{
+  store(property, axis, value, now);
+  m_updates[slot(property, axis)]++;
+}
+
+void ODriveCan::handle(const CanFrame& frame, uint32_t now)
+{
+  int axis = can_simple::node_of(frame.id);
+  uint32_t command = can_simple::command_of(frame.id);
+  if (frame.rtr || axis >= k_axis_count)
+  {
+    m_discarded_messages++;
+    return;
+  }
+
+  bool parsed = true;
+  switch (command)
+  {
+    case can_simple::k_heartbeat:
+    {
+      can_simple::Heartbeat heartbeat;
+      parsed = can_simple::decode_heartbeat(frame, heartbeat);
+      if (!parsed) break;
+      m_axis_error[axis] = heartbeat.axis_error;
+      store_value(CURRENT_STATE, axis, heartbeat.axis_state, now);
+      break;
+    }
+    case can_simple::k_get_encoder_estimates:
+    {
+      float position, velocity;
+      parsed = can_simple::decode_pair(frame, position, velocity);
+      if (parsed) store_value(VELOCITY, axis, velocity, now);
+      break;
+    }
+    case can_simple::k_get_encoder_count:
+    {
+      int32_t shadow_count, count_in_cpr;
+      parsed = can_simple::decode_encoder_count(frame, shadow_count, count_in_cpr);
+      if (parsed) store_value(ENCODER_POS, axis, shadow_count, now);
+      break;
+    }
+    case can_simple::k_get_bus_voltage_current:
+    {
+      float vbus, ibus;
+      parsed = can_simple::decode_pair(frame, vbus, ibus);
+      if (!parsed) break;
+      store_value(VBUS_VOLTAGE, 0, vbus, now);
+      store_value(IBUS_CURRENT, 0, ibus, now);
+      break;
+    }
+    default:
+      if (frame.id != m_error_id)
+      {
+        m_discarded_messages++;
+        return;
+      }
+      parsed = can_simple::decode_error(frame, m_error_value);
+      m_error_received = parsed;
+      break;
+  }
+  if (!parsed) m_parse_errors++;
+}
+
+//-----------------Blocking Reads--------------//
+bool ODriveCan::wait_for(int index, uint32_t updates_before)
+{
+  uint32_t start = millis();
+  while (millis() - start < k_blocking_timeout_ms)
+  {
+    receive(micros());
+    if (m_updates[index] != updates_before) return true;
+    delayMicroseconds(50);
+  }
+  m_timeouts++;
+  m_read_status = k_read_timeout;
+  return false;
+}
+
+float ODriveCan::read(int property, int axis)
+{
+  // Waits for a value that arrives after the call, whether pushed or asked for
+  if (!valid_property(property, axis)) return 0;
+  int index = slot(property, axis);
+  receive(micros());
+  uint32_t updates_before = m_updates[index];
+  m_remote_requests++;
+  send(can_simple::request(axis, command_for(property)));
+  if (!wait_for(index, updates_before)) return 0;
+  m_read_status = k_read_ok;
+  return m_cache[index].value;
+}
+
+bool ODriveCan::read_error(int axis, uint32_t command, uint32_t& error)
+{
+  m_error_id = can_simple::frame_id(axis, command);
+  m_error_received = false;
+  send(can_simple::request(axis, command));
+  uint32_t start = millis();
+  while (!m_error_received && millis() - start < k_blocking_timeout_ms)
+  {
+    receive(micros());
+    if (!m_error_received) delayMicroseconds(50);
+  }
+  m_error_id = 0;
+  if (!m_error_received)
+  {
+    m_timeouts++;
+    m_read_status = k_read_timeout;
+    return false;
+  }
+  m_read_status = k_read_ok;
+  error = m_error_value;
+  return true;
+}
@@ -1,6 +1,8 @@
-#include <HardwareSerial.h>
+#include <Hal.h>
 #include <ODrive.h>
-#include <SoftwareSerial.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
 
 template <class T>
 inline Print& operator<<(Print& obj, T arg)
@@ -17,6 +19,17 @@ inline Print& operator<<(Print& obj, float arg)
 
 ODrive::ODrive(HardwareSerial& serial) : OdriveSerial(serial)
 {
+  // Built now so stop_now only has to copy bytes
+  for (int axis = 0; axis < k_axis_count; axis++)
+  {
+    m_stop_length[axis] = format_velocity(m_stop_command[axis], axis, 0);
+    m_idle_length[axis] = snprintf(m_idle_command[axis], k_command_size, "w axis%d.requested_state 1\n", axis);
+  }
+}
+
+void ODrive::begin()
+{
+  OdriveSerial.begin(115200);
 }
 
 int ODrive::init(int timeout)
@@ -26,7 +39,7 @@ int ODrive::init(int timeout)
   Will wait for connection, and return error if unsuccessful after timeout
 
   */
-  OdriveSerial.begin(115200);
+  begin();
 
   long start = millis();
   while (ODrive::get_voltage() <= 1)
@@ -45,21 +58,26 @@ int ODrive::init(int timeout)
 bool ODrive::run_state(int axis, int requested_state, bool wait_for_idle, float timeout)
 {
   // Dont set odrive to same state again
-  if (requested_state == m_current_state) return false;
+  if (axis < 0 || axis >= k_axis_count) return false;
+  if (requested_state == m_current_state[axis]) return false;
 
   int timeout_ctr = (int)(timeout * 10.0f);
-  OdriveSerial << "w axis" << axis << ".requested_state " << requested_state << '\n';
+  if (wait_for_idle) wait_idle();
+  char command[k_query_size];
+  write(command, snprintf(command, sizeof(command), "w axis%d.requested_state %d\n", axis, requested_state));
+  m_commands_sent++;
   if (wait_for_idle)
   {
     do
     {
       delay(100);
-      OdriveSerial << "r axis" << axis << ".current_state\n";
+      write(command, format_query(command, CURRENT_STATE, axis));
     } while (read_int() != 1 && --timeout_ctr > 0);
   }
-  if (timeout_ctr > 0)
+  // Without waiting there's nothing to time out, the state counts as set once it's sent
+  if (!wait_for_idle || timeout_ctr > 0)
   {
-    m_current_state = requested_state;
+    state_sent(axis, requested_state);
     return true;
   }
   else return false;
@@ -67,99 +85,355 @@ bool ODrive::run_state(int axis, int requested_state, bool wait_for_idle, float
 
 void ODrive::set_velocity(int motor_number, float velocity)
 {
-  OdriveSerial << "v " << motor_number << " " << velocity << " "
-               << "0.0f"
-               << "\n";
-  ;
+  char command[k_command_size];
+  write(command, format_velocity(command, motor_number, velocity));
+  m_commands_sent++;
+  // Whatever the control loop queued is out of date now
+  if (motor_number >= 0 && motor_number < k_axis_count)
+  {
+    m_velocity_length[motor_number] = 0;
+    m_velocity_gates[motor_number].reset();
+  }
+}
+
+void ODrive::queue_velocity(int motor_number, float velocity, uint32_t stops_seen)
+{
+  // Only formatted once it's going out, a skipped one would have been as long as the last one sent
+  if (motor_number < 0 || motor_number >= k_axis_count) return;
+  // Worked out before the last stop_now, the next cycle decides again. After a stop the ODrive
+  // holds 0, so the first fresh one has to go out.
+  bool after_stop;
+  if (!take_stopped(motor_number, stops_seen, after_stop)) return;
+  if (after_stop) m_velocity_gates[motor_number].reset();
+  if (admit_velocity(motor_number, velocity, m_velocity_sent_length[motor_number]) == SetpointGate::k_skip) return;
+  if (m_velocity_length[motor_number] != 0)
+  {
+    // Never sent, the new one replaces it
+    m_commands_saved++;
+    m_command_bytes_saved += m_velocity_length[motor_number];
+  }
+  int length = format_velocity(m_velocity_command[motor_number], motor_number, velocity);
+  m_velocity_length[motor_number] = length;
+  m_velocity_sent_length[motor_number] = length;
+}
+
+int ODrive::format_velocity(char* buffer, int axis, float velocity)
+{
+  // Four decimals like Print does, without leaning on printf's float support
+  long scaled = lroundf(velocity * 10000);
+  unsigned long magnitude = scaled < 0 ? -scaled : scaled;
+  return snprintf(buffer, k_command_size, "v %d %s%lu.%04lu 0\n", axis, scaled < 0 ? "-" : "", magnitude / 10000,
+                  magnitude % 10000);
+}
+
+int ODrive::take_commands(char* buffer, int room)
+{
+  // Queued setpoints that fit, they get no reply so they can go out while a batch is in flight
+  int length = 0;
+  for (int axis = 0; axis < k_axis_count; axis++)
+  {
+    int command_length = m_velocity_length[axis];
+    // Queued before a stop_now, the next queue_velocity decides again
+    if (stopped(axis)) m_velocity_length[axis] = command_length = 0;
+    if (command_length == 0 || length + command_length > room) continue;
+    memcpy(buffer + length, m_velocity_command[axis], command_length);
+    length += command_length;
+    m_velocity_length[axis] = 0;
+    m_commands_sent++;
+  }
+  return length;
 }
 
 //-----------------ODrive Getters--------------//
 float ODrive::get_vel(int motor_number)
 {
-  OdriveSerial << "r axis" << motor_number << ".encoder.vel_estimate\n";
+  wait_idle();
+  write_query(VELOCITY, motor_number);
   return ODrive::read_float();
 }
 
 float ODrive::get_voltage()
 {
-  OdriveSerial << "r vbus_voltage\n";
+  wait_idle();
+  write_query(VBUS_VOLTAGE, 0);
   return ODrive::read_float();
 }
 
-float ODrive::get_encoder_pos(int motor_number){
-  OdriveSerial << "r axis" << motor_number << ".encoder.shadow_count\n";
+float ODrive::get_encoder_pos(int motor_number)
+{
+  wait_idle();
+  write_query(ENCODER_POS, motor_number);
   return ODrive::read_float();
 }
 
 float ODrive::get_cur()
 {
-  OdriveSerial << "r ibus\n";
+  wait_idle();
+  write_query(IBUS_CURRENT, 0);
   return ODrive::read_float();
 }
 
-String ODrive::dump_errors()
+void ODrive::dump_errors(Print& out)
 {
-  String output = "";
-  output += "system: ";
-
-  OdriveSerial << "r error\n";
-  output += ODrive::read_string();
-  for (int axis = 0; axis < 2; ++axis)
+  static const char* const k_axis_errors[] = {"error", "motor.error", "sensorless_estimator.error",
+                                               "encoder.error", "controller.error"};
+  char query[k_query_size];
+  wait_idle();
+  write(query, snprintf(query, sizeof(query), "r error\n"));
+  out << "system: " << (read_line() ? m_parser.line() : "no reply");
+  for (int axis = 0; axis < k_axis_count; ++axis)
   {
-    output += "\naxis";
-    output += axis;
-
-    output += "\n  axis: ";
-    OdriveSerial << "r axis" << axis << ".error\n";
-    output += ODrive::read_string();
-
-    output += "\n  motor: ";
-    OdriveSerial << "r axis" << axis << ".motor.error\n";
-    output += ODrive::read_string();
-
-    output += "\n  sensorless_estimator: ";
-    OdriveSerial << "r axis" << axis << ".sensorless_estimator.error\n";
-    output += ODrive::read_string();
-
-    output += "\n  encoder: ";
-    OdriveSerial << "r axis" << axis << ".encoder.error\n";
-    output += ODrive::read_string();
-
-    output += "\n  controller: ";
-    OdriveSerial << "r axis" << axis << ".controller.error\n";
-    output += ODrive::read_string();
+    out << "\naxis" << axis;
+    for (const char* error : k_axis_errors)
+    {
+      write(query, snprintf(query, sizeof(query), "r axis%d.%s\n", axis, error));
+      out << "\n  " << error << ": " << (read_line() ? m_parser.line() : "no reply");
+    }
   }
-  return output;
+  out << "\n";
 }
 
-String ODrive::read_string()
+bool ODrive::read_line()
 {
-  String str = "";
-  static const unsigned long timeout = 1000;
+  // Waits for one whole line, false on a timeout
   unsigned long timeout_start = millis();
   for (;;)
   {
     while (!OdriveSerial.available())
     {
-      if (millis() - timeout_start >= timeout)
+      if (millis() - timeout_start >= k_blocking_timeout_ms)
       {
-        return str;
+        m_parser.reset();
+        m_timeouts++;
+        m_read_status = k_read_timeout;
+        return false;
       }
     }
-    char c = OdriveSerial.read();
-    if (c == '\n')
-      break;
-    str += c;
+    m_rx_bytes++;
+    if (m_parser.feed(OdriveSerial.read()) == ReplyParser::k_complete)
+    {
+      m_rx_messages++;
+      return true;
+    }
   }
-  return str;
 }
 
 float ODrive::read_float()
 {
-  return read_string().toFloat();
+  float value = 0;
+  if (!read_line()) return 0;
+  if (m_parser.parse_float(value) != ReplyParser::k_ok)
+  {
+    m_parse_errors++;
+    m_read_status = k_read_parse_error;
+    return 0;
+  }
+  m_read_status = k_read_ok;
+  return value;
 }
 
 int32_t ODrive::read_int()
 {
-  return read_string().toInt();
+  int32_t value = 0;
+  if (!read_line()) return 0;
+  if (m_parser.parse_int(value) != ReplyParser::k_ok)
+  {
+    m_parse_errors++;
+    m_read_status = k_read_parse_error;
+    return 0;
+  }
+  m_read_status = k_read_ok;
+  return value;
+}
+
+//-----------------Asynchronous Reads--------------//
+void ODrive::write(const char* buffer, int length)
+{
+  begin_write();
+  write_lines(buffer, length);
+  end_write();
+}
+
+void ODrive::write_lines(const char* buffer, int length)
+{
+  // Line by line, a stop_now from an interrupt waits for the line going out instead of the batch
+  int start = 0;
+  for (int i = 0; i < length; i++)
+  {
+    if (buffer[i] != '\n' && i + 1 < length) continue;
+    OdriveSerial.write((const uint8_t*)buffer + start, i + 1 - start);
+    start = i + 1;
+    write_stops();
+  }
+}
+
+void ODrive::write_query(int property, int axis)
+{
+  char query[k_query_size];
+  write(query, format_query(query, property, axis));
+}
+
+bool ODrive::write_stop(int axis, bool idle)
+{
+  if (idle) return OdriveSerial.write((const uint8_t*)m_idle_command[axis], m_idle_length[axis]) == (size_t)m_idle_length[axis];
+  return OdriveSerial.write((const uint8_t*)m_stop_command[axis], m_stop_length[axis]) == (size_t)m_stop_length[axis];
+}
+
+int ODrive::format_query(char* buffer, int property, int axis)
+{
+  switch (property)
+  {
+  case ENCODER_POS:
+    return snprintf(buffer, k_query_size, "r axis%d.encoder.shadow_count\n", axis);
+  case VELOCITY:
+    return snprintf(buffer, k_query_size, "r axis%d.encoder.vel_estimate\n", axis);
+  case VBUS_VOLTAGE:
+    return snprintf(buffer, k_query_size, "r vbus_voltage\n");
+  case IBUS_CURRENT:
+    return snprintf(buffer, k_query_size, "r ibus\n");
+  case CURRENT_STATE:
+    return snprintf(buffer, k_query_size, "r axis%d.current_state\n", axis);
+  }
+  return 0;
+}
+
+bool ODrive::request(int property, int axis)
+{
+  // Queues a read, a property that is already queued or in flight is not queued twice
+  if (!valid_property(property, axis)) return false;
+  uint32_t bit = 1UL << slot(property, axis);
+  if (m_outstanding & bit) return true;
+
+  Query query = {(uint8_t)property, (uint8_t)axis};
+  if (!m_pending.push(query)) return false;
+  m_outstanding |= bit;
+  return true;
+}
+
+void ODrive::update()
+{
+  // Never blocks: reads whatever bytes arrived, expires a stale batch and
+  // sends the next one as soon as the previous one is answered
+  uint32_t now = micros();
+  receive(now);
+  expire(now);
+
+  // Setpoints first, then the next batch of queries, in one write.
+  // Only send what fits in the tx buffer right now so the write can't block.
+  char buffer[k_axis_count * k_command_size + k_pipeline_depth * k_query_size];
+  int room = OdriveSerial.availableForWrite();
+  // Held from taking the setpoints until they're out: a stop_now before take_commands drops
+  // the setpoint, one after it goes out behind the setpoint instead of ahead of it
+  begin_write();
+  int length = take_commands(buffer, room);
+  bool new_batch = false;
+  if (!m_resyncing && m_batch_size == 0)
+  {
+    while (m_batch_size < k_pipeline_depth && !m_pending.empty())
+    {
+      int query_length = format_query(buffer + length, m_pending.front().property, m_pending.front().axis);
+      if (length + query_length > room) break;
+      length += query_length;
+      m_pending.pop(m_batch[m_batch_size++]);
+      new_batch = true;
+    }
+  }
+  write_lines(buffer, length);
+  end_write();
+  if (!new_batch) return;
+  m_batch_received = 0;
+  m_batch_bad = false;
+  m_batch_sent_us = micros();
+}
+
+void ODrive::expire(uint32_t now)
+{
+  if (m_batch_size != 0 && now - m_batch_sent_us > k_reply_timeout_us)
+  {
+    // A reply got lost, so the rest of the batch can't be matched up.
+    // Drop it and ignore anything that still trickles in for a moment.
+    m_timeouts++;
+    drop_batch();
+    m_parser.reset();
+    m_resyncing = true;
+    m_resync_until = now + k_resync_guard_us;
+  }
+  if (m_resyncing && (int32_t)(now - m_resync_until) >= 0) m_resyncing = false;
+}
+
+void ODrive::receive(uint32_t now)
+{
+  while (OdriveSerial.available())
+  {
+    char c = OdriveSerial.read();
+    m_rx_bytes++;
+    if (m_resyncing) continue;
+    if (m_parser.feed(c) == ReplyParser::k_complete)
+    {
+      m_rx_messages++;
+      handle_line(now);
+    }
+  }
+}
+
+void ODrive::handle_line(uint32_t now)
+{
+  // The ODrive answers in order, so line n belongs to query n of the batch
+  if (m_batch_received >= m_batch_size)
+  {
+    m_discarded_messages++;
+    return;
+  }
+
+  float value = 0;
+  if (m_parser.parse_float(value) != ReplyParser::k_ok)
+  {
+    // A merged or garbled line means the count can't be trusted either
+    m_parse_errors++;
+    m_batch_bad = true;
+  }
+  m_batch_values[m_batch_received++] = value;
+  if (m_batch_received == m_batch_size) finish_batch(now);
+}
+
+void ODrive::finish_batch(uint32_t now)
+{
+  if (m_batch_bad)
+  {
+    drop_batch();
+    return;
+  }
+  for (int i = 0; i < m_batch_size; i++)
+  {
+    store(m_batch[i].property, m_batch[i].axis, m_batch_values[i], now);
+  }
+  drop_batch();
+}
+
+void ODrive::drop_batch()
+{
+  for (int i = 0; i < m_batch_size; i++)
+  {
+    m_outstanding &= ~(1UL << slot(m_batch[i].property, m_batch[i].axis));
+  }
+  m_batch_size = 0;
+  m_batch_received = 0;
+}
+
+bool ODrive::is_idle() const
+{
+  return m_pending.empty() && m_batch_size == 0;
+}
+
+void ODrive::wait_idle()
+{
+  // Blocking reads share the line with the pipeline, so let the batch in flight land first.
+  // Queries that have not been sent yet stay queued.
+  for (;;)
+  {
+    uint32_t now = micros();
+    receive(now);
+    expire(now);
+    if (m_batch_size == 0 && !m_resyncing) return;
+  }
 }
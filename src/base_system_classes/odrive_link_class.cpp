@@ -0,0 +1,134 @@
+#include <ODriveLink.h>
+
+float ODriveLink::cached(int property, int axis) const
+{
+  if (!valid_property(property, axis)) return 0;
+  return m_cache[slot(property, axis)].value;
+}
+
+uint32_t ODriveLink::age_us(int property, int axis) const
+{
+  if (!valid_property(property, axis)) return UINT32_MAX;
+  const CachedValue& cache = m_cache[slot(property, axis)];
+  if (!cache.valid) return UINT32_MAX;
+  return micros() - cache.stamp_us;
+}
+
+void ODriveLink::store(int property, int axis, float value, uint32_t now_us)
+{
+  CachedValue& cache = m_cache[slot(property, axis)];
+  cache.value = value;
+  cache.stamp_us = now_us;
+  cache.valid = true;
+  m_replies++;
+
+  // The state asked for didn't stick, forget it so the next run_state sends it again
+  if (property == CURRENT_STATE && m_current_state[axis] >= 0 && (int)value != m_current_state[axis] &&
+      now_us - m_state_sent_us[axis] > k_state_settle_us)
+  {
+    m_current_state[axis] = -1;
+    m_state_resends++;
+  }
+}
+
+void ODriveLink::state_sent(int axis, int state)
+{
+  m_current_state[axis] = state;
+  m_state_sent_us[axis] = micros();
+}
+
+void ODriveLink::configure_setpoints(const SetpointGate::Config& config)
+{
+  for (SetpointGate& gate : m_velocity_gates) gate.configure(config);
+}
+
+int ODriveLink::admit_velocity(int axis, float velocity, int bytes)
+{
+  int decision = m_velocity_gates[axis].decide(velocity, micros());
+  if (decision == SetpointGate::k_skip)
+  {
+    m_commands_saved++;
+    m_command_bytes_saved += bytes;
+  }
+  else if (decision == SetpointGate::k_keepalive)
+  {
+    m_keepalives_sent++;
+  }
+  return decision;
+}
+
+void ODriveLink::stop_now(int axis, bool idle)
+{
+  if (axis < 0 || axis >= k_axis_count) return;
+  noInterrupts();
+  m_stop_pending |= 1 << axis;
+  if (idle) m_idle_pending |= 1 << axis;
+  m_stopped |= 1 << axis;
+  m_stops[axis]++;
+  bool writing = m_writing;
+  m_writing = true;
+  interrupts();
+  m_immediate_stops++;
+  // Otherwise whoever holds the writer sends it as soon as its write is out
+  if (!writing) end_write();
+}
+
+void ODriveLink::end_write()
+{
+  // Stops that came in while the write went out follow it right away. One the port didn't take
+  // waits for the next end_write instead of spinning here, this can be an interrupt.
+  for (;;)
+  {
+    bool written = write_stops();
+    noInterrupts();
+    bool done = !written || m_stop_pending == 0;
+    if (done) m_writing = false;
+    interrupts();
+    if (done) return;
+  }
+}
+
+bool ODriveLink::write_stops()
+{
+  for (;;)
+  {
+    noInterrupts();
+    uint8_t pending = m_stop_pending;
+    uint8_t idle = m_idle_pending;
+    m_stop_pending = 0;
+    m_idle_pending = 0;
+    interrupts();
+    if (pending == 0) return true;
+    uint8_t failed = 0;
+    for (int axis = 0; axis < k_axis_count; axis++)
+    {
+      if (!(pending & (1 << axis))) continue;
+      if (!write_stop(axis, idle & (1 << axis)))
+      {
+        failed |= 1 << axis;
+        continue;
+      }
+      m_stop_written_us[axis] = micros();
+      if (idle & (1 << axis)) m_idle_written_us[axis] = m_stop_written_us[axis];
+    }
+    if (failed == 0) continue;
+    // Back to pending, an idle stays an idle even if a plain stop came in meanwhile
+    noInterrupts();
+    m_stop_pending |= failed;
+    m_idle_pending |= idle & failed;
+    interrupts();
+    m_stop_retries++;
+    return false;
+  }
+}
+
+bool ODriveLink::take_stopped(int axis, uint32_t stops_seen, bool& after_stop)
+{
+  // One critical section, a stop landing between the count and the flag would be lost
+  noInterrupts();
+  bool fresh = m_stops[axis] == stops_seen;
+  after_stop = fresh && (m_stopped & (1 << axis));
+  if (after_stop) m_stopped &= ~(1 << axis);
+  interrupts();
+  return fresh;
+}
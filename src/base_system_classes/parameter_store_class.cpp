@@ -0,0 +1,248 @@
+#include <Hal.h>
+#include <ParameterStore.h>
+#include <TelemetryFormat.h>
+#include <stdlib.h>
+#include <string.h>
+
+ParameterStore::ParameterStore()
+{
+  m_slots[0] = defaults();
+  m_slots[1] = m_slots[0];
+}
+
+Parameters ParameterStore::defaults()
+{
+  Parameters params = {};
+  params.proportional_gain = Constant::proportional_gain;
+  params.integral_gain = Constant::integral_gain;
+  params.derivative_gain = Constant::derivative_gain;
+  params.feed_forward_gain = Constant::feed_forward_gain;
+  params.derivative_filter_time = Constant::derivative_filter_time;
+  params.integral_limit = Constant::integral_limit;
+  params.actuator_velocity_limit = Constant::actuator_velocity_limit;
+  params.actuator_acceleration_limit = Constant::actuator_acceleration_limit;
+  params.exponential_filter_alpha = Constant::exponential_filter_alpha;
+  params.engine_engage = Constant::engine_engage;
+  params.engine_launch = Constant::engine_launch;
+  params.engine_power = Constant::engine_power;
+  params.ecvt_max_ratio = Constant::ecvt_max_ratio;
+  params.overdrive_ratio = Constant::overdrive_ratio;
+  params.reference_profile = k_profile_endurance;
+  derive(params);
+  return params;
+}
+
+void ParameterStore::derive(Parameters& params)
+{
+  // Same breakpoints Constant derives at compile time
+  params.gearbox_engage_rpm = int(params.engine_engage / params.ecvt_max_ratio);
+  params.gearbox_power_rpm = int(params.engine_power / params.ecvt_max_ratio);
+  params.gearbox_overdrive_rpm = int(params.engine_power / params.overdrive_ratio);
+  params.profile = int(params.reference_profile + 0.5f);
+
+  // Breakpoints of every profile, validate() already made sure they are in order
+  const float top = ReferenceCurve::k_max_gearbox_rpm;
+  float gearbox_launch_rpm = int(params.engine_launch / params.ecvt_max_ratio);
+
+  // Endurance: the original four regions, hold engage until the belt grabs, accelerate at the
+  // max ratio, hold power while shifting, then ride the overdrive ratio
+  const CurvePoint endurance[] = {{params.gearbox_engage_rpm, params.engine_engage},
+                                  {params.gearbox_power_rpm, params.engine_power},
+                                  {params.gearbox_overdrive_rpm, params.engine_power},
+                                  {top, top * params.overdrive_ratio}};
+  // Launch: engage higher up the torque curve, otherwise endurance
+  const CurvePoint launch[] = {{gearbox_launch_rpm, params.engine_launch},
+                               {params.gearbox_power_rpm, params.engine_power},
+                               {params.gearbox_overdrive_rpm, params.engine_power},
+                               {top, top * params.overdrive_ratio}};
+  // Hill: engage high and never leave power for overdrive
+  const CurvePoint hill[] = {{gearbox_launch_rpm, params.engine_launch},
+                             {params.gearbox_power_rpm, params.engine_power}};
+  params.curves[k_profile_endurance].build(endurance, 4);
+  params.curves[k_profile_launch].build(launch, 4);
+  params.curves[k_profile_hill].build(hill, 2);
+}
+
+int ParameterStore::validate(const Parameters& params)
+{
+  const ParameterInfo* info = parameter_info();
+  for (int i = 0; i < k_parameter_count; i++)
+  {
+    float value = parameter_value(params, i);
+    // Written so NaN fails too
+    if (!(value >= info[i].min && value <= info[i].max)) return k_out_of_range;
+  }
+  if (params.overdrive_ratio >= params.ecvt_max_ratio) return k_inconsistent;
+  if (params.engine_engage >= params.engine_power) return k_inconsistent;
+  if (params.engine_launch >= params.engine_power) return k_inconsistent;
+  if (params.engine_power / params.overdrive_ratio > ReferenceCurve::k_max_gearbox_rpm) return k_inconsistent;
+  return k_ok;
+}
+
+int ParameterStore::stage(const Parameters& params)
+{
+  int status = validate(params);
+  if (status != k_ok) return status;
+
+  int inactive = 1 - m_active.load(std::memory_order_relaxed);
+  m_slots[inactive] = params;
+  derive(m_slots[inactive]);
+  m_active.store(inactive, std::memory_order_release);
+  m_changes++;
+  return k_ok;
+}
+
+void ParameterStore::restore_defaults()
+{
+  stage(defaults());
+}
+
+int ParameterStore::decode(const uint8_t* data, size_t length, Parameters& params)
+{
+  parameters::ParameterFileHeader header;
+  if (length < sizeof(header)) return k_too_short;
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != parameters::k_file_magic) return k_bad_magic;
+  if (header.version != parameters::k_version) return k_bad_version;
+  if (header.value_count != k_parameter_count) return k_bad_count;
+  if (length < k_file_size) return k_too_short;
+
+  const uint8_t* values = data + sizeof(header);
+  if (telemetry::crc16(values, k_parameter_count * sizeof(float)) != header.crc) return k_bad_crc;
+
+  params = defaults();
+  for (int i = 0; i < k_parameter_count; i++)
+  {
+    memcpy(&parameter_value(params, i), values + i * sizeof(float), sizeof(float));
+  }
+  derive(params);
+  return validate(params);
+}
+
+size_t ParameterStore::encode(const Parameters& params, uint8_t* data, size_t capacity)
+{
+  if (capacity < k_file_size) return 0;
+  uint8_t* values = data + sizeof(parameters::ParameterFileHeader);
+  for (int i = 0; i < k_parameter_count; i++)
+  {
+    float value = parameter_value(params, i);
+    memcpy(values + i * sizeof(float), &value, sizeof(float));
+  }
+
+  parameters::ParameterFileHeader header = {};
+  header.magic = parameters::k_file_magic;
+  header.version = parameters::k_version;
+  header.value_count = k_parameter_count;
+  header.crc = telemetry::crc16(values, k_parameter_count * sizeof(float));
+  memcpy(data, &header, sizeof(header));
+  return k_file_size;
+}
+
+int ParameterStore::load(const uint8_t* data, size_t length)
+{
+  Parameters params;
+  int status = decode(data, length, params);
+  if (status != k_ok) return status;
+  return stage(params);
+}
+
+int ParameterStore::find(const char* name)
+{
+  const ParameterInfo* info = parameter_info();
+  for (int i = 0; i < k_parameter_count; i++)
+  {
+    if (strcmp(info[i].name, name) == 0) return i;
+  }
+  return -1;
+}
+
+const char* ParameterStore::status_name(int status)
+{
+  switch (status)
+  {
+    case k_ok: return "ok";
+    case k_too_short: return "file too short";
+    case k_bad_magic: return "not a parameter file";
+    case k_bad_version: return "wrong version";
+    case k_bad_count: return "wrong parameter count";
+    case k_bad_crc: return "bad crc";
+    case k_out_of_range: return "value out of range";
+    case k_inconsistent: return "values inconsistent";
+    default: return "unknown";
+  }
+}
+
+void ParameterStore::print_parameter(Print& reply, int index) const
+{
+  reply.print(parameter_info()[index].name);
+  reply.print(" ");
+  reply.print(parameter_value(active(), index), 6);
+  reply.print("\n");
+}
+
+int ParameterStore::command(char* line, Print& reply)
+{
+  char* save_pointer = nullptr;
+  const char* verb = strtok_r(line, " \t\r\n", &save_pointer);
+  const char* name = strtok_r(nullptr, " \t\r\n", &save_pointer);
+  const char* value = strtok_r(nullptr, " \t\r\n", &save_pointer);
+  if (verb == nullptr) return k_command_done;
+
+  if (strcmp(verb, "get") == 0)
+  {
+    if (name == nullptr)
+    {
+      for (int i = 0; i < k_parameter_count; i++) print_parameter(reply, i);
+      return k_command_done;
+    }
+    int index = find(name);
+    if (index < 0)
+    {
+      reply.print("error unknown parameter\n");
+      return k_command_error;
+    }
+    print_parameter(reply, index);
+    return k_command_done;
+  }
+
+  if (strcmp(verb, "set") == 0)
+  {
+    int index = name == nullptr ? -1 : find(name);
+    if (index < 0 || value == nullptr)
+    {
+      reply.print("error usage: set <name> <value>\n");
+      return k_command_error;
+    }
+    char* end = nullptr;
+    float number = strtof(value, &end);
+    if (end == value || *end != '\0')
+    {
+      reply.print("error not a number\n");
+      return k_command_error;
+    }
+    Parameters params = active();
+    parameter_value(params, index) = number;
+    int status = stage(params);
+    if (status != k_ok)
+    {
+      reply.print("error ");
+      reply.print(status_name(status));
+      reply.print("\n");
+      return k_command_error;
+    }
+    print_parameter(reply, index);
+    return k_command_done;
+  }
+
+  if (strcmp(verb, "defaults") == 0)
+  {
+    restore_defaults();
+    reply.print("ok\n");
+    return k_command_done;
+  }
+  if (strcmp(verb, "save") == 0) return k_command_save;
+  if (strcmp(verb, "reload") == 0) return k_command_reload;
+
+  reply.print("error unknown command\n");
+  return k_command_error;
+}
@@ -0,0 +1,62 @@
+#include <PidController.h>
+
+void PidController::reset()
+{
+  m_started = false;
+  m_measurement_rate = 0;
+  m_proportional = 0;
+  m_integral = 0;
+  m_derivative = 0;
+  m_feed_forward = 0;
+  m_output = 0;
+}
+
+float PidController::update(float reference, float measurement, float feed_forward_signal, float dt, int blocked,
+                            float max_positive, float max_negative)
+{
+  const Config& config = m_config;
+  if (dt <= 0) return m_output;
+  float error = reference - measurement;
+
+  // Derivative of the measurement, low passed, zero on the first call
+  if (m_started)
+  {
+    float rate = (measurement - m_last_measurement) / dt;
+    m_measurement_rate += (rate - m_measurement_rate) * dt / (config.derivative_time_constant + dt);
+  }
+  m_last_measurement = measurement;
+  m_started = true;
+
+  m_proportional = config.kp * error;
+  m_derivative = -config.kd * m_measurement_rate;
+  m_feed_forward = config.kff * feed_forward_signal;
+
+  // Only integrate when the output could actually move that way
+  float integral = clamp(m_integral + config.ki * error * dt, -config.integral_limit, config.integral_limit);
+  float unsaturated = m_proportional + integral + m_derivative + m_feed_forward;
+  float upper = max_positive < config.output_limit ? max_positive : config.output_limit;
+  float lower = max_negative < config.output_limit ? -max_negative : -config.output_limit;
+  bool pushing_up = error > 0;
+  bool saturated = (unsaturated > upper && pushing_up) || (unsaturated < lower && !pushing_up);
+  bool stopped = ((blocked & k_block_positive) && pushing_up) || ((blocked & k_block_negative) && !pushing_up);
+  if (!saturated && !stopped) m_integral = integral;
+
+  // Whatever is stored pushing into a stop would only have to unwind later
+  if ((blocked & k_block_positive) && m_integral > 0) m_integral = 0;
+  if ((blocked & k_block_negative) && m_integral < 0) m_integral = 0;
+
+  float output = clamp(m_proportional + m_integral + m_derivative + m_feed_forward, -config.output_limit, config.output_limit);
+  if (config.rate_limit > 0)
+  {
+    float step = config.rate_limit * dt;
+    output = clamp(output, m_output - step, m_output + step);
+  }
+
+  // The caps and the stops win over the slew limit
+  output = clamp(output, lower, upper);
+  if ((blocked & k_block_positive) && output > 0) output = 0;
+  if ((blocked & k_block_negative) && output < 0) output = 0;
+
+  m_output = output;
+  return output;
+}
@@ -0,0 +1,111 @@
+#include <Profiler.h>
+
+#ifdef MOAT_PROFILE
+
+#include <Hal.h>
+#include <atomic>
+
+const char* profile::stage_name(int stage)
+{
+  switch (stage)
+  {
+    case k_cycle: return "cycle";
+    case k_snapshot: return "snapshot";
+    case k_engine_rpm: return "engine_rpm";
+    case k_gearbox_rpm: return "gearbox_rpm";
+    case k_filters: return "filters";
+    case k_estimator: return "estimator";
+    case k_reference: return "reference";
+    case k_pid: return "pid";
+    case k_odrive: return "odrive";
+    case k_log_fill: return "log_fill";
+    case k_estop_read: return "estop_read";
+    case k_telemetry_push: return "telemetry_push";
+    case k_telemetry_write: return "telemetry_write";
+    case k_serial_commands: return "serial_commands";
+    default: return "unknown";
+  }
+}
+
+Profiler& Profiler::instance()
+{
+  static Profiler profiler;
+  return profiler;
+}
+
+void Profiler::record(int stage, uint32_t ticks)
+{
+  Slot& slot = m_slots[stage];
+  StageStats& stats = slot.stats;
+
+  // Same odd / even version as Scheduler::stats(), readers retry while it moves
+  slot.version++;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  if (slot.reset_requested)
+  {
+    stats = StageStats();
+    slot.reset_requested = false;
+  }
+  if (stats.count == 0 || ticks < stats.min) stats.min = ticks;
+  if (ticks > stats.max) stats.max = ticks;
+  stats.count++;
+  stats.total += ticks;
+  int bucket = ticks == 0 ? 0 : 31 - __builtin_clz(ticks);
+  stats.histogram[bucket < k_buckets ? bucket : k_buckets - 1]++;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  slot.version++;
+}
+
+Profiler::StageStats Profiler::stats(int stage) const
+{
+  const Slot& slot = m_slots[stage];
+  StageStats out;
+  uint32_t version;
+  do
+  {
+    version = slot.version;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    out = slot.stats;
+    if (slot.reset_requested) out = StageStats();
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  } while ((version & 1) || version != slot.version);
+  return out;
+}
+
+void Profiler::reset()
+{
+  for (int i = 0; i < profile::k_stage_count; i++) m_slots[i].reset_requested = true;
+}
+
+void Profiler::print(Print& out) const
+{
+  float ticks_us = ticks_per_us();
+  for (int i = 0; i < profile::k_stage_count; i++)
+  {
+    StageStats s = stats(i);
+    if (s.count == 0) continue;
+    out.print("profile ");
+    out.print(profile::stage_name(i));
+    out.print(" n ");
+    out.print(s.count);
+    out.print(" us ");
+    out.print(s.min / ticks_us, 3);
+    out.print("/");
+    out.print(s.total / (double)s.count / ticks_us, 3);
+    out.print("/");
+    out.print(s.max / ticks_us, 3);
+    // Histogram as bucket:count for the buckets that were hit
+    out.print(" log2(ticks)");
+    for (int b = 0; b < k_buckets; b++)
+    {
+      if (s.histogram[b] == 0) continue;
+      out.print(" ");
+      out.print(b);
+      out.print(":");
+      out.print(s.histogram[b]);
+    }
+    out.print("\n");
+  }
+}
+
+#endif
@@ -0,0 +1,29 @@
+#include <ReferenceCurve.h>
+
+bool ReferenceCurve::build(const CurvePoint* points, int count)
+{
+  if (count < 1 || count > k_max_points) return false;
+  for (int i = 1; i < count; i++)
+  {
+    if (!(points[i].gearbox_rpm >= points[i - 1].gearbox_rpm)) return false;
+  }
+
+  // Sample the piecewise linear curve at every grid node
+  int segment = 0;
+  for (int n = 0; n <= k_cells; n++)
+  {
+    float rpm = n * k_cell_rpm;
+    while (segment < count - 1 && points[segment + 1].gearbox_rpm <= rpm) segment++;
+
+    if (rpm <= points[0].gearbox_rpm) m_table[n] = points[0].engine_rpm;
+    else if (segment == count - 1) m_table[n] = points[count - 1].engine_rpm;
+    else
+    {
+      const CurvePoint& a = points[segment];
+      const CurvePoint& b = points[segment + 1];
+      float span = b.gearbox_rpm - a.gearbox_rpm;
+      m_table[n] = span > 0 ? a.engine_rpm + (b.engine_rpm - a.engine_rpm) * (rpm - a.gearbox_rpm) / span : b.engine_rpm;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,175 @@
+#include <ReplyParser.h>
+#include <float.h>
+
+// Digits past this are too small to change a float and are only counted in the exponent
+static const uint64_t k_max_mantissa = 100000000000000000ULL;  // 1e17
+static const int k_max_exponent = 10000;
+
+static bool is_digit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+static const char* skip_spaces(const char* p)
+{
+  while (*p == ' ' || *p == '\t') p++;
+  return p;
+}
+
+// mantissa * 10^exponent in double, exact powers up to 1e22 and repeated steps beyond
+static double scale(double mantissa, int exponent)
+{
+  static const double k_powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                    1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  const int k_max_step = 22;
+  while (exponent > k_max_step && mantissa != 0 && mantissa < DBL_MAX / k_powers[k_max_step])
+  {
+    mantissa *= k_powers[k_max_step];
+    exponent -= k_max_step;
+  }
+  while (exponent < -k_max_step && mantissa != 0)
+  {
+    mantissa /= k_powers[k_max_step];
+    exponent += k_max_step;
+  }
+  if (exponent > k_max_step) return DBL_MAX;
+  if (exponent < -k_max_step) return 0;
+  return exponent >= 0 ? mantissa * k_powers[exponent] : mantissa / k_powers[-exponent];
+}
+
+int ReplyParser::feed(char c)
+{
+  if (m_complete)
+  {
+    m_length = 0;
+    m_too_long = false;
+    m_complete = false;
+  }
+  m_bytes++;
+  if (c == '\r') return k_incomplete;
+  if (c == '\n')
+  {
+    m_line[m_length] = '\0';
+    m_complete = true;
+    m_lines++;
+    if (m_too_long) m_long_lines++;
+    return k_complete;
+  }
+  if (m_length < k_line_size - 1) m_line[m_length++] = c;
+  else m_too_long = true;
+  return k_incomplete;
+}
+
+void ReplyParser::reset()
+{
+  m_length = 0;
+  m_too_long = false;
+  m_complete = false;
+}
+
+int ReplyParser::parse_float(float& value) const
+{
+  if (m_too_long) return k_too_long;
+  return parse_float(m_line, value);
+}
+
+int ReplyParser::parse_int(int32_t& value) const
+{
+  if (m_too_long) return k_too_long;
+  return parse_int(m_line, value);
+}
+
+int ReplyParser::parse_float(const char* text, float& value)
+{
+  const char* p = skip_spaces(text);
+  if (*p == '\0') return k_empty;
+
+  bool negative = false;
+  if (*p == '+' || *p == '-') negative = *p++ == '-';
+
+  uint64_t mantissa = 0;
+  int exponent = 0;
+  bool any_digits = false;
+  for (; is_digit(*p); p++)
+  {
+    any_digits = true;
+    if (mantissa < k_max_mantissa) mantissa = mantissa * 10 + (*p - '0');
+    else exponent++;
+  }
+  if (*p == '.')
+  {
+    for (p++; is_digit(*p); p++)
+    {
+      any_digits = true;
+      if (mantissa < k_max_mantissa)
+      {
+        mantissa = mantissa * 10 + (*p - '0');
+        exponent--;
+      }
+    }
+  }
+  if (!any_digits) return k_invalid;
+
+  if (*p == 'e' || *p == 'E')
+  {
+    p++;
+    bool negative_exponent = false;
+    if (*p == '+' || *p == '-') negative_exponent = *p++ == '-';
+    if (!is_digit(*p)) return k_invalid;
+    int written = 0;
+    for (; is_digit(*p); p++)
+    {
+      if (written < k_max_exponent) written = written * 10 + (*p - '0');
+    }
+    exponent += negative_exponent ? -written : written;
+  }
+  if (*skip_spaces(p) != '\0') return k_invalid;
+
+  double result = scale((double)mantissa, exponent);
+  if (result > FLT_MAX) return k_out_of_range;
+  value = negative ? -result : result;
+  return k_ok;
+}
+
+int ReplyParser::parse_int(const char* text, int32_t& value)
+{
+  const char* p = skip_spaces(text);
+  if (*p == '\0') return k_empty;
+
+  bool negative = false;
+  if (*p == '+' || *p == '-') negative = *p++ == '-';
+  if (!is_digit(*p)) return k_invalid;
+
+  // One past INT32_MAX so INT32_MIN still fits
+  const int64_t limit = negative ? 2147483648LL : 2147483647LL;
+  int64_t magnitude = 0;
+  bool too_big = false;
+  for (; is_digit(*p); p++)
+  {
+    magnitude = magnitude * 10 + (*p - '0');
+    if (magnitude > limit)
+    {
+      too_big = true;
+      magnitude = limit;
+    }
+  }
+  if (*skip_spaces(p) != '\0') return k_invalid;
+  if (too_big) return k_out_of_range;
+
+  value = (int32_t)(negative ? -magnitude : magnitude);
+  return k_ok;
+}
+
+const char* ReplyParser::status_name(int status)
+{
+  switch (status)
+  {
+    case k_ok: return "ok";
+    case k_empty: return "empty";
+    case k_invalid: return "not a number";
+    case k_out_of_range: return "out of range";
+    case k_too_long: return "line too long";
+    default: return "unknown";
+  }
+}
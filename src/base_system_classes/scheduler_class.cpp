@@ -0,0 +1,156 @@
+#include <Hal.h>
+#include <Scheduler.h>
+#include <atomic>
+
+#ifdef ARDUINO
+static IntervalTimer control_timer;
+#endif
+
+Scheduler* Scheduler::s_active = nullptr;
+
+Scheduler::Scheduler()
+{
+  clear_stats();
+}
+
+bool Scheduler::begin(uint32_t period_us, Task task)
+{
+  // Starts calling task every period_us, only one scheduler can own the timer
+  if (period_us < k_min_period_us || task == nullptr) return false;
+  if (s_active != nullptr && s_active != this) return false;
+
+  m_task = task;
+  m_period_us = period_us;
+  clear_stats();
+  m_next_deadline = micros() + period_us;
+  s_active = this;
+  m_running = true;
+
+#ifdef ARDUINO
+  // Below the gear tooth and hall interrupts (128) so their edges never wait on the control step
+  control_timer.priority(160);
+  if (!control_timer.begin(timer_isr, period_us))
+  {
+    m_running = false;
+    s_active = nullptr;
+    return false;
+  }
+#endif
+  return true;
+}
+
+void Scheduler::end()
+{
+#ifdef ARDUINO
+  control_timer.end();
+#endif
+  m_running = false;
+  if (s_active == this) s_active = nullptr;
+}
+
+void Scheduler::timer_isr()
+{
+  if (s_active != nullptr) s_active->dispatch();
+}
+
+bool Scheduler::poll()
+{
+  // Host builds (and anything without a timer) drive the scheduler from here
+  if (!m_running || m_in_task) return false;
+  if ((int32_t)(micros() - m_next_deadline) < 0) return false;
+  dispatch();
+  return true;
+}
+
+void Scheduler::dispatch()
+{
+  if (!m_running || m_in_task) return;
+  m_in_task = true;
+
+  uint32_t start = micros();
+  int32_t jitter = (int32_t)(start - m_next_deadline);
+
+  // Fell more than a whole period behind: count what was skipped and line back up with the clock
+  uint32_t missed = 0;
+  if (jitter >= (int32_t)m_period_us)
+  {
+    missed = jitter / m_period_us;
+    m_next_deadline += missed * m_period_us;
+    jitter -= missed * m_period_us;
+  }
+  m_next_deadline += m_period_us;
+
+  m_task();
+
+  uint32_t stop = micros();
+  uint32_t exec = stop - start;
+  bool overrun = (int32_t)(stop - m_next_deadline) > 0;
+
+  if (m_reset_requested)
+  {
+    m_reset_requested = false;
+    clear_stats();
+  }
+  m_version++;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  if (m_cycles == 0 || jitter < m_jitter_min) m_jitter_min = jitter;
+  if (m_cycles == 0 || jitter > m_jitter_max) m_jitter_max = jitter;
+  if (m_cycles == 0 || exec < m_exec_min) m_exec_min = exec;
+  if (m_cycles == 0 || exec > m_exec_max) m_exec_max = exec;
+  m_jitter_sum += jitter;
+  m_exec_sum += exec;
+  m_missed += missed;
+  if (overrun) m_overruns++;
+  m_cycles++;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  m_version++;
+
+  m_in_task = false;
+}
+
+Scheduler::Stats Scheduler::stats() const
+{
+  // The timer can fire while copying, retry until the version didn't move
+  Stats out;
+  uint32_t version;
+  do
+  {
+    version = m_version;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    out.cycles = m_cycles;
+    out.overruns = m_overruns;
+    out.missed = m_missed;
+    out.jitter_min = m_jitter_min;
+    out.jitter_max = m_jitter_max;
+    out.jitter_mean = m_cycles ? (int32_t)(m_jitter_sum / (int64_t)m_cycles) : 0;
+    out.exec_min = m_exec_min;
+    out.exec_max = m_exec_max;
+    out.exec_mean = m_cycles ? (uint32_t)(m_exec_sum / m_cycles) : 0;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  } while ((version & 1) || version != m_version);
+  return out;
+}
+
+void Scheduler::reset_stats()
+{
+  // While running the stats belong to the task context, so let the next cycle clear them
+  if (m_running) m_reset_requested = true;
+  else clear_stats();
+}
+
+void Scheduler::clear_stats()
+{
+  m_version++;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  m_cycles = 0;
+  m_overruns = 0;
+  m_missed = 0;
+  m_jitter_min = 0;
+  m_jitter_max = 0;
+  m_jitter_sum = 0;
+  m_exec_min = 0;
+  m_exec_max = 0;
+  m_exec_sum = 0;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  m_version++;
+}
@@ -0,0 +1,57 @@
+#include <Sensors.h>
+
+Sensors::Sensors(const Constant& constant, ToothSensor& engine, ToothSensor& gearbox)
+  : m_engine(engine), m_gearbox(gearbox)
+{
+  m_hall_inbound_pin = constant.hall_inbound_pin;
+  m_hall_outbound_pin = constant.hall_outbound_pin;
+}
+
+void Sensors::begin()
+{
+  HallState hall = m_hall_last;
+  hall.inbound = !digitalReadFast(m_hall_inbound_pin);
+  hall.outbound = !digitalReadFast(m_hall_outbound_pin);
+  hall.changed_us = micros();
+  hall.changes = m_hall_changes;
+  m_hall_last = hall;
+  m_hall.write(hall);
+}
+
+int Sensors::on_hall_change()
+{
+  // Both sensors share this handler, so read both pins and publish them together
+  HallState hall = m_hall_last;
+  hall.inbound = !digitalReadFast(m_hall_inbound_pin);
+  hall.outbound = !digitalReadFast(m_hall_outbound_pin);
+  hall.changed_us = micros();
+  hall.changes = ++m_hall_changes;
+
+  // The count at the edge, not whatever the next control cycle would see. Without an encoder
+  // there's nothing to latch, so an edge then isn't a hit.
+  int hits = 0;
+  if (m_actuator_encoder != nullptr && hall.inbound && !m_hall_last.inbound)
+  {
+    hits |= k_inbound_hit;
+    hall.inbound_hits++;
+    hall.inbound_count = m_actuator_encoder->read();
+  }
+  if (m_actuator_encoder != nullptr && hall.outbound && !m_hall_last.outbound)
+  {
+    hits |= k_outbound_hit;
+    hall.outbound_hits++;
+    hall.outbound_count = m_actuator_encoder->read();
+  }
+  m_hall_last = hall;
+  m_hall.write(hall);
+  return hits;
+}
+
+SensorSnapshot Sensors::snapshot() const
+{
+  SensorSnapshot snapshot;
+  snapshot.engine = m_engine.state();
+  snapshot.gearbox = m_gearbox.state();
+  m_hall.read(snapshot.hall);
+  return snapshot;
+}
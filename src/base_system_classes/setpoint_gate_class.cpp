@@ -0,0 +1,32 @@
+#include <SetpointGate.h>
+#include <math.h>
+
+int SetpointGate::decide(float value, uint32_t now_us)
+{
+  uint32_t since_sent = now_us - m_sent_us;
+  int decision = k_skip;
+  if (!m_sent || (value == 0 && m_value != 0))
+  {
+    decision = k_change;
+  }
+  else if (fabsf(value - m_value) > m_config.deadband && since_sent >= m_config.min_interval_us)
+  {
+    decision = k_change;
+  }
+  else if (m_config.keepalive_us != 0 && since_sent >= m_config.keepalive_us)
+  {
+    decision = k_keepalive;
+  }
+
+  if (decision == k_skip)
+  {
+    m_skipped++;
+    return k_skip;
+  }
+  if (decision == k_change) m_changes++;
+  else m_keepalives++;
+  m_sent = true;
+  m_value = value;
+  m_sent_us = now_us;
+  return decision;
+}
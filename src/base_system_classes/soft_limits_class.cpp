@@ -0,0 +1,39 @@
+#include <SoftLimits.h>
+#include <float.h>
+#include <math.h>
+
+void SoftLimits::set_inbound(int32_t count)
+{
+  m_inbound = count;
+  m_has_inbound = true;
+}
+
+void SoftLimits::set_outbound(int32_t count)
+{
+  m_outbound = count;
+  m_has_outbound = true;
+}
+
+float SoftLimits::max_outbound_speed(int32_t position) const
+{
+  if (!m_has_outbound) return FLT_MAX;
+  return cap(m_outbound - position);
+}
+
+float SoftLimits::max_inbound_speed(int32_t position) const
+{
+  if (!m_has_inbound) return FLT_MAX;
+  return cap(position - m_inbound);
+}
+
+float SoftLimits::cap(int32_t distance) const
+{
+  // distance in counts to the end, negative once past it
+  if (m_config.decel <= 0) return FLT_MAX;
+  if (distance < -m_config.overtravel) return 0;
+  float turns = distance > 0 ? distance / m_config.counts_per_turn : 0;
+  // Positive root of v^2 / (2 * decel) + v * response - turns = 0
+  float a = m_config.decel;
+  float t = m_config.response;
+  return fmaxf(m_config.min_speed, a * (sqrtf(t * t + 2 * turns / a) - t));
+}
@@ -0,0 +1,176 @@
+#include <StateEstimator.h>
+#include <math.h>
+
+// Scalar Kalman correction, h * x is the predicted reading and innovation is reading - h * x.
+// Returns false without touching anything when the innovation is outside gate sigma (0 for no gate).
+template <int N>
+static bool kalman_correct(Matrix<N, 1>& x, Matrix<N, N>& p, const Matrix<1, N>& h, float innovation,
+                           float variance, float gate)
+{
+  Matrix<N, 1> ph = p * h.transpose();
+  float s = (h * ph)(0, 0) + variance;
+  if (gate > 0 && innovation * innovation > gate * gate * s) return false;
+
+  Matrix<N, 1> gain = ph * (1 / s);
+  x = x + gain * innovation;
+  // p is symmetric, so h * p is ph transposed
+  p = p - gain * ph.transpose();
+  return true;
+}
+
+// Covariance a white noise jerk of density q adds to a (value, rate) pair over dt
+static void add_jerk_noise(Matrix<5, 5>& p, int index, float q, float dt)
+{
+  float q2 = q * q;
+  p(index, index) += q2 * dt * dt * dt / 3;
+  p(index, index + 1) += q2 * dt * dt / 2;
+  p(index + 1, index) += q2 * dt * dt / 2;
+  p(index + 1, index + 1) += q2 * dt;
+}
+
+StateEstimator::StateEstimator() : StateEstimator(Config())
+{
+}
+
+StateEstimator::StateEstimator(const Config& config) : m_config(config)
+{
+  reset();
+}
+
+void StateEstimator::reset()
+{
+  m_x = Matrix<k_states, 1>::zero();
+  m_x(k_ratio, 0) = m_config.max_ratio;
+  m_p = Matrix<k_states, k_states>::zero();
+  m_p(k_engine, k_engine) = 4000 * 4000.0f;
+  m_p(k_engine_accel, k_engine_accel) = 5000 * 5000.0f;
+  m_p(k_gearbox, k_gearbox) = 1000 * 1000.0f;
+  m_p(k_gearbox_accel, k_gearbox_accel) = 2000 * 2000.0f;
+  m_p(k_ratio, k_ratio) = 0.3f * 0.3f;
+
+  m_sheave = Matrix<2, 1>::zero();
+  m_sheave_p = Matrix<2, 2>::identity() * 1e6f;
+  m_sheave_started = false;
+  m_estimate = StateEstimate();
+}
+
+void StateEstimator::set_travel(int32_t inbound_count, int32_t outbound_count)
+{
+  m_has_travel = outbound_count != inbound_count;
+  m_inbound_count = inbound_count;
+  m_outbound_count = outbound_count;
+}
+
+void StateEstimator::predict(float dt_s)
+{
+  // Sheave, constant velocity
+  Matrix<2, 2> fs = Matrix<2, 2>::identity();
+  fs(0, 1) = dt_s;
+  m_sheave = fs * m_sheave;
+  m_sheave_p = fs * m_sheave_p * fs.transpose();
+  float qs = m_config.sheave_jerk * m_config.sheave_jerk;
+  m_sheave_p(0, 0) += qs * dt_s * dt_s * dt_s / 3;
+  m_sheave_p(0, 1) += qs * dt_s * dt_s / 2;
+  m_sheave_p(1, 0) += qs * dt_s * dt_s / 2;
+  m_sheave_p(1, 1) += qs * dt_s;
+
+  // Shafts at constant acceleration, the ratio follows the sheave
+  Matrix<k_states, k_states> f = Matrix<k_states, k_states>::identity();
+  f(k_engine, k_engine_accel) = dt_s;
+  f(k_gearbox, k_gearbox_accel) = dt_s;
+  m_x = f * m_x;
+  m_x(k_ratio, 0) += m_config.ratio_per_count * m_sheave(1, 0) * dt_s;
+  m_p = f * m_p * f.transpose();
+  add_jerk_noise(m_p, k_engine, m_config.engine_jerk, dt_s);
+  add_jerk_noise(m_p, k_gearbox, m_config.gearbox_jerk, dt_s);
+  float ratio_step = m_config.ratio_per_count * dt_s;
+  m_p(k_ratio, k_ratio) += m_config.ratio_walk * m_config.ratio_walk * dt_s +
+                           ratio_step * ratio_step * m_sheave_p(1, 1);
+}
+
+void StateEstimator::correct_sheave(const EstimatorInput& input)
+{
+  if (!m_sheave_started)
+  {
+    m_sheave(0, 0) = input.encoder_count;
+    m_sheave_started = true;
+  }
+
+  Matrix<1, 2> h = {{{1, 0}}};
+  kalman_correct(m_sheave, m_sheave_p, h, input.encoder_count - m_sheave(0, 0),
+                 m_config.encoder_noise * m_config.encoder_noise, 0);
+
+  if (input.odrive_fresh)
+  {
+    // shadow_count was taken odrive_age_s ago
+    Matrix<1, 2> h_count = {{{1, -input.odrive_age_s}}};
+    float predicted = m_sheave(0, 0) - input.odrive_age_s * m_sheave(1, 0);
+    kalman_correct(m_sheave, m_sheave_p, h_count, input.odrive_count - predicted,
+                   m_config.odrive_count_noise * m_config.odrive_count_noise, 0);
+
+    Matrix<1, 2> h_velocity = {{{0, 1}}};
+    float velocity_noise = m_config.odrive_velocity_noise * m_config.counts_per_turn;
+    kalman_correct(m_sheave, m_sheave_p, h_velocity,
+                   input.odrive_velocity * m_config.counts_per_turn - m_sheave(1, 0),
+                   velocity_noise * velocity_noise, 0);
+  }
+}
+
+void StateEstimator::correct_shafts(const EstimatorInput& input)
+{
+  if (input.engine_fresh)
+  {
+    Matrix<1, k_states> h = {{{1, -input.engine_age_s, 0, 0, 0}}};
+    float predicted = m_x(k_engine, 0) - input.engine_age_s * m_x(k_engine_accel, 0);
+    kalman_correct(m_x, m_p, h, input.engine_rpm - predicted, m_config.engine_noise * m_config.engine_noise, 0);
+  }
+  if (input.gearbox_fresh)
+  {
+    Matrix<1, k_states> h = {{{0, 0, 1, -input.gearbox_age_s, 0}}};
+    float predicted = m_x(k_gearbox, 0) - input.gearbox_age_s * m_x(k_gearbox_accel, 0);
+    kalman_correct(m_x, m_p, h, input.gearbox_rpm - predicted, m_config.gearbox_noise * m_config.gearbox_noise, 0);
+  }
+
+  // Sheave position to ratio, only once homing has found the ends
+  if (m_has_travel)
+  {
+    float travel = (m_sheave(0, 0) - m_inbound_count) / (m_outbound_count - m_inbound_count);
+    travel = fminf(fmaxf(travel, 0), 1);
+    float ratio = m_config.min_ratio + (m_config.max_ratio - m_config.min_ratio) * travel;
+    Matrix<1, k_states> h = {{{0, 0, 0, 0, 1}}};
+    kalman_correct(m_x, m_p, h, ratio - m_x(k_ratio, 0),
+                   m_config.position_ratio_noise * m_config.position_ratio_noise, 0);
+  }
+
+  // Belt: 0 = engine - ratio * gearbox, linearised around the current estimate
+  m_estimate.belt_locked = false;
+  if (m_x(k_gearbox, 0) > m_config.belt_min_gearbox_rpm)
+  {
+    float engine = m_x(k_engine, 0);
+    float gearbox = m_x(k_gearbox, 0);
+    float ratio = m_x(k_ratio, 0);
+    Matrix<1, k_states> h = {{{1, 0, -ratio, 0, -gearbox}}};
+    m_estimate.belt_locked = kalman_correct(m_x, m_p, h, ratio * gearbox - engine,
+                                            m_config.belt_noise * m_config.belt_noise, m_config.belt_gate);
+  }
+
+  // A ratio outside the mechanical range is the linearisation going wrong, not the car
+  float ratio = m_x(k_ratio, 0);
+  m_x(k_ratio, 0) = fminf(fmaxf(ratio, m_config.min_ratio * 0.9f), m_config.max_ratio * 1.1f);
+}
+
+const StateEstimate& StateEstimator::update(const EstimatorInput& input, float dt_s)
+{
+  predict(dt_s);
+  correct_sheave(input);
+  correct_shafts(input);
+
+  m_estimate.engine_rpm = m_x(k_engine, 0);
+  m_estimate.engine_accel = m_x(k_engine_accel, 0);
+  m_estimate.gearbox_rpm = m_x(k_gearbox, 0);
+  m_estimate.gearbox_accel = m_x(k_gearbox_accel, 0);
+  m_estimate.ratio = m_x(k_ratio, 0);
+  m_estimate.sheave_position = m_sheave(0, 0);
+  m_estimate.sheave_velocity = m_sheave(1, 0);
+  return m_estimate;
+}
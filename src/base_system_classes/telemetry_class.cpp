@@ -0,0 +1,113 @@
+#include <Telemetry.h>
+#include <atomic>
+#include <string.h>
+
+bool Telemetry::begin(const telemetry::FieldInfo* fields, int field_count, uint32_t period_us)
+{
+  // Writes the self describing header into the first block, records follow it
+  if (field_count <= 0 || field_count > telemetry::k_max_fields) return false;
+
+  memset(&m_header, 0, sizeof(m_header));
+  m_header.magic = telemetry::k_file_magic;
+  m_header.version = telemetry::k_version;
+  m_header.header_size = telemetry::k_block_size;
+  m_header.record_size = telemetry::record_size(field_count);
+  m_header.field_count = field_count;
+  m_header.period_us = period_us;
+  for (int i = 0; i < field_count; i++)
+  {
+    m_header.fields[i] = fields[i];
+    m_header.fields[i].name[telemetry::k_name_size - 1] = '\0';
+    m_field_index[i] = fields[i].out_index;
+  }
+  m_header.crc = telemetry::header_crc(m_header);
+
+  m_field_count = field_count;
+  m_record_size = m_header.record_size;
+  m_sequence = 0;
+  m_dropped = 0;
+  m_ready = -1;
+  m_active = 0;
+
+  memset(m_buffers[0], 0, telemetry::k_block_size);
+  memcpy(m_buffers[0], &m_header, sizeof(m_header));
+  m_fill = telemetry::k_block_size;
+  return true;
+}
+
+bool Telemetry::push(const int* out, uint32_t time_us)
+{
+  // Control step side, constant time and no I/O
+  if (m_record_size == 0) return false;
+
+  // A record that runs over the end of the active buffer needs the other one to be free
+  bool crosses = m_fill + m_record_size >= k_buffer_size;
+  if (crosses && m_ready != -1)
+  {
+    m_dropped++;
+    return false;
+  }
+
+  uint8_t record[telemetry::record_size(telemetry::k_max_fields)] __attribute__((aligned(4)));
+  telemetry::RecordHeader* header = (telemetry::RecordHeader*)record;
+  int32_t* values = (int32_t*)(record + sizeof(telemetry::RecordHeader));
+  header->sync = telemetry::k_record_sync;
+  header->sequence = m_sequence++;
+  header->time_us = time_us;
+  for (int i = 0; i < m_field_count; i++)
+  {
+    values[i] = out[m_field_index[i]];
+  }
+  header->crc = telemetry::record_crc(record, m_record_size);
+
+  write(record, m_record_size);
+  return true;
+}
+
+void Telemetry::write(const uint8_t* data, size_t length)
+{
+  size_t first = k_buffer_size - m_fill;
+  if (first > length) first = length;
+  memcpy(m_buffers[m_active] + m_fill, data, first);
+  m_fill += first;
+
+  if (m_fill == k_buffer_size)
+  {
+    // Buffer is full, hand it to the background and carry on in the other one
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    m_ready = m_active;
+    m_active ^= 1;
+    m_fill = 0;
+    memcpy(m_buffers[m_active], data + first, length - first);
+    m_fill = length - first;
+  }
+}
+
+const uint8_t* Telemetry::ready(size_t& length)
+{
+  int ready = m_ready;
+  if (ready < 0)
+  {
+    length = 0;
+    return nullptr;
+  }
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  length = k_buffer_size;
+  return m_buffers[ready];
+}
+
+void Telemetry::release()
+{
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  m_ready = -1;
+}
+
+const uint8_t* Telemetry::drain(size_t& length)
+{
+  // Zero pads the active buffer up to the next block, the zero sync word ends the log
+  size_t padded = (m_fill + telemetry::k_block_size - 1) / telemetry::k_block_size * telemetry::k_block_size;
+  memset(m_buffers[m_active] + m_fill, 0, padded - m_fill);
+  length = padded;
+  m_fill = 0;
+  return m_buffers[m_active];
+}
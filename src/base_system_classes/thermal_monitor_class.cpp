@@ -0,0 +1,210 @@
+#include <ThermalMonitor.h>
+
+#ifdef ARDUINO
+#include <ADC.h>
+static ADC s_adc;
+static ADC_Module* s_adc_module = nullptr;
+#endif
+
+ThermalMonitor* ThermalMonitor::s_active = nullptr;
+
+ThermalMonitor::ThermalMonitor(const Constant& constant)
+{
+  Config config;
+  config.pins[0] = constant.thermistor_1_pin;
+  config.pins[1] = constant.thermistor_2_pin;
+  config.pins[2] = constant.thermistor_3_pin;
+  config.sample_rate = constant.thermistor_sample_rate;
+  config.update_period_us = constant.cooling_update_period;
+  config.thermistor.beta = constant.thermistor_beta;
+  config.thermistor.nominal = constant.thermistor_nominal;
+  config.thermistor.series = constant.thermistor_series;
+  config.on_temp = constant.cooling_on_temp;
+  config.full_temp = constant.cooling_full_temp;
+  config.hysteresis = constant.cooling_hysteresis;
+  config.min_speed = constant.cooling_min_speed;
+  config.max_speed = constant.cooling_max_speed;
+  configure(config);
+}
+
+void ThermalMonitor::configure(const Config& config)
+{
+  m_config = config;
+  m_table.build(config.thermistor);
+  m_scan_count = 0;
+  for (int i = 0; i < k_channels; i++)
+  {
+    m_readings[i] = Reading();
+    if (config.pins[i] < 0) continue;
+    m_scan[m_scan_count++] = i;
+    m_readings[i].status = k_no_samples;
+  }
+}
+
+bool ThermalMonitor::begin()
+{
+  // Only one monitor can own the ADC and its interrupt
+  if (m_scan_count == 0 || m_config.sample_rate == 0) return false;
+  if (s_active != nullptr && s_active != this) return false;
+
+  m_trigger_period_us = 1000000 / (m_config.sample_rate * m_scan_count);
+  m_scan_index = 0;
+  m_next_trigger_us = micros() + m_trigger_period_us;
+  m_last_update_us = micros();
+  s_active = this;
+  m_running = true;
+
+#ifdef ARDUINO
+  // The timer triggers one module, it has to reach every pin
+  s_adc_module = nullptr;
+  ADC_Module* const modules[] = {s_adc.adc0, s_adc.adc1};
+  for (ADC_Module* module : modules)
+  {
+    bool reaches = true;
+    for (int i = 0; i < m_scan_count; i++) reaches = reaches && module->checkPin(m_config.pins[m_scan[i]]);
+    if (!reaches) continue;
+    s_adc_module = module;
+    break;
+  }
+  if (s_adc_module == nullptr)
+  {
+    end();
+    return false;
+  }
+  // The divider is up to 5k behind the pin, so a long sample time, and the hardware averages
+  s_adc_module->setResolution(ThermistorTable::k_adc_bits);
+  s_adc_module->setAveraging(8);
+  s_adc_module->setConversionSpeed(ADC_CONVERSION_SPEED::MED_SPEED);
+  s_adc_module->setSamplingSpeed(ADC_SAMPLING_SPEED::LOW_SPEED);
+  // Below the control step (160), the interrupt only moves a code into the ring
+  s_adc_module->enableInterrupts(adc_isr, 224);
+  s_adc_module->startSingleRead(m_config.pins[m_scan[0]]);
+  s_adc_module->startTimer(m_config.sample_rate * m_scan_count);
+#endif
+  return true;
+}
+
+void ThermalMonitor::end()
+{
+#ifdef ARDUINO
+  if (s_adc_module != nullptr)
+  {
+    s_adc_module->stopTimer();
+    s_adc_module->disableInterrupts();
+  }
+#endif
+  m_running = false;
+  if (s_active == this) s_active = nullptr;
+}
+
+void ThermalMonitor::adc_isr()
+{
+#ifdef ARDUINO
+  uint16_t code = s_adc_module->readSingle();
+  // With the timer running this only picks the pin the next trigger converts
+  if (s_active != nullptr) s_adc_module->startSingleRead(s_active->on_conversion(code));
+  asm volatile("dsb");  // flag cleared before the interrupt returns, or it fires again
+#endif
+}
+
+bool ThermalMonitor::poll()
+{
+#ifdef ARDUINO
+  return false;
+#else
+  if (!m_running) return false;
+  if ((int32_t)(micros() - m_next_trigger_us) < 0) return false;
+  m_next_trigger_us += m_trigger_period_us;
+  on_conversion(analogRead(m_config.pins[m_scan[m_scan_index]]));
+  return true;
+#endif
+}
+
+int ThermalMonitor::on_conversion(uint16_t code)
+{
+  int index = m_scan_index;
+  Sample sample = {(uint8_t)m_scan[index], code};
+  if (!m_samples_ready.push(sample)) m_dropped++;
+  index = index + 1 < m_scan_count ? index + 1 : 0;
+  m_scan_index = index;
+  return m_config.pins[m_scan[index]];
+}
+
+bool ThermalMonitor::update(uint32_t now_us)
+{
+  Sample sample;
+  while (m_samples_ready.pop(sample))
+  {
+    m_sums[sample.channel] += sample.code;
+    m_counts[sample.channel]++;
+    m_samples++;
+  }
+  if (now_us - m_last_update_us < m_config.update_period_us) return false;
+  m_last_update_us = now_us;
+
+  // Mean code over the period, a thermistor that can't be read can't be trusted to be cool
+  bool fault = false;
+  bool any = false;
+  float hottest = 0;
+  for (int n = 0; n < m_scan_count; n++)
+  {
+    int i = m_scan[n];
+    Reading& reading = m_readings[i];
+    if (m_counts[i] == 0) reading.status = k_no_samples;
+    else
+    {
+      reading.code = (m_sums[i] + m_counts[i] / 2) / m_counts[i];
+      if (m_table.shorted(reading.code)) reading.status = k_shorted;
+      else if (m_table.open(reading.code)) reading.status = k_open;
+      else
+      {
+        reading.status = k_ok;
+        reading.temperature = m_table.temperature(reading.code);
+      }
+    }
+    m_sums[i] = 0;
+    m_counts[i] = 0;
+
+    if (reading.status != k_ok) fault = true;
+    else if (!any || reading.temperature > hottest)
+    {
+      hottest = reading.temperature;
+      any = true;
+    }
+  }
+  m_hottest = hottest;
+  m_cooling_velocity = m_scan_count > 0 ? cooling_speed(fault) : 0;
+  return true;
+}
+
+float ThermalMonitor::cooling_speed(bool fault)
+{
+  // The hysteresis only holds it on at min_speed, above on_temp the speed follows the temperature
+  if (fault)
+  {
+    m_cooling = true;
+    return m_config.max_speed;
+  }
+  if (m_hottest >= m_config.on_temp) m_cooling = true;
+  else if (m_hottest < m_config.on_temp - m_config.hysteresis) m_cooling = false;
+  if (!m_cooling) return 0;
+
+  float span = m_config.full_temp - m_config.on_temp;
+  float fraction = span > 0 ? (m_hottest - m_config.on_temp) / span : 1;
+  if (fraction < 0) fraction = 0;
+  if (fraction > 1) fraction = 1;
+  return m_config.min_speed + (m_config.max_speed - m_config.min_speed) * fraction;
+}
+
+const char* ThermalMonitor::status_name(int status)
+{
+  switch (status)
+  {
+    case k_ok: return "ok";
+    case k_unused: return "unused";
+    case k_no_samples: return "no samples";
+    case k_shorted: return "shorted";
+    case k_open: return "open";
+    default: return "unknown";
+  }
+}
@@ -0,0 +1,33 @@
+#include <Thermistor.h>
+#include <math.h>
+
+const static float k_kelvin = 273.15f;
+const static float k_nominal_temp = 25 + k_kelvin;
+
+void ThermistorTable::build(const Config& config)
+{
+  // The ends of the table are never read between, they only have to stay finite
+  for (int i = 0; i < k_entries; i++)
+  {
+    float code = (float)(i << k_shift);
+    if (code < 0.5f) code = 0.5f;
+    if (code > k_adc_max - 0.5f) code = k_adc_max - 0.5f;
+    m_table[i] = exact(config, code);
+  }
+  m_short_code = (uint16_t)ceilf(code_at(config, config.max_temp));
+  m_open_code = (uint16_t)floorf(code_at(config, config.min_temp));
+}
+
+float ThermistorTable::exact(const Config& config, float code)
+{
+  if (code <= 0 || code >= k_adc_max) return NAN;
+  float ratio = code / k_adc_max;
+  float resistance = config.series * ratio / (1 - ratio);
+  return 1 / (1 / k_nominal_temp + logf(resistance / config.nominal) / config.beta) - k_kelvin;
+}
+
+float ThermistorTable::code_at(const Config& config, float temperature)
+{
+  float resistance = config.nominal * expf(config.beta * (1 / (temperature + k_kelvin) - 1 / k_nominal_temp));
+  return k_adc_max * resistance / (resistance + config.series);
+}
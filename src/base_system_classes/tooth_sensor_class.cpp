@@ -0,0 +1,80 @@
+#include <ToothSensor.h>
+
+ToothSensor::ToothSensor(float teeth_per_rotation, uint32_t window_teeth, uint32_t stall_us)
+{
+  m_teeth_per_rotation = teeth_per_rotation;
+  m_window_teeth = window_teeth < 1 ? 1 : (window_teeth >= k_history ? k_history - 1 : window_teeth);
+  m_stall_us = stall_us;
+}
+
+void ToothSensor::on_edge()
+{
+  // Only this interrupt writes the counters, so plain load / store is enough
+  uint32_t now = micros();
+  if (!m_edges.push(now))
+  {
+    m_overflows.store(m_overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+  m_count++;
+  m_state.write({m_count, now});
+}
+
+void ToothSensor::drain()
+{
+  uint32_t edge;
+  while (m_edges.pop(edge))
+  {
+    m_history[m_history_count & (k_history - 1)] = edge;
+    m_history_count++;
+    m_last_edge_us = edge;
+  }
+
+  // Edges were dropped somewhere after what was just read, a window across the gap would
+  // count too few teeth, so start the history over with what comes in next
+  uint32_t overflows = m_overflows.load(std::memory_order_relaxed);
+  if (overflows != m_seen_overflows)
+  {
+    m_seen_overflows = overflows;
+    m_history_count = 0;
+  }
+}
+
+float ToothSensor::rpm()
+{
+  drain();
+
+  // Stopped if nothing came in for a while
+  uint32_t since_edge = micros() - m_last_edge_us;
+  if (since_edge > m_stall_us)
+  {
+    m_last_rpm = 0;
+    m_age_us = 0;
+    return 0;
+  }
+  if (m_history_count < 2) return m_last_rpm;
+
+  // Walk back over up to window_teeth periods, leaving out edges from before a stall
+  uint32_t available = m_history_count - 1 < m_window_teeth ? m_history_count - 1 : m_window_teeth;
+  uint32_t newest = history(0);
+  uint32_t teeth = 0;
+  while (teeth < available && newest - history(teeth + 1) <= m_stall_us)
+  {
+    teeth++;
+  }
+  if (teeth == 0) return m_last_rpm;
+
+  uint32_t span_us = newest - history(teeth);
+  if (span_us == 0) return m_last_rpm;
+  float teeth_per_us = float(teeth) / span_us;
+  m_age_us = since_edge + span_us / 2;
+
+  // While slowing down the next tooth is late, so the speed is at most one tooth over the wait
+  if (since_edge * teeth > span_us)
+  {
+    teeth_per_us = 1.0f / since_edge;
+    m_age_us = since_edge / 2;
+  }
+
+  m_last_rpm = teeth_per_us * 60e6f / m_teeth_per_rotation;
+  return m_last_rpm;
+}
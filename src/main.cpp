@@ -9,6 +9,7 @@ General code to oversee all functions of the Teensy
 // Libraries
 #include <SPI.h>  // MUST BE INCLUDED BEFORE ArduinoLog.h
 #include <ArduinoLog.h>
+#include <EEPROM.h>
 #include <HardwareSerial.h>
 #include <SD.h>
 #include <SoftwareSerial.h>
@@ -16,126 +17,478 @@ General code to oversee all functions of the Teensy
 
 // Classes
 #include <Actuator.h>
+#include <BootSequencer.h>
+#include <Calibration.h>
 #include <Constant.h>
+#include <DiagnosticStream.h>
+#include <Estop.h>
+#include <ParameterStore.h>
+#include <Profiler.h>
+#include <Scheduler.h>
+#include <Sensors.h>
+#include <Telemetry.h>
+#include <ThermalMonitor.h>
+#include <ToothSensor.h>
 
 // Modes
 /*
  * Operating (0): For normal operation. Initializes then runs main control function in loop.
  * May disable logging object in its library config to free up memory.
  *
- * Diagnostic (1)
- * 
+ * Diagnostic (1): Streams diagnostic frames over USB serial without the control step, read them
+ * with tools/diag_viewer. "diag <hz>" on the serial port changes the rate, "diag 0" stops it.
  */
 #define MODE 1
 
 // Startup
 #define WAIT_SERIAL_STARTUP 1
-#define HOME_ON_STARTUP 0
+#define SERIAL_WAIT_MS 250         // Longest the boot gives USB serial to connect
+#define HOME_ON_STARTUP 0          // Unless the saved calibration was restored
+#define ODRIVE_TIMEOUT_MS 2000     // For the ODrive to answer at boot
+#define BOOT_TIMEOUT_MS 10000      // Boot steps still busy after this are given up on
 bool is_main_power = 0;
-// NOTE: To set model 20 / 21 check the Constant.h file
+bool homing_on_boot = false;
+// NOTE: To set model 20 / 21 build with -DMOAT_MODEL=20 / 21 (platformio.ini), the tables are in Constant.h
 
 // Constants Object
 Constant constant;
 
 // Logging
 #define LOG_LEVEL LOG_LEVEL_NOTICE
-#define SAVE_THRESHOLD 1000  // Sets how often the log object will save to SD when in operating mode
+#define SAVE_THRESHOLD 8  // Telemetry buffers written between directory updates of the telemetry file
+#define TELEMETRY_PREALLOCATE (64UL * 1024 * 1024)  // Contiguous space reserved for the telemetry file
 
-// Diagnostic Mode
-#define DIAGNOSTIC_MODE_SHOTS 100  // Number of times diagnostic mode is run
+// Parameters
+#define PARAMETER_FILE "params.bin"  // Written by the "save" serial command or tools/param_tool
+#define COMMAND_LINE_SIZE 64          // Longest serial command line
+
+// Calibration, the ends of travel kept in EEPROM across power cycles
+#define CALIBRATION_ADDRESS 0             // EEPROM byte offset
+#define CALIBRATION_SETTLE_MS 2000        // Still this long before it's saved
+#define CALIBRATION_SAVE_INTERVAL_MS 60000  // Between saves that only move where it rests
+
+// Diagnostic stream
+#define DIAGNOSTIC_RATE_HZ 100    // Frames per second on USB serial
+#define STREAM_DIAGNOSTICS 0      // Also stream them in mode 0, between the serial command replies
+
+// Scheduling
+#define CONTROL_PERIOD_US (constant.cycle_period * 1000)  // Up to 1 kHz (1000 us)
+#define SCHEDULER_REPORT_MS 5000  // How often the scheduler timing stats are logged
 
 //<--><--><--><-->< Base Systems ><--><--><--><--><-->
 
 // Logging and SD
 File log_file;
 String log_name = "log.txt";
+FsFile telemetry_file;
+String telemetry_name = "tlm.bin";
+Telemetry telemetry;
+DiagnosticStream diagnostics;
 
 // Logging titles
-unsigned int STATUS = 0;
-unsigned int ACT_VEL = 1;
-unsigned int ENC_IN = 2;
-unsigned int ENC_OUT = 3;
-unsigned int T_START = 4;
-unsigned int T_STOP = 5;
-unsigned int ENC_POS = 6;
-unsigned int ODRV_VOLT = 7;
-unsigned int ODRV_CUR = 8; 
-unsigned int RPM = 9;
-unsigned int HALL_IN = 10;
-unsigned int HALL_OUT = 11;
-unsigned int WHL_RPM = 12;
-unsigned int WHL_COUNT = 13;
-unsigned int RPM_COUNT = 14;
-unsigned int DT = 15;
-unsigned int ROLLING_FRAME = 16;
-unsigned int EXP_DECAY = 17;
-unsigned int REF_RPM = 18;
+const unsigned int STATUS = 0;
+const unsigned int ACT_VEL = 1;
+const unsigned int ENC_IN = 2;
+const unsigned int ENC_OUT = 3;
+const unsigned int T_START = 4;
+const unsigned int T_STOP = 5;
+const unsigned int ENC_POS = 6;
+const unsigned int ODRV_VOLT = 7;
+const unsigned int ODRV_CUR = 8; 
+const unsigned int RPM = 9;
+const unsigned int HALL_IN = 10;
+const unsigned int HALL_OUT = 11;
+const unsigned int WHL_RPM = 12;
+const unsigned int WHL_COUNT = 13;
+const unsigned int RPM_COUNT = 14;
+const unsigned int DT = 15;
+const unsigned int ROLLING_FRAME = 16;
+const unsigned int EXP_DECAY = 17;
+const unsigned int REF_RPM = 18;
+const unsigned int ODRV_AGE = 19;
+const unsigned int ESTOP = 20;
+const unsigned int PID_P = 21;
+const unsigned int PID_I = 22;
+const unsigned int PID_D = 23;
+const unsigned int PID_FF = 24;
+const unsigned int GB_MEDIAN = 25;
+const unsigned int EST_EG_RPM = 26;
+const unsigned int EST_GB_RPM = 27;
+const unsigned int EST_RATIO = 28;
+const unsigned int GB_RPM = 29;
+
+// Order of the telemetry fields, the binary log header records it so the decoder doesn't need this table
+const telemetry::FieldInfo telemetry_fields[] = {
+  {"status", STATUS},
+  {"rpm", RPM},
+  {"rpm_count", RPM_COUNT},
+  {"dt", DT},
+  {"act_vel", ACT_VEL},
+  {"enc_pos", ENC_POS},
+  {"hall_in", HALL_IN},
+  {"hall_out", HALL_OUT},
+  {"s_time", T_START},
+  {"f_time", T_STOP},
+  {"o_vol", ODRV_VOLT},
+  {"o_curr", ODRV_CUR},
+  {"roll_frame", ROLLING_FRAME},
+  {"exp_decay", EXP_DECAY},
+  {"ref_rpm", REF_RPM},
+  {"estop", ESTOP},
+  {"odrv_age", ODRV_AGE},
+  {"pid_p", PID_P},
+  {"pid_i", PID_I},
+  {"pid_d", PID_D},
+  {"pid_ff", PID_FF},
+  {"gb_median", GB_MEDIAN},
+  {"est_eg_rpm", EST_EG_RPM},
+  {"est_gb_rpm", EST_GB_RPM},
+  {"est_ratio", EST_RATIO},
+  {"gb_rpm", GB_RPM}
+};
+const int telemetry_field_count = sizeof(telemetry_fields) / sizeof(telemetry_fields[0]);
 
 //<--><--><--><-->< Subsystems ><--><--><--><--><-->
 
 // Actuator settings
 #define PRINT_TO_SERIAL false
 
-// PINS CAR
-#define ENC_A_PIN 2
-#define ENC_B_PIN 3
-#define HALL_INBOUND_PIN 23
-#define HALL_OUTBOUND_PIN 22
-#define GEARTOOTH_ENGINE_PIN 41
-#define GEARTOOTH_GEARBOX_PIN 40
+ToothSensor eg_teeth(Constant::eg_teeth_per_rotation, Constant::eg_rpm_window_teeth, Constant::tooth_stall_timeout);
+ToothSensor gb_teeth(Constant::gb_teeth_per_rotation, Constant::gb_rpm_window_teeth, Constant::tooth_stall_timeout);
+
+Sensors sensors(constant, eg_teeth, gb_teeth);
+ParameterStore parameters;
+
+#ifdef MOAT_ODRIVE_CAN
+TeensyCanBus can_bus;
+Actuator actuator(can_bus, constant, &sensors, &parameters, PRINT_TO_SERIAL);
+#else
+Actuator actuator(Serial1, constant, &sensors, &parameters, PRINT_TO_SERIAL);
+#endif
+
+// Thermistors and the cooling motor, the ADC samples on its own timer
+ThermalMonitor thermal(constant);
 
-volatile unsigned long ext_eg_tooth_count = 0;
-volatile unsigned long ext_gb_tooth_count = 0;
+// Latched by its interrupt, cleared with the "estop reset" serial command
+Estop estop(constant);
 
-Actuator actuator(Serial1, constant, &ext_eg_tooth_count, &ext_gb_tooth_count, PRINT_TO_SERIAL);
+// Startup steps, taken in turns
+BootSequencer boot;
+int odrive_boot_status = Actuator::k_link_busy;
+int calibration_boot_status = Calibration::k_no_index;
+Calibration::Record saved_calibration;
+bool calibration_saved = false;  // saved_calibration is what the EEPROM holds
+int32_t saved_outbound = 0;      // in this boot's counts
+bool thermal_started = false;
 
 // externally declared for interrupt
 void external_count_eg_tooth(){
-  ext_eg_tooth_count++;
+  eg_teeth.on_edge();
 }
 void external_count_gb_tooth(){
-  ext_gb_tooth_count++;
+  gb_teeth.on_edge();
+}
+void external_hall_change(){
+  actuator.on_limit(sensors.on_hall_change());
 }
 
 void save_log()
 {
-  // Closes and then opens the file stream
-  log_file.close();
-  log_file = SD.open(log_name.c_str(), FILE_WRITE);
+  // Pushes buffered text to the card without closing the file
+  log_file.flush();
 }
 
-bool estop_pressed = 0;
+void save_telemetry()
+{
+  // Writes out whatever telemetry buffer is full, runs in the background only
+  static int buffers_since_sync = 0;
+  size_t length;
+  const uint8_t* buffer = telemetry.ready(length);
+  if (buffer == nullptr) return;
+  PROFILE_SCOPE(profile::k_telemetry_write);
+  telemetry_file.write(buffer, length);
+  telemetry.release();
+
+  // Updating the directory entry costs an extra block write, so only do it now and then
+  if (++buffers_since_sync >= SAVE_THRESHOLD)
+  {
+    telemetry_file.flush();
+    buffers_since_sync = 0;
+  }
+}
 
-// Set flag and turn on LED if the estop is ever pressed
-void odrive_estop()
+void load_parameters()
 {
-  estop_pressed = 1;
-  digitalWrite(LED_BUILTIN, HIGH);
-  // Serial.println("ESTOP PRESSED" + String(millis()));
+  // Anything wrong with the file leaves the compiled defaults in place
+  File file = SD.open(PARAMETER_FILE, FILE_READ);
+  if (!file)
+  {
+    Log.notice("No %s, using compiled parameters" CR, PARAMETER_FILE);
+    return;
+  }
+  uint8_t buffer[ParameterStore::k_file_size];
+  size_t length = file.read(buffer, sizeof(buffer));
+  file.close();
+
+  int status = parameters.load(buffer, length);
+  if (status != ParameterStore::k_ok)
+  {
+    Log.warning("Ignoring %s (%s), using compiled parameters" CR, PARAMETER_FILE, ParameterStore::status_name(status));
+    return;
+  }
+  Log.notice("Parameters loaded from %s" CR, PARAMETER_FILE);
 }
 
-void setup()
+bool save_parameters()
 {
-  Serial.println("Starting...");
-  //-------------Attach E-Stop interrupt-----------------//
-  // interrupts();
-  // attachInterrupt(ESTOP_PIN, odrive_estop, RISING);
+  uint8_t buffer[ParameterStore::k_file_size];
+  size_t length = ParameterStore::encode(parameters.active(), buffer, sizeof(buffer));
+  SD.remove(PARAMETER_FILE);
+  File file = SD.open(PARAMETER_FILE, FILE_WRITE);
+  if (!file) return false;
+  bool written = file.write(buffer, length) == length;
+  file.close();
+  return written;
+}
+
+int load_calibration()
+{
+  // Skips homing when the actuator rests where the saved ends of travel put it
+  uint8_t buffer[Calibration::k_size];
+  for (size_t i = 0; i < sizeof(buffer); i++) buffer[i] = EEPROM.read(CALIBRATION_ADDRESS + i);
+  int status = Calibration::decode(buffer, sizeof(buffer), saved_calibration);
+  if (status != Calibration::k_ok) return status;
+  calibration_saved = true;
+  status = actuator.restore_calibration(saved_calibration);
+  if (status == Calibration::k_ok) saved_outbound = actuator.encoder_outbound();
+  return status;
+}
+
+void save_calibration(const Calibration::Record& record)
+{
+  // update() only writes the bytes that changed
+  uint8_t buffer[Calibration::k_size];
+  size_t length = Calibration::encode(record, buffer, sizeof(buffer));
+  for (size_t i = 0; i < length; i++) EEPROM.update(CALIBRATION_ADDRESS + i, buffer[i]);
+  saved_calibration = record;
+  calibration_saved = true;
+}
 
-  //-------------Wait for serial-----------------//
-  if (WAIT_SERIAL_STARTUP)
+bool car_running()
+{
+  // An engine or gearbox tooth inside the stall timeout
+  SensorSnapshot snapshot = sensors.snapshot();
+  uint32_t now = micros();
+  return (snapshot.engine.count > 0 && now - snapshot.engine.last_edge_us < Constant::tooth_stall_timeout) ||
+         (snapshot.gearbox.count > 0 && now - snapshot.gearbox.last_edge_us < Constant::tooth_stall_timeout);
+}
+
+void update_calibration()
+{
+  // Background: once the actuator has been still for a while the ends of travel and where it
+  // rests are saved, so the next boot finds it where they say. Only when something changed and
+  // a new resting place at most every CALIBRATION_SAVE_INTERVAL_MS, the flash wears out.
+  // Never while the car runs: the EEPROM emulation programs and now and then erases flash with
+  // interrupts off, that holds the control step and the e-stop interrupt for up to tens of ms.
+  // Steady cruising looks still too, so it waits for the engine and gearbox to stop.
+  static int32_t still_position = 0;
+  static uint32_t still_since_ms = 0;
+  static uint32_t last_save_ms = 0;
+  Calibration::Record record;
+  if (actuator.motion_active() || car_running() || !actuator.calibration(record)) return;
+  int32_t moved = record.position - still_position;
+  if (moved > constant.calibration_tolerance || moved < -constant.calibration_tolerance)
+  {
+    still_position = record.position;
+    still_since_ms = millis();
+    return;
+  }
+  if (millis() - still_since_ms < CALIBRATION_SETTLE_MS) return;
+  if (calibration_saved && !Calibration::changed(actuator.calibration_config(), saved_calibration, record)) return;
+  // Ends of travel from a homing go out right away
+  bool new_travel = !calibration_saved || actuator.encoder_outbound() != saved_outbound;
+  if (!new_travel && millis() - last_save_ms < CALIBRATION_SAVE_INTERVAL_MS) return;
+
+  record.saves = calibration_saved ? saved_calibration.saves + 1 : 1;
+  save_calibration(record);
+  saved_outbound = actuator.encoder_outbound();
+  last_save_ms = millis();
+  Log.notice("Calibration saved, inbound: %d, outbound: %d, at: %d from the index, saves %l" CR, record.inbound,
+             record.outbound, record.position, record.saves);
+}
+
+void handle_serial_commands()
+{
+  // Collects a line from USB serial and hands it to the parameter store, runs in the background
+  // so a change is picked up by the next control cycle
+  static char line[COMMAND_LINE_SIZE];
+  static size_t line_length = 0;
+  PROFILE_SCOPE(profile::k_serial_commands);
+  while (Serial.available() > 0)
   {
-    while (!Serial)  // wait for serial port to connect. Needed for native USB port only
+    char c = Serial.read();
+    if (c != '\n' && c != '\r')
     {
+      if (line_length < sizeof(line) - 1) line[line_length++] = c;
+      continue;
     }
+    if (line_length == 0) continue;
+    line[line_length] = '\0';
+    line_length = 0;
+
+    // "diag <hz>" sets the diagnostic stream rate
+    if (strncmp(line, "diag", 4) == 0)
+    {
+      diagnostics.set_rate(strtoul(line + 4, nullptr, 10));
+      Serial.println("ok");
+      continue;
+    }
+
+    // "estop reset" clears a trip once the button has been released for long enough
+    if (strcmp(line, "estop reset") == 0)
+    {
+      int result = estop.reset(micros());
+      if (result == Estop::k_reset_ok) digitalWrite(LED_BUILTIN, LOW);
+      Serial.println(result == Estop::k_reset_ok      ? "ok"
+                     : result == Estop::k_reset_armed ? "ok not tripped"
+                                                      : "error still pressed");
+      if (result == Estop::k_reset_ok) Log.notice("E-stop reset" CR);
+      continue;
+    }
+    if (strcmp(line, "estop") == 0)
+    {
+      Serial.println(Estop::state_name(estop.state()));
+      continue;
+    }
+
+#ifdef MOAT_PROFILE
+    // "profile" dumps the stage timings, "profile reset" starts them over
+    if (strncmp(line, "profile", 7) == 0)
+    {
+      if (strstr(line, "reset") != nullptr) Profiler::instance().reset();
+      else Profiler::instance().print(Serial);
+      continue;
+    }
+#endif
+
+    uint32_t changes = parameters.changes();
+    int result = parameters.command(line, Serial);
+    if (result == ParameterStore::k_command_save)
+    {
+      Serial.println(save_parameters() ? "ok" : "error could not write " PARAMETER_FILE);
+    }
+    else if (result == ParameterStore::k_command_reload)
+    {
+      load_parameters();
+      Serial.println("ok");
+    }
+    if (parameters.changes() != changes)
+    {
+      Log.notice("Parameters changed over serial, proportional gain (x1000): %d" CR,
+                 (int)(1000.0 * parameters.active().proportional_gain));
+    }
+  }
+}
+
+// Idles the ODrive axes from the interrupt and turns on the LED, the control step holds them
+// idle until the e-stop is released and reset
+void odrive_estop()
+{
+  actuator.on_estop();
+  digitalWrite(LED_BUILTIN, HIGH);
+}
+
+void update_estop()
+{
+  // Background, a stop the interrupt left to whoever held the port is timed once it went out,
+  // mode 1 has no control step to do it
+  estop.update(micros());
+  estop.stopped(actuator.odrive_link().idle_written_us(constant.actuator_motor_number));
+}
+
+void report_estop()
+{
+  Estop::Stats stats = estop.stats();
+  Log.notice("estop: %s, trips %l, presses %l, latency last %l us, max %l us over %l" CR,
+             Estop::state_name(estop.state()), stats.trips, stats.presses, stats.last_latency_us,
+             stats.max_latency_us, stats.latency_count);
+}
+
+void stream_diagnostics()
+{
+  // Background only, a frame the port has no room for is dropped instead of waited on
+  if (!diagnostics.due(micros())) return;
+  diagnostic::Sample sample;
+  actuator.sample_diagnostic(sample);
+  diagnostics.send(sample, Serial);
+}
+
+void update_thermal()
+{
+  // Background only, the control step sends the cooling setpoint along with the actuator's
+  if (thermal.update(micros())) actuator.set_cooling_velocity(thermal.cooling_velocity());
+}
+
+void report_thermal()
+{
+  for (int i = 0; i < ThermalMonitor::k_channels; i++)
+  {
+    const ThermalMonitor::Reading& reading = thermal.reading(i);
+    if (reading.status == ThermalMonitor::k_unused) continue;
+    Log.notice("thermistor %d (x10 C): %d, code %d, %s" CR, i + 1, (int)(10 * reading.temperature), reading.code,
+               ThermalMonitor::status_name(reading.status));
   }
+  Log.notice("cooling (x10 turns/s): %d, samples %l, dropped %l" CR, (int)(10 * thermal.cooling_velocity()),
+             thermal.samples(), thermal.dropped());
+}
 
+//-------------Boot steps (BootSequencer)-----------------//
+int boot_interrupts(uint32_t now_us)
+{
+  // Geartooth Interrupts
+  pinMode(constant.engine_geartooth_pin, INPUT_PULLUP);
+  pinMode(constant.gearbox_geartooth_pin, INPUT_PULLUP);
+  attachInterrupt(constant.engine_geartooth_pin, external_count_eg_tooth, FALLING);
+  attachInterrupt(constant.gearbox_geartooth_pin, external_count_gb_tooth, FALLING);
+
+  // Hall Interrupts
+  pinMode(constant.hall_inbound_pin, INPUT_PULLUP);
+  pinMode(constant.hall_outbound_pin, INPUT_PULLUP);
+  attachInterrupt(constant.hall_inbound_pin, external_hall_change, CHANGE);
+  attachInterrupt(constant.hall_outbound_pin, external_hall_change, CHANGE);
+  sensors.begin();
+
+  // E-stop, active high. Already pressed at power up trips it straight away.
+  pinMode(constant.estop_pin, INPUT_PULLDOWN);
+  actuator.attach_estop(&estop);
+  attachInterrupt(constant.estop_pin, odrive_estop, RISING);
+  estop.begin(now_us);
+  if (estop.tripped()) digitalWrite(LED_BUILTIN, HIGH);
+
+  // Thermistors, without them the cooling runs at full speed
+  thermal_started = thermal.begin();
+  return BootSequencer::k_done;
+}
+
+int boot_odrive(uint32_t now_us)
+{
+  // Index search, then the saved ends of travel if the actuator hasn't moved since
+  odrive_boot_status = actuator.poll_link(now_us);
+  if (odrive_boot_status == Actuator::k_link_busy) return BootSequencer::k_busy;
+  if (odrive_boot_status != 0) return BootSequencer::k_failed;
+  calibration_boot_status = load_calibration();
+  return BootSequencer::k_done;
+}
+
+int boot_sd(uint32_t now_us)
+{
   //-------------Initializing SD and Loading Settings-----------------
   if (!SD.begin(BUILTIN_SDCARD))
   {
     // This means that no SD card was found or there was an error with it
     // In this case, we will switch to the headless horseman mode and continue to operate with no logging
     // This behaviour is arbitrary, and may be changed in the future
-    // constant.init(nullptr, 3);
+    // Parameters stay at the compiled defaults
   }
 
   //-------------Logging and SD Card-----------------
@@ -145,46 +498,84 @@ void setup()
     log_file_number++;
   }
   log_name = "log_" + String(log_file_number) + ".txt";
-  Serial.println(constant.engine_geartooth_pin);
-  Serial.println("Logging at: " + log_name);
-  Serial.println(constant.gearbox_overdrive_rpm);
+  telemetry_name = "tlm_" + String(log_file_number) + ".bin";
 
   log_file = SD.open(log_name.c_str(), FILE_WRITE);
 
+  // Reserving contiguous clusters up front keeps the per-buffer writes from walking the FAT
+  telemetry_file = SD.sdfs.open(telemetry_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC);
+  if (!telemetry_file.preAllocate(TELEMETRY_PREALLOCATE))
+  {
+    Serial.println("Telemetry preallocation failed, logging to a fragmented file");
+  }
+  telemetry.begin(telemetry_fields, telemetry_field_count, CONTROL_PERIOD_US);
+
   Log.begin(LOG_LEVEL, &log_file, false);
   Log.notice("Initialization Started" CR);
   // This is for the data analysis tool to be able to change the log order easily
   Log.verbose("Time: %d" CR, millis());
+  load_parameters();
+  return BootSequencer::k_done;
+}
 
-  save_log();
+int boot_serial(uint32_t now_us)
+{
+  // A laptop on the bench gets a moment to connect, the car doesn't wait for one
+  if (!WAIT_SERIAL_STARTUP || Serial) return BootSequencer::k_done;
+  return now_us - boot.started_us() > SERIAL_WAIT_MS * 1000UL ? BootSequencer::k_done : BootSequencer::k_busy;
+}
+
+void report_boot()
+{
+  boot.report(Serial);
+  boot.report(log_file);
+  if (estop.tripped()) Log.error("E-stop pressed at startup" CR);
+  if (!thermal_started) Log.error("Thermal monitor failed to start" CR);
+  if (odrive_boot_status != 0)
+  {
+    Log.error("Actuator Init Failed code: %d" CR, odrive_boot_status);
+    return;
+  }
+  if (calibration_boot_status == Calibration::k_ok)
+  {
+    Log.notice("Calibration restored, inbound: %d, outbound: %d" CR, actuator.encoder_inbound(),
+               actuator.encoder_outbound());
+  }
+  else Log.notice("Calibration not restored (%s)" CR, Calibration::status_name(calibration_boot_status));
+}
+
+void setup()
+{
+  Serial.println("Starting...");
 
   //-------------Actuator-----------------//
-  // General Init
-  Serial.println("Actuator Init");
-  // int o_actuator_init = actuator.init(constant.homing_timeout);
-  // if (o_actuator_init)
-  // {
-  //   Log.error("Actuator Init Failed code: %d" CR, o_actuator_init);
-  //   Serial.println("Actuator init failed code: " + String(o_actuator_init));
-  // }
-  // else
-  // {
-  //   Log.verbose("Actuator Init Success code: %d" CR, o_actuator_init);
-  //   Log.notice("Proportional gain (x1000): %d" CR, (1000.0 * actuator.get_p_value()));
-  //   Serial.println("Actuator init success code: " + String(o_actuator_init));
-  // }
+#ifdef MOAT_ODRIVE_CAN
+  // The ASCII backend opens its serial port in begin_link, the CAN bus belongs to main
+  can_bus.begin(ODriveCan::k_bitrate);
+#endif
+  // Port open before the e-stop interrupt can write to it, the rest comes up alongside the others
+  actuator.begin_link(ODRIVE_TIMEOUT_MS);
+
+  // The ODrive boots and runs its index search while SD and the interrupts come up
+  boot.add("interrupts", boot_interrupts);
+  boot.add("odrive", boot_odrive);
+  boot.add("sd", boot_sd);
+  boot.add("serial", boot_serial, false);
+  boot.run(BOOT_TIMEOUT_MS * 1000UL);
+  Serial.println("Logging at: " + log_name + ", telemetry at: " + telemetry_name);
+  report_boot();
   save_log();
 
-  // Geartooth Interrupts
-  Serial.println(constant.engine_geartooth_pin);
-  Serial.println(constant.gearbox_geartooth_pin);
-  pinMode(constant.engine_geartooth_pin, INPUT_PULLUP);
-  pinMode(constant.gearbox_geartooth_pin, INPUT_PULLUP);
-  attachInterrupt(constant.engine_geartooth_pin, external_count_eg_tooth, FALLING);
-  attachInterrupt(constant.gearbox_geartooth_pin, external_count_gb_tooth, FALLING);
-
   // Homing
-  if (HOME_ON_STARTUP)
+#if MODE == 0
+  // Runs inside the control step once the scheduler starts, loop() logs how it went
+  if (HOME_ON_STARTUP && !actuator.calibrated())
+  {
+    homing_on_boot = actuator.start_homing();
+    Log.notice("Homing started" CR);
+  }
+#else
+  if (HOME_ON_STARTUP && !actuator.calibrated())
   {
     int o_homing[3];
     actuator.homing_sequence(o_homing);
@@ -199,66 +590,150 @@ void setup()
       Log.notice("Homing results, inbound: %d, outbound: %d" CR, o_homing[1], o_homing[2]);
     }
   }
+#endif
   Log.verbose("Initialization Complete" CR);
   Log.notice("Starting mode %d" CR, MODE);
-  // This message is critical as it sets the order that the analysis script will read the data in
-  Log.notice("status, rpm, rpm_count, dt, act_vel, enc_pos, hall_in, hall_out, s_time, f_time, o_vol, o_curr, roll_frame, exp_decay, ref_rpm, estop" CR);
+  // Per cycle data goes to the binary telemetry file, its header holds the field order
+  Log.notice("Telemetry: %s" CR, telemetry_name.c_str());
   save_log();
   Serial.println("Starting mode " + String(MODE));
+  diagnostics.begin((MODE == 1 || STREAM_DIAGNOSTICS) ? DIAGNOSTIC_RATE_HZ : 0, micros());
 }
 
 // OPERATING MODE
 #if MODE == 0
 
+Scheduler scheduler;
 int o_control[30];
-int save_count = 0;
-int last_save = 0;
-int o_return = 0;
+unsigned long last_scheduler_report = 0;
+uint32_t last_commands_saved = 0;
+uint32_t last_command_bytes_saved = 0;
 
-void loop()
+// Runs from the scheduler's timer interrupt, nothing in here may block
+void control_step()
 {
-  // Report output with log
+  PROFILE_SCOPE(profile::k_cycle);
   actuator.control_function(o_control);
-  
-  if (o_control[STATUS] != 3)
+  PROFILE_LAPS(laps);
+  o_control[ESTOP] = digitalReadFast(constant.estop_pin);
+  PROFILE_LAP(laps, profile::k_estop_read);
+  telemetry.push(o_control, micros());
+  PROFILE_LAP(laps, profile::k_telemetry_push);
+}
+
+void report_scheduler()
+{
+  Scheduler::Stats stats = scheduler.stats();
+  Log.notice("scheduler (us): cycles %l, overruns %l, missed %l, jitter %d/%d/%d, exec %l/%l/%l, dropped %l" CR,
+             stats.cycles, stats.overruns, stats.missed,
+             stats.jitter_min, stats.jitter_mean, stats.jitter_max,
+             stats.exec_min, stats.exec_mean, stats.exec_max,
+             telemetry.dropped());
+  scheduler.reset_stats();
+  // Totals since boot, the control step keeps adding to them while this reads
+  const ODriveLink& odrive = actuator.odrive_link();
+  Log.notice("odrive: bytes %l, messages %l, replies %l, timeouts %l, parse errors %l, discarded %l" CR,
+             odrive.rx_bytes(), odrive.rx_messages(), odrive.replies(), odrive.timeouts(), odrive.parse_errors(),
+             odrive.discarded_messages());
+  // Setpoints the gate kept off the line since the last report, per second
+  uint32_t elapsed_ms = millis() - last_scheduler_report;
+  uint32_t commands_saved = odrive.commands_saved();
+  uint32_t command_bytes_saved = odrive.command_bytes_saved();
+  if (elapsed_ms > 0)
+  {
+    Log.notice("odrive commands: sent %l, keepalives %l, state resends %l, limit stops %l, saved %l/s, %l bytes/s" CR,
+               odrive.commands_sent(), odrive.keepalives_sent(), odrive.state_resends(), odrive.immediate_stops(),
+               (commands_saved - last_commands_saved) * 1000 / elapsed_ms,
+               (command_bytes_saved - last_command_bytes_saved) * 1000 / elapsed_ms);
+  }
+  last_commands_saved = commands_saved;
+  last_command_bytes_saved = command_bytes_saved;
+  report_thermal();
+  report_estop();
+#ifdef MOAT_PROFILE
+  for (int i = 0; i < profile::k_stage_count; i++)
+  {
+    Profiler::StageStats stats = Profiler::instance().stats(i);
+    if (stats.count == 0) continue;
+    float ticks_us = Profiler::ticks_per_us();
+    Log.notice("profile %s (ns): n %l, min %l, mean %l, max %l" CR, profile::stage_name(i), stats.count,
+               (uint32_t)(stats.min * 1000 / ticks_us), (uint32_t)(stats.total / stats.count * 1000 / ticks_us),
+               (uint32_t)(stats.max * 1000 / ticks_us));
+  }
+  Profiler::instance().reset();
+#endif
+  save_log();
+}
+
+void report_motion()
+{
+  int status = actuator.motion_status();
+  if (status != MotionSequencer::k_ok)
   {
-    // For log output format check log statement after log begins in init
-    Log.notice("%d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d" CR, 
-    o_control[STATUS], 
-    o_control[RPM],
-    o_control[RPM_COUNT],
-    o_control[DT],
-    o_control[ACT_VEL], 
-    o_control[ENC_POS],
-    o_control[HALL_IN], 
-    o_control[HALL_OUT],
-    o_control[T_START], 
-    o_control[T_STOP], 
-    o_control[ODRV_VOLT], 
-    o_control[ODRV_CUR],
-    o_control[ROLLING_FRAME],
-    o_control[EXP_DECAY],
-    o_control[REF_RPM],
-    digitalRead(constant.estop_pin)
-    );
+    Log.error("Homing Failed code: %d (%s), actuator held idle" CR, status, MotionSequencer::status_name(status));
+    return;
   }
+  Log.notice("Homing results, inbound: %d, outbound: %d" CR, actuator.encoder_inbound(), actuator.encoder_outbound());
+}
 
-  // Save data to sd every SAVE_THRESHOLD
-  if (save_count > SAVE_THRESHOLD)
+void loop()
+{
+  if (!scheduler.running())
   {
+    if (!scheduler.begin(CONTROL_PERIOD_US, control_step))
+    {
+      Log.error("Scheduler failed to start, period: %l us" CR, CONTROL_PERIOD_US);
+      save_log();
+      while (1);
+    }
+  }
+
+  // Everything below is background work, the control step keeps running underneath it
+  save_telemetry();
+  handle_serial_commands();
+  stream_diagnostics();
+  update_thermal();
+  update_estop();
+
+  update_calibration();
+
+  if (homing_on_boot && !actuator.motion_active())
+  {
+    report_motion();
     save_log();
-    save_count = 0;
+    homing_on_boot = false;
+  }
+
+  if (millis() - last_scheduler_report > SCHEDULER_REPORT_MS)
+  {
+    report_scheduler();
+    last_scheduler_report = millis();
   }
-  save_count++;
 }
 
 // SERIAL DIAGNOSTIC MODE
 #elif MODE == 1
 
+unsigned long last_diagnostic_report = 0;
+
 void loop()
 {
-  Log.notice((actuator.diagnostic(is_main_power, 10, true)).c_str());
-  delay(500);
+  handle_serial_commands();
+  if (is_main_power) actuator.request_diagnostic_reads();
+  stream_diagnostics();
+  update_thermal();
+  update_estop();
+  update_calibration();
+
+  if (millis() - last_diagnostic_report > SCHEDULER_REPORT_MS)
+  {
+    Log.notice("diagnostics: rate %l Hz, frames %l, dropped %l" CR, diagnostics.rate(), diagnostics.frames(),
+               diagnostics.dropped());
+    report_thermal();
+    report_estop();
+    save_log();
+    last_diagnostic_report = millis();
+  }
 }
 
 #endif
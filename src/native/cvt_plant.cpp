@@ -0,0 +1,152 @@
+#include <CvtPlant.h>
+#include <math.h>
+
+static const float k_rpm_to_rad = 2 * M_PI / 60;
+static const float k_gravity = 9.81;
+static const float k_air_density = 1.2;
+
+CvtPlant::CvtPlant(ODriveSim& odrive, const Constant& constant, const Config& config)
+  : m_odrive(odrive), m_config(config)
+{
+  m_eg_pin = constant.engine_geartooth_pin;
+  m_gb_pin = constant.gearbox_geartooth_pin;
+  m_hall_inbound_pin = constant.hall_inbound_pin;
+  m_hall_outbound_pin = constant.hall_outbound_pin;
+  m_encoder_pin = constant.encoder_a_pin;
+  m_shift_counts = constant.encoder_count_shift_length;
+  m_min_ratio = constant.overdrive_ratio;
+  m_max_ratio = constant.ecvt_max_ratio;
+
+  m_engine_rpm = config.engine_idle_rpm;
+  m_position = config.start_position;
+  m_ratio = m_min_ratio + (m_max_ratio - m_min_ratio) * m_position;
+  m_odrive.axis(config.actuator_axis).position = config.inbound_count + m_position * m_shift_counts;
+
+  // Sensors idle high, hall sensors pull low at the stops
+  hal::sim::set_pin(m_eg_pin, HIGH);
+  hal::sim::set_pin(m_gb_pin, HIGH);
+  hal::sim::set_pin(m_hall_inbound_pin, HIGH);
+  hal::sim::set_pin(m_hall_outbound_pin, HIGH);
+}
+
+float CvtPlant::speed() const
+{
+  return m_gearbox_rpm * k_rpm_to_rad / m_config.final_drive * m_config.wheel_radius;
+}
+
+float CvtPlant::engine_torque(float rpm) const
+{
+  // Throttle scaled parabola around the peak, a governor cut, an idle governor and friction
+  float torque = 0;
+  if (rpm < m_config.engine_governed_rpm)
+  {
+    float shape = (rpm - m_config.engine_peak_rpm) / m_config.engine_torque_span;
+    torque = m_throttle * m_config.engine_peak_torque * fmaxf(0, 1 - shape * shape);
+  }
+  if (rpm < m_config.engine_idle_rpm) torque += 0.05 * (m_config.engine_idle_rpm - rpm);
+  torque -= 0.5 + 0.0008 * rpm;
+  return torque;
+}
+
+float CvtPlant::clutch_capacity(float rpm) const
+{
+  if (rpm <= m_config.clutch_start_rpm) return 0;
+  if (rpm >= m_config.clutch_full_rpm) return m_config.clutch_max_torque;
+  return m_config.clutch_max_torque * (rpm - m_config.clutch_start_rpm) /
+         (m_config.clutch_full_rpm - m_config.clutch_start_rpm);
+}
+
+float CvtPlant::load_torque() const
+{
+  // Resistance at the CVT secondary
+  float v = speed();
+  float force = m_config.vehicle_mass * k_gravity * sinf(m_config.grade);
+  if (v > 0.01) force += m_config.rolling_coefficient * m_config.vehicle_mass * k_gravity;
+  force += 0.5 * k_air_density * m_config.drag_area * v * v;
+  return force * m_config.wheel_radius / m_config.final_drive;
+}
+
+void CvtPlant::emit_teeth(double& phase, double teeth, int pin)
+{
+  // One falling edge per tooth that passed the sensor during this step
+  phase += teeth;
+  while (phase >= 1)
+  {
+    phase -= 1;
+    hal::sim::set_pin(pin, LOW);
+    hal::sim::set_pin(pin, HIGH);
+  }
+}
+
+void CvtPlant::step(uint64_t now_us)
+{
+  float dt = (now_us - m_last_us) * 1e-6f;
+  m_last_us = now_us;
+  if (dt <= 0) return;
+
+  // Actuator and ratio, with hard stops a little past the hall sensors
+  ODriveSim::Axis& axis = m_odrive.axis(m_config.actuator_axis);
+  float position = (axis.position - m_config.inbound_count) / m_shift_counts;
+  bool at_stop = position < -0.01f || position > 1.01f;
+  if (at_stop)
+  {
+    position = position < 0 ? -0.01f : 1.01f;
+    axis.position = m_config.inbound_count + position * m_shift_counts;
+    axis.velocity = 0;
+    if (!m_at_stop) m_stop_hits++;
+  }
+  m_at_stop = at_stop;
+  m_position = position;
+  float clamped = fminf(fmaxf(position, 0), 1);
+  m_ratio = m_min_ratio + (m_max_ratio - m_min_ratio) * clamped;
+
+  bool inbound = position <= m_config.hall_band;
+  bool outbound = position >= 1 - m_config.hall_band;
+  if ((inbound || outbound) && !m_at_limit) m_limit_hits++;
+  m_at_limit = inbound || outbound;
+  // Encoder first, so a hall interrupt reads the count the edge happened at
+  hal::sim::set_encoder(m_encoder_pin, (int32_t)axis.position - m_config.encoder_origin);
+  hal::sim::set_pin(m_hall_inbound_pin, inbound ? LOW : HIGH);
+  hal::sim::set_pin(m_hall_outbound_pin, outbound ? LOW : HIGH);
+
+  // Drivetrain
+  float engine_w = m_engine_rpm * k_rpm_to_rad;
+  float gearbox_w = m_gearbox_rpm * k_rpm_to_rad;
+  float engine_torque_now = engine_torque(m_engine_rpm);
+  float load = load_torque();
+  float capacity = clutch_capacity(m_engine_rpm);
+  float vehicle_inertia = m_config.vehicle_mass * powf(m_config.wheel_radius / m_config.final_drive, 2);
+  float engine_inertia = m_config.engine_inertia;
+
+  if (m_locked)
+  {
+    // Engine and car turn together through the belt
+    float accel = (m_ratio * engine_torque_now - load) / (engine_inertia * m_ratio * m_ratio + vehicle_inertia);
+    float belt_torque = engine_torque_now - engine_inertia * m_ratio * accel;
+    if (fabsf(belt_torque) > capacity) m_locked = false;
+    else
+    {
+      gearbox_w = fmaxf(0, gearbox_w + accel * dt);
+      engine_w = m_ratio * gearbox_w;
+    }
+  }
+  if (!m_locked)
+  {
+    float slip = engine_w - m_ratio * gearbox_w;
+    float belt_torque = slip > 0 ? capacity : (slip < 0 ? -capacity : 0);
+    engine_w = fmaxf(0, engine_w + (engine_torque_now - belt_torque) / engine_inertia * dt);
+    gearbox_w = fmaxf(0, gearbox_w + (m_ratio * belt_torque - load) / vehicle_inertia * dt);
+    float new_slip = engine_w - m_ratio * gearbox_w;
+    if (capacity > 0 && ((slip > 0) != (new_slip > 0) || fabsf(new_slip) < 0.5f))
+    {
+      m_locked = true;
+      engine_w = m_ratio * gearbox_w;
+    }
+  }
+  m_engine_rpm = engine_w / k_rpm_to_rad;
+  m_gearbox_rpm = gearbox_w / k_rpm_to_rad;
+
+  // Gear tooth sensors
+  emit_teeth(m_eg_phase, m_engine_rpm / 60.0 * Constant::eg_teeth_per_rotation * dt, m_eg_pin);
+  emit_teeth(m_gb_phase, m_gearbox_rpm / 60.0 * m_config.gb_teeth_per_rotation * dt, m_gb_pin);
+}
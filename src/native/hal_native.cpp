@@ -0,0 +1,286 @@
+#include <Hal.h>
+
+// Simulated board state, one board per thread so simulations can run side by side
+struct PinState
+{
+  int level = HIGH;
+  int mode = INPUT;
+  void (*isr)() = nullptr;
+  int isr_mode = 0;
+  uint32_t interrupts = 0;
+  uint16_t analog = 0;
+  uint32_t analog_reads = 0;
+};
+
+static thread_local uint64_t s_now_us = 0;
+static thread_local uint32_t s_step_us = 10;
+static thread_local hal::sim::WorldHook s_world = nullptr;
+static thread_local void* s_world_context = nullptr;
+static thread_local bool s_in_world = false;
+static thread_local PinState s_pins[hal::sim::k_pin_count];
+static thread_local int32_t s_encoders[hal::sim::k_pin_count];
+
+thread_local HardwareSerial Serial;
+thread_local HardwareSerial Serial1;
+thread_local HardwareSerial Serial2;
+
+//-----------------Clock--------------//
+uint32_t millis()
+{
+  return (uint32_t)(s_now_us / 1000);
+}
+
+uint32_t micros()
+{
+  return (uint32_t)s_now_us;
+}
+
+void delay(uint32_t ms)
+{
+  hal::sim::advance_us(ms * 1000);
+}
+
+void delayMicroseconds(uint32_t us)
+{
+  hal::sim::advance_us(us);
+}
+
+//-----------------GPIO--------------//
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  if (pin >= hal::sim::k_pin_count) return;
+  s_pins[pin].mode = mode;
+  // Pins float high as if pulled up, a pull-down holds one low until set_pin drives it
+  if (mode == INPUT_PULLDOWN) s_pins[pin].level = LOW;
+}
+
+int digitalRead(uint8_t pin)
+{
+  if (pin >= hal::sim::k_pin_count) return LOW;
+  return s_pins[pin].level;
+}
+
+int digitalReadFast(uint8_t pin)
+{
+  return digitalRead(pin);
+}
+
+void digitalWrite(uint8_t pin, uint8_t level)
+{
+  if (pin >= hal::sim::k_pin_count) return;
+  if (s_pins[pin].mode == OUTPUT) s_pins[pin].level = level ? HIGH : LOW;
+}
+
+void digitalWriteFast(uint8_t pin, uint8_t level)
+{
+  digitalWrite(pin, level);
+}
+
+void attachInterrupt(uint8_t pin, void (*isr)(), int mode)
+{
+  if (pin >= hal::sim::k_pin_count) return;
+  s_pins[pin].isr = isr;
+  s_pins[pin].isr_mode = mode;
+}
+
+void detachInterrupt(uint8_t pin)
+{
+  if (pin >= hal::sim::k_pin_count) return;
+  s_pins[pin].isr = nullptr;
+}
+
+//-----------------Analog--------------//
+int analogRead(uint8_t pin)
+{
+  if (pin >= hal::sim::k_pin_count) return 0;
+  s_pins[pin].analog_reads++;
+  return s_pins[pin].analog;
+}
+
+//-----------------Serial--------------//
+int HardwareSerial::available()
+{
+  // Code on the car spins on available(), here an empty port lets simulated time pass
+  // so the other end gets a chance to answer and timeouts still expire
+  if (m_rx.empty()) hal::sim::advance_us(1);
+  return m_rx.size();
+}
+
+int HardwareSerial::read()
+{
+  uint8_t c;
+  if (!m_rx.pop(c)) return -1;
+  return c;
+}
+
+int HardwareSerial::peek()
+{
+  if (m_rx.empty()) return -1;
+  return m_rx.front();
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  if (echo)
+  {
+    putchar(c);
+    return 1;
+  }
+  // Nobody listening on this port, the bytes go nowhere
+  if (!m_attached) return 1;
+
+  // A full buffer blocks until the other end drains it
+  while (m_tx.size() >= k_tx_capacity && s_world != nullptr && !s_in_world)
+  {
+    hal::sim::advance_us(hal::sim::step_us());
+  }
+  m_tx.push(c);
+  return 1;
+}
+
+int HardwareSerial::sim_take()
+{
+  uint8_t c;
+  if (!m_tx.pop(c)) return -1;
+  return c;
+}
+
+void HardwareSerial::sim_give(uint8_t c)
+{
+  m_rx.push(c);
+}
+
+//-----------------Encoder--------------//
+int32_t Encoder::read()
+{
+  return hal::sim::encoder(m_pin_a);
+}
+
+void Encoder::write(int32_t count)
+{
+  hal::sim::set_encoder(m_pin_a, count);
+}
+
+//-----------------Simulation control--------------//
+namespace hal
+{
+namespace sim
+{
+void reset()
+{
+  s_now_us = 0;
+  s_world = nullptr;
+  s_world_context = nullptr;
+  s_in_world = false;
+  for (int i = 0; i < k_pin_count; i++)
+  {
+    s_pins[i] = PinState();
+    s_encoders[i] = 0;
+  }
+  Serial.sim_reset();
+  Serial1.sim_reset();
+  Serial2.sim_reset();
+}
+
+void set_world(WorldHook hook, void* context)
+{
+  s_world = hook;
+  s_world_context = context;
+}
+
+void advance_us(uint32_t us)
+{
+  // Step the world along with the clock. Time moved from inside the world (an ISR that
+  // waits, say) just moves the clock.
+  if (s_world == nullptr || s_in_world)
+  {
+    s_now_us += us;
+    return;
+  }
+  while (us > 0)
+  {
+    uint32_t step = us < s_step_us ? us : s_step_us;
+    s_now_us += step;
+    us -= step;
+    s_in_world = true;
+    s_world(s_world_context, s_now_us);
+    s_in_world = false;
+  }
+}
+
+void set_step_us(uint32_t us)
+{
+  s_step_us = us > 0 ? us : 1;
+}
+
+uint32_t step_us()
+{
+  return s_step_us;
+}
+
+uint64_t now_us()
+{
+  return s_now_us;
+}
+
+void set_pin(uint8_t pin, int level)
+{
+  if (pin >= k_pin_count) return;
+  PinState& state = s_pins[pin];
+  level = level ? HIGH : LOW;
+  if (level == state.level) return;
+  state.level = level;
+
+  if (state.isr == nullptr) return;
+  bool fire = state.isr_mode == CHANGE || (state.isr_mode == RISING && level == HIGH) ||
+              (state.isr_mode == FALLING && level == LOW);
+  if (fire)
+  {
+    state.interrupts++;
+    state.isr();
+  }
+}
+
+int pin(uint8_t pin)
+{
+  if (pin >= k_pin_count) return LOW;
+  return s_pins[pin].level;
+}
+
+int pin_mode(uint8_t pin)
+{
+  if (pin >= k_pin_count) return INPUT;
+  return s_pins[pin].mode;
+}
+
+uint32_t interrupt_count(uint8_t pin)
+{
+  if (pin >= k_pin_count) return 0;
+  return s_pins[pin].interrupts;
+}
+
+void set_analog(uint8_t pin, uint16_t code)
+{
+  if (pin >= k_pin_count) return;
+  s_pins[pin].analog = code;
+}
+
+uint32_t analog_reads(uint8_t pin)
+{
+  if (pin >= k_pin_count) return 0;
+  return s_pins[pin].analog_reads;
+}
+
+void set_encoder(uint8_t pin_a, int32_t count)
+{
+  if (pin_a >= k_pin_count) return;
+  s_encoders[pin_a] = count;
+}
+
+int32_t encoder(uint8_t pin_a)
+{
+  if (pin_a >= k_pin_count) return 0;
+  return s_encoders[pin_a];
+}
+}  // namespace sim
+}  // namespace hal
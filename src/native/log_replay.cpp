@@ -0,0 +1,431 @@
+#include <Actuator.h>
+#include <Constant.h>
+#include <Hal.h>
+#include <LogReplay.h>
+#include <ODriveSim.h>
+#include <ParameterStore.h>
+#include <Sensors.h>
+#include <TelemetryFormat.h>
+#include <ToothSensor.h>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+//-----------------Reading logs--------------//
+
+// Where each field is in a record, -1 if the log doesn't have it
+struct LogColumns
+{
+  int time_us = -1;
+  int s_time = -1;
+  int status = -1;
+  int rpm = -1;
+  int rpm_count = -1;
+  int gb_rpm = -1;
+  int roll_frame = -1;
+  int act_vel = -1;
+  int enc_pos = -1;
+  int hall_in = -1;
+  int hall_out = -1;
+  int ref_rpm = -1;
+
+  void add(const char* name, int index)
+  {
+    struct
+    {
+      const char* name;
+      int* column;
+    } known[] = {{"time_us", &time_us},   {"s_time", &s_time},     {"status", &status},
+                 {"rpm", &rpm},           {"rpm_count", &rpm_count}, {"gb_rpm", &gb_rpm},
+                 {"roll_frame", &roll_frame}, {"act_vel", &act_vel}, {"enc_pos", &enc_pos},
+                 {"hall_in", &hall_in},   {"hall_out", &hall_out}, {"ref_rpm", &ref_rpm}};
+    for (auto& field : known)
+    {
+      if (strcmp(name, field.name) == 0) *field.column = index;
+    }
+  }
+
+  // Without these there is nothing to drive the control code with or to compare against
+  const char* missing() const
+  {
+    if (time_us < 0 && s_time < 0) return "s_time";
+    if (rpm_count < 0) return "rpm_count";
+    if (gb_rpm < 0 && roll_frame < 0) return "gb_rpm";
+    if (act_vel < 0) return "act_vel";
+    if (enc_pos < 0) return "enc_pos";
+    if (hall_in < 0) return "hall_in";
+    if (hall_out < 0) return "hall_out";
+    return nullptr;
+  }
+};
+
+// Recorded times are 32 bit and wrap after 71 minutes (text logs in ms after 49 days)
+static void append_cycle(LogReplay::Recording& recording, const LogColumns& columns, const int64_t* values, uint32_t time_us)
+{
+  LogReplay::Cycle cycle;
+  if (recording.cycles.empty()) cycle.time_us = time_us;
+  else
+  {
+    const LogReplay::Cycle& last = recording.cycles.back();
+    cycle.time_us = last.time_us + (uint32_t)(time_us - (uint32_t)last.time_us);
+  }
+  auto value = [&](int column) { return column < 0 ? 0 : (int32_t)values[column]; };
+  cycle.status = value(columns.status);
+  cycle.rpm = value(columns.rpm);
+  cycle.rpm_count = value(columns.rpm_count);
+  cycle.gb_rpm = value(columns.gb_rpm >= 0 ? columns.gb_rpm : columns.roll_frame);
+  cycle.act_vel = value(columns.act_vel);
+  cycle.enc_pos = value(columns.enc_pos);
+  cycle.hall_in = value(columns.hall_in);
+  cycle.hall_out = value(columns.hall_out);
+  cycle.ref_rpm = value(columns.ref_rpm);
+  recording.cycles.push_back(cycle);
+}
+
+static void finish_columns(LogReplay::Recording& recording, const LogColumns& columns)
+{
+  recording.has_gb_rpm = columns.gb_rpm >= 0;
+  recording.has_ref_rpm = columns.ref_rpm >= 0;
+}
+
+static bool read_file(const char* path, std::vector<uint8_t>& data)
+{
+  FILE* file = fopen(path, "rb");
+  if (file == nullptr) return false;
+  uint8_t chunk[64 * 1024];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+  {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  fclose(file);
+  return true;
+}
+
+// Same checks as tools/log_decoder, records that fail them are skipped
+static const char* read_binary(const std::vector<uint8_t>& data, LogReplay::Recording& recording)
+{
+  telemetry::FileHeader header;
+  if (data.size() < sizeof(header)) return "file too short for a header";
+  memcpy(&header, data.data(), sizeof(header));
+  if (header.version != telemetry::k_version) return "unsupported log version";
+  if (header.crc != telemetry::header_crc(header) || header.field_count == 0 ||
+      header.field_count > telemetry::k_max_fields || header.record_size != telemetry::record_size(header.field_count))
+  {
+    return "corrupt header";
+  }
+
+  LogColumns columns;
+  for (int i = 0; i < header.field_count; i++)
+  {
+    char name[telemetry::k_name_size + 1] = {0};
+    memcpy(name, header.fields[i].name, telemetry::k_name_size);
+    columns.add(name, i);
+  }
+  const char* missing = columns.missing();
+  if (missing != nullptr) return missing;
+  finish_columns(recording, columns);
+  recording.format = "binary";
+
+  size_t record_size = header.record_size;
+  size_t position = header.header_size;
+  bool hunting = false;
+  int32_t values[telemetry::k_max_fields];
+  int64_t wide[telemetry::k_max_fields];
+  while (position + record_size <= data.size())
+  {
+    const uint8_t* raw = data.data() + position;
+    telemetry::RecordHeader record;
+    memcpy(&record, raw, sizeof(record));
+    if (record.sync == 0 && !hunting) break;
+    if (record.sync != telemetry::k_record_sync || record.crc != telemetry::record_crc(raw, record_size))
+    {
+      if (!hunting) recording.skipped++;
+      hunting = true;
+      position++;
+      continue;
+    }
+    hunting = false;
+    memcpy(values, raw + sizeof(record), header.field_count * sizeof(int32_t));
+    for (int i = 0; i < header.field_count; i++) wide[i] = values[i];
+    append_cycle(recording, columns, wide, record.time_us);
+    position += record_size;
+  }
+  return nullptr;
+}
+
+static void split(const std::string& line, std::vector<std::string>& tokens)
+{
+  tokens.clear();
+  size_t start = 0;
+  while (start <= line.size())
+  {
+    size_t end = line.find(',', start);
+    if (end == std::string::npos) end = line.size();
+    size_t first = line.find_first_not_of(" \t", start);
+    size_t last = line.find_last_not_of(" \t\r", end - 1);
+    tokens.push_back(first < end && last != std::string::npos && last >= first ? line.substr(first, last - first + 1)
+                                                                                : "");
+    start = end + 1;
+  }
+}
+
+// log_N.txt and log_decoder's CSV: a header naming the columns, then one line of integers per
+// cycle. Anything else the firmware logged in between is skipped.
+static const char* read_text(const std::vector<uint8_t>& data, LogReplay::Recording& recording)
+{
+  LogColumns columns;
+  size_t column_count = 0;
+  std::vector<std::string> tokens;
+  std::vector<int64_t> values;
+  size_t position = 0;
+  while (position < data.size())
+  {
+    size_t end = position;
+    while (end < data.size() && data[end] != '\n') end++;
+    std::string line((const char*)data.data() + position, end - position);
+    position = end + 1;
+    split(line, tokens);
+
+    bool header = false;
+    for (const std::string& token : tokens) header |= token == "act_vel";
+    if (header)
+    {
+      // A new header (the firmware restarted into the same log) may change the order
+      columns = LogColumns();
+      for (size_t i = 0; i < tokens.size(); i++) columns.add(tokens[i].c_str(), i);
+      const char* missing = columns.missing();
+      if (missing != nullptr) return missing;
+      finish_columns(recording, columns);
+      column_count = tokens.size();
+      continue;
+    }
+    if (column_count == 0) continue;
+
+    bool numbers = tokens.size() == column_count;
+    values.resize(tokens.size());
+    for (size_t i = 0; numbers && i < tokens.size(); i++)
+    {
+      char* number_end;
+      values[i] = strtoll(tokens[i].c_str(), &number_end, 10);
+      numbers = !tokens[i].empty() && *number_end == '\0';
+    }
+    if (!numbers)
+    {
+      if (!line.empty() && line != "\r") recording.skipped++;
+      continue;
+    }
+    uint32_t time_us = columns.time_us >= 0 ? (uint32_t)values[columns.time_us] : (uint32_t)values[columns.s_time] * 1000;
+    append_cycle(recording, columns, values.data(), time_us);
+  }
+  if (column_count == 0) return "no header with act_vel";
+  recording.format = columns.time_us >= 0 ? "csv" : "text";
+  return nullptr;
+}
+
+const char* LogReplay::load(const char* path)
+{
+  m_recording = Recording();
+  std::vector<uint8_t> data;
+  if (!read_file(path, data)) return "could not read it";
+  uint32_t magic = 0;
+  if (data.size() >= sizeof(magic)) memcpy(&magic, data.data(), sizeof(magic));
+  const char* error = magic == telemetry::k_file_magic ? read_binary(data, m_recording) : read_text(data, m_recording);
+  if (error == nullptr && m_recording.cycles.size() < 2) error = "fewer than two cycles";
+  return error;
+}
+
+//-----------------Replaying--------------//
+
+float LogReplay::Result::act_vel_rms() const
+{
+  return compared ? sqrt(act_vel_squared / compared) : 0;
+}
+
+float LogReplay::Result::ref_rpm_rms() const
+{
+  return compared ? sqrt(ref_rpm_squared / compared) : 0;
+}
+
+// The interrupts main.cpp attaches, per thread like the simulated board they run on
+static thread_local ToothSensor* s_eg_teeth = nullptr;
+static thread_local ToothSensor* s_gb_teeth = nullptr;
+static thread_local Sensors* s_sensors = nullptr;
+static thread_local Actuator* s_actuator = nullptr;
+
+static void count_eg_tooth()
+{
+  s_eg_teeth->on_edge();
+}
+
+static void count_gb_tooth()
+{
+  s_gb_teeth->on_edge();
+}
+
+static void hall_change()
+{
+  int hits = s_sensors->on_hall_change();
+  if (s_actuator != nullptr) s_actuator->on_limit(hits);
+}
+
+// The ODrive answers with the recorded position instead of integrating its own
+struct World
+{
+  ODriveSim* odrive;
+  int axis;
+  double position;
+};
+
+static void step_world(void* context, uint64_t now_us)
+{
+  World* world = (World*)context;
+  world->odrive->axis(world->axis).position = world->position;
+  world->odrive->step(now_us);
+  world->odrive->axis(world->axis).position = world->position;
+}
+
+static void advance_to(uint64_t time_us)
+{
+  uint64_t now = hal::sim::now_us();
+  if (time_us > now) hal::sim::advance_us(time_us - now);
+}
+
+// Teeth of both sensors that passed during one cycle, spread evenly over it, in time order
+static void emit_teeth(uint64_t start_us, uint64_t end_us, uint32_t eg_teeth, uint32_t gb_teeth)
+{
+  double length = end_us - start_us;
+  uint32_t eg = 0;
+  uint32_t gb = 0;
+  while (eg < eg_teeth || gb < gb_teeth)
+  {
+    double eg_at = eg < eg_teeth ? (eg + 0.5) * length / eg_teeth : length;
+    double gb_at = gb < gb_teeth ? (gb + 0.5) * length / gb_teeth : length;
+    bool engine = eg_at <= gb_at;
+    advance_to(start_us + (uint64_t)(engine ? eg_at : gb_at));
+    int pin = engine ? Constant::engine_geartooth_pin : Constant::gearbox_geartooth_pin;
+    hal::sim::set_pin(pin, LOW);
+    hal::sim::set_pin(pin, HIGH);
+    if (engine) eg++;
+    else gb++;
+  }
+}
+
+static bool compared_cycle(const LogReplay::Cycle& cycle)
+{
+  // Homing, full shifts, holding after a failed one and the e-stop aren't the PID
+  return cycle.status != 3 && cycle.status != 4 && cycle.status != 5;
+}
+
+LogReplay::Result LogReplay::run(const Parameters& params, const Config& config, CycleHook hook, void* context) const
+{
+  Result result;
+  const std::vector<Cycle>& cycles = m_recording.cycles;
+  if (cycles.empty()) return result;
+
+  Constant constant;
+  hal::sim::reset();
+  hal::sim::set_step_us(config.step_us);
+  ToothSensor eg_teeth(Constant::eg_teeth_per_rotation, Constant::eg_rpm_window_teeth, Constant::tooth_stall_timeout);
+  ToothSensor gb_teeth(Constant::gb_teeth_per_rotation, Constant::gb_rpm_window_teeth, Constant::tooth_stall_timeout);
+  s_eg_teeth = &eg_teeth;
+  s_gb_teeth = &gb_teeth;
+  Sensors sensors(constant, eg_teeth, gb_teeth);
+  s_sensors = &sensors;
+  pinMode(constant.engine_geartooth_pin, INPUT_PULLUP);
+  pinMode(constant.gearbox_geartooth_pin, INPUT_PULLUP);
+  attachInterrupt(constant.engine_geartooth_pin, count_eg_tooth, FALLING);
+  attachInterrupt(constant.gearbox_geartooth_pin, count_gb_tooth, FALLING);
+  pinMode(constant.hall_inbound_pin, INPUT_PULLUP);
+  pinMode(constant.hall_outbound_pin, INPUT_PULLUP);
+  attachInterrupt(constant.hall_inbound_pin, hall_change, CHANGE);
+  attachInterrupt(constant.hall_outbound_pin, hall_change, CHANGE);
+  hal::sim::set_pin(constant.engine_geartooth_pin, HIGH);
+  hal::sim::set_pin(constant.gearbox_geartooth_pin, HIGH);
+  hal::sim::set_pin(constant.hall_inbound_pin, HIGH);
+  hal::sim::set_pin(constant.hall_outbound_pin, HIGH);
+
+  const Cycle& first = cycles.front();
+  ODriveSim::Config odrive_config;
+#ifdef MOAT_ODRIVE_CAN
+  CanLoopback can_bus;
+  ODriveSim odrive(can_bus.end(1), odrive_config);
+  CanBus& odrive_port = can_bus.end(0);
+#else
+  ODriveSim odrive(Serial1, odrive_config);
+  HardwareSerial& odrive_port = Serial1;
+#endif
+  World world = {&odrive, constant.actuator_motor_number, (double)first.enc_pos};
+  hal::sim::set_encoder(constant.encoder_a_pin, first.enc_pos);
+  hal::sim::set_world(step_world, &world);
+  sensors.begin();
+
+  ParameterStore parameters;
+  parameters.stage(params);
+  Actuator actuator(odrive_port, constant, &sensors, &parameters, false);
+  actuator.init(1000);
+  s_actuator = &actuator;
+
+  auto wall_start = std::chrono::steady_clock::now();
+  uint64_t start_us = hal::sim::now_us();
+  double gb_phase = 0;
+  int out[30] = {0};
+  for (size_t i = 0; i < cycles.size(); i++)
+  {
+    const Cycle& cycle = cycles[i];
+    uint64_t at_us = start_us + (cycle.time_us - first.time_us);
+    if (i > 0)
+    {
+      const Cycle& last = cycles[i - 1];
+      uint64_t last_us = start_us + (last.time_us - first.time_us);
+      // Faster than a tooth every 10 us is the count starting over, not the engine
+      uint32_t eg_teeth = cycle.rpm_count - last.rpm_count;
+      if (eg_teeth > (at_us - last_us) / 10) eg_teeth = 0;
+      gb_phase += cycle.gb_rpm / 60.0 * Constant::gb_teeth_per_rotation * (at_us - last_us) * 1e-6;
+      uint32_t gb_teeth = gb_phase > 0 ? (uint32_t)gb_phase : 0;
+      gb_phase -= gb_teeth;
+      emit_teeth(last_us, at_us, eg_teeth, gb_teeth);
+    }
+    advance_to(at_us);
+
+    // enc_pos is the ODrive reply of the cycle before, so the next one holds where it is now
+    int32_t position = cycles[i + 1 < cycles.size() ? i + 1 : i].enc_pos;
+    hal::sim::set_encoder(constant.encoder_a_pin, position);
+    world.position = position;
+    hal::sim::set_pin(constant.hall_inbound_pin, cycle.hall_in ? LOW : HIGH);
+    hal::sim::set_pin(constant.hall_outbound_pin, cycle.hall_out ? LOW : HIGH);
+
+    actuator.control_function(out);
+    result.cycles++;
+
+    double t = (cycle.time_us - first.time_us) * 1e-6;
+    Replayed replayed = {out[actuator.STATUS], out[actuator.ACT_VEL], out[actuator.REF_RPM]};
+    if (hook != nullptr) hook(context, cycle, replayed, t);
+    if (t < config.skip || !compared_cycle(cycle)) continue;
+
+    int32_t difference = replayed.act_vel - cycle.act_vel;
+    result.compared++;
+    if (difference == 0) result.identical++;
+    else if (result.first_difference < 0) result.first_difference = t;
+    result.act_vel_squared += (double)difference * difference;
+    result.act_vel_sum += difference;
+    if (abs(difference) > abs(result.act_vel_max))
+    {
+      result.act_vel_max = difference;
+      result.act_vel_max_at = t;
+    }
+    if (m_recording.has_ref_rpm)
+    {
+      double ref_difference = replayed.ref_rpm - cycle.ref_rpm;
+      result.ref_rpm_squared += ref_difference * ref_difference;
+    }
+  }
+  result.wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+  result.seconds = (cycles.back().time_us - first.time_us) * 1e-6;
+  s_actuator = nullptr;
+  hal::sim::set_world(nullptr, nullptr);
+  return result;
+}
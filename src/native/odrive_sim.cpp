@@ -0,0 +1,344 @@
+#include <CanSimple.h>
+#include <ODriveSim.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+ODriveSim::ODriveSim(HardwareSerial& port, const Config& config)
+  : m_port(&port), m_config(config), m_rng(config.seed ? config.seed : 1)
+{
+  m_port->sim_attach();
+}
+
+ODriveSim::ODriveSim(CanBus& bus, const Config& config)
+  : m_bus(&bus), m_config(config), m_rng(config.seed ? config.seed : 1)
+{
+}
+
+float ODriveSim::random()
+{
+  // xorshift32, deterministic per seed
+  m_rng ^= m_rng << 13;
+  m_rng ^= m_rng >> 17;
+  m_rng ^= m_rng << 5;
+  return (m_rng >> 8) * (1.0f / 16777216.0f);
+}
+
+float ODriveSim::ibus() const
+{
+  float current = 0.1;
+  for (int i = 0; i < 2; i++)
+  {
+    if (m_axes[i].state == 8) current += 0.2 + 0.15 * fabsf(m_axes[i].velocity);
+  }
+  return current;
+}
+
+void ODriveSim::step(uint64_t now_us)
+{
+  double dt = (now_us - m_last_us) * 1e-6;
+  m_last_us = now_us;
+
+  // Motors
+  for (int i = 0; i < 2; i++)
+  {
+    Axis& axis = m_axes[i];
+    if (axis.state == 6 && m_config.index_position >= 0)
+    {
+      // Turns until the index passes, then stops on it and counts from it
+      double before = (axis.position - m_config.index_position) / m_config.counts_per_turn;
+      axis.velocity = m_config.index_search_velocity;
+      axis.position += axis.velocity * m_config.counts_per_turn * dt;
+      double after = (axis.position - m_config.index_position) / m_config.counts_per_turn;
+      if (floor(before) == floor(after)) continue;
+      double turns = after > before ? floor(after) : floor(before);
+      axis.position = m_config.index_position + turns * m_config.counts_per_turn;
+      axis.count_origin = axis.position;
+      axis.velocity = 0;
+      axis.state = 1;
+      axis.state_since_us = now_us;
+      continue;
+    }
+    if (axis.state == 6 && now_us - axis.state_since_us >= m_config.index_search_us)
+    {
+      axis.state = 1;
+      axis.state_since_us = now_us;
+    }
+    float target = axis.state == 8 ? axis.vel_setpoint : 0;
+    float alpha = dt / (m_config.velocity_time_constant + dt);
+    axis.velocity += (target - axis.velocity) * alpha;
+    axis.position += axis.velocity * m_config.counts_per_turn * dt;
+  }
+
+  if (m_port) step_serial(dt, now_us);
+  else step_can(now_us);
+}
+
+void ODriveSim::step_serial(double dt, uint64_t now_us)
+{
+  HardwareSerial& port = *m_port;
+  double bytes_per_second = m_config.baud / 10.0;
+
+  // Teensy -> ODrive, nothing gets through while the Teensy side hasn't opened the port
+  if (!port.is_open())
+  {
+    while (port.sim_take() >= 0)
+    {
+    }
+    m_rx_credit = 0;
+  }
+  else
+  {
+    m_rx_credit += dt * bytes_per_second;
+    while (m_rx_credit >= 1)
+    {
+      int c = port.sim_take();
+      if (c < 0)
+      {
+        m_rx_credit = 0;
+        break;
+      }
+      m_rx_credit -= 1;
+      if (c == '\n')
+      {
+        handle_line(now_us);
+        m_line.clear();
+      }
+      else if (c != '\r')
+      {
+        m_line += (char)c;
+      }
+    }
+  }
+
+  // ODrive -> Teensy
+  while (!m_replies.empty() && m_replies.front().due_us <= now_us)
+  {
+    for (char c : m_replies.front().text)
+    {
+      m_wire.push_back(c);
+    }
+    m_replies.pop_front();
+  }
+  if (m_wire.empty())
+  {
+    m_tx_credit = 0;
+    return;
+  }
+  m_tx_credit += dt * bytes_per_second;
+  while (m_tx_credit >= 1 && !m_wire.empty())
+  {
+    m_tx_credit -= 1;
+    uint8_t c = m_wire.front();
+    m_wire.pop_front();
+    if (m_config.byte_drop_rate > 0 && random() < m_config.byte_drop_rate)
+    {
+      m_dropped_bytes++;
+      continue;
+    }
+    port.sim_give(c);
+  }
+}
+
+void ODriveSim::reply(const std::string& text, uint64_t now_us)
+{
+  if (m_config.reply_drop_rate > 0 && random() < m_config.reply_drop_rate)
+  {
+    m_dropped_replies++;
+    return;
+  }
+  Reply reply;
+  reply.due_us = now_us + m_config.reply_latency_us;
+  reply.text = text + "\r\n";
+  m_replies.push_back(reply);
+}
+
+bool ODriveSim::read_property(const char* name, std::string& value)
+{
+  char buffer[32];
+  int axis_number;
+  int consumed = 0;
+
+  if (strcmp(name, "vbus_voltage") == 0)
+  {
+    snprintf(buffer, sizeof(buffer), "%.3f", m_config.vbus_voltage);
+  }
+  else if (strcmp(name, "ibus") == 0)
+  {
+    snprintf(buffer, sizeof(buffer), "%.3f", ibus());
+  }
+  else if (strcmp(name, "error") == 0)
+  {
+    snprintf(buffer, sizeof(buffer), "0");
+  }
+  else if (sscanf(name, "axis%d.%n", &axis_number, &consumed) == 1 && consumed > 0 &&
+           (axis_number == 0 || axis_number == 1))
+  {
+    Axis& axis = m_axes[axis_number];
+    const char* field = name + consumed;
+    size_t length = strlen(field);
+    if (strcmp(field, "encoder.shadow_count") == 0)
+    {
+      snprintf(buffer, sizeof(buffer), "%ld", (long)floor(axis.count()));
+    }
+    else if (strcmp(field, "encoder.vel_estimate") == 0)
+    {
+      snprintf(buffer, sizeof(buffer), "%.4f", axis.velocity);
+    }
+    else if (strcmp(field, "current_state") == 0)
+    {
+      snprintf(buffer, sizeof(buffer), "%d", axis.state);
+    }
+    else if (length >= 5 && strcmp(field + length - 5, "error") == 0)
+    {
+      snprintf(buffer, sizeof(buffer), "0");
+    }
+    else
+    {
+      return false;
+    }
+  }
+  else
+  {
+    return false;
+  }
+  value = buffer;
+  return true;
+}
+
+void ODriveSim::handle_line(uint64_t now_us)
+{
+  const char* line = m_line.c_str();
+  int axis_number;
+  float velocity;
+  float torque;
+  int state;
+  char name[64];
+
+  if (sscanf(line, "v %d %f %f", &axis_number, &velocity, &torque) >= 2)
+  {
+    m_commands++;
+    m_velocity_commands++;
+    if (axis_number == 0 || axis_number == 1) m_axes[axis_number].vel_setpoint = velocity;
+  }
+  else if (sscanf(line, "w axis%d.requested_state %d", &axis_number, &state) == 2)
+  {
+    m_commands++;
+    if (axis_number == 0 || axis_number == 1)
+    {
+      m_axes[axis_number].state = state;
+      m_axes[axis_number].state_since_us = now_us;
+    }
+  }
+  else if (sscanf(line, "r %63s", name) == 1)
+  {
+    m_queries++;
+    std::string value;
+    if (read_property(name, value)) reply(value, now_us);
+    else reply("invalid property", now_us);
+  }
+  else if (!m_line.empty())
+  {
+    m_commands++;
+    reply("invalid command format", now_us);
+  }
+}
+
+//-----------------CAN--------------//
+void ODriveSim::step_can(uint64_t now_us)
+{
+  // Teensy -> ODrive, the bus is fast enough next to the control period to leave its timing out
+  CanFrame frame;
+  while (m_bus->read(frame))
+  {
+    handle_frame(frame, now_us);
+  }
+
+  // ODrive -> Teensy, answers to remote requests
+  while (!m_frames.empty() && m_frames.front().due_us <= now_us)
+  {
+    m_bus->write(m_frames.front().frame);
+    m_frames.pop_front();
+  }
+
+  // Cyclic messages
+  static const uint32_t k_commands[CYCLIC_COUNT] = {can_simple::k_heartbeat, can_simple::k_get_encoder_estimates,
+                                                    can_simple::k_get_encoder_count,
+                                                    can_simple::k_get_bus_voltage_current};
+  const uint32_t periods[CYCLIC_COUNT] = {m_config.heartbeat_period_us, m_config.encoder_estimates_period_us,
+                                          m_config.encoder_count_period_us, m_config.bus_vi_period_us};
+  for (int node = 0; node < 2; node++)
+  {
+    for (int i = 0; i < CYCLIC_COUNT; i++)
+    {
+      if (periods[i] == 0 || (i == BUS_VI && node != 0)) continue;
+      uint64_t& next_us = m_next_cyclic_us[node][i];
+      if (now_us < next_us) continue;
+      next_us = now_us + periods[i];
+      if (build_frame(node, k_commands[i], frame) && m_bus->write(frame)) m_cyclic_frames++;
+    }
+  }
+}
+
+bool ODriveSim::build_frame(uint8_t node, uint32_t command, CanFrame& frame)
+{
+  const Axis& axis = m_axes[node & 1];
+  switch (command)
+  {
+    case can_simple::k_heartbeat:
+      frame = can_simple::heartbeat(node, 0, axis.state);
+      return true;
+    case can_simple::k_get_encoder_estimates:
+      frame = can_simple::pair(node, command, axis.count() / m_config.counts_per_turn, axis.velocity);
+      return true;
+    case can_simple::k_get_encoder_count:
+      frame = can_simple::encoder_count(node, (int32_t)floor(axis.count()),
+                                        (int32_t)fmod(floor(axis.count()), m_config.counts_per_turn));
+      return true;
+    case can_simple::k_get_bus_voltage_current:
+      frame = can_simple::pair(node, command, m_config.vbus_voltage, ibus());
+      return true;
+    case can_simple::k_get_motor_error:
+    case can_simple::k_get_encoder_error:
+    case can_simple::k_get_sensorless_error:
+    case can_simple::k_get_controller_error:
+      frame = can_simple::error(node, command, 0);
+      return true;
+    default:
+      return false;
+  }
+}
+
+void ODriveSim::handle_frame(const CanFrame& frame, uint64_t now_us)
+{
+  uint8_t node = can_simple::node_of(frame.id);
+  uint32_t command = can_simple::command_of(frame.id);
+  if (node > 1) return;  // someone else on the bus
+
+  if (frame.rtr)
+  {
+    m_queries++;
+    PendingFrame reply;
+    if (!build_frame(node, command, reply.frame)) return;
+    if (m_config.reply_drop_rate > 0 && random() < m_config.reply_drop_rate)
+    {
+      m_dropped_replies++;
+      return;
+    }
+    reply.due_us = now_us + m_config.reply_latency_us;
+    m_frames.push_back(reply);
+    return;
+  }
+
+  m_commands++;
+  if (command == can_simple::k_set_input_vel && frame.length >= 4)
+  {
+    m_velocity_commands++;
+    m_axes[node].vel_setpoint = can_simple::get_float(frame.data);
+  }
+  else if (command == can_simple::k_set_axis_state && frame.length >= 4)
+  {
+    m_axes[node].state = can_simple::get_u32(frame.data);
+    m_axes[node].state_since_us = now_us;
+  }
+}
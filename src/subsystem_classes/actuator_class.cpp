@@ -1,10 +1,8 @@
 #include <Actuator.h>
 #include <Constant.h>
-#include <HardwareSerial.h>
-#include <ODrive.h>
-#include <queue>
-#include <SoftwareSerial.h>
-#include <TimerThree.h>
+#include <Hal.h>
+#include <Profiler.h>
+#include <string.h>
 
 // Print with stream operator
 template <class T>
@@ -20,96 +18,192 @@ inline Print& operator<<(Print& obj, float arg)
   return obj;
 }
 
-Actuator::Actuator(HardwareSerial& serial, Constant constant_in, volatile unsigned long* eg_tooth_count,  volatile unsigned long* gb_tooth_count, bool print_to_serial)
-  : encoder(constant_in.encoder_a_pin, constant_in.encoder_b_pin), odrive(serial)
+Actuator::Actuator(ODriveBackend::Port& odrive_port, const Constant& constant_in, Sensors* sensors, const ParameterStore* parameters, bool print_to_serial)
+  : constant(constant_in), encoder(constant_in.encoder_a_pin, constant_in.encoder_b_pin), odrive(odrive_port)
 {
-  Constant constant = constant_in;
-  // Save pin values
-
   m_print_to_serial = print_to_serial;
 
-  // initialize count vairables
-  m_gb_tooth_count = gb_tooth_count;
-  m_eg_tooth_count = eg_tooth_count;
-  m_last_gb_tooth_count = 0;
-  m_last_eg_tooth_count = 0;
+  // sensors published by the interrupts
+  m_sensors = sensors;
+  m_parameters = parameters;
   m_last_control_execution = 0;
 
-  // limit variables
-  m_encoder_outbound = odrive.get_encoder_pos(constant.actuator_motor_number);
+  SetpointGate::Config setpoints;
+  setpoints.deadband = constant.setpoint_deadband;
+  setpoints.min_interval_us = constant.setpoint_min_interval;
+  setpoints.keepalive_us = constant.setpoint_keepalive;
+  odrive.configure_setpoints(setpoints);
+
+  SoftLimits::Config soft_limits;
+  soft_limits.decel = constant.soft_limit_decel;
+  soft_limits.min_speed = constant.soft_limit_min_speed;
+  soft_limits.response = constant.soft_limit_response;
+  soft_limits.overtravel = constant.soft_limit_overtravel;
+  soft_limits.counts_per_turn = constant.encoder_counts_per_turn;
+  m_soft_limits.configure(soft_limits);
+
+  // limit variables, the port isn't open yet
+  m_encoder_outbound = -666;
   m_encoder_inbound = -666;
   m_encoder_engage = -666;
 
-  // Construct rolling frames queue
-  for (int i = 0; i < constant.gearbox_rolling_frames; i++)
-  {
-    m_gearbox_rpm_frames.push(0.0);
-  }
+  // The hall interrupts latch this encoder's count for homing
+  m_sensors->attach_encoder(&encoder);
 }
 
 int Actuator::init(int odrive_timeout)
 {
-  status = 0;
   interrupts();
+  begin_link(odrive_timeout);
+  int result;
+  while ((result = poll_link(micros())) == k_link_busy) delay(1);
+  return result;
+}
 
-  // Initialize Odrive object
-  int o_init = odrive.init(odrive_timeout);
-  if (o_init != 0)
-  {
-    status = o_init;
-    return status;
-  }
+void Actuator::begin_link(int odrive_timeout)
+{
+  status = 0;
+  odrive.begin();
+  m_link_timeout_us = (uint32_t)odrive_timeout * 1000;
+  link_phase(LINK_VOLTAGE, micros());
+}
+
+void Actuator::link_phase(LinkPhase phase, uint32_t now_us)
+{
+  m_link_phase = phase;
+  m_link_phase_us = now_us;
+}
 
-  // Runs encoder index search to find z index
-  Serial.println("Running encoder index search");
-  bool encoder_index_search = odrive.run_state(constant.actuator_motor_number, 6, true, 5);
-  Serial.println("Encoder index search complete, code: " + String(encoder_index_search));
-  // If successful, set ODRV to idle
-  if(!encoder_index_search) 
+bool Actuator::link_fresh(int property, uint32_t since_us)
+{
+  // Received after since_us, age_us is UINT32_MAX for nothing received
+  return odrive.age_us(property, constant.actuator_motor_number) <= micros() - since_us;
+}
+
+int Actuator::poll_link(uint32_t now_us)
+{
+  const int axis = constant.actuator_motor_number;
+  odrive.update();
+  switch (m_link_phase)
   {
-    odrive.run_state(constant.actuator_motor_number, 1, true, 1);
+    case LINK_DOWN: return k_link_busy;
+    case LINK_READY:
+    case LINK_FAILED: return status;
+
+    case LINK_VOLTAGE:
+      // The ODrive answers once it has booted
+      if (link_fresh(ODriveLink::VBUS_VOLTAGE, m_link_phase_us) && odrive.cached(ODriveLink::VBUS_VOLTAGE, axis) > 1)
+      {
+        // Runs encoder index search to find z index. It turns the motor onto the index, so
+        // restore_calibration gets where it rested before that.
+        m_rest = observe();
+        odrive.run_state(axis, 6, false, 0);
+        link_phase(LINK_INDEX, now_us);
+      }
+      else if (now_us - m_link_phase_us > m_link_timeout_us)
+      {
+        status = 13;
+        link_phase(LINK_FAILED, now_us);
+      }
+      else odrive.request(ODriveLink::VBUS_VOLTAGE, axis);
+      return k_link_busy;
+
+    case LINK_INDEX:
+      // Drops back to idle when it's done
+      if (now_us - m_link_phase_us < k_index_settle_us) return k_link_busy;
+      if (link_fresh(ODriveLink::CURRENT_STATE, m_link_phase_us + k_index_settle_us) &&
+          odrive.cached(ODriveLink::CURRENT_STATE, axis) == 1)
+      {
+        odrive.run_state(axis, 1, false, 0);
+        link_phase(LINK_LOCATE, now_us);
+      }
+      else if (now_us - m_link_phase_us > k_index_timeout_us)
+      {
+        status = 1003;
+        link_phase(LINK_FAILED, now_us);
+      }
+      else odrive.request(ODriveLink::CURRENT_STATE, axis);
+      return k_link_busy;
+
+    case LINK_LOCATE:
+      // Still idle, so both encoders read the same place
+      if (!link_fresh(ODriveLink::ENCODER_POS, m_link_phase_us))
+      {
+        odrive.request(ODriveLink::ENCODER_POS, axis);
+        return k_link_busy;
+      }
+      m_odrive_origin = encoder.read() - (int32_t)odrive.cached(ODriveLink::ENCODER_POS, axis);
+      link_phase(LINK_READY, now_us);
+      return status;
   }
-  else status = 1003;
-
   return status;
 }
 
-int* Actuator::homing_sequence(int* out)
+void Actuator::set_travel(int32_t inbound, int32_t outbound)
 {
-  // Returns an array of ints in format <status, inbound, outbound>
-  out[0] = 0;
+  m_encoder_inbound = inbound;
+  m_encoder_outbound = outbound;
+  m_estimator.set_travel(inbound, outbound);
+  m_soft_limits.set_outbound(outbound);
+  if (m_inbound_hits == 0) m_soft_limits.set_inbound(inbound);
+  m_calibrated = true;
+}
 
-  odrive.run_state(constant.actuator_motor_number, 8, false, 0);  // Enter velocity control mode
-  delay(1000);
+Calibration::Observed Actuator::observe()
+{
+  HallState hall = m_sensors->snapshot().hall;
+  Calibration::Observed observed;
+  observed.index = m_odrive_origin;
+  observed.position = encoder.read();
+  observed.hall_inbound = hall.inbound;
+  observed.hall_outbound = hall.outbound;
+  return observed;
+}
 
-  // Home outbound
-  int start = millis();
+bool Actuator::calibration(Calibration::Record& record)
+{
+  if (!m_calibrated || !link_ready()) return false;
+  record = Calibration::capture(constant.model, observe(), m_encoder_inbound, m_encoder_outbound);
+  return true;
+}
+
+Calibration::Config Actuator::calibration_config() const
+{
+  Calibration::Config config;
+  config.model = constant.model;
+  config.counts_per_turn = constant.encoder_counts_per_turn;
+  config.tolerance = constant.calibration_tolerance;
+  config.margin = constant.calibration_margin;
+  return config;
+}
 
-  odrive.set_velocity(constant.actuator_motor_number, 2);
+int Actuator::restore_calibration(const Calibration::Record& record)
+{
+  if (!link_ready()) return Calibration::k_no_index;
+  Calibration::Observed rest = m_rest;
+  rest.index = m_odrive_origin;
+  Calibration::Restored restored;
+  int result = Calibration::restore(calibration_config(), record, rest, restored);
+  if (result == Calibration::k_ok) set_travel(restored.inbound, restored.outbound);
+  return result;
+}
 
-  while (digitalReadFast(constant.hall_outbound_pin) == 1)
+int* Actuator::homing_sequence(int* out)
+{
+  // Returns an array of ints in format <status, inbound, outbound>
+  // Another motion running isn't a homing result
+  if (start_homing())
   {
-    delay(10);
-    if (digitalReadFast(constant.hall_outbound_pin) == 0)
-    {
-      break;
-    }
-    m_encoder_outbound = odrive.get_encoder_pos(constant.actuator_motor_number);
-    if (millis() - start > constant.homing_timeout)
-    {
-      out[0] = 2;
-      odrive.run_state(constant.actuator_motor_number, 1, false, 0);
-      out[1], out[2] = -1;
-      return out;
-    }
+    run_motion();
+    out[0] = m_motion.status();
+  }
+  else out[0] = MotionSequencer::k_busy;
+  if (out[0] != MotionSequencer::k_ok)
+  {
+    out[1] = -1;
+    out[2] = -1;
+    return out;
   }
-  odrive.set_velocity(constant.actuator_motor_number, 0);         // Stop spinning after homing
-  // odrive.run_state(constant.actuator_motor_number, 1, false, 0);  // Idle state
-  // digitalWrite(LED_BUILTIN, LOW);
-
-  m_encoder_inbound = m_encoder_outbound - constant.encoder_count_shift_length;
-
-
   out[1] = m_encoder_inbound;
   out[2] = m_encoder_outbound;
   return out;
@@ -117,264 +211,462 @@ int* Actuator::homing_sequence(int* out)
 
 int* Actuator::control_function(int* out)
 {
+  // Rate is set by whoever calls this (the Scheduler), dt is measured rather than assumed
   uint32_t timestamp = millis();
-  
-  uint32_t dt = timestamp - m_last_control_execution;
-  if (dt < constant.cycle_period)
-  {
-    out[STATUS] = 3;
-    return out;
-  }
-  m_last_control_execution = timestamp;
+  uint32_t timestamp_us = micros();
+  float dt = m_control_function_count == 0 ? constant.cycle_period
+                                           : (timestamp_us - m_last_control_execution) / 1000.0f;  // ms
+  m_last_control_execution = timestamp_us;
 
   m_control_function_count++;
+  PROFILE_LAPS(laps);
+
+  // Everything the interrupts published, read once so the whole cycle works off the same state.
+  // The stop counts go first, a hall stop landing after the snapshot makes this cycle's setpoint stale.
+  uint32_t actuator_stops = odrive.stops(constant.actuator_motor_number);
+  uint32_t cooling_stops = odrive.stops(constant.cooling_motor_number);
+  SensorSnapshot sensors = m_sensors->snapshot();
+  // Parameter changes only land between cycles
+  const Parameters& params = m_parameters->active();
+  PROFILE_LAP(laps, profile::k_snapshot);
+
+  float eg_rpm = calc_engine_rpm();
+  PROFILE_LAP(laps, profile::k_engine_rpm);
+  float gb_rpm = calc_gearbox_rpm();
+  PROFILE_LAP(laps, profile::k_gearbox_rpm);
+
+  m_gearbox_filters.set_alpha(params.exponential_filter_alpha);
+  const GearboxFilters::Outputs& gb_filtered = m_gearbox_filters.update(gb_rpm);
+  float gb_rolling = gb_filtered.average;
+  PROFILE_LAP(laps, profile::k_filters);
+  const StateEstimate& estimate = m_estimator.update(estimator_input(eg_rpm, gb_rpm, sensors, dt * 1000), dt / 1000.0f);
+  PROFILE_LAP(laps, profile::k_estimator);
+
+  float ref_rpm = calc_reference_rpm(gb_rolling, params);
+
+  // Feed-forward: the reference asks for a ratio of ref / gb, which moves as the car speeds up.
+  // d(ref / gb)/dt = (slope * gb - ref) / gb^2 * d(gb)/dt, zero where the curve holds a fixed ratio
+  float dt_s = dt / 1000.0f;
+  float ratio_rate = 0;
+  if (gb_rolling >= params.gearbox_engage_rpm)
+  {
+    // The estimator's acceleration, differencing the rolling average lags it by half the window
+    float gb_accel = estimate.gearbox_accel;
+    ratio_rate = (calc_reference_slope(gb_rolling, params) * gb_rolling - ref_rpm) / (gb_rolling * gb_rolling) * gb_accel;
+  }
+  PROFILE_LAP(laps, profile::k_reference);
 
-  float eg_rpm = calc_engine_rpm(dt);
-  float gb_rpm = calc_gearbox_rpm(dt);
-
-  float gb_rolling = calc_gearbox_rpm_rolling(gb_rpm);
-  float gb_exp_decay = calc_gearbox_rpm_exponential(gb_rpm);
-
-  float ref_rpm = calc_reference_rpm(m_gb_rolling);
+  // Stop shifting out if shifted out completely (and in if in)
+  bool outbound_signal = sensors.hall.outbound;
+  bool inbound_signal = sensors.hall.inbound;
+  int blocked = 0;
+  if (outbound_signal) blocked |= PidController::k_block_positive;
+  if (inbound_signal) blocked |= PidController::k_block_negative;
 
-  float error = ref_rpm - eg_rpm;
+  update_soft_limits(sensors.hall);
 
-  // Stop shifting out if shifted out completely
-  bool outbound_signal = !digitalReadFast(constant.hall_outbound_pin);
-  bool inbound_signal = !digitalReadFast(constant.hall_inbound_pin);
-  if (outbound_signal && error > 0) error = 0;
-  if (inbound_signal && error < 0) error = 0;
+  // A tripped e-stop ends any motion and holds both axes idle until it is reset, the PID starts
+  // over from where the actuator ends up
+  bool estop = m_estop != nullptr && m_estop->tripped();
+  if (estop)
+  {
+    m_motion.abort();
+    m_pid.reset();
+  }
 
-  // Calculate control signal
-  float motor_velocity = constant.proportional_gain * error;
+  // Calculate control signal, a homing or full shift takes over until it ends
+  float motor_velocity;
+  int odrive_state = MotionSequencer::k_state_closed_loop;
+  bool stop_now = false;
+  bool moving = m_motion.active();
+  if (estop)
+  {
+    if (moving) step_motion(sensors, timestamp_us);  // only finishes the abort
+    motor_velocity = 0;
+    odrive_state = MotionSequencer::k_state_idle;
+  }
+  else if (moving)
+  {
+    const MotionSequencer::Command& command = step_motion(sensors, timestamp_us);
+    motor_velocity = command.velocity;
+    odrive_state = command.state;
+    stop_now = command.stop;
+  }
+  else if (m_motion.state() == MotionSequencer::FAILED)
+  {
+    // Stays stopped after a motion failed or was aborted, until the next one starts
+    motor_velocity = 0;
+    odrive_state = MotionSequencer::k_state_idle;
+  }
+  else
+  {
+    // Slowing down ahead of the ends of travel the hall sensors marked
+    int32_t position = encoder.read();
+    m_pid.configure(pid_config(params));
+    motor_velocity = m_pid.update(ref_rpm, eg_rpm, ratio_rate, dt_s, blocked,
+                                  m_soft_limits.max_outbound_speed(position), m_soft_limits.max_inbound_speed(position));
+  }
+  m_commanded_velocity = motor_velocity;
+  PROFILE_LAP(laps, profile::k_pid);
+
+  // A stop goes out now, any other setpoint with update(). Only sends a state that changed or didn't stick.
+  if (stop_now) odrive.set_velocity(constant.actuator_motor_number, motor_velocity);
+  else odrive.queue_velocity(constant.actuator_motor_number, motor_velocity, actuator_stops);
+  odrive.run_state(constant.actuator_motor_number, odrive_state, false, 0);
+  if (m_cooling_enabled || estop)
+  {
+    float cooling_velocity = estop ? 0 : m_cooling_velocity;
+    odrive.queue_velocity(constant.cooling_motor_number, cooling_velocity, cooling_stops);
+    odrive.run_state(constant.cooling_motor_number,
+                     cooling_velocity != 0 ? MotionSequencer::k_state_closed_loop : MotionSequencer::k_state_idle,
+                     false, 0);
+  }
 
-  odrive.set_velocity(constant.actuator_motor_number, motor_velocity);
-  odrive.run_state(constant.actuator_motor_number, 8, false, 0);
+  // Queue this cycle's reads and use whatever arrived so far instead of waiting on the replies
+  odrive.request(ODriveLink::ENCODER_POS, constant.actuator_motor_number);
+  odrive.request(ODriveLink::VELOCITY, constant.actuator_motor_number);
+  odrive.request(ODriveLink::VBUS_VOLTAGE, 0);
+  odrive.request(ODriveLink::IBUS_CURRENT, 0);
+  if (m_control_function_count % constant.state_poll_cycles == 0 ||
+      m_motion.state() == MotionSequencer::ENTER_CLOSED_LOOP)
+  {
+    odrive.request(ODriveLink::CURRENT_STATE, constant.actuator_motor_number);
+  }
+  if (m_cooling_enabled && m_control_function_count % constant.state_poll_cycles == 0)
+  {
+    odrive.request(ODriveLink::CURRENT_STATE, constant.cooling_motor_number);
+  }
+  odrive.update();
+  // By now the interrupt's stop is out, even one that had to wait for a write this cycle made
+  if (estop) m_estop->stopped(odrive.idle_written_us(constant.actuator_motor_number));
+  PROFILE_LAP(laps, profile::k_odrive);
 
   // Logging
   // TODO: calculate status
   out[STATUS] = 0;  // Nominal
   if (outbound_signal) out[STATUS] = 1;  // Outbound
   if (inbound_signal) out[STATUS] = 2;  // Inbound
+  if (moving) out[STATUS] = 3;  // Homing or fully shifting
+  else if (m_motion.state() == MotionSequencer::FAILED) out[STATUS] = 4;  // Held after a failed motion
+  if (estop) out[STATUS] = 5;  // Held by the e-stop
   
   out[RPM] = eg_rpm;
-  out[RPM_COUNT] = *m_eg_tooth_count;
+  out[RPM_COUNT] = sensors.engine.count;
   out[DT] = dt;
   out[ACT_VEL] = motor_velocity;
-  out[ENC_POS] = odrive.get_encoder_pos(constant.actuator_motor_number);
+  out[ENC_POS] = odrive.cached(ODriveLink::ENCODER_POS, constant.actuator_motor_number);
   out[HALL_IN] = inbound_signal;
   out[HALL_OUT] = outbound_signal;
   out[T_START] = timestamp;
-  out[ODRV_VOLT] = odrive.get_voltage();
-  out[ODRV_CUR] = odrive.get_cur();
+  out[ODRV_VOLT] = odrive.cached(ODriveLink::VBUS_VOLTAGE, 0);
+  out[ODRV_CUR] = odrive.cached(ODriveLink::IBUS_CURRENT, 0);
+  uint32_t encoder_age = odrive.age_us(ODriveLink::ENCODER_POS, constant.actuator_motor_number);
+  out[ODRV_AGE] = encoder_age > INT32_MAX ? INT32_MAX : encoder_age;
+  out[GB_RPM] = gb_rpm;
   out[ROLLING_FRAME] = gb_rolling;
-  out[EXP_DECAY] = gb_exp_decay;
+  out[EXP_DECAY] = gb_filtered.exponential;
+  out[GB_MEDIAN] = gb_filtered.median;
+  out[EST_EG_RPM] = estimate.engine_rpm;
+  out[EST_GB_RPM] = estimate.gearbox_rpm;
+  out[EST_RATIO] = estimate.ratio * 1000;
   out[REF_RPM] = ref_rpm;
+  out[PID_P] = m_pid.proportional() * 1000;
+  out[PID_I] = m_pid.integral() * 1000;
+  out[PID_D] = m_pid.derivative() * 1000;
+  out[PID_FF] = m_pid.feed_forward() * 1000;
   out[T_STOP] = millis();
+  PROFILE_LAP(laps, profile::k_log_fill);
 
   return out;
 }
 
 //----------------Geartooth Functions----------------//
 
-float Actuator::calc_gearbox_rpm(float dt)
-// Secondary rpm
+float Actuator::calc_gearbox_rpm()
+// Secondary rpm, from the period of the last few gear teeth
 {
-  noInterrupts();
-  float rps = float(*m_gb_tooth_count - m_last_gb_tooth_count) / dt;
-  rps *= 6.0/17.0;
-  float rpm = rps * 1000.0 * 60.0;
-  m_last_gb_tooth_count = *m_gb_tooth_count;
-  interrupts();
-  return rpm;
+  return m_sensors->gearbox().rpm();
 }
 
-float Actuator::calc_gearbox_rpm_rolling(float new_rpm)
-// Calculate the avg gearbox rpm
-// Will automatically calculate the new rpm, then calculate the avg with a queue
+EstimatorInput Actuator::estimator_input(float eg_rpm, float gb_rpm, const SensorSnapshot& sensors, uint32_t dt_us)
+// A tooth reading only counts as new if teeth came in or it changed (slowing down, stalled)
 {
-  m_gearbox_frames_average += (new_rpm - m_gearbox_rpm_frames.front()) / constant.gearbox_rolling_frames;
-  m_gearbox_rpm_frames.pop();
-  m_gearbox_rpm_frames.push(new_rpm);
-  return m_gearbox_frames_average;
+  EstimatorInput input;
+  input.engine_rpm = eg_rpm;
+  input.engine_age_s = m_sensors->engine().age_us() * 1e-6f;
+  input.engine_fresh = sensors.engine.count != m_last_eg_count || eg_rpm != m_last_eg_rpm;
+  input.gearbox_rpm = gb_rpm;
+  input.gearbox_age_s = m_sensors->gearbox().age_us() * 1e-6f;
+  input.gearbox_fresh = sensors.gearbox.count != m_last_gb_count || gb_rpm != m_last_gb_rpm;
+  m_last_eg_count = sensors.engine.count;
+  m_last_gb_count = sensors.gearbox.count;
+  m_last_eg_rpm = eg_rpm;
+  m_last_gb_rpm = gb_rpm;
+
+  // Replies from the requests queued last cycle
+  input.encoder_count = encoder.read();
+  uint32_t odrive_age = odrive.age_us(ODriveLink::ENCODER_POS, constant.actuator_motor_number);
+  input.odrive_fresh = odrive_age < dt_us &&
+                       odrive.age_us(ODriveLink::VELOCITY, constant.actuator_motor_number) < dt_us;
+  input.odrive_count = odrive.cached(ODriveLink::ENCODER_POS, constant.actuator_motor_number) + m_odrive_origin;
+  input.odrive_velocity = odrive.cached(ODriveLink::VELOCITY, constant.actuator_motor_number);
+  input.odrive_age_s = odrive_age * 1e-6f;
+  return input;
 }
 
-float Actuator::calc_gearbox_rpm_exponential(float new_rpm)
+float Actuator::calc_engine_rpm()
 {
-  float alpha = 0.05;
-  float output = new_rpm * alpha + m_old_rpm * (1 - alpha);
-  m_old_rpm = output;
-  return output;
+  return m_sensors->engine().rpm();
 }
 
-float Actuator::calc_engine_rpm(float dt)
+float Actuator::calc_reference_rpm(float gearbox_rpm, const Parameters& params)
+// Shift profile picked by the reference_profile parameter, see ParameterStore::derive
 {
-  noInterrupts();
-  float freq_in_minutes = 1000 * 60 / dt;
-  float rpm = (float(*m_eg_tooth_count - m_last_eg_tooth_count) / constant.eg_teeth_per_rotation) * freq_in_minutes;
-  m_last_eg_tooth_count = *m_eg_tooth_count;
-  interrupts();
-  return rpm;
+  return params.curves[params.profile].evaluate(gearbox_rpm);
 }
 
-float Actuator::calc_reference_rpm(float gearbox_rpm)
-// Implemented according to a reference drawing John drew up
+float Actuator::calc_reference_slope(float gearbox_rpm, const Parameters& params)
+// d(reference)/d(gearbox rpm) of calc_reference_rpm
 {
-  float output;
-  // Region 1: Before belt slip, so hold at engage rpm
-  if (gearbox_rpm < constant.gearbox_engage_rpm)
-  {
-    output = constant.engine_engage;
-  }
-  // Region 2: Acceleration zone
-  else if (gearbox_rpm < constant.gearbox_power_rpm)
-  {
-    output = gearbox_rpm * constant.ecvt_max_ratio;
-  }
-  // Region 3: Shifting zone
-  else if (gearbox_rpm < constant.gearbox_overdrive_rpm)
-  {
-    output = constant.engine_power;
-  }
-  // Region 4: Overdrive zone
-  else
-  {
-    output = gearbox_rpm * constant.overdrive_ratio;
-  }
+  return params.curves[params.profile].slope(gearbox_rpm);
+}
 
-  return output;
+PidController::Config Actuator::pid_config(const Parameters& params)
+{
+  PidController::Config config;
+  config.kp = params.proportional_gain;
+  config.ki = params.integral_gain;
+  config.kd = params.derivative_gain;
+  config.kff = params.feed_forward_gain;
+  config.derivative_time_constant = params.derivative_filter_time;
+  config.integral_limit = params.integral_limit;
+  config.output_limit = params.actuator_velocity_limit;
+  config.rate_limit = params.actuator_acceleration_limit;
+  return config;
 }
 
 //-----------------Diagnostic Functions--------------//
 
-String Actuator::diagnostic(bool main_power, int dt, bool print_serial = true)
+void Actuator::sample_diagnostic(diagnostic::Sample& sample)
+// Copies what the interrupts published and the last cycle left behind, changes nothing
 {
-  // General diagnostic tool to record sensor readings as well as some odrive info
-  m_serial_dt = millis() - m_last_serial_execution;
-  m_last_serial_execution = millis();
-  String output = "";
-  output += "-----------------------------\n";
-  output += "Time: " + String(millis()) + "\n";
-  if (main_power)
-  {
-    output += "Odrive voltage: " + String(odrive.get_voltage()) + "\n";
-    output += "Odrive speed: " + String(odrive.get_vel(constant.actuator_motor_number)) + "\n";
-    output += "Encoder count: " + String(odrive.get_encoder_pos(constant.actuator_motor_number)) + "\n";
-  }
-  output += "Outbound limit: " + String(m_encoder_outbound) + "\n";
-  output += "Inbound limit: " + String(m_encoder_inbound) + "\n";
-  output += "Outbound reading: " + String(digitalReadFast(constant.hall_outbound_pin)) + "\n";
-  output += "Inbound reading: " + String(digitalReadFast(constant.hall_inbound_pin)) + "\n";
-  output += "dt term: " + String(m_serial_dt) + "\n";
-  output += "Engine Gear Tooth Count: " + String(*m_eg_tooth_count) + "\n";
-  output += "Engine RPM: " + String(calc_engine_rpm(m_serial_dt)) + "\n";
-  output += "Gearbox gear tooth count: " + String(*m_gb_tooth_count) + "\n";
-  float gearbox_rpm = calc_gearbox_rpm(m_serial_dt);
-  output += "Gearbox RPM: " + String(gearbox_rpm) + "\n";
-  output += "Gearbox RPM Rolling: " + String(calc_gearbox_rpm_rolling(gearbox_rpm)) + "\n";
-  output += "Gearbox RPM Exponential: " + String(calc_gearbox_rpm_exponential(gearbox_rpm)) + "\n";
-  output += "Estop Signal: " + String(digitalRead(36)) + "\n";
-  // output = String(gearbox_rpm) + ", " + String(calc_gearbox_rpm_rolling(gearbox_rpm)) + ", " + String(calc_gearbox_rpm_exponential(gearbox_rpm)) + "\n";
-  // output = String(millis()/10.0 - 100) + ", " + String(calc_reference_rpm(millis()/10.0-100)) + "\n";
-  if (print_serial)
+  memset(&sample, 0, sizeof(sample));
+  sample.time_us = micros();
+  SensorSnapshot sensors = m_sensors->snapshot();
+  sample.engine_count = sensors.engine.count;
+  sample.engine_edge_us = sensors.engine.last_edge_us;
+  sample.gearbox_count = sensors.gearbox.count;
+  sample.gearbox_edge_us = sensors.gearbox.last_edge_us;
+
+  sample.engine_rpm = m_last_eg_rpm;
+  sample.gearbox_rpm = m_last_gb_rpm;
+  const GearboxFilters::Outputs& filtered = m_gearbox_filters.outputs();
+  sample.gearbox_average = filtered.average;
+  sample.gearbox_median = filtered.median;
+  sample.gearbox_exponential = filtered.exponential;
+  sample.commanded_velocity = m_commanded_velocity;
+
+  int axis = constant.actuator_motor_number;
+  sample.odrive_voltage = odrive.cached(ODriveLink::VBUS_VOLTAGE, 0);
+  sample.odrive_current = odrive.cached(ODriveLink::IBUS_CURRENT, 0);
+  sample.odrive_velocity = odrive.cached(ODriveLink::VELOCITY, axis);
+  sample.odrive_position = odrive.cached(ODriveLink::ENCODER_POS, axis);
+  uint32_t ages[] = {odrive.age_us(ODriveLink::VBUS_VOLTAGE, 0), odrive.age_us(ODriveLink::IBUS_CURRENT, 0),
+                     odrive.age_us(ODriveLink::VELOCITY, axis), odrive.age_us(ODriveLink::ENCODER_POS, axis)};
+  sample.odrive_age_us = 0;
+  for (uint32_t age : ages)
   {
-    Serial.print(output);
+    if (age > sample.odrive_age_us) sample.odrive_age_us = age;
   }
-  return output;
+
+  sample.encoder_count = encoder.read();
+  sample.encoder_inbound = m_encoder_inbound;
+  sample.encoder_outbound = m_encoder_outbound;
+  sample.hall_inbound_count = sensors.hall.inbound_count;
+  sample.hall_outbound_count = sensors.hall.outbound_count;
+  sample.hall_changes = sensors.hall.changes;
+  sample.hall_inbound = sensors.hall.inbound;
+  sample.hall_outbound = sensors.hall.outbound;
+  sample.estop_pin = digitalReadFast(constant.estop_pin);
+  sample.estop_pressed = m_estop != nullptr && m_estop->tripped();
+  sample.motion_state = m_motion.state();
+  sample.motion_status = m_motion.status();
+}
+
+void Actuator::request_diagnostic_reads()
+// Without the control step nothing else asks the ODrive, so the diagnostic loop does
+{
+  odrive.request(ODriveLink::ENCODER_POS, constant.actuator_motor_number);
+  odrive.request(ODriveLink::VELOCITY, constant.actuator_motor_number);
+  odrive.request(ODriveLink::VBUS_VOLTAGE, 0);
+  odrive.request(ODriveLink::IBUS_CURRENT, 0);
+  odrive.update();
 }
 
 float Actuator::communication_speed()
 {
-  // Tests communication speed with the odrive and returns the result as a float
+  // Mean time of one blocking vel_estimate round trip with the odrive, in ms
   const int data_points = 1000;
-  int com_start = 0;
-  int com_end = 0;
-  int com_total = 0;
-  int com_bench = 0;
-  // float test = 0;
   odrive.run_state(constant.actuator_motor_number, 8, false, 0);
   odrive.set_velocity(constant.actuator_motor_number, .5);
   delay(1000);
 
-  // Benchmark
+  // Cost of the timing itself
+  uint32_t bench_start = micros();
   for (int i = 0; i < data_points; i++)
   {
-    com_start = millis();
-    com_end = millis();
-    com_bench += com_end - com_start;
+    (void)micros();
   }
-
-  Serial.println(com_bench);
+  uint32_t com_bench = micros() - bench_start;
 
   // With command to odrive
+  float sink = 0;
+  uint32_t com_start = micros();
   for (int i = 0; i < data_points; i++)
   {
-    com_start = millis();
-
-    // command to odrive
-    // test = odrive.get_vel(motor_number);
-
-    com_end = millis();
-    com_total += com_end - com_start;
+    sink += odrive.get_vel(constant.actuator_motor_number);
+    (void)micros();
   }
-  Serial.println(com_total);
+  uint32_t com_total = micros() - com_start;
+  Serial.println("odrive round trips: " + String(com_total) + " us, timing overhead: " + String(com_bench) +
+                 " us, mean velocity: " + String(sink / data_points));
+
   odrive.set_velocity(constant.actuator_motor_number, 0);  // Stop spinning after homing
   odrive.run_state(constant.actuator_motor_number, 1, false, 0);
 
-  return float(com_total - com_bench) / float(data_points);
+  return float(com_total - com_bench) / data_points / 1000.0f;
 }
 
 float Actuator::get_p_value()
 {
-  return constant.proportional_gain;
+  return m_parameters->active().proportional_gain;
 }
 
-String Actuator::odrive_errors()
+void Actuator::odrive_errors(Print& out)
 {
-  return odrive.dump_errors();
+  odrive.dump_errors(out);
 }
 
 int Actuator::fully_shift(bool direction, int timeout)
 {
-  // Shifts the motor all the way in or out
+  // Shifts the motor all the way in or out and leaves it idle, returns the motion status
   // direction = true is in, false is out
-  int speed;
-  int software_limit_pin;
-  if (direction) {
-    speed = -2;
-    software_limit_pin = constant.hall_inbound_pin;
-  }
-  else {
-    speed = 2;
-    software_limit_pin = constant.hall_outbound_pin;
+  if (!start_shift(direction, timeout)) return MotionSequencer::k_busy;
+  run_motion();
+  odrive.run_state(constant.actuator_motor_number, 1, false, 0);  // Idle state
+  return m_motion.status();
+}
+
+//-----------------Homing and Full Shifts--------------//
+
+bool Actuator::start_homing()
+{
+  // The control step may be stepping m_motion from the timer interrupt
+  noInterrupts();
+  bool started = !m_motion.active();
+  if (started)
+  {
+    m_motion.configure(motion_config(constant.homing_timeout));
+    m_motion.start(MotionSequencer::HOME, micros());
   }
-  int status = 0;
-  // int start_time = millis();
+  interrupts();
+  return started;
+}
 
-  odrive.run_state(constant.actuator_motor_number, 8, false, 0);  // Enter velocity control mode
-  delay(1000);
+bool Actuator::start_shift(bool inbound, int timeout)
+{
+  noInterrupts();
+  bool started = !m_motion.active();
+  if (started)
+  {
+    m_motion.configure(motion_config(timeout));
+    m_motion.start(inbound ? MotionSequencer::SHIFT_IN : MotionSequencer::SHIFT_OUT, micros());
+  }
+  interrupts();
+  return started;
+}
 
-  // Home outbound
-  int start = millis();
+MotionSequencer::Config Actuator::motion_config(int timeout)
+{
+  MotionSequencer::Config config;
+  config.speed = constant.homing_speed;
+  config.back_off_speed = constant.homing_back_off_speed;
+  config.closed_loop_timeout_us = constant.closed_loop_timeout * 1000UL;
+  config.timeout_us = timeout * 1000UL;
+  return config;
+}
 
-  odrive.set_velocity(constant.actuator_motor_number, speed);
+const MotionSequencer::Command& Actuator::step_motion(const SensorSnapshot& sensors, uint32_t now_us)
+{
+  MotionSequencer::Input input;
+  input.now_us = now_us;
+  input.hall = sensors.hall;
+  input.odrive_state = odrive.cached(ODriveLink::CURRENT_STATE, constant.actuator_motor_number);
+  input.odrive_state_age_us = odrive.age_us(ODriveLink::CURRENT_STATE, constant.actuator_motor_number);
+  const MotionSequencer::Command& command = m_motion.step(input);
+  if (m_motion.active()) return command;
+
+  // Where the outbound sensor latched is the outbound limit, the estimator gets the ODrive count
+  // moved onto the Teensy encoder's origin (see StateEstimator)
+  if (m_motion.kind() == MotionSequencer::HOME && m_motion.status() == MotionSequencer::k_ok)
+  {
+    int32_t outbound = m_motion.latched_count();
+    set_travel(outbound - constant.encoder_count_shift_length, outbound);
+  }
+  // The PID picks up from a standstill once a motion succeeded
+  m_pid.reset();
+  return command;
+}
 
-  while (digitalReadFast(software_limit_pin) == 1)
+void Actuator::update_soft_limits(const HallState& hall)
+// A new edge on a sensor moves that soft limit to where it latched
+{
+  if (hall.inbound_hits != m_inbound_hits)
   {
-    delay(10);
-    if (digitalReadFast(constant.hall_outbound_pin) == 0)
-    {
-      break;
-    }
-    if (millis() - start > constant.homing_timeout)
-    {
-      status = 1;
-      odrive.run_state(constant.actuator_motor_number, 1, false, 0);
-      return status;
-    }
+    m_inbound_hits = hall.inbound_hits;
+    m_soft_limits.set_inbound(hall.inbound_count);
   }
-  odrive.set_velocity(constant.actuator_motor_number, 0);         // Stop spinning after homing
-  odrive.run_state(constant.actuator_motor_number, 1, false, 0);  // Idle state
+  if (hall.outbound_hits != m_outbound_hits)
+  {
+    m_outbound_hits = hall.outbound_hits;
+    m_soft_limits.set_outbound(hall.outbound_count);
+  }
+}
 
-  return status;
-}
\ No newline at end of file
+void Actuator::on_limit(int hits)
+{
+  // Positive velocity is outbound
+  float velocity = m_commanded_velocity;
+  bool into_outbound = (hits & Sensors::k_outbound_hit) && velocity > 0;
+  bool into_inbound = (hits & Sensors::k_inbound_hit) && velocity < 0;
+  if (into_outbound || into_inbound) odrive.stop_now(constant.actuator_motor_number);
+}
+
+void Actuator::on_estop()
+{
+  if (m_estop == nullptr) return;
+  m_estop->press(micros());
+  odrive.stop_now(constant.actuator_motor_number, true);
+  odrive.stop_now(constant.cooling_motor_number, true);
+  // Written right here unless another write held the port, then whoever held it sends it and
+  // the control step or the background records it
+  m_estop->stopped(odrive.idle_written_us(constant.actuator_motor_number));
+}
+
+void Actuator::set_cooling_velocity(float velocity)
+{
+  // Picked up by the next control cycle
+  m_cooling_velocity = velocity;
+  m_cooling_enabled = true;
+}
+
+void Actuator::run_motion()
+// Steps the control function until the motion ends, for callers that may block
+{
+  int out[30];
+  while (m_motion.active())
+  {
+    control_function(out);
+    delay(constant.cycle_period);
+  }
+}
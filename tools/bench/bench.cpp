@@ -0,0 +1,808 @@
+/*
+Host benchmark suite for the control stack
+Times the hot paths of the control step on the host, counts heap allocations per operation
+and checks that the replacements still match what they replaced:
+- control_function: one whole control cycle against the simulated ODrive and car
+- engine / gearbox tooth rpm, the gearbox filters (and the std::queue average they replaced),
+  the state estimator
+- reference rpm: the ReferenceCurve table and the four region function it replaced
+- log record: the old text log line and the binary telemetry record
+- diagnostic frame: framing one diagnostic sample for USB serial
+- thermistor: one ADC code to C through the ThermistorTable and through the beta equation
+- odrive exchange: queueing, sending and parsing one cycle's four ODrive reads
+- reply parse: one ODrive reply through ReplyParser and through the String based reads it replaced
+
+usage: bench [--ops-scale X] [--drift-samples N] [--json file] [--label text]
+             [--baseline file] [--tolerance T] [--budget-ns N]
+
+Each result is the median of several repeats and every input is seeded, so two runs on the
+same machine agree to a few percent. --json writes the results to track them across commits,
+--baseline compares against such a file and fails on anything more than T (default 0.25)
+slower or allocating more. --budget-ns fails if control_function takes longer than that.
+Exit code is non-zero if a check or a comparison fails.
+*/
+
+#include <Actuator.h>
+#include <Constant.h>
+#include <CvtPlant.h>
+#include <DiagnosticStream.h>
+#include <Filters.h>
+#include <Hal.h>
+#include <ODrive.h>
+#include <ODriveSim.h>
+#include <ParameterStore.h>
+#include <ReferenceCurve.h>
+#include <ReplyParser.h>
+#include <Sensors.h>
+#include <StateEstimator.h>
+#include <Telemetry.h>
+#include <Thermistor.h>
+#include <ToothSensor.h>
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <new>
+#include <queue>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+//-----------------Allocation counting--------------//
+static uint64_t s_allocations = 0;
+
+void* operator new(size_t size)
+{
+  s_allocations++;
+  void* p = malloc(size ? size : 1);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+void* operator new[](size_t size)
+{
+  s_allocations++;
+  void* p = malloc(size ? size : 1);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+//-----------------Harness--------------//
+const int k_repeats = 5;
+
+// Only the time and allocations between start() and stop() count, set up goes in between.
+// What a start() / stop() pair costs by itself is taken off again, see s_lap_overhead_ns.
+class Stopwatch
+{
+public:
+  void start()
+  {
+    m_allocations_start = s_allocations;
+    m_start = std::chrono::steady_clock::now();
+  }
+  void stop()
+  {
+    auto end = std::chrono::steady_clock::now();
+    m_ns += std::chrono::duration<double, std::nano>(end - m_start).count();
+    m_allocations += s_allocations - m_allocations_start;
+    m_laps++;
+  }
+  double ns() const { return m_ns; }
+  uint64_t laps() const { return m_laps; }
+  uint64_t allocations() const { return m_allocations; }
+
+private:
+  std::chrono::steady_clock::time_point m_start;
+  uint64_t m_allocations_start = 0;
+  double m_ns = 0;
+  uint64_t m_allocations = 0;
+  uint64_t m_laps = 0;
+};
+
+struct Result
+{
+  std::string name;
+  double ns_per_op;
+  double allocations_per_op;
+  long ops;
+};
+
+static std::vector<Result> s_results;
+static double s_ops_scale = 1;
+
+// Keeps the compiler from dropping the loops
+static volatile float s_sink;
+
+static double s_lap_overhead_ns = 0;
+
+// Median cost of an empty start() / stop() pair
+static double lap_overhead_ns()
+{
+  const int k_laps = 100000;
+  double ns[k_repeats];
+  for (int r = 0; r < k_repeats; r++)
+  {
+    Stopwatch stopwatch;
+    for (int i = 0; i < k_laps; i++)
+    {
+      stopwatch.start();
+      stopwatch.stop();
+    }
+    ns[r] = stopwatch.ns() / k_laps;
+  }
+  std::sort(ns, ns + k_repeats);
+  return ns[k_repeats / 2];
+}
+
+// body(ops, stopwatch) does ops operations, a warm up run first and then the median of the repeats
+template <typename F>
+static void measure(const char* name, long ops, F body)
+{
+  ops = std::max(1L, (long)(ops * s_ops_scale));
+  Stopwatch warm_up;
+  body(std::max(1L, ops / 10), warm_up);
+
+  double ns[k_repeats];
+  uint64_t allocations = 0;
+  for (int r = 0; r < k_repeats; r++)
+  {
+    Stopwatch stopwatch;
+    body(ops, stopwatch);
+    ns[r] = std::max(0.0, stopwatch.ns() - stopwatch.laps() * s_lap_overhead_ns) / ops;
+    allocations += stopwatch.allocations();
+  }
+  std::sort(ns, ns + k_repeats);
+  Result result = {name, ns[k_repeats / 2], double(allocations) / (double(ops) * k_repeats), ops};
+  printf("%-24s %10.1f ns/op %8.3f allocs/op\n", name, result.ns_per_op, result.allocations_per_op);
+  s_results.push_back(result);
+}
+
+//-----------------Control cycle--------------//
+Constant constant;
+
+// Same sensors and interrupts as main.cpp
+static ToothSensor* s_eg_teeth = nullptr;
+static ToothSensor* s_gb_teeth = nullptr;
+static Sensors* s_sensors = nullptr;
+
+void external_count_eg_tooth()
+{
+  s_eg_teeth->on_edge();
+}
+void external_count_gb_tooth()
+{
+  s_gb_teeth->on_edge();
+}
+void external_hall_change()
+{
+  s_sensors->on_hall_change();
+}
+
+struct World
+{
+  ODriveSim* odrive;
+  CvtPlant* plant;
+};
+
+static void step_world(void* context, uint64_t now_us)
+{
+  World* world = (World*)context;
+  world->odrive->step(now_us);
+  world->plant->step(now_us);
+}
+
+// A fresh car launched at full throttle. The car only moves between cycles: during the timed
+// call the world is unhooked, so time control_function spends waiting on the port doesn't
+// step the plant and only the firmware's own work is counted.
+static void bench_control_function(long ops, Stopwatch& stopwatch)
+{
+  hal::sim::reset();
+  hal::sim::set_step_us(20);
+  ToothSensor eg_teeth(Constant::eg_teeth_per_rotation, Constant::eg_rpm_window_teeth, Constant::tooth_stall_timeout);
+  ToothSensor gb_teeth(Constant::gb_teeth_per_rotation, Constant::gb_rpm_window_teeth, Constant::tooth_stall_timeout);
+  s_eg_teeth = &eg_teeth;
+  s_gb_teeth = &gb_teeth;
+  Sensors sensors(constant, eg_teeth, gb_teeth);
+  s_sensors = &sensors;
+  pinMode(constant.engine_geartooth_pin, INPUT_PULLUP);
+  pinMode(constant.gearbox_geartooth_pin, INPUT_PULLUP);
+  attachInterrupt(constant.engine_geartooth_pin, external_count_eg_tooth, FALLING);
+  attachInterrupt(constant.gearbox_geartooth_pin, external_count_gb_tooth, FALLING);
+  pinMode(constant.hall_inbound_pin, INPUT_PULLUP);
+  pinMode(constant.hall_outbound_pin, INPUT_PULLUP);
+  attachInterrupt(constant.hall_inbound_pin, external_hall_change, CHANGE);
+  attachInterrupt(constant.hall_outbound_pin, external_hall_change, CHANGE);
+
+  ODriveSim::Config odrive_config;
+#ifdef MOAT_ODRIVE_CAN
+  CanLoopback can_bus;
+  ODriveSim odrive(can_bus.end(1), odrive_config);
+  CanBus& odrive_port = can_bus.end(0);
+#else
+  ODriveSim odrive(Serial1, odrive_config);
+  HardwareSerial& odrive_port = Serial1;
+#endif
+  CvtPlant::Config plant_config;
+  plant_config.actuator_axis = constant.actuator_motor_number;
+  CvtPlant plant(odrive, constant, plant_config);
+  World world = {&odrive, &plant};
+  hal::sim::set_world(step_world, &world);
+  sensors.begin();
+
+  ParameterStore parameters;
+  Actuator actuator(odrive_port, constant, &sensors, &parameters, false);
+  actuator.init(1000);
+  plant.set_throttle(1);
+
+  int out[30] = {};
+  for (long i = 0; i < ops; i++)
+  {
+    hal::sim::set_world(step_world, &world);
+    hal::sim::advance_us(constant.cycle_period * 1000);
+    hal::sim::set_world(nullptr, nullptr);
+    stopwatch.start();
+    actuator.control_function(out);
+    stopwatch.stop();
+  }
+  s_sink = out[0];
+}
+
+//-----------------Rpm estimators--------------//
+// An edge every period_us, rpm() once per 10 ms cycle like the control step
+static void bench_tooth_rpm(uint32_t teeth_per_rotation, uint32_t window_teeth, uint32_t period_us, long ops,
+                            Stopwatch& stopwatch)
+{
+  hal::sim::reset();
+  ToothSensor sensor(teeth_per_rotation, window_teeth, Constant::tooth_stall_timeout);
+  const uint32_t cycle_us = 10000;
+  uint32_t next_edge_us = period_us;
+  uint32_t now_us = 0;
+  float sum = 0;
+  for (long i = 0; i < ops; i++)
+  {
+    uint32_t end_us = now_us + cycle_us;
+    while (next_edge_us <= end_us)
+    {
+      hal::sim::advance_us(next_edge_us - now_us);
+      now_us = next_edge_us;
+      next_edge_us += period_us;
+      sensor.on_edge();
+    }
+    hal::sim::advance_us(end_us - now_us);
+    now_us = end_us;
+    stopwatch.start();
+    sum += sensor.rpm();
+    stopwatch.stop();
+  }
+  s_sink = sum;
+}
+
+// Gear tooth rpm on a long endurance run: a slow wander over the whole range plus tooth jitter
+static float gearbox_sample(uint64_t n)
+{
+  float base = 1500 + 1200 * sinf(n * 1e-4f);
+  float jitter = 40.0f * rand() / float(RAND_MAX) - 20;
+  return base + jitter;
+}
+
+// calc_gearbox_rpm_rolling as it was before the filter bank: a queue preloaded with zeros and a
+// running average that's only ever added to
+struct LegacyRolling
+{
+  std::queue<float> frames;
+  float average = 0;
+
+  LegacyRolling()
+  {
+    for (int i = 0; i < Constant::gearbox_rolling_frames; i++) frames.push(0.0);
+  }
+
+  float update(float new_rpm)
+  {
+    average += (new_rpm - frames.front()) / Constant::gearbox_rolling_frames;
+    frames.pop();
+    frames.push(new_rpm);
+    return average;
+  }
+};
+
+typedef FilterBank<float, Constant::gearbox_rolling_frames, Constant::gearbox_median_frames> GearboxFilters;
+
+static std::vector<float> gearbox_inputs()
+{
+  std::vector<float> inputs(4096);
+  srand(2);
+  for (size_t i = 0; i < inputs.size(); i++) inputs[i] = gearbox_sample(i);
+  return inputs;
+}
+
+// inputs.size() has to be a power of two
+template <typename F>
+static void over_inputs(const std::vector<float>& inputs, long ops, Stopwatch& stopwatch, F evaluate)
+{
+  float sum = 0;
+  stopwatch.start();
+  for (long i = 0; i < ops; i++) sum += evaluate(inputs[i & (inputs.size() - 1)]);
+  stopwatch.stop();
+  s_sink = sum;
+}
+
+// The car shifting back and forth with the belt gripping, a gearbox tooth reading every 4th cycle
+static void bench_estimator(long ops, Stopwatch& stopwatch)
+{
+  StateEstimator estimator;
+  estimator.set_travel(0, Constant::encoder_count_shift_length);
+  srand(4);
+  float sum = 0;
+  for (long i = 0; i < ops; i++)
+  {
+    float t = i * 0.01f;
+    float gearbox = 700 + 300 * sinf(t * 0.5f);
+    float travel = 0.5f + 0.5f * sinf(t * 0.2f);
+    float ratio = Constant::ecvt_max_ratio - (Constant::ecvt_max_ratio - Constant::overdrive_ratio) * travel;
+    EstimatorInput input = {};
+    input.engine_rpm = gearbox * ratio + 20.0f * rand() / float(RAND_MAX) - 10;
+    input.engine_age_s = 0.002f;
+    input.engine_fresh = true;
+    input.gearbox_rpm = gearbox;
+    input.gearbox_age_s = 0.05f;
+    input.gearbox_fresh = i % 4 == 0;
+    input.encoder_count = (int32_t)(travel * Constant::encoder_count_shift_length);
+    input.odrive_fresh = true;
+    input.odrive_count = input.encoder_count;
+    input.odrive_velocity = 0;
+    input.odrive_age_s = 0.003f;
+    stopwatch.start();
+    sum += estimator.update(input, 0.01f).gearbox_rpm;
+    stopwatch.stop();
+  }
+  s_sink = sum;
+}
+
+//-----------------Reference--------------//
+// calc_reference_rpm as it was before the lookup tables
+static float legacy_reference_rpm(float gearbox_rpm, const Parameters& params)
+{
+  float output;
+  if (gearbox_rpm < params.gearbox_engage_rpm)
+  {
+    output = params.engine_engage;
+  }
+  else if (gearbox_rpm < params.gearbox_power_rpm)
+  {
+    output = gearbox_rpm * params.ecvt_max_ratio;
+  }
+  else if (gearbox_rpm < params.gearbox_overdrive_rpm)
+  {
+    output = params.engine_power;
+  }
+  else
+  {
+    output = gearbox_rpm * params.overdrive_ratio;
+  }
+  return output;
+}
+
+// Random gearbox rpm over the whole range, so the branches of the old function mispredict
+// the way they would on the car going through the regions
+static std::vector<float> reference_inputs()
+{
+  std::vector<float> inputs(4096);
+  srand(1);
+  for (float& x : inputs) x = ReferenceCurve::k_max_gearbox_rpm * rand() / float(RAND_MAX);
+  return inputs;
+}
+
+//-----------------Logging--------------//
+const int k_log_fields = 21;  // what main.cpp logged while records were still text
+
+// The old per cycle line, Log.notice("%d, %d, ..." CR) straight to the SD card
+static void bench_text_record(long ops, Stopwatch& stopwatch)
+{
+  int out[30];
+  for (int i = 0; i < 30; i++) out[i] = 1000 * i + 7;
+  char line[256];
+  size_t total = 0;
+  stopwatch.start();
+  for (long n = 0; n < ops; n++)
+  {
+    out[5] = n;
+    int length = 0;
+    for (int i = 0; i < k_log_fields; i++)
+    {
+      length += snprintf(line + length, sizeof(line) - length, i ? ", %d" : "%d", out[i]);
+    }
+    length += snprintf(line + length, sizeof(line) - length, "\r\n");
+    total += length;
+  }
+  stopwatch.stop();
+  s_sink = total;
+}
+
+static Telemetry s_telemetry;
+
+// The background write is outside the stopwatch, it isn't part of the control step
+static void bench_binary_record(long ops, Stopwatch& stopwatch)
+{
+  telemetry::FieldInfo fields[k_log_fields] = {};
+  for (int i = 0; i < k_log_fields; i++)
+  {
+    snprintf(fields[i].name, sizeof(fields[i].name), "field_%d", i);
+    fields[i].out_index = i;
+  }
+  s_telemetry.begin(fields, k_log_fields, 10000);
+  int out[30];
+  for (int i = 0; i < 30; i++) out[i] = 1000 * i + 7;
+  for (long n = 0; n < ops; n++)
+  {
+    out[5] = n;
+    stopwatch.start();
+    s_telemetry.push(out, n * 10000);
+    stopwatch.stop();
+    size_t length;
+    if (s_telemetry.ready(length) != nullptr) s_telemetry.release();
+  }
+}
+
+static DiagnosticStream s_diagnostics;
+
+// Header, sample and crc into the stream's own buffer, what send() does before the port
+static void bench_diagnostic_frame(long ops, Stopwatch& stopwatch)
+{
+  diagnostic::Sample sample = {};
+  uint8_t frame[diagnostic::k_frame_size];
+  size_t total = 0;
+  stopwatch.start();
+  for (long n = 0; n < ops; n++)
+  {
+    sample.time_us = n;
+    total += s_diagnostics.encode(sample, frame);
+  }
+  stopwatch.stop();
+  s_sink = total + frame[diagnostic::k_frame_size - 1];
+}
+
+//-----------------Thermistor--------------//
+static ThermistorTable s_thermistor;
+
+// Every code between the thresholds, as the thermal monitor converts its averages
+static void bench_thermistor(bool equation, long ops, Stopwatch& stopwatch)
+{
+  ThermistorTable::Config config;
+  uint16_t first = s_thermistor.short_code();
+  uint16_t span = s_thermistor.open_code() - first;
+  float total = 0;
+  stopwatch.start();
+  for (long n = 0; n < ops; n++)
+  {
+    uint16_t code = first + n % span;
+    total += equation ? ThermistorTable::exact(config, code) : s_thermistor.temperature(code);
+  }
+  stopwatch.stop();
+  s_sink = total;
+}
+
+//-----------------ODrive--------------//
+// The replies the four reads of a cycle get, in request order
+static const char* const k_replies[] = {"-12345\r\n", "0.5123\r\n", "24.0500\r\n", "1.875\r\n"};
+
+// Plays the ODrive on Serial2: answers every query the firmware has written so far, in order
+static int answer_queries(int next)
+{
+  for (int c = Serial2.sim_take(); c >= 0; c = Serial2.sim_take())
+  {
+    if (c != '\n') continue;
+    for (const char* r = k_replies[next++ & 3]; *r; r++) Serial2.sim_give(*r);
+  }
+  return next;
+}
+
+// One cycle's reads: queue four, send them in as many batches as the tx buffer takes and parse
+// the replies. Only the update() calls are timed, the ODrive's side is not.
+static void bench_odrive_exchange(long ops, Stopwatch& stopwatch)
+{
+  hal::sim::reset();
+  Serial2.sim_reset();
+  Serial2.begin(115200);
+  Serial2.sim_attach();
+  ODrive odrive(Serial2);
+  float sum = 0;
+  int next = 0;
+  for (long i = 0; i < ops; i++)
+  {
+    stopwatch.start();
+    odrive.request(ODrive::ENCODER_POS, 1);
+    odrive.request(ODrive::VELOCITY, 1);
+    odrive.request(ODrive::VBUS_VOLTAGE, 0);
+    odrive.request(ODrive::IBUS_CURRENT, 0);
+    odrive.update();
+    stopwatch.stop();
+    while (!odrive.is_idle())
+    {
+      next = answer_queries(next);
+      hal::sim::advance_us(500);
+      stopwatch.start();
+      odrive.update();
+      stopwatch.stop();
+    }
+    sum += odrive.cached(ODrive::ENCODER_POS, 1);
+    hal::sim::advance_us(9000);
+  }
+  s_sink = sum;
+}
+
+// read_string() and toFloat() as they were before ReplyParser, one char at a time into a String.
+// The host String keeps text this short inline, so only the Teensy's one reallocates here.
+static float legacy_parse(const char* reply)
+{
+  String text = "";
+  for (const char* c = reply; *c != '\n'; c++) text += *c;
+  return text.toFloat();
+}
+
+static float parse(ReplyParser& parser, const char* reply)
+{
+  float value = 0;
+  for (const char* c = reply;; c++)
+  {
+    if (parser.feed(*c) == ReplyParser::k_complete) break;
+  }
+  parser.parse_float(value);
+  return value;
+}
+
+static void bench_reply_parse(bool legacy, long ops, Stopwatch& stopwatch)
+{
+  ReplyParser parser;
+  float sum = 0;
+  stopwatch.start();
+  for (long i = 0; i < ops; i++)
+  {
+    const char* reply = k_replies[i & 3];
+    sum += legacy ? legacy_parse(reply) : parse(parser, reply);
+  }
+  stopwatch.stop();
+  s_sink = sum;
+}
+
+//-----------------Checks--------------//
+static int check_reference()
+{
+  const Parameters params = ParameterStore::defaults();
+  const ReferenceCurve& endurance = params.curves[k_profile_endurance];
+
+  // Away from the breakpoints the table has to be exact, at them it rounds the corner by at most
+  // slope change * cell / 4
+  const float breakpoints[] = {params.gearbox_engage_rpm, params.gearbox_power_rpm, params.gearbox_overdrive_rpm};
+  float worst_flat = 0;
+  float worst_corner = 0;
+  for (float x = 0; x <= ReferenceCurve::k_max_gearbox_rpm; x += 0.25f)
+  {
+    float error = fabsf(endurance.evaluate(x) - legacy_reference_rpm(x, params));
+    bool near_corner = false;
+    for (float b : breakpoints) near_corner |= fabsf(x - b) < ReferenceCurve::k_cell_rpm;
+    if (near_corner) worst_corner = fmaxf(worst_corner, error);
+    else worst_flat = fmaxf(worst_flat, error);
+  }
+  float corner_limit = params.ecvt_max_ratio * ReferenceCurve::k_cell_rpm / 4 + 1;
+  printf("reference error away from breakpoints %.3f rpm, at breakpoints %.2f rpm (limit %.2f)\n", worst_flat,
+         worst_corner, corner_limit);
+
+  int failures = 0;
+  if (worst_flat > 1) failures++;  // the old function compared against the int truncated breakpoints
+  if (worst_corner > corner_limit) failures++;
+  return failures;
+}
+
+static int check_filters(long drift_samples)
+{
+  // Drift: both against the exact mean of the same window, kept in double
+  LegacyRolling legacy;
+  MovingAverage<float, Constant::gearbox_rolling_frames> average;
+  const int window = Constant::gearbox_rolling_frames;
+  std::vector<double> exact_window(window, 0.0);
+  double exact_sum = 0;
+  float worst_legacy = 0;
+  float worst_average = 0;
+  srand(3);
+  for (long n = 0; n < drift_samples; n++)
+  {
+    float x = gearbox_sample(n);
+    exact_sum += x - exact_window[n % window];
+    exact_window[n % window] = x;
+    float legacy_value = legacy.update(x);
+    float average_value = average.update(x);
+    if (n >= window)
+    {
+      double exact = exact_sum / window;
+      worst_legacy = fmaxf(worst_legacy, fabs(legacy_value - exact));
+      worst_average = fmaxf(worst_average, fabs(average_value - exact));
+    }
+  }
+  printf("running average drift over %ld samples   legacy %.3f rpm   average %.3f rpm\n", drift_samples,
+         worst_legacy, worst_average);
+
+  // The median has to throw away a lone spike completely
+  MovingMedian<float, Constant::gearbox_median_frames> median;
+  float spiked = 0;
+  for (int n = 0; n < 50; n++) spiked = fmaxf(spiked, median.update(n == 25 ? 10000 : 1000));
+  printf("median through a 10000 rpm spike peaks at %.0f rpm\n", spiked);
+
+  int failures = 0;
+  if (worst_average > 0.05f) failures++;
+  if (spiked != 1000) failures++;
+  return failures;
+}
+
+//-----------------Results--------------//
+static bool write_json(const char* path, const char* label)
+{
+  FILE* file = fopen(path, "w");
+  if (file == nullptr) return false;
+  // One benchmark per line, read_baseline() relies on that
+  fprintf(file, "{\n  \"label\": \"%s\",\n  \"repeats\": %d,\n  \"benchmarks\": [\n", label, k_repeats);
+  for (size_t i = 0; i < s_results.size(); i++)
+  {
+    const Result& r = s_results[i];
+    fprintf(file, "    {\"name\": \"%s\", \"ns_per_op\": %.2f, \"allocs_per_op\": %.4f, \"ops\": %ld}%s\n",
+            r.name.c_str(), r.ns_per_op, r.allocations_per_op, r.ops, i + 1 < s_results.size() ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  fclose(file);
+  return true;
+}
+
+static std::vector<Result> read_baseline(const char* path)
+{
+  std::vector<Result> baseline;
+  FILE* file = fopen(path, "r");
+  if (file == nullptr) return baseline;
+  char line[512];
+  while (fgets(line, sizeof(line), file))
+  {
+    char name[64];
+    Result r;
+    if (sscanf(line, " {\"name\": \"%63[^\"]\", \"ns_per_op\": %lf, \"allocs_per_op\": %lf, \"ops\": %ld", name,
+               &r.ns_per_op, &r.allocations_per_op, &r.ops) == 4)
+    {
+      r.name = name;
+      baseline.push_back(r);
+    }
+  }
+  fclose(file);
+  return baseline;
+}
+
+static int compare(const std::vector<Result>& baseline, double tolerance)
+{
+  printf("\nagainst the baseline\n");
+  int failures = 0;
+  for (const Result& r : s_results)
+  {
+    for (const Result& b : baseline)
+    {
+      if (b.name != r.name) continue;
+      double change = b.ns_per_op > 0 ? r.ns_per_op / b.ns_per_op - 1 : 0;
+      bool slower = change > tolerance;
+      bool allocates = r.allocations_per_op > b.allocations_per_op + 1e-3;
+      printf("%-24s %+7.1f %%%s%s\n", r.name.c_str(), change * 100, slower ? "  SLOWER" : "",
+             allocates ? "  MORE ALLOCATIONS" : "");
+      failures += slower || allocates;
+    }
+  }
+  return failures;
+}
+
+static void usage(const char* name)
+{
+  fprintf(stderr,
+          "usage: %s [--ops-scale X] [--drift-samples N] [--json file] [--label text]\n"
+          "          [--baseline file] [--tolerance T] [--budget-ns N]\n",
+          name);
+  exit(2);
+}
+
+int main(int argc, char** argv)
+{
+  long drift_samples = 20000000;  // about 55 hours of 10 ms cycles
+  const char* json = nullptr;
+  const char* label = "";
+  const char* baseline = nullptr;
+  double tolerance = 0.25;
+  double budget_ns = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (i + 1 >= argc) usage(argv[0]);
+    const char* arg = argv[i];
+    const char* value = argv[++i];
+    if (strcmp(arg, "--ops-scale") == 0) s_ops_scale = atof(value);
+    else if (strcmp(arg, "--drift-samples") == 0) drift_samples = atol(value);
+    else if (strcmp(arg, "--json") == 0) json = value;
+    else if (strcmp(arg, "--label") == 0) label = value;
+    else if (strcmp(arg, "--baseline") == 0) baseline = value;
+    else if (strcmp(arg, "--tolerance") == 0) tolerance = atof(value);
+    else if (strcmp(arg, "--budget-ns") == 0) budget_ns = atof(value);
+    else usage(argv[0]);
+  }
+  s_results.reserve(16);
+  s_lap_overhead_ns = lap_overhead_ns();
+  printf("stopwatch overhead %.1f ns a lap, taken off every result\n", s_lap_overhead_ns);
+
+  measure("control_function", 2000, bench_control_function);
+
+  // 3000 rpm engine, 700 rpm gearbox
+  uint32_t engine_period = 60e6 / (3000 * Constant::eg_teeth_per_rotation);
+  uint32_t gearbox_period = 60e6 / (700 * Constant::gb_teeth_per_rotation);
+  measure("engine_tooth_rpm", 20000, [&](long ops, Stopwatch& s) {
+    bench_tooth_rpm(Constant::eg_teeth_per_rotation, Constant::eg_rpm_window_teeth, engine_period, ops, s);
+  });
+  measure("gearbox_tooth_rpm", 20000, [&](long ops, Stopwatch& s) {
+    bench_tooth_rpm(Constant::gb_teeth_per_rotation, Constant::gb_rpm_window_teeth, gearbox_period, ops, s);
+  });
+
+  std::vector<float> gearbox_rpm = gearbox_inputs();
+  measure("gearbox_average_legacy", 2000000, [&](long ops, Stopwatch& s) {
+    LegacyRolling legacy;
+    over_inputs(gearbox_rpm, ops, s, [&](float x) { return legacy.update(x); });
+  });
+  measure("gearbox_filter_bank", 2000000, [&](long ops, Stopwatch& s) {
+    GearboxFilters bank;
+    bank.set_alpha(Constant::exponential_filter_alpha);
+    over_inputs(gearbox_rpm, ops, s, [&](float x) {
+      const GearboxFilters::Outputs& filtered = bank.update(x);
+      return filtered.average + filtered.median + filtered.exponential;
+    });
+  });
+  measure("state_estimator", 200000, bench_estimator);
+
+  const Parameters params = ParameterStore::defaults();
+  std::vector<float> reference_rpm = reference_inputs();
+  measure("reference_rpm_legacy", 4000000, [&](long ops, Stopwatch& s) {
+    over_inputs(reference_rpm, ops, s, [&](float x) { return legacy_reference_rpm(x, params); });
+  });
+  measure("reference_rpm_table", 4000000, [&](long ops, Stopwatch& s) {
+    const ReferenceCurve& curve = params.curves[params.profile];
+    over_inputs(reference_rpm, ops, s, [&](float x) { return curve.evaluate(x); });
+  });
+
+  measure("log_record_text", 200000, bench_text_record);
+  measure("log_record_binary", 200000, bench_binary_record);
+  measure("diagnostic_frame", 200000, bench_diagnostic_frame);
+  measure("thermistor_equation", 2000000, [](long ops, Stopwatch& s) { bench_thermistor(true, ops, s); });
+  measure("thermistor_table", 2000000, [](long ops, Stopwatch& s) { bench_thermistor(false, ops, s); });
+  measure("odrive_exchange", 100000, bench_odrive_exchange);
+  measure("reply_parse_legacy", 2000000, [](long ops, Stopwatch& s) { bench_reply_parse(true, ops, s); });
+  measure("reply_parse", 2000000, [](long ops, Stopwatch& s) { bench_reply_parse(false, ops, s); });
+  printf("\n");
+
+  int failures = check_reference();
+  failures += check_filters(drift_samples);
+
+  if (budget_ns > 0 && s_results[0].ns_per_op > budget_ns)
+  {
+    printf("control_function %.0f ns is over the %.0f ns budget\n", s_results[0].ns_per_op, budget_ns);
+    failures++;
+  }
+  if (baseline != nullptr)
+  {
+    std::vector<Result> previous = read_baseline(baseline);
+    if (previous.empty())
+    {
+      fprintf(stderr, "no results in %s\n", baseline);
+      return 2;
+    }
+    failures += compare(previous, tolerance);
+  }
+  if (json != nullptr && !write_json(json, label))
+  {
+    fprintf(stderr, "could not write %s\n", json);
+    return 2;
+  }
+
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
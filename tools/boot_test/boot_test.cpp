@@ -0,0 +1,439 @@
+/*
+Boot test
+- sequencer: BootSequencer takes the steps in turns, a blocking step doesn't hold the others
+  back more than its own call, each stage keeps its start, finish and time inside the step,
+  ready_us() only waits on the required ones and run() gives up on a step that never finishes
+- record: Calibration encode / decode, an erased or corrupted EEPROM is refused
+- restore: the saved ends of travel come back relative to a new index whole turns away, and are
+  refused for a move past the tolerance, changed hall sensors, another model or a resting place
+  outside the travel
+- reboot: the simulated ODrive and car powered up twice. The first boot finds nothing saved and
+  homes, the second one starts with both encoders counting from somewhere else, restores the
+  same ends of travel from where it rested before the index search turned it onto the index and
+  is control-ready in under a second. Powered up after a move it homes again.
+
+usage: boot_test [--verbose]
+Exit code is non-zero on any failure.
+Built with -DMOAT_ODRIVE_CAN the ODrive is on a CAN loopback instead of Serial1.
+*/
+
+#include "../common/SimCar.h"
+#include <BootSequencer.h>
+#include <Calibration.h>
+#include <MotionSequencer.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+Constant constant;
+
+static bool s_verbose = false;
+
+//-----------------Sequencer--------------//
+static int s_link_calls = 0;
+static uint32_t s_link_ready_us = 0;
+
+static int step_link(uint32_t now_us)
+{
+  // Waits on something outside, a little time passes in every call
+  s_link_calls++;
+  hal::sim::advance_us(100);
+  return now_us >= s_link_ready_us ? BootSequencer::k_done : BootSequencer::k_busy;
+}
+
+static int step_card(uint32_t now_us)
+{
+  (void)now_us;
+  // Blocks once, like SD.begin
+  hal::sim::advance_us(30000);
+  return BootSequencer::k_done;
+}
+
+static int step_broken(uint32_t now_us)
+{
+  (void)now_us;
+  return BootSequencer::k_failed;
+}
+
+static int step_forever(uint32_t now_us)
+{
+  (void)now_us;
+  hal::sim::advance_us(100);
+  return BootSequencer::k_busy;
+}
+
+static void test_sequencer()
+{
+  hal::sim::reset();
+  hal::sim::advance_us(5000);
+  s_link_calls = 0;
+  s_link_ready_us = 200000;
+  BootSequencer boot;
+  check(boot.add("link", step_link), "sequencer: add");
+  boot.add("card", step_card);
+  boot.add("optional", step_broken, false);
+  boot.start();
+  check(boot.busy() && boot.ready_us() == 0, "sequencer: busy after start");
+  while (boot.poll())
+  {
+  }
+  const BootSequencer::Stage& link = boot.stage(0);
+  const BootSequencer::Stage& card = boot.stage(1);
+  const BootSequencer::Stage& optional = boot.stage(2);
+  check(boot.started_us() == 5000 && link.started_us == 5000 && card.started_us == 5000,
+        "sequencer: all stages start together");
+  check(card.result == BootSequencer::k_done && card.calls == 1 && card.active_us == 30000,
+        "sequencer: blocking step called once");
+  check(link.result == BootSequencer::k_done && link.calls > 1 && link.active_us == link.calls * 100u,
+        "sequencer: waiting step called until done");
+  check(link.finished_us >= 200000 && link.finished_us < 200000 + 30000 + 200,
+        "sequencer: waiting step finishes as soon as it's ready");
+  check(card.finished_us - card.started_us < 30000 + 200, "sequencer: blocking step doesn't wait on the other");
+  check(optional.result == BootSequencer::k_failed && optional.calls == 1, "sequencer: failed step not called again");
+  check(boot.ok(), "sequencer: ok with only an optional step failed");
+  check(boot.ready_us() == link.finished_us, "sequencer: ready when the last required step finished");
+
+  BootSequencer stuck;
+  stuck.add("link", step_link);
+  stuck.add("forever", step_forever);
+  s_link_ready_us = 0;
+  uint32_t started = micros();
+  check(!stuck.run(50000), "sequencer: run not ok with a required step stuck");
+  check(stuck.stage(0).result == BootSequencer::k_done, "sequencer: finished step kept");
+  check(stuck.stage(1).result == BootSequencer::k_timed_out, "sequencer: stuck step timed out");
+  check(micros() - started >= 50000 && micros() - started < 51000, "sequencer: run gives up after the timeout");
+  check(!stuck.add("late", step_card), "sequencer: no steps added once started");
+
+  BootSequencer full;
+  for (int i = 0; i < BootSequencer::k_max_steps; i++) full.add("card", step_card);
+  check(!full.add("card", step_card), "sequencer: k_max_steps at most");
+  if (s_verbose) printf("sequencer: link %u calls, ready at %u us\n", link.calls, boot.ready_us());
+}
+
+//-----------------Record--------------//
+static Calibration::Record sample_record()
+{
+  Calibration::Record record = {};
+  record.model = constant.model;
+  record.inbound = -150000;
+  record.outbound = 46608;
+  record.position = 40000;
+  record.saves = 7;
+  record.hall_outbound = 1;
+  return record;
+}
+
+static void test_record()
+{
+  Calibration::Record record = sample_record();
+  uint8_t data[Calibration::k_size + 8];
+  check(Calibration::encode(record, data, Calibration::k_size - 1) == 0, "record: no room");
+  size_t length = Calibration::encode(record, data, sizeof(data));
+  check(length == Calibration::k_size, "record: encoded size");
+  Calibration::Record decoded = {};
+  check(Calibration::decode(data, length, decoded) == Calibration::k_ok, "record: decodes");
+  check(memcmp(&decoded, &record, sizeof(record)) == 0, "record: round trip");
+
+  check(Calibration::decode(data, 4, decoded) == Calibration::k_too_short, "record: header cut short");
+  check(Calibration::decode(data, length - 1, decoded) == Calibration::k_too_short, "record: record cut short");
+  uint8_t erased[Calibration::k_size];
+  memset(erased, 0xFF, sizeof(erased));
+  check(Calibration::decode(erased, sizeof(erased), decoded) == Calibration::k_bad_magic, "record: erased");
+  memset(erased, 0, sizeof(erased));
+  check(Calibration::decode(erased, sizeof(erased), decoded) == Calibration::k_bad_magic, "record: zeroed");
+
+  uint8_t copy[Calibration::k_size];
+  memcpy(copy, data, length);
+  copy[4] ^= 1;  // version
+  check(Calibration::decode(copy, length, decoded) == Calibration::k_bad_version, "record: version");
+  for (size_t i = sizeof(calibration::Header); i < length; i++)
+  {
+    memcpy(copy, data, length);
+    copy[i] ^= 0x10;
+    if (Calibration::decode(copy, length, decoded) == Calibration::k_bad_crc) continue;
+    check(false, "record: flipped bit caught by the crc");
+    break;
+  }
+}
+
+//-----------------Restore--------------//
+static Calibration::Config restore_config()
+{
+  Calibration::Config config;
+  config.model = constant.model;
+  config.counts_per_turn = constant.encoder_counts_per_turn;
+  config.tolerance = constant.calibration_tolerance;
+  config.margin = constant.calibration_margin;
+  return config;
+}
+
+static void test_restore()
+{
+  const int32_t turn = constant.encoder_counts_per_turn;
+  Calibration::Config config = restore_config();
+
+  // Powered up with the index 3000 counts away the first time
+  Calibration::Observed saving = {3000, 40000, false, true};
+  Calibration::Record record = Calibration::capture(constant.model, saving, -150000, 46608);
+  check(record.inbound == -153000 && record.outbound == 43608 && record.position == 37000,
+        "restore: captured from the index");
+
+  // Counting from somewhere else the next time, the index 17 turns and some away
+  const int32_t shift = -17 * turn - 5000;
+  Calibration::Observed unmoved = {saving.index + shift + 2 * turn, saving.position + shift, false, true};
+  Calibration::Restored restored;
+  check(Calibration::restore(config, record, unmoved, restored) == Calibration::k_ok, "restore: unmoved");
+  check(restored.inbound == -150000 + shift && restored.outbound == 46608 + shift && restored.error == 0,
+        "restore: same ends of travel in the new counts");
+
+  Calibration::Observed nudged = unmoved;
+  nudged.position += constant.calibration_tolerance;
+  check(Calibration::restore(config, record, nudged, restored) == Calibration::k_ok &&
+            restored.error == -constant.calibration_tolerance && restored.outbound == 46608 + shift,
+        "restore: within tolerance");
+  nudged.position += 1;
+  check(Calibration::restore(config, record, nudged, restored) == Calibration::k_moved, "restore: past tolerance");
+  Calibration::Observed half = unmoved;
+  half.position += turn / 2;
+  check(Calibration::restore(config, record, half, restored) == Calibration::k_moved, "restore: half a turn");
+
+  Calibration::Observed halls = unmoved;
+  halls.hall_outbound = false;
+  check(Calibration::restore(config, record, halls, restored) == Calibration::k_hall_changed,
+        "restore: hall sensors changed");
+
+  Calibration::Config other = config;
+  other.model = constant.model == 20 ? 21 : 20;
+  check(Calibration::restore(other, record, unmoved, restored) == Calibration::k_other_model, "restore: other model");
+
+  Calibration::Record outside = record;
+  outside.position = outside.outbound + constant.calibration_margin + 1;
+  Calibration::Observed at_outside = {unmoved.index, unmoved.index + outside.position, false, true};
+  check(Calibration::restore(config, outside, at_outside, restored) == Calibration::k_out_of_range,
+        "restore: resting past the travel");
+  Calibration::Record reversed = record;
+  reversed.inbound = reversed.outbound;
+  check(Calibration::restore(config, reversed, unmoved, restored) == Calibration::k_out_of_range,
+        "restore: empty travel");
+
+  Calibration::restore(config, record, unmoved, restored);
+  Calibration::Record later = Calibration::capture(constant.model, unmoved, restored.inbound, restored.outbound);
+  check(!Calibration::changed(config, record, later), "restore: nothing to save when unmoved");
+  Calibration::Record moved = later;
+  moved.position += config.tolerance + 1;
+  check(Calibration::changed(config, record, moved), "restore: save when it rests elsewhere");
+  Calibration::Record rehomed = later;
+  rehomed.outbound += 10;
+  check(Calibration::changed(config, record, rehomed), "restore: save when homing moved an end");
+}
+
+//-----------------Reboot--------------//
+// What survives a power cycle
+static uint8_t s_eeprom[Calibration::k_size];
+
+// The firmware and the car from power up, physical is where the actuator is in ODriveSim position
+// counts and both encoders count from there
+struct Rig : SimCar
+{
+  BootSequencer boot;
+  int32_t origin;
+  int link_status = Actuator::k_link_busy;
+  int restore_status = Calibration::k_no_index;
+  int out[30] = {};
+
+  Rig(double physical, const ODriveSim::Config& odrive_config)
+    : SimCar(options(physical, odrive_config)), origin((int32_t)physical)
+  {
+  }
+
+  static Options options(double physical, const ODriveSim::Config& odrive_config)
+  {
+    Options options;
+    options.odrive = odrive_config;
+    options.power_up = true;
+    options.physical = physical;
+    options.start = false;
+    return options;
+  }
+
+  // main.cpp's setup, a card that takes a while next to the ODrive coming up
+  void power_up();
+  void home();
+};
+
+static Rig* s_rig = nullptr;
+
+static void control_step()
+{
+  s_rig->actuator.control_function(s_rig->out);
+}
+
+static int boot_interrupts(uint32_t now_us)
+{
+  (void)now_us;
+  s_rig->attach_interrupts();
+  return BootSequencer::k_done;
+}
+
+static int boot_odrive(uint32_t now_us)
+{
+  Rig& rig = *s_rig;
+  rig.link_status = rig.actuator.poll_link(now_us);
+  if (rig.link_status == Actuator::k_link_busy) return BootSequencer::k_busy;
+  if (rig.link_status != 0) return BootSequencer::k_failed;
+  Calibration::Record record;
+  rig.restore_status = Calibration::decode(s_eeprom, sizeof(s_eeprom), record);
+  if (rig.restore_status == Calibration::k_ok) rig.restore_status = rig.actuator.restore_calibration(record);
+  return BootSequencer::k_done;
+}
+
+static int boot_sd(uint32_t now_us)
+{
+  (void)now_us;
+  hal::sim::advance_us(80000);
+  return BootSequencer::k_done;
+}
+
+void Rig::power_up()
+{
+  s_rig = this;
+  hal::sim::advance_us(hal::sim::step_us());  // hall pins where the plant starts
+  actuator.begin_link(1000);
+  boot.add("interrupts", boot_interrupts);
+  boot.add("odrive", boot_odrive);
+  boot.add("sd", boot_sd);
+  // What run() does on the Teensy, the simulated clock only moves when it's stepped
+  boot.start();
+  while (boot.poll() && hal::sim::now_us() < 10000000) hal::sim::advance_us(hal::sim::step_us());
+}
+
+void Rig::home()
+{
+  start_scheduler(control_step);
+  actuator.start_homing();
+  run_motion(30);
+  // Parked where it stopped, nothing moves it before power off
+  scheduler.end();
+  uint64_t settle_us = hal::sim::now_us() + 200000;
+  while (hal::sim::now_us() < settle_us) hal::sim::advance_us(hal::sim::step_us());
+}
+
+static ODriveSim::Config odrive_with_index()
+{
+  ODriveSim::Config config;
+  config.index_position = 1234;
+  return config;
+}
+
+static bool save(Rig& rig)
+{
+  Calibration::Record record;
+  if (!rig.actuator.calibration(record)) return false;
+  record.saves++;
+  return Calibration::encode(record, s_eeprom, sizeof(s_eeprom)) == sizeof(s_eeprom);
+}
+
+static void test_reboot()
+{
+  memset(s_eeprom, 0xFF, sizeof(s_eeprom));
+  const double mid = CvtPlant::Config().inbound_count + 0.5 * constant.encoder_count_shift_length + 321.25;
+
+  // First boot, nothing saved
+  int32_t physical_inbound;
+  int32_t physical_outbound;
+  double parked;
+  {
+    Rig rig(mid, odrive_with_index());
+    rig.power_up();
+    check(rig.boot.ok() && rig.link_status == 0, "reboot: first boot link up");
+    check(rig.restore_status == Calibration::k_bad_magic && !rig.actuator.calibrated(),
+          "reboot: first boot finds nothing saved");
+    check(!save(rig), "reboot: nothing to save before homing");
+    rig.home();
+    check(rig.actuator.motion_status() == MotionSequencer::k_ok && rig.actuator.calibrated(), "reboot: homed");
+    check(rig.axis().velocity == 0 || fabs(rig.axis().velocity) < 1e-3, "reboot: parked");
+    check(save(rig), "reboot: saved after homing");
+    physical_inbound = rig.actuator.encoder_inbound() + rig.origin;
+    physical_outbound = rig.actuator.encoder_outbound() + rig.origin;
+    parked = rig.axis().position;
+    if (s_verbose)
+    {
+      printf("reboot: homed, outbound %d (physical %d), parked at %.1f, ready at %u us\n",
+             rig.actuator.encoder_outbound(), physical_outbound, parked, rig.boot.ready_us());
+    }
+  }
+
+  // Unmoved, both encoders count from where it is now
+  {
+    Rig rig(parked, odrive_with_index());
+    rig.power_up();
+    check(rig.restore_status == Calibration::k_ok && rig.actuator.calibrated(), "reboot: restored unmoved");
+    check(rig.actuator.encoder_inbound() + rig.origin == physical_inbound &&
+              rig.actuator.encoder_outbound() + rig.origin == physical_outbound,
+          "reboot: same ends of travel as homing found");
+    check(rig.boot.ready_us() > 0 && rig.boot.ready_us() < 1000000, "reboot: control-ready in under a second");
+    // Restored from where it rested, the index search has since turned it onto the index
+    double turned = parked - rig.axis().position;
+    check(fmod(rig.axis().position - odrive_with_index().index_position, constant.encoder_counts_per_turn) == 0 &&
+              turned >= 0 && turned < constant.encoder_counts_per_turn,
+          "reboot: index search turned it onto the index");
+    // The PID takes it from there without homing
+    rig.start_scheduler(control_step);
+    rig.run(0.5);
+    // The ODrive counts from the index, the estimator has to see it moved onto the Teensy encoder
+    float sheave_error = rig.actuator.estimate().sheave_position - (float)(rig.axis().position - rig.origin);
+    check(fabsf(sheave_error) < 50, "reboot: sheave position from both encoders agrees");
+    if (s_verbose)
+    {
+      printf("reboot: restored, outbound %d, ready at %u us\n", rig.actuator.encoder_outbound(),
+             rig.boot.ready_us());
+      for (int i = 0; i < rig.boot.count(); i++)
+      {
+        const BootSequencer::Stage& stage = rig.boot.stage(i);
+        printf("  %s: %u us\n", stage.name, stage.finished_us - stage.started_us);
+      }
+    }
+  }
+
+  // Pushed by hand while the power was off
+  {
+    Rig rig(parked - 3 * constant.calibration_tolerance, odrive_with_index());
+    rig.power_up();
+    check(rig.restore_status == Calibration::k_moved && !rig.actuator.calibrated(), "reboot: moved, not restored");
+  }
+
+  // Whole turns off the sensor it was parked on
+  {
+    Rig rig(parked - 4 * constant.encoder_counts_per_turn, odrive_with_index());
+    rig.power_up();
+    check(rig.restore_status == Calibration::k_hall_changed && !rig.actuator.calibrated(),
+          "reboot: whole turns off the sensor, not restored");
+  }
+}
+
+int main(int argc, char** argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--verbose") == 0) s_verbose = true;
+    else
+    {
+      fprintf(stderr, "usage: %s [--verbose]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  test_sequencer();
+  test_record();
+  test_restore();
+  test_reboot();
+
+  if (s_failures > 0)
+  {
+    printf("%d failures\n", s_failures);
+    return 1;
+  }
+  printf("all passed\n");
+  return 0;
+}
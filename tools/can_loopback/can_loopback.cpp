@@ -0,0 +1,406 @@
+/*
+CAN-simple loopback test
+- frames: every message can_simple builds decodes back to what went in, with the ids and the
+  little endian byte layout the ODrive uses, and a short payload is refused without touching
+  the outputs
+- cyclic: ODriveCan against ODriveSim on a CanLoopback with the cyclic messages on. Values
+  keep arriving with no remote requests sent.
+- remote: the same with the cyclic messages off, request() falls back to remote requests,
+  at most one per message per k_poll_after_us
+- blocking: the getters, run_state waiting on the index search and dump_errors, with and
+  without lost answers
+- setpoints: queue_velocity sends changes, holds back repeats and values inside the deadband,
+  resends for the keepalive and lets a stop through at once
+- malformed: short payloads, unknown commands, other nodes and stray remote requests are
+  counted and never reach the cache
+- stop retry: a stop the full transmit queue refused stays pending, isn't timed as written and
+  goes out with the next write. A plain stop after an idle doesn't move the idle's time.
+
+usage: can_loopback
+Exit code is non-zero on any failure.
+*/
+
+#include "../common/SimCar.h"
+#include <CanBus.h>
+#include <CanSimple.h>
+#include <ODriveCan.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+static bool same_bytes(const CanFrame& frame, const uint8_t* expected, int length)
+{
+  return frame.length == length && memcmp(frame.data, expected, length) == 0;
+}
+
+//-----------------Frames--------------//
+static void check_frames()
+{
+  CanFrame frame = can_simple::set_input_vel(1, 1.0f, -2.0f);
+  const uint8_t velocity_bytes[] = {0x00, 0x00, 0x80, 0x3f, 0x00, 0x00, 0x00, 0xc0};
+  check(frame.id == 0x2d && !frame.rtr, "set_input_vel id");
+  check(same_bytes(frame, velocity_bytes, 8), "set_input_vel layout");
+
+  frame = can_simple::set_axis_state(0, 8);
+  const uint8_t state_bytes[] = {0x08, 0x00, 0x00, 0x00};
+  check(frame.id == 0x007 && same_bytes(frame, state_bytes, 4), "set_axis_state");
+
+  frame = can_simple::request(1, can_simple::k_get_bus_voltage_current);
+  check(frame.id == 0x37 && frame.rtr && frame.length == 0, "request");
+  check(can_simple::node_of(frame.id) == 1, "node_of");
+  check(can_simple::command_of(frame.id) == can_simple::k_get_bus_voltage_current, "command_of");
+
+  can_simple::Heartbeat heartbeat = {};
+  frame = can_simple::heartbeat(1, 0x80000001, 8);
+  check(can_simple::decode_heartbeat(frame, heartbeat), "heartbeat decodes");
+  check(heartbeat.axis_error == 0x80000001 && heartbeat.axis_state == 8, "heartbeat values");
+
+  float first = 0, second = 0;
+  frame = can_simple::pair(0, can_simple::k_get_encoder_estimates, -1.25f, 3.5e-3f);
+  check(can_simple::decode_pair(frame, first, second), "pair decodes");
+  check(first == -1.25f && second == 3.5e-3f, "pair values");
+
+  int32_t shadow_count = 0, count_in_cpr = 0;
+  frame = can_simple::encoder_count(1, -123456, 4000);
+  check(can_simple::decode_encoder_count(frame, shadow_count, count_in_cpr), "encoder_count decodes");
+  check(shadow_count == -123456 && count_in_cpr == 4000, "encoder_count values");
+
+  uint32_t error = 0;
+  frame = can_simple::error(0, can_simple::k_get_motor_error, 0x1234);
+  check(frame.length == 8 && can_simple::decode_error(frame, error) && error == 0x1234, "motor error");
+  frame = can_simple::error(0, can_simple::k_get_encoder_error, 0x40);
+  check(frame.length == 4 && can_simple::decode_error(frame, error) && error == 0x40, "encoder error");
+
+  // Every decoder refuses a payload one byte short and leaves its outputs alone
+  frame = can_simple::heartbeat(0, 7, 1);
+  frame.length = 4;
+  heartbeat = {99, 99};
+  check(!can_simple::decode_heartbeat(frame, heartbeat) && heartbeat.axis_error == 99, "short heartbeat");
+  frame = can_simple::pair(0, can_simple::k_get_encoder_estimates, 1, 2);
+  frame.length = 7;
+  first = second = 99;
+  check(!can_simple::decode_pair(frame, first, second) && first == 99 && second == 99, "short pair");
+  frame = can_simple::encoder_count(0, 1, 2);
+  frame.length = 7;
+  shadow_count = count_in_cpr = 99;
+  check(!can_simple::decode_encoder_count(frame, shadow_count, count_in_cpr) && shadow_count == 99,
+        "short encoder_count");
+  frame = can_simple::error(0, can_simple::k_get_controller_error, 1);
+  frame.length = 3;
+  error = 99;
+  check(!can_simple::decode_error(frame, error) && error == 99, "short error");
+
+  // The loopback hands frames across in order and counts what doesn't fit
+  CanLoopback bus;
+  for (int i = 0; i < CanLoopback::k_queue_frames; i++)
+  {
+    check(bus.end(0).write(can_simple::set_axis_state(0, i)), "loopback write");
+  }
+  check(!bus.end(0).write(can_simple::set_axis_state(0, 0)), "loopback full");
+  check(bus.end(0).dropped() == 1, "loopback dropped");
+  bool in_order = true;
+  for (int i = 0; i < CanLoopback::k_queue_frames; i++)
+  {
+    in_order = bus.end(1).read(frame) && can_simple::get_u32(frame.data) == (uint32_t)i && in_order;
+  }
+  check(in_order, "loopback order");
+  check(!bus.end(1).read(frame) && !bus.end(0).read(frame), "loopback empty");
+}
+
+//-----------------ODriveCan against ODriveSim--------------//
+static void step_odrive(void* context, uint64_t now_us)
+{
+  ((ODriveSim*)context)->step(now_us);
+}
+
+// One control cycle the way Actuator runs it
+static void cycle(ODriveCan& odrive, int axis)
+{
+  hal::sim::advance_us(10000);
+  odrive.request(ODriveLink::ENCODER_POS, axis);
+  odrive.request(ODriveLink::VELOCITY, axis);
+  odrive.request(ODriveLink::VBUS_VOLTAGE, 0);
+  odrive.request(ODriveLink::IBUS_CURRENT, 0);
+  odrive.update();
+}
+
+static void check_values(ODriveCan& odrive, ODriveSim& sim, int axis, uint32_t max_age_us, const char* what)
+{
+  // The cached encoder count is behind by its age, plus up to a cycle it waited on the bus
+  float velocity = sim.axis(axis).velocity;
+  uint32_t age_us = odrive.age_us(ODriveLink::ENCODER_POS, axis);
+  float counts_behind = fabsf(velocity) * 8192 * (age_us + 11000) * 1e-6f + 2;
+  bool ok = age_us <= max_age_us &&
+            fabsf(odrive.cached(ODriveLink::ENCODER_POS, axis) - (float)sim.axis(axis).position) <= counts_behind &&
+            fabsf(odrive.cached(ODriveLink::VELOCITY, axis) - velocity) <= fabsf(velocity) * 0.5f + 0.01f &&
+            odrive.cached(ODriveLink::VBUS_VOLTAGE, 0) == 24;
+  check(ok, what);
+}
+
+static void check_cyclic()
+{
+  hal::sim::reset();
+  CanLoopback bus;
+  ODriveSim::Config config;
+  ODriveSim sim(bus.end(1), config);
+  ODriveCan odrive(bus.end(0));
+  hal::sim::set_world(step_odrive, &sim);
+
+  check(odrive.init(1000) == 0, "cyclic init");
+  check(odrive.run_state(1, 8, false, 0), "cyclic closed loop");
+  odrive.set_velocity(1, 2.5f);
+  for (int i = 0; i < 10; i++) cycle(odrive, 1);
+  uint32_t requests_before = odrive.remote_requests();
+  for (int i = 0; i < 200; i++)
+  {
+    cycle(odrive, 1);
+    check_values(odrive, sim, 1, 10000, "cyclic values");
+  }
+  check(odrive.remote_requests() == requests_before, "cyclic sends no remote requests");
+  check(sim.velocity_commands() == 1 && sim.axis(1).vel_setpoint == 2.5f, "cyclic velocity command");
+  check(fabsf(sim.axis(1).velocity - 2.5f) < 0.01f, "cyclic velocity reached");
+  check(odrive.cached(ODriveLink::CURRENT_STATE, 1) == 8, "cyclic heartbeat state");
+  check(odrive.parse_errors() == 0 && odrive.timeouts() == 0, "cyclic clean");
+  printf("cyclic: %lu messages, %lu bytes, %lu remote requests, %lu frames sent\n",
+         (unsigned long)odrive.rx_messages(), (unsigned long)odrive.rx_bytes(),
+         (unsigned long)odrive.remote_requests(), (unsigned long)odrive.tx_frames());
+  hal::sim::set_world(nullptr, nullptr);
+}
+
+static void check_remote()
+{
+  hal::sim::reset();
+  CanLoopback bus;
+  ODriveSim::Config config;
+  config.heartbeat_period_us = 0;
+  config.encoder_estimates_period_us = 0;
+  config.encoder_count_period_us = 0;
+  config.bus_vi_period_us = 0;
+  ODriveSim sim(bus.end(1), config);
+  ODriveCan odrive(bus.end(0));
+  hal::sim::set_world(step_odrive, &sim);
+
+  check(odrive.init(1000) == 0, "remote init");
+  odrive.run_state(0, 8, false, 0);
+  odrive.set_velocity(0, -1);
+  for (int i = 0; i < 100; i++)
+  {
+    uint32_t queries_before = sim.queries();
+    cycle(odrive, 0);
+    // Encoder count, estimates and one bus voltage / current for the two bus properties
+    check(sim.queries() - queries_before <= 3, "remote one request per message");
+    // Same cycle again, everything has been asked for already
+    uint32_t requests_before = odrive.remote_requests();
+    odrive.request(ODriveLink::ENCODER_POS, 0);
+    odrive.request(ODriveLink::IBUS_CURRENT, 0);
+    check(odrive.remote_requests() == requests_before, "remote throttled");
+    // Asked for again once older than k_poll_after_us, answered by the next cycle
+    if (i > 10) check_values(odrive, sim, 0, ODriveCan::k_poll_after_us + 10000, "remote values");
+  }
+  check(odrive.remote_requests() > 50, "remote fallback used");
+  check(odrive.timeouts() == 0 && odrive.parse_errors() == 0, "remote clean");
+  hal::sim::set_world(nullptr, nullptr);
+}
+
+class TextOut : public Print
+{
+public:
+  size_t write(uint8_t c) override
+  {
+    text += (char)c;
+    return 1;
+  }
+  std::string text;
+};
+
+static void check_blocking()
+{
+  hal::sim::reset();
+  CanLoopback bus;
+  ODriveSim::Config config;
+  config.encoder_estimates_period_us = 0;
+  config.encoder_count_period_us = 0;
+  config.bus_vi_period_us = 0;
+  ODriveSim sim(bus.end(1), config);
+  ODriveCan odrive(bus.end(0));
+  hal::sim::set_world(step_odrive, &sim);
+
+  sim.axis(1).position = 5000;
+  check(odrive.get_voltage() == 24 && odrive.read_status() == ODriveLink::k_read_ok, "get_voltage");
+  check(odrive.get_encoder_pos(1) == 5000, "get_encoder_pos");
+  check(odrive.get_vel(1) == 0, "get_vel");
+  check(odrive.get_cur() > 0, "get_cur");
+
+  uint64_t start_us = hal::sim::now_us();
+  check(odrive.run_state(1, 6, true, 5), "index search finishes");
+  check(hal::sim::now_us() - start_us >= config.index_search_us, "index search waited");
+  check(!odrive.run_state(1, 6, true, 5), "same state not sent again");
+
+  TextOut out;
+  odrive.dump_errors(out);
+  check(out.text.find("no reply") == std::string::npos, "dump_errors answered");
+  check(out.text.find("controller: 0") != std::string::npos, "dump_errors content");
+
+  // Lost answers time out, report it and hand back 0
+  hal::sim::set_world(nullptr, nullptr);
+  uint32_t timeouts_before = odrive.timeouts();
+  check(odrive.get_vel(0) == 0 && odrive.read_status() == ODriveLink::k_read_timeout, "get_vel timeout");
+  out.text.clear();
+  odrive.dump_errors(out);
+  check(out.text.find("no reply") != std::string::npos, "dump_errors timeout");
+  check(odrive.timeouts() == timeouts_before + 1 + 2 * 4, "timeouts counted");
+}
+
+static void check_setpoints()
+{
+  hal::sim::reset();
+  CanLoopback bus;
+  ODriveSim::Config config;
+  config.heartbeat_period_us = 0;
+  config.encoder_estimates_period_us = 0;
+  config.encoder_count_period_us = 0;
+  config.bus_vi_period_us = 0;
+  ODriveSim sim(bus.end(1), config);
+  ODriveCan odrive(bus.end(0));
+  hal::sim::set_world(step_odrive, &sim);
+  SetpointGate::Config gate;
+  gate.deadband = 0.01f;
+  gate.keepalive_us = 100000;
+  odrive.configure_setpoints(gate);
+
+  // Queued twice before an update, only the second goes out
+  odrive.queue_velocity(0, 1, odrive.stops(0));
+  odrive.queue_velocity(0, 2, odrive.stops(0));
+  odrive.update();
+  hal::sim::advance_us(1000);
+  check(sim.velocity_commands() == 1 && sim.axis(0).vel_setpoint == 2, "setpoint replaced before sending");
+  check(odrive.commands_saved() == 1, "replaced setpoint counted");
+
+  // Inside the deadband for the next 100 ms: nothing, then the keepalive carries the latest value
+  for (int i = 0; i < 10; i++)
+  {
+    odrive.queue_velocity(0, 2.005f, odrive.stops(0));
+    odrive.update();
+    hal::sim::advance_us(10000);
+  }
+  check(sim.velocity_commands() == 1, "deadband holds back");
+  odrive.queue_velocity(0, 2.005f, odrive.stops(0));
+  odrive.update();
+  hal::sim::advance_us(1000);
+  check(sim.velocity_commands() == 2 && sim.axis(0).vel_setpoint == 2.005f, "keepalive resends");
+  check(odrive.keepalives_sent() == 1, "keepalive counted");
+
+  odrive.queue_velocity(0, 2.1f, odrive.stops(0));
+  odrive.update();
+  odrive.queue_velocity(0, 0, odrive.stops(0));
+  odrive.update();
+  hal::sim::advance_us(1000);
+  check(sim.velocity_commands() == 4 && sim.axis(0).vel_setpoint == 0, "change and stop sent");
+
+  // A direct set_velocity makes the next queued value go out even if it's the same
+  odrive.set_velocity(0, 0.5f);
+  odrive.queue_velocity(0, 0, odrive.stops(0));
+  odrive.update();
+  hal::sim::advance_us(1000);
+  check(sim.velocity_commands() == 6 && sim.axis(0).vel_setpoint == 0, "set_velocity resets the gate");
+  check(odrive.command_bytes_saved() == 11 * 8, "bytes saved");
+
+  // Worked out before a stop that came in meanwhile: dropped, the next fresh one still goes out
+  uint32_t stops_seen = odrive.stops(0);
+  odrive.queue_velocity(0, 0.7f, odrive.stops(0));
+  odrive.stop_now(0);
+  odrive.queue_velocity(0, 0.7f, stops_seen);
+  odrive.update();
+  hal::sim::advance_us(1000);
+  check(sim.velocity_commands() == 7 && sim.axis(0).vel_setpoint == 0, "setpoint from before a stop dropped");
+  odrive.queue_velocity(0, 0, odrive.stops(0));
+  odrive.update();
+  hal::sim::advance_us(1000);
+  check(sim.velocity_commands() == 8 && sim.axis(0).vel_setpoint == 0, "fresh setpoint after a stop sent");
+  hal::sim::set_world(nullptr, nullptr);
+}
+
+static void check_malformed()
+{
+  hal::sim::reset();
+  CanLoopback bus;
+  ODriveCan odrive(bus.end(0));
+  CanBus& odrive_side = bus.end(1);
+
+  odrive_side.write(can_simple::pair(1, can_simple::k_get_encoder_estimates, 1, 2.0f));
+  odrive.update();
+  check(odrive.cached(ODriveLink::VELOCITY, 1) == 2.0f, "malformed baseline");
+
+  CanFrame frame = can_simple::pair(1, can_simple::k_get_encoder_estimates, 1, 9.0f);
+  frame.length = 4;
+  odrive_side.write(frame);
+  frame = can_simple::heartbeat(1, 0, 8);
+  frame.length = 2;
+  odrive_side.write(frame);
+  odrive.update();
+  check(odrive.parse_errors() == 2, "short payloads counted");
+
+  odrive_side.write(can_simple::pair(3, can_simple::k_get_encoder_estimates, 1, 9.0f));  // another node
+  odrive_side.write(can_simple::request(1, can_simple::k_get_encoder_estimates));          // stray request
+  odrive_side.write(can_simple::error(1, can_simple::k_get_motor_error, 1));               // nobody asked
+  odrive_side.write(can_simple::pair(1, 0x1f, 1, 9.0f));                                   // unknown command
+  odrive.update();
+  check(odrive.discarded_messages() == 4, "strays discarded");
+  check(odrive.cached(ODriveLink::VELOCITY, 1) == 2.0f, "cache untouched");
+  check(!odrive.cached(ODriveLink::CURRENT_STATE, 1) && odrive.replies() == 1, "nothing else stored");
+  check(odrive.rx_messages() == 7, "messages counted");
+}
+
+static void check_stop_retry()
+{
+  hal::sim::reset();
+  hal::sim::advance_us(1000);
+  CanLoopback bus;
+  ODriveCan odrive(bus.end(0));
+  CanBus& odrive_side = bus.end(1);
+
+  // Transmit queue full: the idle stays pending and isn't timed as written
+  CanFrame filler = can_simple::request(0, can_simple::k_get_encoder_estimates);
+  while (bus.end(0).write(filler)) {}
+  odrive.stop_now(1, true);
+  check(odrive.stop_retries() == 1 && odrive.stop_written_us(1) == 0, "stop on a full queue not timed");
+
+  CanFrame frame;
+  int idles = 0;
+  while (odrive_side.read(frame)) idles += frame.id == can_simple::frame_id(1, can_simple::k_set_axis_state);
+  check(idles == 0, "stop on a full queue not sent");
+
+  // The next write retries it
+  odrive.update();
+  while (odrive_side.read(frame)) idles += frame.id == can_simple::frame_id(1, can_simple::k_set_axis_state);
+  check(idles == 1 && odrive.stop_written_us(1) != 0, "stop retried once the queue drained");
+  check(odrive.idle_written_us(1) == odrive.stop_written_us(1), "idle timed when it went out");
+
+  // A plain stop after it, a limit stop say, leaves the idle's time alone
+  uint32_t idle_us = odrive.idle_written_us(1);
+  hal::sim::advance_us(500);
+  odrive.stop_now(1);
+  check(odrive.stop_written_us(1) == idle_us + 500 && odrive.idle_written_us(1) == idle_us,
+        "plain stop doesn't move the idle time");
+}
+
+int main(int argc, char** argv)
+{
+  if (argc > 1)
+  {
+    fprintf(stderr, "usage: %s\n", argv[0]);
+    return 2;
+  }
+
+  check_frames();
+  check_cyclic();
+  check_remote();
+  check_blocking();
+  check_setpoints();
+  check_malformed();
+  check_stop_retry();
+
+  printf("%s (%d failures)\n", s_failures ? "FAILED" : "ok", s_failures);
+  return s_failures ? 1 : 0;
+}
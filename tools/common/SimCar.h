@@ -0,0 +1,220 @@
+#ifndef sim_car_h
+#define sim_car_h
+
+// What the native tests share, each test is one translation unit that defines `constant`:
+// check() and the firmware on the simulated ODrive and car, with the interrupts main.cpp attaches.
+
+#include <Actuator.h>
+#include <Constant.h>
+#include <CvtPlant.h>
+#include <Hal.h>
+#include <ODriveSim.h>
+#include <ParameterStore.h>
+#include <Scheduler.h>
+#include <Sensors.h>
+#include <ToothSensor.h>
+#include <stdint.h>
+#include <stdio.h>
+
+extern Constant constant;
+
+static int s_failures = 0;
+
+// Counts a failure, prints the first 20
+static void check(bool ok, const char* what)
+{
+  if (ok) return;
+  if (s_failures < 20) printf("FAIL %s\n", what);
+  s_failures++;
+}
+
+// Resets the simulation before anything in SimCar touches it
+struct SimStart
+{
+  SimStart()
+  {
+    hal::sim::reset();
+    hal::sim::set_step_us(20);
+  }
+};
+
+// The firmware and the car, one at a time, torn down after every test
+struct SimCar
+{
+  struct Options
+  {
+    CvtPlant::Config plant;
+    ODriveSim::Config odrive;
+    // The hall interrupt stops the actuator through on_limit like main.cpp, off leaves the ends
+    // of travel to the control step
+    bool fast_stop = true;
+    // Powered up with the actuator at physical ODrive position counts and both encoders counting
+    // from there, otherwise where plant.start_position puts it and both count from 0
+    bool power_up = false;
+    double physical = 0;
+    // Interrupts and the link up before the constructor returns, off leaves them to a boot
+    // sequence calling attach_interrupts() and poll_link()
+    bool start = true;
+  };
+
+  SimStart sim_start;
+  Options options;
+  ToothSensor eg_teeth;
+  ToothSensor gb_teeth;
+  Sensors sensors;
+#ifdef MOAT_ODRIVE_CAN
+  CanLoopback can_bus;
+#endif
+  ODriveSim odrive;
+  CvtPlant plant;
+  ParameterStore parameters;
+  Actuator actuator;
+  Scheduler scheduler;
+
+  int init_status = 0;
+  uint32_t limit_stops = 0;  // stop_now calls on_limit made
+
+  explicit SimCar(const Options& options_in);
+  ~SimCar();
+  SimCar(const SimCar&) = delete;
+  SimCar& operator=(const SimCar&) = delete;
+
+  // main.cpp's interrupts on the gear tooth and hall pins, the hall state read once
+  void attach_interrupts();
+  // The scheduler from where it is, the motion until it ends or max_s passed (returns the
+  // seconds it took) or just seconds
+  void start_scheduler(void (*control_step)());
+  float run_motion(float max_s);
+  void run(float seconds);
+  ODriveSim::Axis& axis() { return odrive.axis(constant.actuator_motor_number); }
+
+  static CvtPlant::Config plant_config(const Options& options);
+  ODriveBackend::Port& port();
+};
+
+static SimCar* s_car = nullptr;
+static bool s_car_built = false;  // the hall pins settle before the Actuator is there
+
+// Same interrupts as main.cpp
+inline void external_count_eg_tooth()
+{
+  s_car->eg_teeth.on_edge();
+}
+inline void external_count_gb_tooth()
+{
+  s_car->gb_teeth.on_edge();
+}
+inline void external_hall_change()
+{
+  int hits = s_car->sensors.on_hall_change();
+  if (!s_car_built || !s_car->options.fast_stop) return;
+  uint32_t stops = s_car->actuator.odrive_link().stops(constant.actuator_motor_number);
+  s_car->actuator.on_limit(hits);
+  s_car->limit_stops += s_car->actuator.odrive_link().stops(constant.actuator_motor_number) - stops;
+}
+
+inline void step_car(void* context, uint64_t now_us)
+{
+  SimCar* car = (SimCar*)context;
+  car->odrive.step(now_us);
+  car->plant.step(now_us);
+}
+
+inline SimCar::SimCar(const Options& options_in)
+  : options(options_in),
+    eg_teeth(Constant::eg_teeth_per_rotation, Constant::eg_rpm_window_teeth, Constant::tooth_stall_timeout),
+    gb_teeth(Constant::gb_teeth_per_rotation, Constant::gb_rpm_window_teeth, Constant::tooth_stall_timeout),
+    sensors(constant, eg_teeth, gb_teeth),
+#ifdef MOAT_ODRIVE_CAN
+    odrive(can_bus.end(1), options_in.odrive),
+#else
+    odrive(Serial1, options_in.odrive),
+#endif
+    plant(odrive, constant, plant_config(options_in)),
+    actuator(port(), constant, &sensors, &parameters, false)
+{
+  s_car = this;
+  s_car_built = true;
+  if (options.power_up)
+  {
+    // Exactly there, the plant's start_position is only a float
+    axis().position = options.physical;
+    axis().count_origin = (int32_t)options.physical;
+  }
+  hal::sim::set_world(step_car, this);
+  if (!options.start) return;
+  hal::sim::advance_us(hal::sim::step_us());  // hall pins where the plant starts
+  attach_interrupts();
+  init_status = actuator.init(1000);
+}
+
+inline SimCar::~SimCar()
+{
+  scheduler.end();
+  hal::sim::set_world(nullptr, nullptr);
+  s_car_built = false;
+  s_car = nullptr;
+}
+
+inline CvtPlant::Config SimCar::plant_config(const Options& options)
+{
+  CvtPlant::Config config = options.plant;
+  config.actuator_axis = constant.actuator_motor_number;
+  if (options.power_up)
+  {
+    config.start_position = (options.physical - config.inbound_count) / constant.encoder_count_shift_length;
+    config.encoder_origin = (int32_t)options.physical;
+  }
+  return config;
+}
+
+inline ODriveBackend::Port& SimCar::port()
+{
+#ifdef MOAT_ODRIVE_CAN
+  return can_bus.end(0);
+#else
+  return Serial1;
+#endif
+}
+
+inline void SimCar::attach_interrupts()
+{
+  pinMode(constant.engine_geartooth_pin, INPUT_PULLUP);
+  pinMode(constant.gearbox_geartooth_pin, INPUT_PULLUP);
+  attachInterrupt(constant.engine_geartooth_pin, external_count_eg_tooth, FALLING);
+  attachInterrupt(constant.gearbox_geartooth_pin, external_count_gb_tooth, FALLING);
+  pinMode(constant.hall_inbound_pin, INPUT_PULLUP);
+  pinMode(constant.hall_outbound_pin, INPUT_PULLUP);
+  attachInterrupt(constant.hall_inbound_pin, external_hall_change, CHANGE);
+  attachInterrupt(constant.hall_outbound_pin, external_hall_change, CHANGE);
+  sensors.begin();
+}
+
+inline void SimCar::start_scheduler(void (*control_step)())
+{
+  if (!scheduler.running()) scheduler.begin(constant.cycle_period * 1000, control_step);
+}
+
+inline float SimCar::run_motion(float max_s)
+{
+  uint64_t start_us = hal::sim::now_us();
+  uint64_t end_us = start_us + (uint64_t)(max_s * 1e6);
+  while (actuator.motion_active() && hal::sim::now_us() < end_us)
+  {
+    hal::sim::advance_us(hal::sim::step_us());
+    scheduler.poll();
+  }
+  return (hal::sim::now_us() - start_us) * 1e-6f;
+}
+
+inline void SimCar::run(float seconds)
+{
+  uint64_t end_us = hal::sim::now_us() + (uint64_t)(seconds * 1e6);
+  while (hal::sim::now_us() < end_us)
+  {
+    hal::sim::advance_us(hal::sim::step_us());
+    scheduler.poll();
+  }
+}
+
+#endif
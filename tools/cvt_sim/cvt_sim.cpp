@@ -0,0 +1,630 @@
+/*
+CVT simulator
+Runs the real control code (Actuator, ODrive, Scheduler) on the host against a simulated
+ODrive and car, wired up the same way main.cpp wires the Teensy.
+
+usage: cvt_sim [--runs N] [--seconds S] [--scenario launch|endurance|hill|step] [--period-us U]
+               [--step-us U] [--latency-us U] [--drop-rate P] [--byte-drop-rate P]
+               [--deadband V] [--min-interval-us U] [--keepalive-us U]
+               [--set name=value]... [--seed N] [--trace file.csv] [--estimator] [--quiet]
+               [--diag file.bin] [--diag-hz N] [--telemetry file.bin]
+
+--deadband, --min-interval-us and --keepalive-us override the SetpointGate settings in Constant.h,
+--deadband 0 --keepalive-us 0 comes closest to sending every setpoint.
+--set changes a tunable (see Parameters.h) the same way the serial "set" command does.
+The step scenario climbs the hill until the engine holds engine_power in the shifting region,
+then drops engine_power by 400 rpm and reports overshoot and settling time of the step.
+--estimator compares the state estimator and the gearbox filters against the simulated shafts
+and reports the lag and the noise left once the lag is taken out.
+--diag writes the diagnostic stream main.cpp would send on USB serial, sampled from the
+background loop at --diag-hz (100), for tools/diag_viewer.
+--telemetry writes run 0 as the binary telemetry log main.cpp writes to tlm_N.bin, for
+tools/log_decoder and tools/log_replay.
+Built with -DMOAT_PROFILE (pio env native_profile) it ends with the control step stage timings.
+Built with -DMOAT_ODRIVE_CAN (pio env native_can) the ODrive is on a CAN loopback instead of
+Serial1, --latency-us and --drop-rate then apply to answers to remote requests.
+*/
+
+#include <Actuator.h>
+#include <Constant.h>
+#include <CvtPlant.h>
+#include <DiagnosticStream.h>
+#include <Hal.h>
+#include <ODriveSim.h>
+#include <ParameterStore.h>
+#include <Profiler.h>
+#include <Scheduler.h>
+#include <Sensors.h>
+#include <Telemetry.h>
+#include <ToothSensor.h>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+Constant constant;
+
+// Same sensors and interrupts as main.cpp, rebuilt for every run
+static ToothSensor* s_eg_teeth = nullptr;
+static ToothSensor* s_gb_teeth = nullptr;
+static Sensors* s_sensors = nullptr;
+static Actuator* s_actuator = nullptr;
+
+void external_count_eg_tooth()
+{
+  s_eg_teeth->on_edge();
+}
+void external_count_gb_tooth()
+{
+  s_gb_teeth->on_edge();
+}
+void external_hall_change()
+{
+  int hits = s_sensors->on_hall_change();
+  if (s_actuator != nullptr) s_actuator->on_limit(hits);
+}
+
+static SetpointGate::Config default_setpoints()
+{
+  SetpointGate::Config config;
+  config.deadband = Constant::setpoint_deadband;
+  config.min_interval_us = Constant::setpoint_min_interval;
+  config.keepalive_us = Constant::setpoint_keepalive;
+  return config;
+}
+
+struct Options
+{
+  int runs = 1;
+  float seconds = 20;
+  std::string scenario = "launch";
+  uint32_t period_us = 0;  // 0 uses constant.cycle_period
+  uint32_t step_us = 20;
+  ODriveSim::Config odrive;
+  SetpointGate::Config setpoints = default_setpoints();
+  uint32_t seed = 1;
+  const char* trace = nullptr;
+  const char* diag = nullptr;
+  const char* telemetry = nullptr;
+  uint32_t diag_hz = 100;
+  bool quiet = false;
+  bool estimator = false;
+  std::vector<std::pair<int, float>> sets;  // parameter index, value
+};
+
+// Step scenario
+static const float k_step_time = 12;     // s
+static const float k_step_size = -400;   // rpm on engine_power
+static const float k_settle_band = 50;   // rpm
+
+struct RunResult
+{
+  uint32_t cycles = 0;
+  double error_squared = 0;
+  uint32_t error_samples = 0;
+  float max_error = 0;
+  double travel = 0;          // actuator counts moved
+  uint32_t limit_hits = 0;
+  float final_speed = 0;
+  double step_ns_total = 0;
+  double step_ns_max = 0;
+  Scheduler::Stats scheduler;
+  uint32_t odrive_timeouts = 0;
+  uint32_t odrive_parse_errors = 0;
+  uint32_t commands_sent = 0;       // by the firmware
+  uint32_t keepalives_sent = 0;
+  uint32_t commands_saved = 0;
+  uint32_t command_bytes_saved = 0;
+  uint32_t velocity_commands = 0;   // seen by the ODrive
+  int init_status = 0;
+
+  // Step scenario, engine rpm against the new reference
+  float step_overshoot = 0;      // rpm past the new reference
+  float step_settling = -1;      // s until it stays within k_settle_band, -1 if it never did
+  float step_final_error = 0;    // rpm, mean over the last second
+};
+
+struct World
+{
+  ODriveSim* odrive;
+  CvtPlant* plant;
+};
+
+// What the control step needs, the scheduler only takes a plain function
+static CvtPlant* s_plant = nullptr;
+static ODriveSim* s_odrive = nullptr;
+static RunResult* s_result = nullptr;
+static FILE* s_trace = nullptr;
+static FILE* s_diag = nullptr;
+static FILE* s_telemetry_file = nullptr;
+static Telemetry s_telemetry;
+static float s_throttle = 0;
+static int s_out[30];
+static double s_last_position = 0;
+
+// --estimator, every cycle of the run next to what the car really did
+struct EstimatorTrace
+{
+  std::vector<float> engine, gearbox, ratio;  // plant
+  std::vector<float> engine_raw, engine_estimate;
+  std::vector<float> gearbox_raw, gearbox_rolling, gearbox_exponential, gearbox_median, gearbox_estimate;
+  std::vector<float> ratio_raw, ratio_estimate;
+};
+static EstimatorTrace* s_estimator_trace = nullptr;
+
+static void record_estimator(EstimatorTrace& trace)
+{
+  const StateEstimate& estimate = s_actuator->estimate();
+  trace.engine.push_back(s_plant->engine_rpm());
+  trace.gearbox.push_back(s_plant->gearbox_rpm());
+  trace.ratio.push_back(s_plant->ratio());
+  trace.engine_raw.push_back(s_out[s_actuator->RPM]);
+  trace.engine_estimate.push_back(estimate.engine_rpm);
+  float gearbox_raw = s_out[s_actuator->GB_RPM];
+  trace.gearbox_raw.push_back(gearbox_raw);
+  trace.gearbox_rolling.push_back(s_out[s_actuator->ROLLING_FRAME]);
+  trace.gearbox_exponential.push_back(s_out[s_actuator->EXP_DECAY]);
+  trace.gearbox_median.push_back(s_out[s_actuator->GB_MEDIAN]);
+  trace.gearbox_estimate.push_back(estimate.gearbox_rpm);
+  trace.ratio_raw.push_back(gearbox_raw > 0 ? s_out[s_actuator->RPM] / gearbox_raw : 0);
+  trace.ratio_estimate.push_back(estimate.ratio);
+}
+
+// Lag is the shift (in cycles) that best lines the signal up with the truth, noise is the rms
+// error left at that shift. Only cycles where the gearbox turns and the belt can grip count.
+static void print_quality(const char* name, const std::vector<float>& signal, const std::vector<float>& truth,
+                          const std::vector<float>& gearbox, float period_ms)
+{
+  const int max_shift = 60;
+  const size_t skip = 1000 / period_ms;
+  double best = -1;
+  int best_shift = 0;
+  double raw = 0;
+  for (int shift = 0; shift <= max_shift; shift++)
+  {
+    double sum = 0;
+    size_t samples = 0;
+    for (size_t i = skip + shift; i < signal.size(); i++)
+    {
+      if (gearbox[i] < 300 || gearbox[i - shift] < 300) continue;
+      double error = signal[i] - truth[i - shift];
+      sum += error * error;
+      samples++;
+    }
+    if (samples == 0) continue;
+    double mean = sum / samples;
+    if (shift == 0) raw = mean;
+    if (best < 0 || mean < best)
+    {
+      best = mean;
+      best_shift = shift;
+    }
+  }
+  printf("  %-22s lag %5.0f ms   noise %8.3f   error %8.3f (rms, without lag correction)\n", name,
+         best_shift * period_ms, sqrt(best), sqrt(raw));
+}
+
+static void print_estimator(const EstimatorTrace& trace, float period_ms)
+{
+  printf("engine rpm\n");
+  print_quality("gear tooth", trace.engine_raw, trace.engine, trace.gearbox, period_ms);
+  print_quality("estimator", trace.engine_estimate, trace.engine, trace.gearbox, period_ms);
+  printf("gearbox rpm\n");
+  print_quality("gear tooth", trace.gearbox_raw, trace.gearbox, trace.gearbox, period_ms);
+  print_quality("rolling average", trace.gearbox_rolling, trace.gearbox, trace.gearbox, period_ms);
+  print_quality("exponential", trace.gearbox_exponential, trace.gearbox, trace.gearbox, period_ms);
+  print_quality("median", trace.gearbox_median, trace.gearbox, trace.gearbox, period_ms);
+  print_quality("estimator", trace.gearbox_estimate, trace.gearbox, trace.gearbox, period_ms);
+  printf("ratio\n");
+  print_quality("gear tooth quotient", trace.ratio_raw, trace.ratio, trace.gearbox, period_ms);
+  print_quality("estimator", trace.ratio_estimate, trace.ratio, trace.gearbox, period_ms);
+}
+
+// Same fields as main.cpp's telemetry_fields
+static int telemetry_fields(const Actuator& actuator, telemetry::FieldInfo* fields)
+{
+  const struct
+  {
+    const char* name;
+    unsigned int index;
+  } table[] = {{"status", actuator.STATUS},         {"rpm", actuator.RPM},
+               {"rpm_count", actuator.RPM_COUNT},   {"dt", actuator.DT},
+               {"act_vel", actuator.ACT_VEL},       {"enc_pos", actuator.ENC_POS},
+               {"hall_in", actuator.HALL_IN},       {"hall_out", actuator.HALL_OUT},
+               {"s_time", actuator.T_START},        {"f_time", actuator.T_STOP},
+               {"o_vol", actuator.ODRV_VOLT},       {"o_curr", actuator.ODRV_CUR},
+               {"roll_frame", actuator.ROLLING_FRAME}, {"exp_decay", actuator.EXP_DECAY},
+               {"ref_rpm", actuator.REF_RPM},       {"estop", 20},
+               {"odrv_age", actuator.ODRV_AGE},     {"pid_p", actuator.PID_P},
+               {"pid_i", actuator.PID_I},           {"pid_d", actuator.PID_D},
+               {"pid_ff", actuator.PID_FF},         {"gb_median", actuator.GB_MEDIAN},
+               {"est_eg_rpm", actuator.EST_EG_RPM}, {"est_gb_rpm", actuator.EST_GB_RPM},
+               {"est_ratio", actuator.EST_RATIO},   {"gb_rpm", actuator.GB_RPM}};
+  int count = sizeof(table) / sizeof(table[0]);
+  for (int i = 0; i < count; i++)
+  {
+    memset(&fields[i], 0, sizeof(fields[i]));
+    strncpy(fields[i].name, table[i].name, telemetry::k_name_size);
+    fields[i].out_index = table[i].index;
+  }
+  return count;
+}
+
+// The background half of main.cpp's save_telemetry
+static void save_telemetry()
+{
+  size_t length;
+  const uint8_t* buffer = s_telemetry.ready(length);
+  if (buffer == nullptr) return;
+  fwrite(buffer, 1, length, s_telemetry_file);
+  s_telemetry.release();
+}
+
+static void step_world(void* context, uint64_t now_us)
+{
+  World* world = (World*)context;
+  world->odrive->step(now_us);
+  world->plant->step(now_us);
+}
+
+static void control_step()
+{
+  PROFILE_SCOPE(profile::k_cycle);
+  auto start = std::chrono::steady_clock::now();
+  s_actuator->control_function(s_out);
+  s_out[20] = digitalReadFast(constant.estop_pin);  // main.cpp's ESTOP
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+  RunResult& result = *s_result;
+  result.cycles++;
+  result.step_ns_total += ns;
+  if (ns > result.step_ns_max) result.step_ns_max = ns;
+
+  // Tracking error once the engine has had a second to come up
+  if (hal::sim::now_us() > 1000000)
+  {
+    float error = s_out[s_actuator->REF_RPM] - s_plant->engine_rpm();
+    result.error_squared += error * error;
+    result.error_samples++;
+    if (fabsf(error) > result.max_error) result.max_error = fabsf(error);
+  }
+  double position = s_odrive->axis(constant.actuator_motor_number).position;
+  result.travel += fabs(position - s_last_position);
+  s_last_position = position;
+  if (s_estimator_trace != nullptr) record_estimator(*s_estimator_trace);
+  if (s_telemetry_file != nullptr) s_telemetry.push(s_out, micros());
+
+  if (s_trace != nullptr)
+  {
+    fprintf(s_trace, "%.4f, %.2f, %.1f, %d, %d, %.1f, %d, %.3f, %.3f, %d, %d, %d\n",
+            hal::sim::now_us() * 1e-6, s_throttle, s_plant->engine_rpm(), s_out[s_actuator->RPM],
+            s_out[s_actuator->REF_RPM], s_plant->gearbox_rpm(), s_out[s_actuator->ROLLING_FRAME],
+            s_plant->ratio(), s_plant->position(), s_out[s_actuator->ACT_VEL], s_out[s_actuator->HALL_IN],
+            s_out[s_actuator->HALL_OUT]);
+  }
+}
+
+// Serial in the simulation is the firmware's side of a byte queue, reports and the diagnostic
+// stream go to files instead. A file never runs out of room.
+class FilePrint : public Print
+{
+public:
+  explicit FilePrint(FILE* file) : m_file(file) {}
+  size_t write(uint8_t c) override { return fputc(c, m_file) == EOF ? 0 : 1; }
+  size_t write(const uint8_t* data, size_t length) override { return fwrite(data, 1, length, m_file); }
+  int availableForWrite() override { return 1 << 16; }
+
+private:
+  FILE* m_file;
+};
+
+static float throttle_for(const Options& options, float t, CvtPlant& plant)
+{
+  if (options.scenario == "endurance")
+  {
+    // Full throttle down the straights, partial through the corners
+    float lap = fmodf(t, 12);
+    return lap < 8 ? 1.0f : 0.3f;
+  }
+  if (options.scenario == "hill" || options.scenario == "step")
+  {
+    plant.set_grade(t > 5 ? 0.15f : 0);
+    return t < 0.5f ? 0 : 1;
+  }
+  return t < 0.5f ? 0 : 1;
+}
+
+static RunResult run(const Options& options, int run_number)
+{
+  RunResult result;
+  hal::sim::reset();
+  hal::sim::set_step_us(options.step_us);
+  ToothSensor eg_teeth(Constant::eg_teeth_per_rotation, Constant::eg_rpm_window_teeth, Constant::tooth_stall_timeout);
+  ToothSensor gb_teeth(Constant::gb_teeth_per_rotation, Constant::gb_rpm_window_teeth, Constant::tooth_stall_timeout);
+  s_eg_teeth = &eg_teeth;
+  s_gb_teeth = &gb_teeth;
+  Sensors sensors(constant, eg_teeth, gb_teeth);
+  s_sensors = &sensors;
+  pinMode(constant.engine_geartooth_pin, INPUT_PULLUP);
+  pinMode(constant.gearbox_geartooth_pin, INPUT_PULLUP);
+  attachInterrupt(constant.engine_geartooth_pin, external_count_eg_tooth, FALLING);
+  attachInterrupt(constant.gearbox_geartooth_pin, external_count_gb_tooth, FALLING);
+  pinMode(constant.hall_inbound_pin, INPUT_PULLUP);
+  pinMode(constant.hall_outbound_pin, INPUT_PULLUP);
+  attachInterrupt(constant.hall_inbound_pin, external_hall_change, CHANGE);
+  attachInterrupt(constant.hall_outbound_pin, external_hall_change, CHANGE);
+
+  ODriveSim::Config odrive_config = options.odrive;
+  odrive_config.seed = options.seed + run_number;
+#ifdef MOAT_ODRIVE_CAN
+  CanLoopback can_bus;
+  ODriveSim odrive(can_bus.end(1), odrive_config);
+  CanBus& odrive_port = can_bus.end(0);
+#else
+  ODriveSim odrive(Serial1, odrive_config);
+  HardwareSerial& odrive_port = Serial1;
+#endif
+  CvtPlant::Config plant_config;
+  plant_config.actuator_axis = constant.actuator_motor_number;
+  CvtPlant plant(odrive, constant, plant_config);
+  World world = {&odrive, &plant};
+  hal::sim::set_world(step_world, &world);
+
+  sensors.begin();
+
+  ParameterStore parameters;
+  Parameters tuned = parameters.active();
+  for (const auto& set : options.sets) parameter_value(tuned, set.first) = set.second;
+  int tuned_status = parameters.stage(tuned);
+  if (tuned_status != ParameterStore::k_ok)
+  {
+    fprintf(stderr, "rejected --set: %s\n", ParameterStore::status_name(tuned_status));
+    exit(2);
+  }
+  Actuator actuator(odrive_port, constant, &sensors, &parameters, false);
+  actuator.configure_setpoints(options.setpoints);
+  result.init_status = actuator.init(1000);
+
+  s_actuator = &actuator;
+  s_plant = &plant;
+  s_odrive = &odrive;
+  s_result = &result;
+  s_last_position = odrive.axis(constant.actuator_motor_number).position;
+  EstimatorTrace estimator_trace;
+  s_estimator_trace = options.estimator ? &estimator_trace : nullptr;
+
+  Scheduler scheduler;
+  uint32_t period_us = options.period_us ? options.period_us : constant.cycle_period * 1000;
+  if (s_telemetry_file != nullptr)
+  {
+    // Closed again at the end of run 0
+    telemetry::FieldInfo fields[telemetry::k_max_fields];
+    s_telemetry.begin(fields, telemetry_fields(actuator, fields), period_us);
+  }
+  if (!scheduler.begin(period_us, control_step))
+  {
+    fprintf(stderr, "scheduler rejected a period of %u us\n", period_us);
+    exit(2);
+  }
+
+  // Sampled from the background like main.cpp's loop(), between control steps
+  DiagnosticStream diagnostics;
+  diagnostics.begin(s_diag != nullptr ? options.diag_hz : 0, micros());
+  FilePrint diag_out(s_diag);
+
+  uint64_t start_us = hal::sim::now_us();
+  uint64_t end_us = start_us + (uint64_t)(options.seconds * 1e6);
+  bool stepped = false;
+  float step_target = 0;
+  float last_outside = 0;
+  double final_error = 0;
+  int final_samples = 0;
+  while (hal::sim::now_us() < end_us)
+  {
+    float t = (hal::sim::now_us() - start_us) * 1e-6f;
+    s_throttle = throttle_for(options, t, plant);
+    plant.set_throttle(s_throttle);
+    hal::sim::advance_us(options.step_us);
+    scheduler.poll();
+    if (diagnostics.due(micros()))
+    {
+      diagnostic::Sample sample;
+      actuator.sample_diagnostic(sample);
+      diagnostics.send(sample, diag_out);
+    }
+    if (s_telemetry_file != nullptr) save_telemetry();
+
+    if (options.scenario != "step" || t < k_step_time) continue;
+    if (!stepped)
+    {
+      // Live change, like a "set engine_power" arriving over serial
+      Parameters step = parameters.active();
+      step.engine_power += k_step_size;
+      parameters.stage(step);
+      step_target = step.engine_power;
+      last_outside = t;
+      stepped = true;
+    }
+    float error = plant.engine_rpm() - step_target;
+    float past = k_step_size < 0 ? -error : error;
+    if (past > result.step_overshoot) result.step_overshoot = past;
+    if (fabsf(error) > k_settle_band) last_outside = t;
+    if (t > options.seconds - 1)
+    {
+      final_error += error;
+      final_samples++;
+    }
+  }
+  if (stepped)
+  {
+    float settle_after = last_outside - k_step_time;
+    result.step_settling = last_outside < options.seconds - 1 ? settle_after : -1;
+    result.step_final_error = final_samples ? final_error / final_samples : 0;
+  }
+  scheduler.end();
+  if (s_telemetry_file != nullptr)
+  {
+    save_telemetry();
+    size_t length;
+    const uint8_t* buffer = s_telemetry.drain(length);
+    fwrite(buffer, 1, length, s_telemetry_file);
+    fclose(s_telemetry_file);
+    s_telemetry_file = nullptr;
+  }
+
+  result.scheduler = scheduler.stats();
+  result.limit_hits = plant.limit_hits();
+  result.final_speed = plant.speed();
+  result.odrive_timeouts = actuator.odrive_link().timeouts();
+  result.odrive_parse_errors = actuator.odrive_link().parse_errors();
+  result.commands_sent = actuator.odrive_link().commands_sent();
+  result.keepalives_sent = actuator.odrive_link().keepalives_sent();
+  result.commands_saved = actuator.odrive_link().commands_saved();
+  result.command_bytes_saved = actuator.odrive_link().command_bytes_saved();
+  result.velocity_commands = odrive.velocity_commands();
+  if (options.estimator && !options.quiet) print_estimator(estimator_trace, period_us / 1000.0f);
+  s_estimator_trace = nullptr;
+  s_actuator = nullptr;
+  hal::sim::set_world(nullptr, nullptr);
+  return result;
+}
+
+static void usage(const char* name)
+{
+  fprintf(stderr,
+          "usage: %s [--runs N] [--seconds S] [--scenario launch|endurance|hill|step] [--period-us U]\n"
+          "          [--step-us U] [--latency-us U] [--drop-rate P] [--byte-drop-rate P]\n"
+          "          [--deadband V] [--min-interval-us U] [--keepalive-us U]\n"
+          "          [--set name=value]... [--seed N] [--trace file.csv] [--estimator] [--quiet]\n"
+          "          [--diag file.bin] [--diag-hz N] [--telemetry file.bin]\n",
+          name);
+  exit(2);
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+  for (int i = 1; i < argc; i++)
+  {
+    const char* arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (strcmp(arg, "--quiet") == 0)
+    {
+      options.quiet = true;
+      continue;
+    }
+    if (strcmp(arg, "--estimator") == 0)
+    {
+      options.estimator = true;
+      continue;
+    }
+    if (value == nullptr) usage(argv[0]);
+    i++;
+    if (strcmp(arg, "--runs") == 0) options.runs = atoi(value);
+    else if (strcmp(arg, "--seconds") == 0) options.seconds = atof(value);
+    else if (strcmp(arg, "--scenario") == 0) options.scenario = value;
+    else if (strcmp(arg, "--period-us") == 0) options.period_us = atoi(value);
+    else if (strcmp(arg, "--step-us") == 0) options.step_us = atoi(value);
+    else if (strcmp(arg, "--latency-us") == 0) options.odrive.reply_latency_us = atoi(value);
+    else if (strcmp(arg, "--drop-rate") == 0) options.odrive.reply_drop_rate = atof(value);
+    else if (strcmp(arg, "--byte-drop-rate") == 0) options.odrive.byte_drop_rate = atof(value);
+    else if (strcmp(arg, "--deadband") == 0) options.setpoints.deadband = atof(value);
+    else if (strcmp(arg, "--min-interval-us") == 0) options.setpoints.min_interval_us = atoi(value);
+    else if (strcmp(arg, "--keepalive-us") == 0) options.setpoints.keepalive_us = atoi(value);
+    else if (strcmp(arg, "--seed") == 0) options.seed = atoi(value);
+    else if (strcmp(arg, "--trace") == 0) options.trace = value;
+    else if (strcmp(arg, "--diag") == 0) options.diag = value;
+    else if (strcmp(arg, "--diag-hz") == 0) options.diag_hz = atoi(value);
+    else if (strcmp(arg, "--telemetry") == 0) options.telemetry = value;
+    else if (strcmp(arg, "--set") == 0)
+    {
+      const char* equals = strchr(value, '=');
+      std::string name = equals ? std::string(value, equals - value) : value;
+      int index = ParameterStore::find(name.c_str());
+      if (index < 0 || equals == nullptr)
+      {
+        fprintf(stderr, "unknown parameter in --set %s\n", value);
+        return 2;
+      }
+      options.sets.push_back({index, (float)atof(equals + 1)});
+    }
+    else usage(argv[0]);
+  }
+
+  if (options.trace != nullptr)
+  {
+    s_trace = fopen(options.trace, "w");
+    if (s_trace == nullptr)
+    {
+      fprintf(stderr, "could not write %s\n", options.trace);
+      return 2;
+    }
+    fprintf(s_trace, "t, throttle, engine_rpm, rpm, ref_rpm, gearbox_rpm, roll_frame, ratio, position, act_vel, hall_in, hall_out\n");
+  }
+
+  if (options.diag != nullptr)
+  {
+    s_diag = fopen(options.diag, "wb");
+    if (s_diag == nullptr)
+    {
+      fprintf(stderr, "could not write %s\n", options.diag);
+      return 2;
+    }
+  }
+
+  if (options.telemetry != nullptr)
+  {
+    s_telemetry_file = fopen(options.telemetry, "wb");
+    if (s_telemetry_file == nullptr)
+    {
+      fprintf(stderr, "could not write %s\n", options.telemetry);
+      return 2;
+    }
+  }
+
+  auto wall_start = std::chrono::steady_clock::now();
+  double rms_total = 0;
+  double step_ns_total = 0;
+  uint64_t cycles_total = 0;
+  for (int i = 0; i < options.runs; i++)
+  {
+    RunResult result = run(options, i);
+    float rms = result.error_samples ? sqrt(result.error_squared / result.error_samples) : 0;
+    rms_total += rms;
+    step_ns_total += result.step_ns_total;
+    cycles_total += result.cycles;
+    if (!options.quiet)
+    {
+      printf("run %d: init %d, cycles %u, rpm error rms %.1f max %.1f, travel %.0f counts, limit hits %u, "
+             "speed %.1f m/s, step %.0f ns mean %.0f ns max, jitter %d..%d us, overruns %u, odrive timeouts %u\n",
+             i, result.init_status, result.cycles, rms, result.max_error, result.travel, result.limit_hits,
+             result.final_speed, result.cycles ? result.step_ns_total / result.cycles : 0, result.step_ns_max,
+             result.scheduler.jitter_min, result.scheduler.jitter_max, result.scheduler.overruns,
+             result.odrive_timeouts);
+      printf("run %d: odrive commands sent %u (keepalives %u, %u reached the odrive), saved %.0f/s, %.0f bytes/s\n",
+             i, result.commands_sent, result.keepalives_sent, result.velocity_commands,
+             result.commands_saved / options.seconds, result.command_bytes_saved / options.seconds);
+      if (options.scenario == "step")
+      {
+        printf("run %d: step %+.0f rpm, overshoot %.0f rpm, settling %.2f s (+-%.0f rpm), final error %.1f rpm\n",
+               i, k_step_size, result.step_overshoot, result.step_settling, k_settle_band, result.step_final_error);
+      }
+    }
+  }
+  if (s_trace != nullptr) fclose(s_trace);
+  if (s_diag != nullptr) fclose(s_diag);
+
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+  printf("%d runs of %.1f s (%s) in %.2f s wall, %.0f runs/min, mean rpm error rms %.1f, control step %.0f ns\n",
+         options.runs, options.seconds, options.scenario.c_str(), wall, options.runs / wall * 60,
+         rms_total / options.runs, cycles_total ? step_ns_total / cycles_total : 0);
+#ifdef MOAT_PROFILE
+  FilePrint out(stdout);
+  Profiler::instance().print(out);
+#endif
+  return 0;
+}
@@ -0,0 +1,226 @@
+/*
+Diagnostic stream viewer
+Decodes the diagnostic frames the Teensy streams over USB serial (MODE 1, or mode 0 with
+STREAM_DIAGNOSTICS) into one readable line per frame.
+
+usage: diag_viewer [--every N] [--text] <port|file|->
+  --every N  print every Nth frame, the stream runs at 100 Hz and up
+  --text     also print the text the firmware wrote between frames, prefixed with #
+A serial port is put in raw mode and read until Ctrl-C, a file or stdin until its end. A summary
+goes to stderr and the exit code is non-zero when any frame failed its crc.
+*/
+
+#include <Constant.h>
+#include <DiagnosticFormat.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+struct ViewStats
+{
+  unsigned long frames = 0;
+  unsigned long bad_frames = 0;     // sync and length fine, crc not
+  unsigned long text_bytes = 0;     // anything between frames
+  unsigned long sequence_gaps = 0;
+  unsigned long missing_frames = 0;
+};
+
+static volatile sig_atomic_t s_stop = 0;
+
+static void on_interrupt(int)
+{
+  s_stop = 1;
+}
+
+static bool open_input(const char* path, int& fd)
+{
+  if (strcmp(path, "-") == 0)
+  {
+    fd = STDIN_FILENO;
+    return true;
+  }
+  fd = open(path, O_RDONLY | O_NOCTTY);
+  if (fd < 0) return false;
+  if (isatty(fd))
+  {
+    // USB serial ignores the baud rate, raw mode is what matters
+    struct termios tty;
+    if (tcgetattr(fd, &tty) == 0)
+    {
+      cfmakeraw(&tty);
+      tty.c_cc[VMIN] = 1;
+      tty.c_cc[VTIME] = 0;
+      tcsetattr(fd, TCSANOW, &tty);
+    }
+  }
+  return true;
+}
+
+// rpm from the tooth counts of two samples, the last edge times give the period they took
+static float tooth_rpm(uint32_t count, uint32_t edge_us, uint32_t last_count, uint32_t last_edge_us,
+                       float teeth_per_rotation)
+{
+  uint32_t teeth = count - last_count;
+  uint32_t elapsed_us = edge_us - last_edge_us;
+  if (teeth == 0 || elapsed_us == 0) return 0;
+  return teeth / teeth_per_rotation * 60e6f / elapsed_us;
+}
+
+static void print_sample(const diagnostic::FrameHeader& header, const diagnostic::Sample& sample,
+                         const diagnostic::Sample& last, bool have_last)
+{
+  float engine_rpm = 0;
+  float gearbox_rpm = 0;
+  if (have_last)
+  {
+    engine_rpm = tooth_rpm(sample.engine_count, sample.engine_edge_us, last.engine_count, last.engine_edge_us,
+                           Constant::eg_teeth_per_rotation);
+    gearbox_rpm = tooth_rpm(sample.gearbox_count, sample.gearbox_edge_us, last.gearbox_count, last.gearbox_edge_us,
+                            Constant::gb_teeth_per_rotation);
+  }
+  printf("%10.6f s #%-7u eg %5.0f rpm (%u teeth, control %.0f)  gb %5.0f rpm (%u teeth, control %.0f, "
+         "avg %.0f, median %.0f, exp %.0f)  act %6.2f t/s",
+         sample.time_us * 1e-6, header.sequence, engine_rpm, sample.engine_count, sample.engine_rpm, gearbox_rpm,
+         sample.gearbox_count, sample.gearbox_rpm, sample.gearbox_average, sample.gearbox_median,
+         sample.gearbox_exponential, sample.commanded_velocity);
+  if (sample.odrive_age_us == UINT32_MAX) printf("  odrive -");
+  else
+  {
+    printf("  odrive %.1f V %.2f A %.2f t/s pos %d (%.1f ms old)", sample.odrive_voltage, sample.odrive_current,
+           sample.odrive_velocity, sample.odrive_position, sample.odrive_age_us * 1e-3);
+  }
+  printf("  enc %d [%d..%d] hall in %u@%d out %u@%d (%u changes)  estop %u%s  motion %u/%u\n", sample.encoder_count,
+         sample.encoder_inbound, sample.encoder_outbound, sample.hall_inbound, sample.hall_inbound_count,
+         sample.hall_outbound, sample.hall_outbound_count, sample.hall_changes, sample.estop_pin,
+         sample.estop_pressed ? " pressed" : "", sample.motion_state, sample.motion_status);
+}
+
+// Only what's printable, the rest of a frame that failed its crc also ends up here
+static void print_text(const uint8_t* data, size_t length, bool& line_start)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    uint8_t c = data[i];
+    if (c != '\n' && c != '\t' && !isprint(c)) continue;
+    if (line_start) fputs("# ", stdout);
+    line_start = c == '\n';
+    putchar(c);
+  }
+}
+
+static void end_text(bool& line_start)
+{
+  if (!line_start) putchar('\n');
+  line_start = true;
+}
+
+int main(int argc, char** argv)
+{
+  unsigned long every = 1;
+  bool show_text = false;
+  const char* path = nullptr;
+  bool usage = false;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--every") == 0 && i + 1 < argc) every = strtoul(argv[++i], nullptr, 10);
+    else if (strcmp(argv[i], "--text") == 0) show_text = true;
+    else if (path == nullptr && (argv[i][0] != '-' || strcmp(argv[i], "-") == 0)) path = argv[i];
+    else usage = true;
+  }
+  if (usage || path == nullptr || every == 0)
+  {
+    fprintf(stderr, "usage: %s [--every N] [--text] <port|file|->\n", argv[0]);
+    return 2;
+  }
+
+  int fd;
+  if (!open_input(path, fd))
+  {
+    fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+    return 2;
+  }
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_interrupt;
+  sigaction(SIGINT, &action, nullptr);  // no SA_RESTART, so a blocked read returns
+
+  ViewStats stats;
+  uint8_t buffer[4096];
+  size_t fill = 0;
+  bool have_sequence = false;
+  uint32_t last_sequence = 0;
+  diagnostic::Sample last = {};
+  bool line_start = true;
+  const uint8_t sync[2] = {diagnostic::k_sync & 0xFF, diagnostic::k_sync >> 8};
+
+  while (!s_stop)
+  {
+    ssize_t n = read(fd, buffer + fill, sizeof(buffer) - fill);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    fill += n;
+
+    size_t position = 0;
+    while (fill - position >= diagnostic::k_frame_size)
+    {
+      const uint8_t* raw = buffer + position;
+      diagnostic::FrameHeader header;
+      memcpy(&header, raw, sizeof(header));
+      if (raw[0] != sync[0] || raw[1] != sync[1] || header.version != diagnostic::k_version ||
+          header.length != sizeof(diagnostic::Sample))
+      {
+        // Text, or the middle of a frame the stream started in
+        if (show_text) print_text(raw, 1, line_start);
+        stats.text_bytes++;
+        position++;
+        continue;
+      }
+      uint16_t crc;
+      memcpy(&crc, raw + diagnostic::k_frame_size - sizeof(crc), sizeof(crc));
+      if (crc != diagnostic::frame_crc(raw))
+      {
+        stats.bad_frames++;
+        position++;
+        continue;
+      }
+
+      diagnostic::Sample sample;
+      memcpy(&sample, raw + sizeof(header), sizeof(sample));
+      if (have_sequence && header.sequence != last_sequence + 1)
+      {
+        stats.sequence_gaps++;
+        stats.missing_frames += header.sequence - last_sequence - 1;
+      }
+      if (stats.frames % every == 0)
+      {
+        end_text(line_start);
+        print_sample(header, sample, last, have_sequence);
+      }
+      have_sequence = true;
+      last_sequence = header.sequence;
+      last = sample;
+      stats.frames++;
+      position += diagnostic::k_frame_size;
+    }
+    memmove(buffer, buffer + position, fill - position);
+    fill -= position;
+    fflush(stdout);
+  }
+  if (show_text)
+  {
+    print_text(buffer, fill, line_start);
+    end_text(line_start);
+  }
+  stats.text_bytes += fill;
+  if (fd != STDIN_FILENO) close(fd);
+
+  fprintf(stderr, "frames: %lu, bad frames: %lu, text bytes: %lu, sequence gaps: %lu (%lu frames dropped)\n",
+          stats.frames, stats.bad_frames, stats.text_bytes, stats.sequence_gaps, stats.missing_frames);
+  return stats.bad_frames == 0 ? 0 : 1;
+}
@@ -0,0 +1,339 @@
+/*
+E-stop test
+- states: Estop on the simulated pin, armed -> tripped -> released -> armed, pressing again
+  while released trips it again, a press during the release hold restarts it, reset() only
+  once released and a button held at begin() trips straight away
+- latency: the interrupt-to-stop time is recorded once per trip, a stop from before the trip
+  doesn't count and it survives micros() wrapping
+- actuator: the pin interrupt idles both simulated ODrive axes and records its latency without a
+  control step, the control step holds them idle and aborts a homing while tripped, and only a
+  reset after the release hold brings them back to closed loop
+- load: presses at random times while the control step keeps the ODrive port busy, the stop
+  goes out ahead of everything the link still has queued, waits at most for what the UART
+  buffer already holds and never lands inside another line
+
+usage: estop_test [--verbose]
+Exit code is non-zero on any failure.
+Built with -DMOAT_ODRIVE_CAN the ODrive is on a CAN loopback instead of Serial1.
+*/
+
+#include "../common/SimCar.h"
+#include <Estop.h>
+#include <MotionSequencer.h>
+#include <ODrive.h>
+#include <stdio.h>
+#include <string.h>
+
+Constant constant;
+
+static bool s_verbose = false;
+
+//-----------------States--------------//
+static Estop::Config estop_config(uint32_t hold_us)
+{
+  Estop::Config config;
+  config.pin = constant.estop_pin;
+  config.release_hold_us = hold_us;
+  return config;
+}
+
+static void test_states()
+{
+  hal::sim::reset();
+  pinMode(constant.estop_pin, INPUT_PULLDOWN);
+  const uint32_t hold = 1000;
+  Estop estop(constant);
+  estop.configure(estop_config(hold));
+  estop.begin(0);
+  check(estop.state() == Estop::ARMED && !estop.tripped(), "states: armed after begin with the button up");
+  check(estop.reset(0) == Estop::k_reset_armed, "states: nothing to reset while armed");
+
+  hal::sim::set_pin(constant.estop_pin, HIGH);
+  estop.press(100);
+  estop.press(150);  // bounce
+  Estop::Stats stats = estop.stats();
+  check(estop.state() == Estop::TRIPPED && estop.tripped(), "states: press trips it");
+  check(stats.trips == 1 && stats.presses == 2 && stats.tripped_us == 100, "states: a bounce isn't another trip");
+  estop.update(5000);
+  check(estop.state() == Estop::TRIPPED, "states: stays tripped while pressed");
+  check(estop.reset(5000) == Estop::k_reset_pressed, "states: no reset while pressed");
+
+  hal::sim::set_pin(constant.estop_pin, LOW);
+  estop.update(6000);
+  estop.update(6000 + hold - 1);
+  check(estop.state() == Estop::TRIPPED, "states: tripped until released for the hold");
+  check(estop.reset(6000 + hold - 1) == Estop::k_reset_pressed, "states: no reset inside the hold");
+  estop.press(6500);  // too short for update() to see the pin
+  estop.update(6000 + hold);
+  check(estop.state() == Estop::TRIPPED, "states: a press during the hold restarts it");
+  estop.update(7000);
+  estop.update(7000 + hold);
+  check(estop.state() == Estop::RELEASED && estop.tripped(), "states: released but still holding the outputs");
+
+  hal::sim::set_pin(constant.estop_pin, HIGH);
+  estop.press(9000);
+  check(estop.state() == Estop::TRIPPED && estop.stats().trips == 2, "states: pressing again while released trips");
+  hal::sim::set_pin(constant.estop_pin, LOW);
+  estop.update(10000);
+  check(estop.reset(10000 + hold) == Estop::k_reset_ok, "states: reset once released for the hold");
+  check(estop.state() == Estop::ARMED && !estop.tripped(), "states: armed after reset");
+
+  // Held at power up, and an active low button
+  hal::sim::set_pin(constant.estop_pin, HIGH);
+  Estop held(constant);
+  held.configure(estop_config(hold));
+  held.begin(20);
+  check(held.tripped() && held.stats().tripped_us == 20, "states: held at begin trips");
+  Estop::Config low = estop_config(hold);
+  low.active_high = false;
+  Estop active_low(constant);
+  active_low.configure(low);
+  active_low.begin(0);
+  check(!active_low.tripped() && !active_low.pressed(), "states: active low reads high as released");
+}
+
+//-----------------Latency--------------//
+static void test_latency()
+{
+  hal::sim::reset();
+  pinMode(constant.estop_pin, INPUT_PULLDOWN);
+  Estop estop(constant);
+  estop.configure(estop_config(1000));
+  estop.begin(0);
+  estop.stopped(500);
+  check(estop.stats().latency_count == 0, "latency: nothing without a trip");
+
+  hal::sim::set_pin(constant.estop_pin, HIGH);
+  estop.press(1000);
+  estop.stopped(900);
+  check(estop.stats().latency_count == 0, "latency: a stop from before the trip doesn't count");
+  estop.stopped(1300);
+  estop.stopped(1900);
+  Estop::Stats stats = estop.stats();
+  check(stats.latency_count == 1 && stats.last_latency_us == 300 && stats.max_latency_us == 300,
+        "latency: recorded once per trip");
+
+  hal::sim::set_pin(constant.estop_pin, LOW);
+  estop.update(2000);
+  estop.reset(3000);
+  hal::sim::set_pin(constant.estop_pin, HIGH);
+  estop.press(0xFFFFFF00u);
+  estop.stopped(0x40);
+  stats = estop.stats();
+  check(stats.latency_count == 2 && stats.last_latency_us == 0x140 && stats.max_latency_us == 0x140,
+        "latency: across the micros() wrap");
+}
+
+//-----------------Actuator--------------//
+static Actuator* s_actuator = nullptr;
+static uint64_t s_press_at_us = UINT64_MAX;
+
+static void estop_isr()
+{
+  s_actuator->on_estop();
+}
+
+// Mid travel, so only the e-stop idles the axes
+static SimCar::Options mid_travel()
+{
+  SimCar::Options options;
+  options.plant.start_position = 0.5;
+  return options;
+}
+
+struct Rig : SimCar
+{
+  Estop estop{constant};
+  int out[30];
+  uint64_t next_cycle_us = 0;
+
+  Rig() : SimCar(mid_travel()) {}
+
+  // main.cpp: the control step on its period, the e-stop updated in between
+  void run(float seconds)
+  {
+    uint64_t end_us = hal::sim::now_us() + (uint64_t)(seconds * 1e6);
+    while (hal::sim::now_us() < end_us)
+    {
+      hal::sim::advance_us(hal::sim::step_us());
+      // Outside the world, so the interrupt's write waits on a full tx buffer like it would
+      if (hal::sim::now_us() >= s_press_at_us)
+      {
+        s_press_at_us = UINT64_MAX;
+        hal::sim::set_pin(constant.estop_pin, HIGH);
+      }
+      estop.update(micros());
+      if (hal::sim::now_us() < next_cycle_us) continue;
+      actuator.control_function(out);
+      next_cycle_us += constant.cycle_period * 1000;
+    }
+  }
+
+  void release()
+  {
+    hal::sim::set_pin(constant.estop_pin, LOW);
+  }
+};
+
+static Rig* make_rig(uint32_t hold_us)
+{
+  s_press_at_us = UINT64_MAX;
+  Rig* rig = new Rig();
+  s_actuator = &rig->actuator;
+  rig->estop.configure(estop_config(hold_us));
+  rig->actuator.attach_estop(&rig->estop);
+  pinMode(constant.estop_pin, INPUT_PULLDOWN);
+  attachInterrupt(constant.estop_pin, estop_isr, RISING);
+  rig->estop.begin(micros());
+  rig->next_cycle_us = hal::sim::now_us();
+  return rig;
+}
+
+static void free_rig(Rig* rig)
+{
+  s_actuator = nullptr;
+  delete rig;
+}
+
+static void test_actuator()
+{
+  Rig* rig = make_rig(constant.estop_release_hold);
+  const ODriveSim::Axis& actuator_axis = rig->odrive.axis(constant.actuator_motor_number);
+  const ODriveSim::Axis& cooling_axis = rig->odrive.axis(constant.cooling_motor_number);
+  rig->actuator.set_cooling_velocity(10);
+  rig->run(0.5);
+  check(actuator_axis.state == MotionSequencer::k_state_closed_loop &&
+            cooling_axis.state == MotionSequencer::k_state_closed_loop,
+        "actuator: both axes closed loop before the press");
+  rig->actuator.start_homing();
+  rig->run(0.05);
+  check(rig->actuator.motion_active(), "actuator: homing running before the press");
+
+  // The interrupt's idle reaches the ODrive on its own, no control step runs here
+  hal::sim::set_pin(constant.estop_pin, HIGH);
+  uint64_t pressed_us = hal::sim::now_us();
+  while (hal::sim::now_us() < pressed_us + 10000) hal::sim::advance_us(hal::sim::step_us());
+  check(actuator_axis.state == MotionSequencer::k_state_idle && cooling_axis.state == MotionSequencer::k_state_idle,
+        "actuator: interrupt idles both axes");
+  check(rig->estop.stats().latency_count == 1, "actuator: latency recorded without a control step");
+  rig->next_cycle_us = hal::sim::now_us();
+
+  rig->run(1);
+  check(actuator_axis.state == MotionSequencer::k_state_idle && cooling_axis.state == MotionSequencer::k_state_idle,
+        "actuator: held idle while pressed");
+  check(!rig->actuator.motion_active() && rig->actuator.motion_status() == MotionSequencer::k_aborted,
+        "actuator: homing aborted");
+  check(rig->out[rig->actuator.STATUS] == 5, "actuator: status 5 while held");
+  diagnostic::Sample sample;
+  rig->actuator.sample_diagnostic(sample);
+  check(sample.estop_pressed == 1, "actuator: diagnostic sample shows the trip");
+  Estop::Stats stats = rig->estop.stats();
+  check(stats.trips == 1 && stats.latency_count == 1, "actuator: latency recorded");
+
+  rig->release();
+  rig->run(1);
+  check(rig->estop.state() == Estop::RELEASED, "actuator: released after the hold");
+  check(actuator_axis.state == MotionSequencer::k_state_idle && cooling_axis.state == MotionSequencer::k_state_idle,
+        "actuator: still idle until reset");
+  check(rig->estop.reset(micros()) == Estop::k_reset_ok, "actuator: reset");
+  rig->run(0.5);
+  check(rig->out[rig->actuator.STATUS] != 5, "actuator: status clears after reset");
+  check(cooling_axis.state == MotionSequencer::k_state_closed_loop, "actuator: cooling back in closed loop");
+  // The aborted homing holds the actuator idle until the next motion, like any failed one
+  check(actuator_axis.state == MotionSequencer::k_state_idle, "actuator: actuator stays held after the abort");
+  rig->actuator.start_homing();
+  rig->run(0.1);
+  check(actuator_axis.state == MotionSequencer::k_state_closed_loop, "actuator: closed loop for the next motion");
+  if (s_verbose)
+  {
+    printf("actuator: latency %u us, odrive commands %u\n", stats.last_latency_us,
+           rig->actuator.odrive_link().commands_sent());
+  }
+  free_rig(rig);
+}
+
+//-----------------Load--------------//
+static uint32_t s_rng = 12345;
+static uint32_t random_below(uint32_t n)
+{
+  s_rng = s_rng * 1103515245u + 12345u;
+  return (s_rng >> 8) % n;
+}
+
+static void test_load()
+{
+  const uint32_t hold = 20000;
+  Rig* rig = make_rig(hold);
+  const ODriveSim::Axis& actuator_axis = rig->odrive.axis(constant.actuator_motor_number);
+  rig->actuator.set_cooling_velocity(10);
+  rig->run(0.5);
+  uint32_t parse_errors = rig->actuator.odrive_link().parse_errors();
+
+  const int presses = 100;
+  int idle = 0;
+  int waited = 0;
+  uint64_t latency_sum = 0;
+  for (int i = 0; i < presses; i++)
+  {
+    // Anywhere in a cycle, then two more for the control step to take over
+    s_press_at_us = hal::sim::now_us() + random_below(constant.cycle_period * 1000);
+    rig->run(constant.cycle_period * 3 / 1000.0f);
+    if (actuator_axis.state == MotionSequencer::k_state_idle) idle++;
+    uint32_t latency = rig->estop.stats().last_latency_us;
+    latency_sum += latency;
+    if (latency > 0) waited++;
+    rig->release();
+    rig->run((hold + 2000) / 1e6);
+    rig->estop.reset(micros());
+    // A fresh homing puts the actuator back in closed loop for the next press
+    rig->actuator.start_homing();
+    rig->run(0.03);
+    rig->actuator.abort_motion();
+  }
+
+  Estop::Stats stats = rig->estop.stats();
+  uint32_t link_parse_errors = rig->actuator.odrive_link().parse_errors() - parse_errors;
+#ifdef MOAT_ODRIVE_CAN
+  // Frames go straight to the bus
+  const uint32_t bound_us = 200;
+#else
+  // Whatever the tx buffer already holds has to drain ahead of the two idle lines
+  const uint32_t bound_us =
+      (HardwareSerial::k_tx_capacity + 2 * ODrive::k_command_size) * 10 * 1000000ull / ODriveSim::Config().baud + 200;
+#endif
+  printf("load: %d presses, %u latencies, %d waited, mean %u us, max %u us (bound %u us), axis idle %d, "
+         "parse errors %u\n",
+         presses, stats.latency_count, waited, (uint32_t)(latency_sum / presses), stats.max_latency_us, bound_us,
+         idle, link_parse_errors);
+  check(stats.trips == (uint32_t)presses && stats.latency_count == (uint32_t)presses, "load: every trip measured");
+  check(stats.max_latency_us <= bound_us, "load: latency within one line");
+  check(idle == presses, "load: every press idles the actuator axis");
+  check(link_parse_errors == 0, "load: the stop never splits a line");
+  free_rig(rig);
+}
+
+int main(int argc, char** argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--verbose") == 0) s_verbose = true;
+    else
+    {
+      fprintf(stderr, "usage: %s [--verbose]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  test_states();
+  test_latency();
+  test_actuator();
+  test_load();
+
+  if (s_failures > 0)
+  {
+    printf("%d failures\n", s_failures);
+    return 1;
+  }
+  printf("all passed\n");
+  return 0;
+}
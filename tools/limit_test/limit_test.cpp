@@ -0,0 +1,179 @@
+/*
+Hall limit test
+Slams the actuator into the ends of travel under the PID at its velocity limit, against the
+simulated ODrive and car, and measures how far it runs past each hall sensor edge and how fast
+it is still going when it reaches the hard stop behind the sensor.
+Three ways, each on a fresh car that was homed and fully shifted in first:
+- polled: the sensors only stop it through the next control cycle, like before
+- interrupt: the hall interrupt sends the prebuilt stop the moment the sensor trips
+- soft limits: the interrupt stop plus the PID slowing down ahead of the latched edges
+Checks the interrupt hits the hard stops slower than polling, soft limits stay off them and
+within the overtravel, and
+that the stop never lands inside another command on the wire (no parse errors, no timeouts).
+
+usage: limit_test [--verbose]
+Exit code is non-zero on any failure.
+Built with -DMOAT_ODRIVE_CAN the ODrive is on a CAN loopback instead of Serial1.
+*/
+
+#include "../common/SimCar.h"
+#include <MotionSequencer.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+Constant constant;
+
+static bool s_verbose = false;
+
+enum Variant
+{
+  POLLED = 0,
+  INTERRUPT,
+  SOFT_LIMITS,
+  VARIANT_COUNT
+};
+static const char* const k_variant_names[] = {"polled", "interrupt", "soft limits"};
+
+struct Overshoot
+{
+  float outbound = 0;     // counts past the sensor edge, at most
+  float inbound = 0;
+  float impact = 0;       // turns/s into a hard stop, fastest
+  uint32_t stop_hits = 0;
+  uint32_t immediate_stops = 0;
+  uint32_t parse_errors = 0;
+  uint32_t timeouts = 0;
+  bool homed = false;
+};
+
+static SimCar* s_rig = nullptr;
+static int s_out[30];
+static void control_step()
+{
+  s_rig->actuator.control_function(s_out);
+}
+
+// Deepest the actuator got past an edge while the throttle pushed it there for seconds, and the
+// fastest it ran into the hard stop
+static float slam(Scheduler& scheduler, CvtPlant& plant, ODriveSim& odrive, float throttle, bool outbound,
+                  int32_t edge, float seconds, float* impact)
+{
+  plant.set_throttle(throttle);
+  ODriveSim::Axis& axis = odrive.axis(constant.actuator_motor_number);
+  float deepest = 0;
+  uint64_t end_us = hal::sim::now_us() + (uint64_t)(seconds * 1e6);
+  while (hal::sim::now_us() < end_us)
+  {
+    float velocity = fabsf(axis.velocity);
+    uint32_t stop_hits = plant.stop_hits();
+    hal::sim::advance_us(hal::sim::step_us());
+    scheduler.poll();
+    if (plant.stop_hits() != stop_hits && velocity > *impact) *impact = velocity;
+    float past = outbound ? axis.position - edge : edge - axis.position;
+    if (past > deepest) deepest = past;
+  }
+  return deepest;
+}
+
+static Overshoot run(int variant)
+{
+  Overshoot result;
+  // The polled variant gets no stop from the hall interrupt
+  SimCar::Options options;
+  options.plant.start_position = 0.5;
+  options.fast_stop = variant != POLLED;
+  SimCar car(options);
+  s_rig = &car;
+  Actuator& actuator = car.actuator;
+  if (variant != SOFT_LIMITS) actuator.configure_soft_limits(SoftLimits::Config());
+
+  // Stiff enough that every shift runs at actuator_velocity_limit
+  Parameters slam_gains = car.parameters.active();
+  slam_gains.proportional_gain = 1;
+  car.parameters.stage(slam_gains);
+  car.start_scheduler(control_step);
+
+  // Both edges latched before the slams
+  actuator.start_homing();
+  car.run_motion(30);
+  actuator.start_shift(true, 20000);
+  car.run_motion(30);
+  result.homed = actuator.motion_status() == MotionSequencer::k_ok &&
+                 actuator.soft_limits().has_inbound() && actuator.soft_limits().has_outbound();
+  HallState hall = car.sensors.snapshot().hall;
+  int32_t outbound_edge = hall.outbound_count;
+  int32_t inbound_edge = hall.inbound_count;
+  uint32_t stop_hits = car.plant.stop_hits();
+  uint32_t parse_errors = actuator.odrive_link().parse_errors();
+  uint32_t timeouts = actuator.odrive_link().timeouts();
+
+  // Idle engine sits under the reference so the PID shifts out. Then the reference drops to the
+  // bottom of its range and a revving engine is far over it, so the PID shifts back in.
+  result.outbound = slam(car.scheduler, car.plant, car.odrive, 0, true, outbound_edge, 2, &result.impact);
+  Parameters low_reference = car.parameters.active();
+  low_reference.engine_engage = Constant::engine_idle;
+  low_reference.engine_launch = Constant::engine_idle;
+  low_reference.engine_power = Constant::engine_idle + 50;
+  car.parameters.stage(low_reference);
+  result.inbound = slam(car.scheduler, car.plant, car.odrive, 1, false, inbound_edge, 3, &result.impact);
+  car.scheduler.end();
+
+  result.stop_hits = car.plant.stop_hits() - stop_hits;
+  result.immediate_stops = actuator.odrive_link().immediate_stops();
+  result.parse_errors = actuator.odrive_link().parse_errors() - parse_errors;
+  result.timeouts = actuator.odrive_link().timeouts() - timeouts;
+  if (s_verbose)
+  {
+    printf("%s: edges %d..%d, soft limits %d..%d, odrive commands %u\n", k_variant_names[variant], inbound_edge,
+           outbound_edge, actuator.soft_limits().inbound(), actuator.soft_limits().outbound(),
+           actuator.odrive_link().commands_sent());
+  }
+  s_rig = nullptr;
+  return result;
+}
+
+int main(int argc, char** argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--verbose") == 0) s_verbose = true;
+    else
+    {
+      fprintf(stderr, "usage: %s [--verbose]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  Overshoot results[VARIANT_COUNT];
+  for (int variant = 0; variant < VARIANT_COUNT; variant++)
+  {
+    Overshoot& result = results[variant];
+    result = run(variant);
+    printf("%-12s overshoot outbound %5.0f counts, inbound %5.0f counts, hard stops %u at up to %5.2f turns/s, "
+           "interrupt stops %u\n",
+           k_variant_names[variant], result.outbound, result.inbound, result.stop_hits, result.impact,
+           result.immediate_stops);
+    char message[96];
+    snprintf(message, sizeof(message), "%s: homed and shifted in", k_variant_names[variant]);
+    check(result.homed, message);
+    snprintf(message, sizeof(message), "%s: every command parsed (%u parse errors, %u timeouts)",
+             k_variant_names[variant], result.parse_errors, result.timeouts);
+    check(result.parse_errors == 0 && result.timeouts == 0, message);
+  }
+
+  const Overshoot& polled = results[POLLED];
+  const Overshoot& interrupt = results[INTERRUPT];
+  const Overshoot& soft = results[SOFT_LIMITS];
+  check(polled.immediate_stops == 0 && interrupt.immediate_stops >= 2, "interrupt stops only when wired");
+  // At the velocity limit neither stops short of the hard stops, the interrupt gets there slower
+  check(interrupt.outbound <= polled.outbound && interrupt.inbound <= polled.inbound, "interrupt no deeper than polling");
+  check(interrupt.impact < polled.impact, "interrupt hits the hard stops slower than polling");
+  check(soft.outbound < interrupt.outbound && soft.inbound < interrupt.inbound, "soft limits beat the interrupt");
+  check(soft.stop_hits == 0, "soft limits stay off the hard stops");
+  check(soft.outbound < Constant::soft_limit_overtravel && soft.inbound < Constant::soft_limit_overtravel,
+        "soft limits: within the overtravel");
+
+  printf("%s (%d failures)\n", s_failures ? "FAILED" : "ok", s_failures);
+  return s_failures ? 1 : 0;
+}
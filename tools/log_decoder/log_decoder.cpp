@@ -0,0 +1,160 @@
+/*
+Telemetry log decoder
+Converts a tlm_N.bin file written by the Teensy into CSV and checks it on the way.
+
+usage: log_decoder <tlm_N.bin> [out.csv]
+Writes to stdout without an output file. A summary goes to stderr and the exit code is
+non-zero when the header is bad or any record failed its sync / crc / sequence check.
+*/
+
+#include <TelemetryFormat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+struct DecodeStats
+{
+  unsigned long records = 0;
+  unsigned long bad_records = 0;    // records that failed their sync word or crc
+  unsigned long sync_errors = 0;   // bytes skipped while hunting for the next good record
+  unsigned long sequence_gaps = 0;
+  unsigned long missing_records = 0;
+};
+
+static bool read_file(const char* path, std::vector<uint8_t>& data)
+{
+  FILE* file = fopen(path, "rb");
+  if (file == nullptr) return false;
+  uint8_t chunk[64 * 1024];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+  {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  fclose(file);
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: %s <tlm_N.bin> [out.csv]\n", argv[0]);
+    return 2;
+  }
+
+  std::vector<uint8_t> data;
+  if (!read_file(argv[1], data))
+  {
+    fprintf(stderr, "could not read %s\n", argv[1]);
+    return 2;
+  }
+
+  // Header
+  telemetry::FileHeader header;
+  if (data.size() < sizeof(header))
+  {
+    fprintf(stderr, "file too short for a header\n");
+    return 1;
+  }
+  memcpy(&header, data.data(), sizeof(header));
+  if (header.magic != telemetry::k_file_magic)
+  {
+    fprintf(stderr, "not a telemetry log (magic 0x%08x)\n", header.magic);
+    return 1;
+  }
+  if (header.version != telemetry::k_version)
+  {
+    fprintf(stderr, "unsupported log version %u\n", header.version);
+    return 1;
+  }
+  if (header.crc != telemetry::header_crc(header) || header.field_count == 0 ||
+      header.field_count > telemetry::k_max_fields ||
+      header.record_size != telemetry::record_size(header.field_count))
+  {
+    fprintf(stderr, "corrupt header\n");
+    return 1;
+  }
+
+  FILE* out = stdout;
+  if (argc > 2)
+  {
+    out = fopen(argv[2], "w");
+    if (out == nullptr)
+    {
+      fprintf(stderr, "could not write %s\n", argv[2]);
+      return 2;
+    }
+  }
+
+  fprintf(out, "sequence, time_us");
+  for (int i = 0; i < header.field_count; i++)
+  {
+    char name[telemetry::k_name_size + 1] = {0};
+    memcpy(name, header.fields[i].name, telemetry::k_name_size);
+    fprintf(out, ", %s", name);
+  }
+  fprintf(out, "\n");
+
+  // Records
+  DecodeStats stats;
+  size_t record_size = header.record_size;
+  size_t position = header.header_size;
+  bool have_sequence = false;
+  bool hunting = false;  // lost alignment, zeros don't mean the end until a record checks out
+  uint32_t last_sequence = 0;
+  std::vector<uint8_t> record(record_size);
+
+  while (position + record_size <= data.size())
+  {
+    const uint8_t* raw = data.data() + position;
+    telemetry::RecordHeader record_header;
+    memcpy(&record_header, raw, sizeof(record_header));
+
+    if (record_header.sync == 0 && !hunting)
+    {
+      // Zero padding written when the log was closed, or the unwritten end of a preallocated file
+      break;
+    }
+    if (record_header.sync != telemetry::k_record_sync ||
+        record_header.crc != telemetry::record_crc(raw, record_size))
+    {
+      // Slide forward a byte at a time until something checks out again
+      if (hunting) stats.sync_errors++;
+      else stats.bad_records++;
+      hunting = true;
+      position++;
+      continue;
+    }
+    hunting = false;
+
+    if (have_sequence && record_header.sequence != last_sequence + 1)
+    {
+      stats.sequence_gaps++;
+      stats.missing_records += record_header.sequence - last_sequence - 1;
+    }
+    have_sequence = true;
+    last_sequence = record_header.sequence;
+
+    memcpy(record.data(), raw, record_size);
+    const int32_t* values = (const int32_t*)(record.data() + sizeof(telemetry::RecordHeader));
+    fprintf(out, "%u, %u", record_header.sequence, record_header.time_us);
+    for (int i = 0; i < header.field_count; i++)
+    {
+      fprintf(out, ", %d", values[i]);
+    }
+    fprintf(out, "\n");
+
+    stats.records++;
+    position += record_size;
+  }
+  if (out != stdout) fclose(out);
+
+  fprintf(stderr, "records: %lu, period: %u us, bad records: %lu, bytes skipped: %lu, sequence gaps: %lu (%lu records)\n",
+          stats.records, header.period_us, stats.bad_records, stats.sync_errors, stats.sequence_gaps,
+          stats.missing_records);
+
+  bool clean = stats.bad_records == 0 && stats.sync_errors == 0 && stats.sequence_gaps == 0;
+  return clean ? 0 : 1;
+}
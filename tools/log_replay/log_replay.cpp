@@ -0,0 +1,209 @@
+/*
+Log replay
+Re-runs recorded control cycles through the real control code (Actuator with its gear tooth
+filters, state estimator, reference curve and PID) on the host, as fast as the host allows,
+and compares what it commands against the act_vel the car recorded.
+
+usage: log_replay [--params params.bin] [--set name=value]... [--skip S] [--step-us U]
+                  [--csv out.csv] [--max-rms V] [--quiet] <log...>
+
+A log is a binary telemetry log (tlm_N.bin), a text log from before it (log_N.txt) or the CSV
+tools/log_decoder writes, LogReplay.h has how each cycle's inputs are rebuilt.
+--params and --set replay with other tunables than the compiled defaults, give --params the
+params.bin the run was recorded with to compare against the run itself.
+--skip leaves the first S seconds (1) out while the filters and the estimator warm up, cycles the
+car spent homing or shifting fully or held by the e-stop (status 3 to 5) are left out as well.
+--csv writes every cycle, recorded next to replayed.
+--max-rms fails any log whose act_vel differs by more than V turns/s rms, so a library of logs
+can be run as a regression test. Exit code 1 on such a failure, 2 on a log that can't be read.
+*/
+
+#include <Constant.h>
+#include <LogReplay.h>
+#include <ParameterStore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+Constant constant;
+
+struct Options
+{
+  const char* params = nullptr;
+  std::vector<std::pair<int, float>> sets;  // parameter index, value
+  LogReplay::Config replay;
+  const char* csv = nullptr;
+  float max_rms = -1;                       // turns/s, < 0 never fails
+  bool quiet = false;
+  std::vector<const char*> logs;
+};
+
+struct CsvOut
+{
+  FILE* file;
+  int log_number;
+};
+
+static void write_cycle(void* context, const LogReplay::Cycle& cycle, const LogReplay::Replayed& replayed, double t)
+{
+  CsvOut* csv = (CsvOut*)context;
+  fprintf(csv->file, "%d, %.4f, %d, %d, %d, %d, %d, %d, %d, %d\n", csv->log_number, t, cycle.status, cycle.rpm,
+          cycle.gb_rpm, cycle.ref_rpm, replayed.ref_rpm, cycle.act_vel, replayed.act_vel, replayed.status);
+}
+
+static bool read_file(const char* path, std::vector<uint8_t>& data)
+{
+  FILE* file = fopen(path, "rb");
+  if (file == nullptr) return false;
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+  {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  fclose(file);
+  return true;
+}
+
+static bool load_parameters(const Options& options, Parameters& tuned)
+{
+  ParameterStore parameters;
+  if (options.params != nullptr)
+  {
+    std::vector<uint8_t> data;
+    if (!read_file(options.params, data))
+    {
+      fprintf(stderr, "could not read %s\n", options.params);
+      return false;
+    }
+    int status = parameters.load(data.data(), data.size());
+    if (status != ParameterStore::k_ok)
+    {
+      fprintf(stderr, "rejected %s: %s\n", options.params, ParameterStore::status_name(status));
+      return false;
+    }
+  }
+  tuned = parameters.active();
+  for (const auto& set : options.sets) parameter_value(tuned, set.first) = set.second;
+  int status = ParameterStore::validate(tuned);
+  if (status != ParameterStore::k_ok)
+  {
+    fprintf(stderr, "rejected --set: %s\n", ParameterStore::status_name(status));
+    return false;
+  }
+  return true;
+}
+
+static void usage(const char* name)
+{
+  fprintf(stderr,
+          "usage: %s [--params params.bin] [--set name=value]... [--skip S] [--step-us U]\n"
+          "          [--csv out.csv] [--max-rms V] [--quiet] <log_N.txt|tlm_N.bin|decoded.csv>...\n",
+          name);
+  exit(2);
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+  for (int i = 1; i < argc; i++)
+  {
+    const char* arg = argv[i];
+    if (strcmp(arg, "--quiet") == 0)
+    {
+      options.quiet = true;
+      continue;
+    }
+    if (strncmp(arg, "--", 2) != 0)
+    {
+      options.logs.push_back(arg);
+      continue;
+    }
+    const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (value == nullptr) usage(argv[0]);
+    i++;
+    if (strcmp(arg, "--params") == 0) options.params = value;
+    else if (strcmp(arg, "--skip") == 0) options.replay.skip = atof(value);
+    else if (strcmp(arg, "--step-us") == 0) options.replay.step_us = atoi(value);
+    else if (strcmp(arg, "--csv") == 0) options.csv = value;
+    else if (strcmp(arg, "--max-rms") == 0) options.max_rms = atof(value);
+    else if (strcmp(arg, "--set") == 0)
+    {
+      const char* equals = strchr(value, '=');
+      std::string name = equals ? std::string(value, equals - value) : value;
+      int index = ParameterStore::find(name.c_str());
+      if (index < 0 || equals == nullptr)
+      {
+        fprintf(stderr, "unknown parameter in --set %s\n", value);
+        return 2;
+      }
+      options.sets.push_back({index, (float)atof(equals + 1)});
+    }
+    else usage(argv[0]);
+  }
+  if (options.logs.empty() || options.replay.step_us == 0) usage(argv[0]);
+
+  Parameters tuned;
+  if (!load_parameters(options, tuned)) return 2;
+
+  FILE* csv = nullptr;
+  if (options.csv != nullptr)
+  {
+    csv = fopen(options.csv, "w");
+    if (csv == nullptr)
+    {
+      fprintf(stderr, "could not write %s\n", options.csv);
+      return 2;
+    }
+    fprintf(csv, "log, t, status, rpm, gb_rpm, ref_rpm, replay_ref_rpm, act_vel, replay_act_vel, replay_status\n");
+  }
+
+  int exit_code = 0;
+  int failed = 0;
+  double seconds_total = 0;
+  double wall_total = 0;
+  for (size_t i = 0; i < options.logs.size(); i++)
+  {
+    const char* path = options.logs[i];
+    LogReplay replay;
+    const char* error = replay.load(path);
+    if (error != nullptr)
+    {
+      fprintf(stderr, "%s: %s%s\n", path, strchr(error, ' ') ? "" : "no column ", error);
+      exit_code = 2;
+      continue;
+    }
+
+    CsvOut csv_out = {csv, (int)i};
+    LogReplay::Result result = replay.run(tuned, options.replay, csv ? write_cycle : nullptr, &csv_out);
+    const LogReplay::Recording& recording = replay.recording();
+    seconds_total += result.seconds;
+    wall_total += result.wall;
+    bool fail = options.max_rms >= 0 && result.act_vel_rms() > options.max_rms;
+    if (fail)
+    {
+      failed++;
+      if (exit_code == 0) exit_code = 1;
+    }
+    if (options.quiet && !fail) continue;
+
+    printf("%s: %s, %u cycles (%.1f s) in %.2f s, %.0fx real time, %lu lines skipped%s\n", path, recording.format,
+           result.cycles, result.seconds, result.wall, result.wall > 0 ? result.seconds / result.wall : 0,
+           recording.skipped, recording.has_gb_rpm ? "" : ", gearbox from roll_frame");
+    printf("  act_vel: %u compared, %.1f%% identical, difference rms %.3f mean %+.3f max %+d turns/s at %.2f s",
+           result.compared, result.compared ? 100.0 * result.identical / result.compared : 0, result.act_vel_rms(),
+           result.compared ? result.act_vel_sum / result.compared : 0, result.act_vel_max, result.act_vel_max_at);
+    if (result.first_difference >= 0) printf(", first at %.2f s", result.first_difference);
+    printf("%s\n", fail ? "  FAIL" : "");
+    if (recording.has_ref_rpm) printf("  ref_rpm: difference rms %.1f rpm\n", result.ref_rpm_rms());
+  }
+  if (csv != nullptr) fclose(csv);
+
+  printf("%zu logs, %.1f s replayed in %.2f s wall", options.logs.size(), seconds_total, wall_total);
+  if (options.max_rms >= 0) printf(", %d over %.3f turns/s rms", failed, options.max_rms);
+  printf("\n");
+  return exit_code;
+}
@@ -0,0 +1,280 @@
+/*
+Homing and full shift test
+Runs Actuator homing and full shifts under the Scheduler against the simulated ODrive and car,
+wired up the same way cvt_sim wires them.
+- home: from mid travel, the outbound limit is the count the hall interrupt latched at the
+  sensor edge. Also prints how far off reading the ODrive position on the first control cycle
+  that sees the sensor (what the polling loop used to do) would have been.
+- home on sensor: starting on the outbound sensor it backs off and latches the edge again
+- shift in / shift out: end on the sensor, the limits stay untouched
+- abort: stops the actuator and drops out of closed loop on the next cycle, it stays held
+  until the next motion
+- timeout: with the hall sensors out of reach the motion gives up and stops
+- no closed loop: with every ODrive reply lost it never starts moving
+- blocking: homing_sequence steps the control function itself and returns the limits
+Every run checks the control step kept its rate the whole time. The hall interrupt goes through
+Actuator::on_limit as in main.cpp, homing and the shifts check it stopped the axis once on the
+edge the sequencer finished on and the latched counts still hold.
+
+usage: motion_test
+Exit code is non-zero on any failure.
+Built with -DMOAT_ODRIVE_CAN the ODrive is on a CAN loopback instead of Serial1.
+*/
+
+#include "../common/SimCar.h"
+#include <MotionSequencer.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+Constant constant;
+
+// The car and what the control step saw
+struct Rig : SimCar
+{
+  int out[30] = {};
+  uint32_t cycles = 0;
+  uint32_t moving_cycles = 0;
+  // First cycle that saw the outbound sensor during the motion
+  bool polled = false;
+  int32_t polled_count = 0;
+
+  Rig(const CvtPlant::Config& plant_config, const ODriveSim::Config& odrive_config)
+    : SimCar(options(plant_config, odrive_config))
+  {
+  }
+
+  static Options options(const CvtPlant::Config& plant_config, const ODriveSim::Config& odrive_config)
+  {
+    Options options;
+    options.plant = plant_config;
+    options.odrive = odrive_config;
+    return options;
+  }
+
+  void start_scheduler();
+  float run_motion(float max_s);
+  void run(float seconds);
+};
+
+static Rig* s_rig = nullptr;
+
+static void control_step()
+{
+  Rig& rig = *s_rig;
+  rig.actuator.control_function(rig.out);
+  rig.cycles++;
+  if (rig.out[rig.actuator.STATUS] != 3) return;
+  rig.moving_cycles++;
+  if (!rig.polled && rig.out[rig.actuator.HALL_OUT])
+  {
+    rig.polled = true;
+    rig.polled_count = rig.out[rig.actuator.ENC_POS];
+  }
+}
+
+void Rig::start_scheduler()
+{
+  s_rig = this;
+  SimCar::start_scheduler(control_step);
+}
+
+float Rig::run_motion(float max_s)
+{
+  start_scheduler();
+  return SimCar::run_motion(max_s);
+}
+
+void Rig::run(float seconds)
+{
+  start_scheduler();
+  SimCar::run(seconds);
+}
+
+static CvtPlant::Config plant_at(float position)
+{
+  CvtPlant::Config config;
+  config.start_position = position;
+  return config;
+}
+
+// Where the plant's sensors switch, coming from inside the travel
+static int32_t outbound_edge(const CvtPlant& plant, const CvtPlant::Config& config)
+{
+  return plant.inbound_count() + (int32_t)ceilf((1 - config.hall_band) * constant.encoder_count_shift_length);
+}
+static int32_t inbound_edge(const CvtPlant& plant, const CvtPlant::Config& config)
+{
+  return plant.inbound_count() + (int32_t)(config.hall_band * constant.encoder_count_shift_length);
+}
+
+// The control step ran on every period while the motion went on
+static void check_rate(Rig& rig, float seconds, const char* what)
+{
+  Scheduler::Stats stats = rig.scheduler.stats();
+  uint32_t expected = seconds * 1000 / constant.cycle_period;
+  char message[96];
+  snprintf(message, sizeof(message), "%s: control step kept its rate (%u cycles, %u missed)", what, stats.cycles,
+           stats.missed);
+  check(stats.missed == 0 && stats.cycles + 2 >= expected, message);
+}
+
+static void check_home()
+{
+  CvtPlant::Config config = plant_at(0.5);
+  Rig rig(config, ODriveSim::Config());
+  check(rig.actuator.start_homing(), "home: starts");
+  check(!rig.actuator.start_homing(), "home: second start refused");
+  float seconds = rig.run_motion(30);
+  check_rate(rig, seconds, "home");
+
+  int32_t expected = outbound_edge(rig.plant, config);
+  int32_t latched_error = rig.actuator.encoder_outbound() - expected;
+  int32_t polled_error = rig.polled_count - expected;
+  printf("home: %.2f s, %u cycles moving, outbound %d, edge %d, latched error %d counts, polled error %d counts\n",
+         seconds, rig.moving_cycles, rig.actuator.encoder_outbound(), expected, latched_error, polled_error);
+  check(rig.actuator.motion_status() == MotionSequencer::k_ok, "home: status ok");
+  check(abs(latched_error) <= 2, "home: outbound latched at the sensor edge");
+  check(rig.polled && abs(latched_error) < abs(polled_error), "home: latched beats polled");
+  check(rig.actuator.encoder_inbound() == rig.actuator.encoder_outbound() - constant.encoder_count_shift_length,
+        "home: inbound from the shift length");
+  check(rig.moving_cycles > 100, "home: logged while moving");
+  // on_limit stopped it on the same edge the sequencer finished on
+  check(rig.limit_stops == 1, "home: the hall interrupt stopped it");
+  rig.run(0.005);  // the stop on the wire, the PID takes over next cycle
+  check(rig.axis().vel_setpoint == 0, "home: stopped");
+}
+
+static void check_home_on_sensor()
+{
+  CvtPlant::Config config = plant_at(1);
+  Rig rig(config, ODriveSim::Config());
+  HallState before = rig.sensors.snapshot().hall;
+  check(before.outbound, "on sensor: starts on it");
+  rig.actuator.start_homing();
+  float seconds = rig.run_motion(30);
+  check_rate(rig, seconds, "on sensor");
+  int32_t latched_error = rig.actuator.encoder_outbound() - outbound_edge(rig.plant, config);
+  printf("home on sensor: %.2f s, latched error %d counts\n", seconds, latched_error);
+  check(rig.actuator.motion_status() == MotionSequencer::k_ok, "on sensor: status ok");
+  HallState after = rig.sensors.snapshot().hall;
+  check(after.changes - before.changes >= 2 && after.outbound_hits > before.outbound_hits,
+        "on sensor: left and came back");
+  check(abs(latched_error) <= 2, "on sensor: outbound latched at the sensor edge");
+  check(rig.limit_stops == 1, "on sensor: the hall interrupt stopped it coming back");
+}
+
+static void check_shift(bool inbound)
+{
+  const char* name = inbound ? "shift in" : "shift out";
+  char message[96];
+  CvtPlant::Config config = plant_at(inbound ? 0.6 : 0.3);
+  Rig rig(config, ODriveSim::Config());
+  int32_t outbound_before = rig.actuator.encoder_outbound();
+  check(rig.actuator.start_shift(inbound, 20000), name);
+  float seconds = rig.run_motion(30);
+  check_rate(rig, seconds, name);
+
+  HallState hall = rig.sensors.snapshot().hall;
+  int32_t latched = inbound ? hall.inbound_count : hall.outbound_count;
+  int32_t expected = inbound ? inbound_edge(rig.plant, config) : outbound_edge(rig.plant, config);
+  printf("%s: %.2f s, position %.4f, latched error %d counts\n", name, seconds, rig.plant.position(),
+         latched - expected);
+  snprintf(message, sizeof(message), "%s: status ok", name);
+  check(rig.actuator.motion_status() == MotionSequencer::k_ok, message);
+  snprintf(message, sizeof(message), "%s: ends on the sensor", name);
+  check(inbound ? hall.inbound && rig.plant.position() < 0.01f : hall.outbound && rig.plant.position() > 0.99f,
+        message);
+  snprintf(message, sizeof(message), "%s: the hall interrupt stopped it", name);
+  check(rig.limit_stops == 1, message);
+  snprintf(message, sizeof(message), "%s: limits untouched", name);
+  check(rig.actuator.encoder_outbound() == outbound_before, message);
+}
+
+static void check_abort()
+{
+  Rig rig(plant_at(0.2), ODriveSim::Config());
+  rig.actuator.start_homing();
+  rig.run(1.5);
+  check(rig.actuator.motion_active() && rig.axis().vel_setpoint > 0, "abort: moving");
+  rig.actuator.abort_motion();
+  rig.run(constant.cycle_period / 1000.0f);
+  check(!rig.actuator.motion_active(), "abort: ended on the next cycle");
+  check(rig.actuator.motion_status() == MotionSequencer::k_aborted, "abort: status");
+  rig.run(0.005);
+  check(rig.axis().vel_setpoint == 0, "abort: velocity zero");
+  rig.run(0.1);
+  check(rig.axis().state == 1, "abort: idle");
+  float position = rig.plant.position();
+  rig.run(0.5);
+  check(fabsf(rig.plant.position() - position) < 0.001f, "abort: stays put");
+  check(rig.out[rig.actuator.STATUS] == 4, "abort: logged as held");
+  check(rig.actuator.start_shift(true, 20000), "abort: a new motion starts");
+  rig.run_motion(30);
+  check(rig.actuator.motion_status() == MotionSequencer::k_ok, "abort: and finishes");
+}
+
+static void check_timeout()
+{
+  CvtPlant::Config config = plant_at(0.5);
+  config.hall_band = -0.05;  // never reached
+  Rig rig(config, ODriveSim::Config());
+  rig.actuator.start_shift(false, 3000);
+  float seconds = rig.run_motion(10);
+  check_rate(rig, seconds, "timeout");
+  printf("timeout: gave up after %.2f s\n", seconds);
+  check(rig.actuator.motion_status() == MotionSequencer::k_timeout, "timeout: status");
+  check(seconds >= 3 && seconds < 3.1f, "timeout: after the timeout");
+  rig.run(0.1);
+  check(rig.axis().vel_setpoint == 0 && rig.axis().state == 1, "timeout: held idle");
+}
+
+static void check_no_closed_loop()
+{
+  ODriveSim::Config odrive_config;
+  odrive_config.reply_drop_rate = 1;
+  odrive_config.heartbeat_period_us = 0;  // on CAN the state comes with the heartbeat
+  Rig rig(plant_at(0.5), odrive_config);
+  float position = rig.plant.position();
+  rig.actuator.start_homing();
+  float seconds = rig.run_motion(10);
+  printf("no closed loop: gave up after %.2f s\n", seconds);
+  check(rig.actuator.motion_status() == MotionSequencer::k_no_closed_loop, "no closed loop: status");
+  check(seconds < constant.closed_loop_timeout / 1000.0f + 0.1f, "no closed loop: after closed_loop_timeout");
+  rig.run(1);
+  check(rig.plant.position() == position, "no closed loop: never moved");
+}
+
+static void check_blocking()
+{
+  CvtPlant::Config config = plant_at(0.7);
+  Rig rig(config, ODriveSim::Config());
+  s_rig = &rig;
+  int out[3] = {-9, -9, -9};
+  rig.actuator.homing_sequence(out);
+  check(out[0] == MotionSequencer::k_ok, "blocking: status");
+  check(abs(out[2] - outbound_edge(rig.plant, config)) <= 2, "blocking: outbound");
+  check(rig.limit_stops == 1, "blocking: the hall interrupt stopped it");
+  check(out[1] == out[2] - constant.encoder_count_shift_length, "blocking: inbound");
+}
+
+int main(int argc, char** argv)
+{
+  if (argc > 1)
+  {
+    fprintf(stderr, "usage: %s\n", argv[0]);
+    return 2;
+  }
+
+  check_home();
+  check_home_on_sensor();
+  check_shift(true);
+  check_shift(false);
+  check_abort();
+  check_timeout();
+  check_no_closed_loop();
+  check_blocking();
+
+  printf("%s (%d failures)\n", s_failures ? "FAILED" : "ok", s_failures);
+  return s_failures ? 1 : 0;
+}
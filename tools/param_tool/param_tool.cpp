@@ -0,0 +1,218 @@
+/*
+Parameter file tool
+Reads and writes the params.bin the Teensy loads from the SD card at boot, and checks the
+parameter parser on the host.
+
+usage: param_tool dump <params.bin>
+       param_tool write <params.bin> [name=value ...]   (starts from the compiled defaults)
+       param_tool check
+The exit code is non-zero when a file is rejected or a check fails.
+*/
+
+#include <Hal.h>
+#include <ParameterStore.h>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Collects what the store would send back over serial
+class TextPrint : public Print
+{
+public:
+  size_t write(uint8_t c) override
+  {
+    text += (char)c;
+    return 1;
+  }
+  std::string text;
+};
+
+static void print_parameters(const Parameters& params)
+{
+  for (int i = 0; i < k_parameter_count; i++)
+  {
+    printf("%-26s %g\n", parameter_info()[i].name, parameter_value(params, i));
+  }
+}
+
+static int dump(const char* path)
+{
+  FILE* file = fopen(path, "rb");
+  if (file == nullptr)
+  {
+    fprintf(stderr, "could not read %s\n", path);
+    return 2;
+  }
+  uint8_t buffer[256];
+  size_t length = fread(buffer, 1, sizeof(buffer), file);
+  fclose(file);
+
+  Parameters params;
+  int status = ParameterStore::decode(buffer, length, params);
+  if (status != ParameterStore::k_ok)
+  {
+    fprintf(stderr, "%s: %s, the Teensy would use its compiled defaults\n", path, ParameterStore::status_name(status));
+    return 1;
+  }
+  print_parameters(params);
+  return 0;
+}
+
+static int write(const char* path, int count, char** assignments)
+{
+  Parameters params = ParameterStore::defaults();
+  for (int i = 0; i < count; i++)
+  {
+    char* equals = strchr(assignments[i], '=');
+    if (equals == nullptr)
+    {
+      fprintf(stderr, "expected name=value, got %s\n", assignments[i]);
+      return 2;
+    }
+    *equals = '\0';
+    int index = ParameterStore::find(assignments[i]);
+    if (index < 0)
+    {
+      fprintf(stderr, "unknown parameter %s\n", assignments[i]);
+      return 2;
+    }
+    parameter_value(params, index) = atof(equals + 1);
+  }
+  ParameterStore::derive(params);
+  int status = ParameterStore::validate(params);
+  if (status != ParameterStore::k_ok)
+  {
+    fprintf(stderr, "not written: %s\n", ParameterStore::status_name(status));
+    return 1;
+  }
+
+  uint8_t buffer[ParameterStore::k_file_size];
+  size_t length = ParameterStore::encode(params, buffer, sizeof(buffer));
+  FILE* file = fopen(path, "wb");
+  if (file == nullptr || fwrite(buffer, 1, length, file) != length)
+  {
+    fprintf(stderr, "could not write %s\n", path);
+    return 2;
+  }
+  fclose(file);
+  print_parameters(params);
+  return 0;
+}
+
+static int s_failures = 0;
+
+static void expect(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    fprintf(stderr, "FAIL: %s\n", what);
+    s_failures++;
+  }
+}
+
+static int command(ParameterStore& store, const char* text, std::string* reply = nullptr)
+{
+  char line[64];
+  snprintf(line, sizeof(line), "%s", text);
+  TextPrint out;
+  int result = store.command(line, out);
+  if (reply != nullptr) *reply = out.text;
+  return result;
+}
+
+static int check()
+{
+  uint8_t buffer[ParameterStore::k_file_size];
+  Parameters params = ParameterStore::defaults();
+  Parameters decoded;
+
+  // Round trip
+  params.proportional_gain = 0.02;
+  params.engine_power = 3300;
+  size_t length = ParameterStore::encode(params, buffer, sizeof(buffer));
+  expect(length == ParameterStore::k_file_size, "encode writes a whole file");
+  expect(ParameterStore::decode(buffer, length, decoded) == ParameterStore::k_ok, "round trip decodes");
+  expect(decoded.proportional_gain == 0.02f && decoded.engine_power == 3300, "round trip keeps the values");
+  expect(decoded.gearbox_power_rpm == int(3300 / decoded.ecvt_max_ratio), "decode derives the breakpoints");
+  expect(ParameterStore::encode(params, buffer, sizeof(buffer) - 1) == 0, "encode refuses a short buffer");
+
+  // Everything that should fall back to defaults
+  std::vector<uint8_t> bad(buffer, buffer + length);
+  expect(ParameterStore::decode(bad.data(), 4, decoded) == ParameterStore::k_too_short, "short header");
+  expect(ParameterStore::decode(bad.data(), length - 1, decoded) == ParameterStore::k_too_short, "short values");
+  bad[length - 1] ^= 0x40;
+  expect(ParameterStore::decode(bad.data(), length, decoded) == ParameterStore::k_bad_crc, "flipped bit");
+  bad.assign(buffer, buffer + length);
+  bad[0] ^= 1;
+  expect(ParameterStore::decode(bad.data(), length, decoded) == ParameterStore::k_bad_magic, "magic");
+  bad.assign(buffer, buffer + length);
+  bad[offsetof(parameters::ParameterFileHeader, version)]++;
+  expect(ParameterStore::decode(bad.data(), length, decoded) == ParameterStore::k_bad_version, "version");
+  bad.assign(buffer, buffer + length);
+  bad[offsetof(parameters::ParameterFileHeader, value_count)]++;
+  expect(ParameterStore::decode(bad.data(), length, decoded) == ParameterStore::k_bad_count, "count");
+
+  Parameters out_of_range = params;
+  out_of_range.exponential_filter_alpha = 2;
+  ParameterStore::encode(out_of_range, buffer, sizeof(buffer));
+  expect(ParameterStore::decode(buffer, length, decoded) == ParameterStore::k_out_of_range, "range check on load");
+  Parameters crossed = params;
+  crossed.overdrive_ratio = 1.2;
+  crossed.ecvt_max_ratio = 1.1;
+  expect(ParameterStore::validate(crossed) == ParameterStore::k_inconsistent, "ratios out of order");
+  crossed = params;
+  crossed.engine_launch = crossed.engine_power + 100;
+  expect(ParameterStore::validate(crossed) == ParameterStore::k_inconsistent, "launch above power");
+
+  // Store keeps the last good set
+  ParameterStore store;
+  expect(store.load(bad.data(), length) != ParameterStore::k_ok, "store rejects a bad file");
+  expect(store.active().proportional_gain == Constant::proportional_gain, "bad file leaves the defaults");
+  ParameterStore::encode(params, buffer, sizeof(buffer));
+  expect(store.load(buffer, length) == ParameterStore::k_ok, "store takes a good file");
+  expect(store.active().proportional_gain == 0.02f, "good file is active");
+
+  // Serial commands
+  std::string reply;
+  expect(command(store, "set proportional_gain 0.03", &reply) == ParameterStore::k_command_done, "set");
+  expect(store.active().proportional_gain == 0.03f, "set is active");
+  expect(command(store, "set proportional_gain 5") == ParameterStore::k_command_error, "set out of range");
+  expect(command(store, "set proportional_gain abc") == ParameterStore::k_command_error, "set not a number");
+  expect(command(store, "set nothing 1") == ParameterStore::k_command_error, "set unknown name");
+  expect(store.active().proportional_gain == 0.03f, "failed sets change nothing");
+  expect(command(store, "get engine_power", &reply) == ParameterStore::k_command_done &&
+             reply.compare(0, 13, "engine_power ") == 0,
+         "get one");
+  command(store, "get", &reply);
+  expect(std::count(reply.begin(), reply.end(), '\n') == k_parameter_count, "get lists everything");
+  expect(command(store, "save") == ParameterStore::k_command_save, "save goes to the caller");
+  expect(command(store, "reload") == ParameterStore::k_command_reload, "reload goes to the caller");
+  expect(command(store, "set reference_profile 2") == ParameterStore::k_command_done &&
+             store.active().profile == k_profile_hill,
+         "profile switch");
+  expect(store.active().curves[store.active().profile].evaluate(5000) == store.active().engine_power,
+         "hill profile holds power");
+  expect(command(store, "set reference_profile 3") == ParameterStore::k_command_error, "profile out of range");
+  expect(command(store, "defaults") == ParameterStore::k_command_done, "defaults");
+  expect(store.active().proportional_gain == Constant::proportional_gain, "defaults restored");
+  expect(command(store, "bogus") == ParameterStore::k_command_error, "unknown command");
+
+  printf("%s (%d failed)\n", s_failures ? "FAILED" : "all checks passed", s_failures);
+  return s_failures ? 1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc >= 3 && strcmp(argv[1], "dump") == 0) return dump(argv[2]);
+  if (argc >= 3 && strcmp(argv[1], "write") == 0) return write(argv[2], argc - 3, argv + 3);
+  if (argc == 2 && strcmp(argv[1], "check") == 0) return check();
+  fprintf(stderr,
+          "usage: %s dump <params.bin>\n"
+          "       %s write <params.bin> [name=value ...]\n"
+          "       %s check\n",
+          argv[0], argv[0], argv[0]);
+  return 2;
+}
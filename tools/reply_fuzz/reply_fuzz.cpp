@@ -0,0 +1,333 @@
+/*
+ODrive reply parser fuzz test
+- known cases: what ReplyParser accepts and rejects, and the status it gives
+- numbers: random values printed the ways the ODrive prints them have to parse to what strtof
+  gives, within one float step
+- garbage: random and mutated lines must never crash, never write the output on a failure,
+  and whatever they accept strtof has to agree with
+- odrive: pipelined batches with replies garbled, cut off, merged, dropped or overlong go
+  through ODrive::update(). A cached value may only ever come from a batch that arrived clean.
+
+usage: reply_fuzz [--iterations N] [--seed S]
+Exit code is non-zero on any failure.
+*/
+
+#include <Hal.h>
+#include <ODrive.h>
+#include <ReplyParser.h>
+#include <math.h>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+static std::mt19937 s_random;
+static int s_failures = 0;
+
+static uint32_t random_below(uint32_t n)
+{
+  return s_random() % n;
+}
+
+static void fail(const char* what, const std::string& text)
+{
+  if (s_failures < 20) printf("FAIL %s: \"%s\"\n", what, text.c_str());
+  s_failures++;
+}
+
+// Floats one representable step apart or closer
+static bool close(float a, float b)
+{
+  return a == b || nextafterf(a, b) == b;
+}
+
+static void check_known()
+{
+  struct FloatCase
+  {
+    const char* text;
+    int status;
+    float value;
+  };
+  const FloatCase floats[] = {
+    {"0", ReplyParser::k_ok, 0},          {"-12345", ReplyParser::k_ok, -12345},
+    {"24.05", ReplyParser::k_ok, 24.05f}, {" 1.875 ", ReplyParser::k_ok, 1.875f},
+    {"+.5", ReplyParser::k_ok, 0.5f},     {"5.", ReplyParser::k_ok, 5},
+    {"1e3", ReplyParser::k_ok, 1000},     {"-2.5E-3", ReplyParser::k_ok, -0.0025f},
+    {"1e-60", ReplyParser::k_ok, 0},      {"3.4e38", ReplyParser::k_ok, 3.4e38f},
+    {"", ReplyParser::k_empty, 0},        {"   ", ReplyParser::k_empty, 0},
+    {"-", ReplyParser::k_invalid, 0},     {".", ReplyParser::k_invalid, 0},
+    {"1e", ReplyParser::k_invalid, 0},    {"1e+", ReplyParser::k_invalid, 0},
+    {"nan", ReplyParser::k_invalid, 0},   {"inf", ReplyParser::k_invalid, 0},
+    {"0x10", ReplyParser::k_invalid, 0},  {"1.2.3", ReplyParser::k_invalid, 0},
+    {"12 3", ReplyParser::k_invalid, 0},  {"--1", ReplyParser::k_invalid, 0},
+    {"invalid property", ReplyParser::k_invalid, 0},
+    {"1e39", ReplyParser::k_out_of_range, 0}, {"-1e99999", ReplyParser::k_out_of_range, 0},
+  };
+  for (const FloatCase& c : floats)
+  {
+    float value = 12345.5f;
+    int status = ReplyParser::parse_float(c.text, value);
+    if (status != c.status) fail("float status", c.text);
+    else if (status == ReplyParser::k_ok && !close(value, c.value)) fail("float value", c.text);
+    else if (status != ReplyParser::k_ok && value != 12345.5f) fail("float written on failure", c.text);
+  }
+
+  struct IntCase
+  {
+    const char* text;
+    int status;
+    int32_t value;
+  };
+  const IntCase ints[] = {
+    {"0", ReplyParser::k_ok, 0},
+    {"8", ReplyParser::k_ok, 8},
+    {"-2147483648", ReplyParser::k_ok, INT32_MIN},
+    {"2147483647", ReplyParser::k_ok, INT32_MAX},
+    {"2147483648", ReplyParser::k_out_of_range, 0},
+    {"-99999999999999999999", ReplyParser::k_out_of_range, 0},
+    {"1.0", ReplyParser::k_invalid, 0},
+    {"", ReplyParser::k_empty, 0},
+    {"+", ReplyParser::k_invalid, 0},
+  };
+  for (const IntCase& c : ints)
+  {
+    int32_t value = 77;
+    int status = ReplyParser::parse_int(c.text, value);
+    if (status != c.status) fail("int status", c.text);
+    else if (status == ReplyParser::k_ok && value != c.value) fail("int value", c.text);
+    else if (status != ReplyParser::k_ok && value != 77) fail("int written on failure", c.text);
+  }
+
+  // A line longer than the buffer is cut off, reported and the next one starts clean
+  ReplyParser parser;
+  std::string stream = std::string(ReplyParser::k_line_size * 2, '1') + "\r\n2.5\r\n";
+  int lines = 0;
+  float value = 0;
+  for (char c : stream)
+  {
+    if (parser.feed(c) != ReplyParser::k_complete) continue;
+    lines++;
+    int status = parser.parse_float(value);
+    if (lines == 1 && status != ReplyParser::k_too_long) fail("long line", stream);
+    if (lines == 2 && (status != ReplyParser::k_ok || value != 2.5f)) fail("line after a long one", stream);
+  }
+  if (lines != 2 || parser.long_lines() != 1 || parser.bytes() != stream.size()) fail("line counters", stream);
+}
+
+static std::string format_number()
+{
+  char buffer[64];
+  float x = ldexpf((float)s_random() / 4294967296.0f, (int)random_below(60) - 30);
+  if (random_below(2)) x = -x;
+  switch (random_below(5))
+  {
+    case 0: snprintf(buffer, sizeof(buffer), "%ld", (long)(x * 1000)); break;  // shadow_count
+    case 1: snprintf(buffer, sizeof(buffer), "%.3f", x); break;               // vbus_voltage
+    case 2: snprintf(buffer, sizeof(buffer), "%.4f", x); break;               // vel_estimate
+    case 3: snprintf(buffer, sizeof(buffer), "%.9g", x); break;
+    default: snprintf(buffer, sizeof(buffer), "%e", x); break;
+  }
+  return buffer;
+}
+
+static void check_numbers(long iterations)
+{
+  for (long i = 0; i < iterations; i++)
+  {
+    std::string text = format_number();
+    float value = 0;
+    if (ReplyParser::parse_float(text.c_str(), value) != ReplyParser::k_ok) fail("number rejected", text);
+    else if (!close(value, strtof(text.c_str(), nullptr))) fail("number differs from strtof", text);
+  }
+}
+
+static std::string mutate(std::string text)
+{
+  const char k_alphabet[] = "0123456789+-.eE \tx\r\n\0nai#";
+  int mutations = 1 + random_below(3);
+  for (int m = 0; m < mutations; m++)
+  {
+    size_t at = text.empty() ? 0 : random_below(text.size() + 1);
+    char c = k_alphabet[random_below(sizeof(k_alphabet) - 1)];
+    switch (random_below(4))
+    {
+      case 0: text.insert(at, 1, c); break;
+      case 1: if (at < text.size()) text[at] = c; break;
+      case 2: if (at < text.size()) text.erase(at, 1); break;
+      default: text = text.substr(0, at); break;  // cut off
+    }
+  }
+  return text;
+}
+
+static void check_garbage(long iterations)
+{
+  for (long i = 0; i < iterations; i++)
+  {
+    std::string text;
+    if (random_below(2))
+    {
+      text = mutate(format_number());
+    }
+    else
+    {
+      int length = random_below(40);
+      for (int n = 0; n < length; n++) text += (char)(1 + random_below(255));
+    }
+    // Everything up to the first nul, like a line out of the assembler
+    text = text.c_str();
+
+    float value = 12345.5f;
+    int status = ReplyParser::parse_float(text.c_str(), value);
+    if (status != ReplyParser::k_ok)
+    {
+      if (value != 12345.5f) fail("garbage written on failure", text);
+      continue;
+    }
+    char* end = nullptr;
+    float expected = strtof(text.c_str(), &end);
+    while (*end == ' ' || *end == '\t') end++;
+    if (*end != '\0') fail("accepted what strtof rejects", text);
+    else if (!close(value, expected)) fail("garbage differs from strtof", text);
+
+    int32_t whole = 0;
+    if (ReplyParser::parse_int(text.c_str(), whole) == ReplyParser::k_ok && whole != strtol(text.c_str(), nullptr, 10))
+    {
+      fail("int differs from strtol", text);
+    }
+  }
+}
+
+// Lines the firmware wrote since the last call, each one is a query
+static int take_queries()
+{
+  int queries = 0;
+  for (int c = Serial2.sim_take(); c >= 0; c = Serial2.sim_take()) queries += c == '\n';
+  return queries;
+}
+
+// One reply, damaged one time in three. Returns false if it won't come back as a clean line.
+static bool reply(std::string& replies, const std::string& text)
+{
+  std::string line = text;
+  switch (random_below(15))
+  {
+    case 0: line.insert(random_below(line.size() + 1), 1, 'x'); break;                  // garbled
+    case 1: line = std::string(ReplyParser::k_line_size + 5, '7'); break;               // overlong
+    case 2: line = line.substr(0, random_below(line.size())) + "!"; break;               // cut off
+    case 3: replies += line; return false;                                               // newline lost
+    case 4: return false;                                                                // dropped
+    default: replies += line + "\r\n"; return true;
+  }
+  replies += line + "\r\n";
+  return false;
+}
+
+// Four reads a round on Serial2. They go out in as many batches as the tx buffer needs and
+// each batch is answered in order, sometimes with damaged replies.
+static void check_odrive(long rounds)
+{
+  const int k_reads = 4;
+  const int k_properties[k_reads] = {ODrive::ENCODER_POS, ODrive::VELOCITY, ODrive::VBUS_VOLTAGE,
+                                     ODrive::IBUS_CURRENT};
+  const int k_axes[k_reads] = {1, 1, 0, 0};
+  hal::sim::reset();
+  Serial2.sim_reset();
+  Serial2.begin(115200);
+  Serial2.sim_attach();
+  ODrive odrive(Serial2);
+
+  // Last value that arrived in a clean batch
+  float expected[k_reads] = {};
+  long clean_reads = 0;
+  long batches = 0;
+  for (long round = 0; round < rounds; round++)
+  {
+    float values[k_reads];
+    std::string texts[k_reads];
+    for (int i = 0; i < k_reads; i++)
+    {
+      texts[i] = format_number();
+      values[i] = strtof(texts[i].c_str(), nullptr);
+      odrive.request(k_properties[i], k_axes[i]);
+    }
+
+    // Answer each batch as soon as it is on the wire, then let time pass so a batch that is
+    // missing a reply times out and the resync guard runs out
+    std::string replies;
+    int next = 0;
+    odrive.update();
+    for (int step = 0; step < 100 && !odrive.is_idle(); step++)
+    {
+      int sent = take_queries();
+      if (sent > 0 && next + sent <= k_reads)
+      {
+        batches++;
+        bool clean = true;
+        std::string batch;
+        for (int i = next; i < next + sent; i++) clean &= reply(batch, texts[i]);
+        for (char c : batch) Serial2.sim_give(c);
+        replies += batch;
+        if (clean)
+        {
+          for (int i = next; i < next + sent; i++) expected[i] = values[i];
+          clean_reads += sent;
+        }
+        next += sent;
+      }
+      else if (sent > 0)
+      {
+        fail("more queries than requested", replies);
+      }
+      hal::sim::advance_us(sent > 0 ? 500 : 1000);
+      odrive.update();
+    }
+    if (!odrive.is_idle() || next != k_reads) fail("reads left over", replies);
+
+    for (int i = 0; i < k_reads; i++)
+    {
+      if (odrive.cached(k_properties[i], k_axes[i]) != expected[i])
+      {
+        fail("cached value from a damaged batch", replies);
+        break;
+      }
+    }
+  }
+  printf("odrive: %ld rounds, %ld batches, replies %u, timeouts %u, parse errors %u, discarded %u, "
+         "bytes %u, messages %u\n",
+         rounds, batches, odrive.replies(), odrive.timeouts(), odrive.parse_errors(), odrive.discarded_messages(),
+         odrive.rx_bytes(), odrive.rx_messages());
+  if (odrive.replies() != (uint32_t)clean_reads) fail("replies counted", "");
+}
+
+int main(int argc, char** argv)
+{
+  long iterations = 1000000;
+  uint32_t seed = 1;
+  for (int i = 1; i < argc; i += 2)
+  {
+    if (i + 1 >= argc)
+    {
+      fprintf(stderr, "usage: %s [--iterations N] [--seed S]\n", argv[0]);
+      return 2;
+    }
+    if (strcmp(argv[i], "--iterations") == 0) iterations = atol(argv[i + 1]);
+    else if (strcmp(argv[i], "--seed") == 0) seed = strtoul(argv[i + 1], nullptr, 10);
+    else
+    {
+      fprintf(stderr, "usage: %s [--iterations N] [--seed S]\n", argv[0]);
+      return 2;
+    }
+  }
+  s_random.seed(seed);
+
+  check_known();
+  check_numbers(iterations);
+  check_garbage(iterations);
+  check_odrive(iterations / 100);
+
+  printf("%s (%d failures)\n", s_failures ? "FAILED" : "ok", s_failures);
+  return s_failures ? 1 : 0;
+}
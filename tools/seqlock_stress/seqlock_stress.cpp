@@ -0,0 +1,116 @@
+/*
+Seqlock stress test
+Hammers a Seqlock from a writer thread (standing in for the pin interrupts) while reader
+threads (standing in for the control step) check that every snapshot they get is whole.
+
+usage: seqlock_stress [--seconds S] [--readers N]
+Exit code is non-zero if any reader saw a torn or out of order snapshot.
+*/
+
+#include <Seqlock.h>
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+// Every word is derived from the sequence, so a mix of two writes can't pass the check
+struct Payload
+{
+  uint32_t sequence;
+  uint32_t words[15];
+};
+
+static uint32_t expected_word(uint32_t sequence, int i)
+{
+  uint32_t x = sequence * 2654435761u + i * 40503u;
+  return x ^ (x >> 15);
+}
+
+struct ReaderStats
+{
+  uint64_t reads = 0;
+  uint64_t retries = 0;
+  uint64_t torn = 0;
+  uint64_t backwards = 0;
+};
+
+int main(int argc, char** argv)
+{
+  double seconds = 2;
+  int readers = 2;
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    if (strcmp(argv[i], "--seconds") == 0) seconds = atof(argv[i + 1]);
+    else if (strcmp(argv[i], "--readers") == 0) readers = atoi(argv[i + 1]);
+    else
+    {
+      fprintf(stderr, "usage: %s [--seconds S] [--readers N]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  Seqlock<Payload> lock;
+  std::atomic<bool> stop{false};
+  uint64_t writes = 0;
+
+  std::thread writer([&]() {
+    Payload payload;
+    uint32_t sequence = 0;
+    while (!stop.load(std::memory_order_relaxed))
+    {
+      sequence++;
+      payload.sequence = sequence;
+      for (int i = 0; i < 15; i++) payload.words[i] = expected_word(sequence, i);
+      lock.write(payload);
+    }
+    writes = sequence;
+  });
+
+  std::vector<ReaderStats> stats(readers);
+  std::vector<std::thread> threads;
+  for (int r = 0; r < readers; r++)
+  {
+    threads.emplace_back([&, r]() {
+      ReaderStats& s = stats[r];
+      Payload payload;
+      uint32_t last = 0;
+      while (!stop.load(std::memory_order_relaxed))
+      {
+        s.retries += lock.read(payload);
+        s.reads++;
+        if (payload.sequence < last) s.backwards++;
+        last = payload.sequence;
+        if (payload.sequence == 0) continue;  // nothing written yet
+        for (int i = 0; i < 15; i++)
+        {
+          if (payload.words[i] != expected_word(payload.sequence, i))
+          {
+            s.torn++;
+            break;
+          }
+        }
+      }
+    });
+  }
+
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  stop.store(true);
+  writer.join();
+  for (std::thread& thread : threads) thread.join();
+
+  ReaderStats total;
+  for (const ReaderStats& s : stats)
+  {
+    total.reads += s.reads;
+    total.retries += s.retries;
+    total.torn += s.torn;
+    total.backwards += s.backwards;
+  }
+  printf("writes %llu, reads %llu, retries %llu, torn %llu, out of order %llu\n",
+         (unsigned long long)writes, (unsigned long long)total.reads, (unsigned long long)total.retries,
+         (unsigned long long)total.torn, (unsigned long long)total.backwards);
+  return total.torn || total.backwards ? 1 : 0;
+}
@@ -0,0 +1,578 @@
+/*
+Parameter sweep
+Runs many sets of tunables (Parameters.h) through the real control code against the simulated
+car, and optionally against recorded logs, on every core, then ranks them.
+
+usage: sweep [--grid name=low:high:steps]... [--random N] [--set name=value]...
+             [--scenario launch|endurance|hill]... [--seconds S] [--seeds K] [--log file]...
+             [--threads N] [--seed N] [--travel-weight W] [--limit-weight W] [--replay-weight W]
+             [--top N] [--out results.csv]
+
+--grid walks steps evenly spaced values from low to high, every combination of the --grid
+parameters is one candidate. --random N draws N candidates uniformly from the same ranges instead.
+--set fixes a tunable for every candidate. A candidate ParameterStore rejects is skipped.
+Each candidate runs every --scenario (launch and hill by default) for S seconds (20) with K ODrive
+seeds (1), and replays every --log (see tools/log_replay).
+Candidates are ranked by cost, lowest first:
+  rpm error rms + travel weight (10) * actuator turns/s + limit weight (50) * limit hits per run
+  + replay weight (0) * act_vel difference rms against the logs
+--out writes every candidate, ranked, as CSV for plotting. The summary and the top N (10) go to stdout.
+
+Runs are independent simulations, each on its worker thread's own simulated board, and deterministic:
+the table is the same for any --threads. Exit code is non-zero if nothing could be run.
+
+gearbox_rolling_frames sizes the rolling average at compile time (Constant.h, FilterBank), sweep it
+by building once per model config instead.
+*/
+
+#include <Actuator.h>
+#include <Constant.h>
+#include <CvtPlant.h>
+#include <Hal.h>
+#include <LogReplay.h>
+#include <ODriveSim.h>
+#include <ParameterStore.h>
+#include <Sensors.h>
+#include <ToothSensor.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <math.h>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+Constant constant;
+
+struct Range
+{
+  int index;      // into parameter_info()
+  float low;
+  float high;
+  int steps;
+};
+
+struct Options
+{
+  std::vector<Range> ranges;
+  std::vector<std::pair<int, float>> sets;  // parameter index, value
+  int random = 0;                           // candidates to draw, 0 walks the grid
+  std::vector<std::string> scenarios;
+  float seconds = 20;
+  int seeds = 1;
+  std::vector<const char*> logs;
+  int threads = 0;                          // 0 for every core
+  uint32_t seed = 1;
+  float travel_weight = 10;
+  float limit_weight = 50;
+  float replay_weight = 0;
+  int top = 10;
+  const char* out = nullptr;
+};
+
+//-----------------Work stealing pool--------------//
+
+// Jobs are dealt round robin into one queue per worker. A worker takes from the front of its
+// own queue and, once that runs dry, steals from the back of the others, so a few long jobs
+// (a long log, say) don't leave the other cores idle at the end. Jobs are whole simulations,
+// milliseconds each, so a mutex per queue is nowhere near contended.
+class WorkPool
+{
+public:
+  typedef void (*Job)(void* context, size_t job);
+
+  WorkPool(int workers, size_t jobs)
+  {
+    for (int i = 0; i < workers; i++) m_queues.emplace_back(new Queue());
+    for (size_t job = 0; job < jobs; job++) m_queues[job % workers]->jobs.push_back(job);
+  }
+
+  void run(Job job, void* context)
+  {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < m_queues.size(); i++)
+    {
+      threads.emplace_back([this, i, job, context]() {
+        size_t next;
+        while (take(i, next)) job(context, next);
+      });
+    }
+    for (std::thread& thread : threads) thread.join();
+  }
+
+  uint32_t steals() const { return m_steals; }
+
+private:
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<size_t> jobs;
+  };
+
+  bool take(size_t worker, size_t& job)
+  {
+    {
+      Queue& own = *m_queues[worker];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.jobs.empty())
+      {
+        job = own.jobs.front();
+        own.jobs.pop_front();
+        return true;
+      }
+    }
+    for (size_t i = 1; i < m_queues.size(); i++)
+    {
+      Queue& other = *m_queues[(worker + i) % m_queues.size()];
+      std::lock_guard<std::mutex> lock(other.mutex);
+      if (other.jobs.empty()) continue;
+      job = other.jobs.back();
+      other.jobs.pop_back();
+      m_steals++;
+      return true;
+    }
+    return false;
+  }
+
+  std::vector<std::unique_ptr<Queue>> m_queues;
+  std::atomic<uint32_t> m_steals{0};
+};
+
+//-----------------Simulated runs--------------//
+
+// Same interrupts as main.cpp, per thread like the simulated board
+static thread_local ToothSensor* s_eg_teeth = nullptr;
+static thread_local ToothSensor* s_gb_teeth = nullptr;
+static thread_local Sensors* s_sensors = nullptr;
+static thread_local Actuator* s_actuator = nullptr;
+
+static void count_eg_tooth()
+{
+  s_eg_teeth->on_edge();
+}
+static void count_gb_tooth()
+{
+  s_gb_teeth->on_edge();
+}
+static void hall_change()
+{
+  int hits = s_sensors->on_hall_change();
+  if (s_actuator != nullptr) s_actuator->on_limit(hits);
+}
+
+struct World
+{
+  ODriveSim* odrive;
+  CvtPlant* plant;
+};
+
+static void step_world(void* context, uint64_t now_us)
+{
+  World* world = (World*)context;
+  world->odrive->step(now_us);
+  world->plant->step(now_us);
+}
+
+// Same throttle as cvt_sim's scenarios
+static float throttle_for(const std::string& scenario, float t, CvtPlant& plant)
+{
+  if (scenario == "endurance")
+  {
+    float lap = fmodf(t, 12);
+    return lap < 8 ? 1.0f : 0.3f;
+  }
+  if (scenario == "hill") plant.set_grade(t > 5 ? 0.15f : 0);
+  return t < 0.5f ? 0 : 1;
+}
+
+struct JobResult
+{
+  bool replay = false;
+  double error_squared = 0;   // rpm, reference against the simulated engine
+  uint32_t error_samples = 0;
+  float max_error = 0;
+  double turns = 0;           // actuator travel
+  double seconds = 0;
+  uint32_t limit_hits = 0;
+  float replay_rms = 0;       // act_vel against a log, turns/s
+  double wall = 0;
+};
+
+static const uint32_t k_step_us = 20;
+
+// cvt_sim's run() without the extras. The Scheduler owns the one timer there is, so each run
+// keeps its own deadline and steps control_function the same way Scheduler::poll() would.
+static JobResult simulate(const Parameters& params, const std::string& scenario, float seconds, uint32_t seed)
+{
+  JobResult result;
+  hal::sim::reset();
+  hal::sim::set_step_us(k_step_us);
+  ToothSensor eg_teeth(Constant::eg_teeth_per_rotation, Constant::eg_rpm_window_teeth, Constant::tooth_stall_timeout);
+  ToothSensor gb_teeth(Constant::gb_teeth_per_rotation, Constant::gb_rpm_window_teeth, Constant::tooth_stall_timeout);
+  s_eg_teeth = &eg_teeth;
+  s_gb_teeth = &gb_teeth;
+  Sensors sensors(constant, eg_teeth, gb_teeth);
+  s_sensors = &sensors;
+  pinMode(constant.engine_geartooth_pin, INPUT_PULLUP);
+  pinMode(constant.gearbox_geartooth_pin, INPUT_PULLUP);
+  attachInterrupt(constant.engine_geartooth_pin, count_eg_tooth, FALLING);
+  attachInterrupt(constant.gearbox_geartooth_pin, count_gb_tooth, FALLING);
+  pinMode(constant.hall_inbound_pin, INPUT_PULLUP);
+  pinMode(constant.hall_outbound_pin, INPUT_PULLUP);
+  attachInterrupt(constant.hall_inbound_pin, hall_change, CHANGE);
+  attachInterrupt(constant.hall_outbound_pin, hall_change, CHANGE);
+
+  ODriveSim::Config odrive_config;
+  odrive_config.seed = seed;
+#ifdef MOAT_ODRIVE_CAN
+  CanLoopback can_bus;
+  ODriveSim odrive(can_bus.end(1), odrive_config);
+  CanBus& odrive_port = can_bus.end(0);
+#else
+  ODriveSim odrive(Serial1, odrive_config);
+  HardwareSerial& odrive_port = Serial1;
+#endif
+  CvtPlant::Config plant_config;
+  plant_config.actuator_axis = constant.actuator_motor_number;
+  CvtPlant plant(odrive, constant, plant_config);
+  World world = {&odrive, &plant};
+  hal::sim::set_world(step_world, &world);
+  sensors.begin();
+
+  ParameterStore parameters;
+  parameters.stage(params);
+  Actuator actuator(odrive_port, constant, &sensors, &parameters, false);
+  actuator.init(1000);
+  s_actuator = &actuator;
+
+  int out[30];
+  uint32_t period_us = constant.cycle_period * 1000;
+  uint64_t start_us = hal::sim::now_us();
+  uint64_t end_us = start_us + (uint64_t)(seconds * 1e6);
+  uint64_t deadline = start_us + period_us;
+  const ODriveSim::Axis& axis = odrive.axis(constant.actuator_motor_number);
+  double last_position = axis.position;
+  while (hal::sim::now_us() < end_us)
+  {
+    float t = (hal::sim::now_us() - start_us) * 1e-6f;
+    plant.set_throttle(throttle_for(scenario, t, plant));
+    hal::sim::advance_us(k_step_us);
+    if (hal::sim::now_us() < deadline) continue;
+    deadline += period_us;
+
+    actuator.control_function(out);
+    // Tracking error once the engine has had a second to come up
+    if (hal::sim::now_us() > start_us + 1000000)
+    {
+      float error = out[actuator.REF_RPM] - plant.engine_rpm();
+      result.error_squared += error * error;
+      result.error_samples++;
+      if (fabsf(error) > result.max_error) result.max_error = fabsf(error);
+    }
+    result.turns += fabs(axis.position - last_position) / Constant::encoder_counts_per_turn;
+    last_position = axis.position;
+  }
+  result.seconds = seconds;
+  result.limit_hits = plant.limit_hits();
+  s_actuator = nullptr;
+  hal::sim::set_world(nullptr, nullptr);
+  return result;
+}
+
+//-----------------Sweep--------------//
+
+struct Candidate
+{
+  Parameters params;
+  std::vector<float> values;  // of the swept parameters, in --grid order
+  bool valid = true;
+
+  // Totals over its jobs
+  double error_squared = 0;
+  uint32_t error_samples = 0;
+  float max_error = 0;
+  double turns = 0;
+  double seconds = 0;
+  uint32_t limit_hits = 0;
+  uint32_t runs = 0;
+  double replay_rms = 0;      // mean over the logs
+  uint32_t replays = 0;
+  double cost = 0;
+
+  float rpm_rms() const { return error_samples ? sqrt(error_squared / error_samples) : 0; }
+  float turns_per_s() const { return seconds > 0 ? turns / seconds : 0; }
+  float limit_hits_per_run() const { return runs ? (float)limit_hits / runs : 0; }
+};
+
+struct Sweep
+{
+  const Options* options;
+  std::vector<Candidate> candidates;
+  std::vector<LogReplay> logs;
+  size_t jobs_per_candidate;
+  std::vector<JobResult> results;  // candidate major
+};
+
+static void run_job(void* context, size_t job)
+{
+  Sweep& sweep = *(Sweep*)context;
+  const Options& options = *sweep.options;
+  const Candidate& candidate = sweep.candidates[job / sweep.jobs_per_candidate];
+  size_t part = job % sweep.jobs_per_candidate;
+  if (!candidate.valid) return;
+
+  auto start = std::chrono::steady_clock::now();
+  JobResult result;
+  size_t simulated = options.scenarios.size() * options.seeds;
+  if (part < simulated)
+  {
+    const std::string& scenario = options.scenarios[part / options.seeds];
+    result = simulate(candidate.params, scenario, options.seconds, options.seed + part % options.seeds);
+  }
+  else
+  {
+    LogReplay::Config config;
+    LogReplay::Result replayed = sweep.logs[part - simulated].run(candidate.params, config);
+    result.replay = true;
+    result.replay_rms = replayed.act_vel_rms();
+  }
+  result.wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  sweep.results[job] = result;
+}
+
+// Every combination of the grid, or options.random draws from its ranges
+static std::vector<Candidate> make_candidates(const Options& options, const Parameters& base)
+{
+  std::vector<std::vector<float>> sets;
+  if (options.random > 0)
+  {
+    std::mt19937 rng(options.seed);
+    for (int n = 0; n < options.random; n++)
+    {
+      std::vector<float> values;
+      for (const Range& range : options.ranges)
+      {
+        values.push_back(std::uniform_real_distribution<float>(range.low, range.high)(rng));
+      }
+      sets.push_back(values);
+    }
+  }
+  else
+  {
+    sets.push_back({});
+    for (const Range& range : options.ranges)
+    {
+      std::vector<std::vector<float>> grown;
+      for (const std::vector<float>& set : sets)
+      {
+        for (int step = 0; step < range.steps; step++)
+        {
+          std::vector<float> values = set;
+          float fraction = range.steps > 1 ? (float)step / (range.steps - 1) : 0;
+          values.push_back(range.low + (range.high - range.low) * fraction);
+          grown.push_back(values);
+        }
+      }
+      sets.swap(grown);
+    }
+  }
+
+  std::vector<Candidate> candidates(sets.size());
+  for (size_t i = 0; i < sets.size(); i++)
+  {
+    Candidate& candidate = candidates[i];
+    candidate.params = base;
+    candidate.values = sets[i];
+    for (size_t r = 0; r < options.ranges.size(); r++)
+    {
+      parameter_value(candidate.params, options.ranges[r].index) = sets[i][r];
+    }
+    candidate.valid = ParameterStore::validate(candidate.params) == ParameterStore::k_ok;
+  }
+  return candidates;
+}
+
+static void score(Sweep& sweep)
+{
+  const Options& options = *sweep.options;
+  for (size_t job = 0; job < sweep.results.size(); job++)
+  {
+    Candidate& candidate = sweep.candidates[job / sweep.jobs_per_candidate];
+    const JobResult& result = sweep.results[job];
+    if (!candidate.valid) continue;
+    if (result.replay)
+    {
+      candidate.replay_rms += result.replay_rms;
+      candidate.replays++;
+      continue;
+    }
+    candidate.error_squared += result.error_squared;
+    candidate.error_samples += result.error_samples;
+    candidate.max_error = std::max(candidate.max_error, result.max_error);
+    candidate.turns += result.turns;
+    candidate.seconds += result.seconds;
+    candidate.limit_hits += result.limit_hits;
+    candidate.runs++;
+  }
+  for (Candidate& candidate : sweep.candidates)
+  {
+    if (candidate.replays > 0) candidate.replay_rms /= candidate.replays;
+    candidate.cost = candidate.rpm_rms() + options.travel_weight * candidate.turns_per_s() +
+                     options.limit_weight * candidate.limit_hits_per_run() +
+                     options.replay_weight * candidate.replay_rms;
+  }
+}
+
+static void write_table(FILE* out, const Options& options, const std::vector<const Candidate*>& ranked)
+{
+  fprintf(out, "rank, cost");
+  for (const Range& range : options.ranges) fprintf(out, ", %s", parameter_info()[range.index].name);
+  fprintf(out, ", rpm_rms, rpm_max, turns_per_s, limit_hits, replay_rms\n");
+  for (size_t i = 0; i < ranked.size(); i++)
+  {
+    const Candidate& candidate = *ranked[i];
+    fprintf(out, "%zu, %.2f", i + 1, candidate.cost);
+    for (float value : candidate.values) fprintf(out, ", %g", value);
+    fprintf(out, ", %.2f, %.1f, %.3f, %.2f, %.3f\n", candidate.rpm_rms(), candidate.max_error, candidate.turns_per_s(),
+            candidate.limit_hits_per_run(), candidate.replay_rms);
+  }
+}
+
+static bool parse_range(const char* value, Range& range)
+{
+  const char* equals = strchr(value, '=');
+  if (equals == nullptr) return false;
+  std::string name(value, equals - value);
+  range.index = ParameterStore::find(name.c_str());
+  range.steps = 5;
+  int fields = sscanf(equals + 1, "%f:%f:%d", &range.low, &range.high, &range.steps);
+  return range.index >= 0 && fields >= 2 && range.steps > 0;
+}
+
+static void usage(const char* name)
+{
+  fprintf(stderr,
+          "usage: %s [--grid name=low:high:steps]... [--random N] [--set name=value]...\n"
+          "          [--scenario launch|endurance|hill]... [--seconds S] [--seeds K] [--log file]...\n"
+          "          [--threads N] [--seed N] [--travel-weight W] [--limit-weight W] [--replay-weight W]\n"
+          "          [--top N] [--out results.csv]\n",
+          name);
+  exit(2);
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+  for (int i = 1; i < argc; i++)
+  {
+    const char* arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (value == nullptr) usage(argv[0]);
+    i++;
+    if (strcmp(arg, "--grid") == 0)
+    {
+      Range range;
+      if (!parse_range(value, range))
+      {
+        fprintf(stderr, "bad --grid %s, expected name=low:high:steps\n", value);
+        return 2;
+      }
+      options.ranges.push_back(range);
+    }
+    else if (strcmp(arg, "--set") == 0)
+    {
+      const char* equals = strchr(value, '=');
+      std::string name = equals ? std::string(value, equals - value) : value;
+      int index = ParameterStore::find(name.c_str());
+      if (index < 0 || equals == nullptr)
+      {
+        fprintf(stderr, "unknown parameter in --set %s\n", value);
+        return 2;
+      }
+      options.sets.push_back({index, (float)atof(equals + 1)});
+    }
+    else if (strcmp(arg, "--random") == 0) options.random = atoi(value);
+    else if (strcmp(arg, "--scenario") == 0) options.scenarios.push_back(value);
+    else if (strcmp(arg, "--seconds") == 0) options.seconds = atof(value);
+    else if (strcmp(arg, "--seeds") == 0) options.seeds = atoi(value);
+    else if (strcmp(arg, "--log") == 0) options.logs.push_back(value);
+    else if (strcmp(arg, "--threads") == 0) options.threads = atoi(value);
+    else if (strcmp(arg, "--seed") == 0) options.seed = atoi(value);
+    else if (strcmp(arg, "--travel-weight") == 0) options.travel_weight = atof(value);
+    else if (strcmp(arg, "--limit-weight") == 0) options.limit_weight = atof(value);
+    else if (strcmp(arg, "--replay-weight") == 0) options.replay_weight = atof(value);
+    else if (strcmp(arg, "--top") == 0) options.top = atoi(value);
+    else if (strcmp(arg, "--out") == 0) options.out = value;
+    else usage(argv[0]);
+  }
+  if (options.scenarios.empty() && options.logs.empty()) options.scenarios = {"launch", "hill"};
+  for (const std::string& scenario : options.scenarios)
+  {
+    if (scenario != "launch" && scenario != "endurance" && scenario != "hill") usage(argv[0]);
+  }
+  if (options.seeds < 1) usage(argv[0]);
+  if (options.threads <= 0) options.threads = std::max(1u, std::thread::hardware_concurrency());
+
+  Parameters base = ParameterStore::defaults();
+  for (const auto& set : options.sets) parameter_value(base, set.first) = set.second;
+
+  Sweep sweep;
+  sweep.options = &options;
+  for (const char* path : options.logs)
+  {
+    sweep.logs.emplace_back();
+    const char* error = sweep.logs.back().load(path);
+    if (error != nullptr)
+    {
+      fprintf(stderr, "%s: %s\n", path, error);
+      return 2;
+    }
+  }
+  sweep.candidates = make_candidates(options, base);
+  sweep.jobs_per_candidate = options.scenarios.size() * options.seeds + options.logs.size();
+  size_t job_count = sweep.candidates.size() * sweep.jobs_per_candidate;
+  sweep.results.resize(job_count);
+
+  auto wall_start = std::chrono::steady_clock::now();
+  WorkPool pool(options.threads, job_count);
+  pool.run(run_job, &sweep);
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+  score(sweep);
+
+  std::vector<const Candidate*> ranked;
+  for (const Candidate& candidate : sweep.candidates)
+  {
+    if (candidate.valid) ranked.push_back(&candidate);
+  }
+  std::stable_sort(ranked.begin(), ranked.end(),
+                   [](const Candidate* a, const Candidate* b) { return a->cost < b->cost; });
+
+  double busy = 0;
+  for (const JobResult& result : sweep.results) busy += result.wall;
+  printf("%zu candidates (%zu rejected), %zu runs on %d threads in %.2f s wall, %.1f s of runs, "
+         "%.0f%% busy, %u steals\n",
+         sweep.candidates.size(), sweep.candidates.size() - ranked.size(), job_count, options.threads, wall, busy,
+         wall > 0 ? 100 * busy / (wall * options.threads) : 0, pool.steals());
+  std::vector<const Candidate*> top(ranked.begin(), ranked.begin() + std::min<size_t>(options.top, ranked.size()));
+  write_table(stdout, options, top);
+
+  if (options.out != nullptr)
+  {
+    FILE* out = fopen(options.out, "w");
+    if (out == nullptr)
+    {
+      fprintf(stderr, "could not write %s\n", options.out);
+      return 2;
+    }
+    write_table(out, options, ranked);
+    fclose(out);
+  }
+  return ranked.empty() ? 1 : 0;
+}
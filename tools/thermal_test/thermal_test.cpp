@@ -0,0 +1,300 @@
+/*
+Thermal monitor test
+- table: ThermistorTable against the beta equation in double precision on every code between
+  the short and open thresholds, within 0.1 C from -20 to 125 C and 0.3 C out to the ends
+  (-40 and 150 C). Also for a second thermistor, the Constant one and the table only rising as
+  the thermistor heats up.
+- sampling: thermistors on the simulated analog pins, sampled through poll() at the configured
+  rate into the ring buffer and averaged by update()
+- cooling: speed against the hottest thermistor, the hysteresis on the way down and full speed
+  for a shorted, open or silent thermistor
+- overflow: samples update() doesn't come for are dropped and counted, not blocked on
+- odrive: the cooling speed reaches the simulated ODrive's cooling axis through
+  Actuator::control_function, closed loop while it turns and idle once it stops
+
+usage: thermal_test
+Exit code is non-zero on any failure.
+Built with -DMOAT_ODRIVE_CAN the ODrive is on a CAN loopback instead of Serial1.
+*/
+
+#include "../common/SimCar.h"
+#include <MotionSequencer.h>
+#include <ThermalMonitor.h>
+#include <Thermistor.h>
+#include <math.h>
+#include <stdio.h>
+
+Constant constant;
+
+//-----------------Table--------------//
+static double beta_equation(const ThermistorTable::Config& config, double code)
+{
+  double ratio = code / ThermistorTable::k_adc_max;
+  double resistance = config.series * ratio / (1 - ratio);
+  return 1 / (1 / 298.15 + log(resistance / config.nominal) / config.beta) - 273.15;
+}
+
+static void test_table(const char* name, const ThermistorTable::Config& config)
+{
+  ThermistorTable table;
+  table.build(config);
+
+  double worst_inner = 0;
+  double worst_outer = 0;
+  int worst_code = 0;
+  bool rising = true;
+  float last = INFINITY;
+  for (int code = table.short_code(); code <= table.open_code(); code++)
+  {
+    float temperature = table.temperature(code);
+    double exact = beta_equation(config, code);
+    double error = fabs(temperature - exact);
+    if (exact >= -20 && exact <= 125) worst_inner = fmax(worst_inner, error);
+    if (error > worst_outer)
+    {
+      worst_outer = error;
+      worst_code = code;
+    }
+    if (temperature > last) rising = false;
+    last = temperature;
+  }
+  printf("table %s: codes %d..%d (%.1f..%.1f C), worst %.3f C from -20 to 125 C, %.3f C at code %d (%.1f C)\n", name,
+         table.short_code(), table.open_code(), table.temperature(table.short_code()),
+         table.temperature(table.open_code()), worst_inner, worst_outer, worst_code, beta_equation(config, worst_code));
+  check(worst_inner <= 0.1, "table within 0.1 C from -20 to 125 C");
+  check(worst_outer <= 0.3, "table within 0.3 C over its whole range");
+  check(rising, "table temperature falls as the code rises");
+
+  // The thresholds sit on the ends of the range
+  check(fabs(beta_equation(config, table.short_code()) - config.max_temp) < 1, "short threshold at max_temp");
+  check(fabs(beta_equation(config, table.open_code()) - config.min_temp) < 1, "open threshold at min_temp");
+  check(table.shorted(table.short_code() - 1) && !table.shorted(table.short_code()), "shorted below the threshold");
+  check(table.open(table.open_code() + 1) && !table.open(table.open_code()), "open above the threshold");
+  check(table.temperature(0) == table.temperature(table.short_code()), "codes past the short threshold clamp");
+  check(table.temperature(ThermistorTable::k_adc_max) == table.temperature(table.open_code()),
+        "codes past the open threshold clamp");
+  check(fabs(table.temperature(ThermistorTable::code_at(config, 25) + 0.5f) - 25) < 0.1, "25 C at the nominal code");
+}
+
+//-----------------Monitor--------------//
+static ThermalMonitor::Config monitor_config()
+{
+  ThermalMonitor::Config config;
+  config.pins[0] = 40;
+  config.pins[1] = 39;
+  config.pins[2] = 38;
+  return config;
+}
+
+static void set_temperature(const ThermalMonitor& monitor, int channel, float temperature)
+{
+  float code = ThermistorTable::code_at(monitor.config().thermistor, temperature);
+  hal::sim::set_analog(monitor.config().pins[channel], (uint16_t)lroundf(code));
+}
+
+// What the firmware's background loop does, for seconds of simulated time
+static int run_monitor(ThermalMonitor& monitor, float seconds, bool updates = true)
+{
+  int setpoints = 0;
+  uint64_t end_us = hal::sim::now_us() + (uint64_t)(seconds * 1e6);
+  while (hal::sim::now_us() < end_us)
+  {
+    hal::sim::advance_us(100);
+    while (monitor.poll())
+    {
+    }
+    if (updates && monitor.update(micros())) setpoints++;
+  }
+  return setpoints;
+}
+
+static void test_sampling()
+{
+  hal::sim::reset();
+  ThermalMonitor monitor(constant);
+  monitor.configure(monitor_config());
+  const ThermalMonitor::Config& config = monitor.config();
+  const float temperatures[ThermalMonitor::k_channels] = {25, 70.5, 40};
+  for (int i = 0; i < ThermalMonitor::k_channels; i++) set_temperature(monitor, i, temperatures[i]);
+
+  check(monitor.begin(), "monitor starts");
+  int setpoints = run_monitor(monitor, 2);
+  monitor.end();
+
+  uint32_t expected = 2 * config.sample_rate * ThermalMonitor::k_channels;
+  printf("sampling: %u samples (%u expected), %d setpoints, dropped %u, reads %u %u %u, %.2f %.2f %.2f C\n",
+         monitor.samples(), expected, setpoints, monitor.dropped(), hal::sim::analog_reads(config.pins[0]),
+         hal::sim::analog_reads(config.pins[1]), hal::sim::analog_reads(config.pins[2]),
+         monitor.reading(0).temperature, monitor.reading(1).temperature, monitor.reading(2).temperature);
+  check(monitor.samples() + 3 >= expected && monitor.samples() <= expected, "samples at the configured rate");
+  check(setpoints == (int)(2000000 / config.update_period_us), "one setpoint per update period");
+  check(monitor.dropped() == 0, "nothing dropped while update() keeps up");
+  for (int i = 0; i < ThermalMonitor::k_channels; i++)
+  {
+    const ThermalMonitor::Reading& reading = monitor.reading(i);
+    check(reading.status == ThermalMonitor::k_ok, "every thermistor reads");
+    check(fabs(reading.temperature - temperatures[i]) < 0.2, "temperature within 0.2 C of the simulated one");
+    uint32_t reads = hal::sim::analog_reads(config.pins[i]);
+    check(reads + 1 >= 2 * config.sample_rate && reads <= 2 * config.sample_rate, "every pin at the sample rate");
+  }
+  check(fabs(monitor.hottest() - 70.5) < 0.2, "hottest thermistor");
+
+  // A channel without a pin is never sampled and doesn't count
+  hal::sim::reset();
+  ThermalMonitor::Config partial = monitor_config();
+  partial.pins[0] = -1;
+  monitor.configure(partial);
+  hal::sim::set_analog(40, 0);  // would read as shorted
+  set_temperature(monitor, 1, 30);
+  set_temperature(monitor, 2, 30);
+  monitor.begin();
+  run_monitor(monitor, 1);
+  monitor.end();
+  check(monitor.reading(0).status == ThermalMonitor::k_unused, "channel without a pin unused");
+  check(hal::sim::analog_reads(40) == 0, "channel without a pin not sampled");
+  check(monitor.cooling_velocity() == 0, "unused channel doesn't turn the cooling on");
+}
+
+static float cooling_at(ThermalMonitor& monitor, float temperature)
+{
+  set_temperature(monitor, 1, temperature);
+  run_monitor(monitor, 0.3f);
+  return monitor.cooling_velocity();
+}
+
+static void test_cooling()
+{
+  hal::sim::reset();
+  ThermalMonitor monitor(constant);
+  monitor.configure(monitor_config());
+  const ThermalMonitor::Config& config = monitor.config();
+  set_temperature(monitor, 0, 30);
+  set_temperature(monitor, 2, 30);
+  monitor.begin();
+
+  float mid = (config.on_temp + config.full_temp) / 2;
+  float cold = cooling_at(monitor, config.on_temp - 10);
+  float on = cooling_at(monitor, config.on_temp + 0.5f);
+  float half = cooling_at(monitor, mid);
+  float full = cooling_at(monitor, config.full_temp + 10);
+  float held = cooling_at(monitor, config.on_temp - config.hysteresis / 2);
+  float off = cooling_at(monitor, config.on_temp - config.hysteresis - 1);
+  printf("cooling: %.1f C %.2f, %.1f C %.2f, %.1f C %.2f, %.1f C %.2f, down to %.1f C %.2f, %.1f C %.2f turns/s\n",
+         config.on_temp - 10, cold, config.on_temp + 0.5f, on, mid, half, config.full_temp + 10, full,
+         config.on_temp - config.hysteresis / 2, held, config.on_temp - config.hysteresis - 1, off);
+  check(cold == 0, "off below on_temp");
+  check(on >= config.min_speed && on < config.min_speed + 1, "min speed at on_temp");
+  check(fabs(half - (config.min_speed + config.max_speed) / 2) < 0.2, "halfway at the middle of the range");
+  check(full == config.max_speed, "max speed above full_temp");
+  check(held == config.min_speed, "held at min speed inside the hysteresis");
+  check(off == 0, "off below the hysteresis");
+
+  // Anything that can't be read runs it at full speed
+  hal::sim::set_analog(config.pins[1], 0);
+  run_monitor(monitor, 0.3f);
+  check(monitor.reading(1).status == ThermalMonitor::k_shorted && monitor.cooling_velocity() == config.max_speed,
+        "shorted thermistor runs the cooling at full speed");
+  hal::sim::set_analog(config.pins[1], ThermistorTable::k_adc_max);
+  run_monitor(monitor, 0.3f);
+  check(monitor.reading(1).status == ThermalMonitor::k_open && monitor.cooling_velocity() == config.max_speed,
+        "open thermistor runs the cooling at full speed");
+  monitor.end();
+  run_monitor(monitor, 0.3f);
+  check(monitor.reading(0).status == ThermalMonitor::k_no_samples && monitor.cooling_velocity() == config.max_speed,
+        "no samples runs the cooling at full speed");
+}
+
+static void test_overflow()
+{
+  hal::sim::reset();
+  ThermalMonitor monitor(constant);
+  monitor.configure(monitor_config());
+  for (int i = 0; i < ThermalMonitor::k_channels; i++) set_temperature(monitor, i, 45);
+  monitor.begin();
+  run_monitor(monitor, 1, false);
+  uint32_t converted = hal::sim::analog_reads(40) + hal::sim::analog_reads(39) + hal::sim::analog_reads(38);
+  uint32_t dropped = monitor.dropped();
+  run_monitor(monitor, 0.2f);
+  monitor.end();
+  printf("overflow: %u converted without update(), %u dropped, then %.2f C\n", converted, dropped,
+         monitor.reading(0).temperature);
+  check(dropped == converted - 64, "everything past the ring buffer dropped");
+  check(monitor.reading(0).status == ThermalMonitor::k_ok && fabs(monitor.reading(0).temperature - 45) < 0.2,
+        "reads again once update() comes back");
+}
+
+//-----------------ODrive--------------//
+static void test_odrive()
+{
+  // Mid travel, the actuator axis has nothing to do with the cooling
+  SimCar::Options options;
+  options.plant.start_position = 0.5;
+  SimCar car(options);
+  Actuator& actuator = car.actuator;
+  ODriveSim& odrive = car.odrive;
+
+  ThermalMonitor monitor(constant);
+  monitor.configure(monitor_config());
+  for (int i = 0; i < ThermalMonitor::k_channels; i++) set_temperature(monitor, i, 30);
+  monitor.begin();
+  const ODriveSim::Axis& cooling = odrive.axis(constant.cooling_motor_number);
+  int out[30];
+
+  // main.cpp's loop: control step on its period, the monitor in between
+  auto run = [&](float seconds) {
+    uint64_t end_us = hal::sim::now_us() + (uint64_t)(seconds * 1e6);
+    uint64_t next_cycle_us = hal::sim::now_us();
+    while (hal::sim::now_us() < end_us)
+    {
+      hal::sim::advance_us(100);
+      while (monitor.poll())
+      {
+      }
+      if (monitor.update(micros())) actuator.set_cooling_velocity(monitor.cooling_velocity());
+      if (hal::sim::now_us() < next_cycle_us) continue;
+      actuator.control_function(out);
+      next_cycle_us += constant.cycle_period * 1000;
+    }
+  };
+
+  run(1);
+  int cold_state = cooling.state;
+  float cold_setpoint = cooling.vel_setpoint;
+  set_temperature(monitor, 2, monitor.config().full_temp + 5);
+  run(1);
+  int hot_state = cooling.state;
+  float hot_velocity = cooling.velocity;
+  set_temperature(monitor, 2, 30);
+  run(1);
+  printf("odrive: cold state %d at %.2f, hot state %d at %.2f turns/s, cooled down state %d at %.2f\n", cold_state,
+         cold_setpoint, hot_state, hot_velocity, cooling.state, cooling.vel_setpoint);
+  check(cold_state == MotionSequencer::k_state_idle && cold_setpoint == 0, "cooling axis idle while cold");
+  check(hot_state == MotionSequencer::k_state_closed_loop, "cooling axis closed loop while hot");
+  check(fabs(hot_velocity - monitor.config().max_speed) < 0.5, "cooling axis at full speed while hot");
+  check(cooling.state == MotionSequencer::k_state_idle && cooling.vel_setpoint == 0, "cooling axis idle again");
+  check(odrive.axis(constant.actuator_motor_number).state == MotionSequencer::k_state_closed_loop,
+        "actuator axis left in closed loop");
+  monitor.end();
+}
+
+int main()
+{
+  ThermistorTable::Config thermistor;
+  test_table("3950 K 10k", thermistor);
+  thermistor.beta = 3380;
+  thermistor.series = 4700;
+  test_table("3380 K 10k, 4k7 pull-up", thermistor);
+  test_table("constant", ThermalMonitor(constant).config().thermistor);
+  test_sampling();
+  test_cooling();
+  test_overflow();
+  test_odrive();
+
+  if (s_failures > 0)
+  {
+    printf("%d failures\n", s_failures);
+    return 1;
+  }
+  printf("all passed\n");
+  return 0;
+}